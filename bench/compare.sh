@@ -0,0 +1,47 @@
+#!/bin/sh
+# Put two plc_bench result files side by side: ops/s, p50 and p99 of every
+# case and phase found in both, with the change from OLD to NEW.
+#
+#   bench/compare.sh OLD NEW
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 OLD NEW" >&2
+    exit 1
+fi
+
+awk '
+function field(line, key,    n, i, parts, kv) {
+    n = split(line, parts, " ")
+    for(i = 3; i <= n; i++) {
+        split(parts[i], kv, "=")
+        if(kv[1] == key) {
+            return kv[2]
+        }
+    }
+    return ""
+}
+
+function change(old, new) {
+    if(old == "" || new == "" || old + 0 == 0) {
+        return "-"
+    }
+    return sprintf("%+.1f%%", (new - old) * 100.0 / old)
+}
+
+/^#/ || NF < 3 { next }
+
+FNR == NR { old[$1 " " $2] = $0; next }
+
+($1 " " $2) in old {
+    key = $1 " " $2
+    o = old[key]
+    printf "%-40s", key
+    if($2 == "total") {
+        printf " ops_s %10s -> %-10s %8s", field(o, "ops_s"), field($0, "ops_s"), change(field(o, "ops_s"), field($0, "ops_s"))
+    } else {
+        printf "%40s", ""
+    }
+    printf " p50_us %8s -> %-8s %8s", field(o, "p50_us"), field($0, "p50_us"), change(field(o, "p50_us"), field($0, "p50_us"))
+    printf " p99_us %8s -> %-8s %8s\n", field(o, "p99_us"), field($0, "p99_us"), change(field(o, "p99_us"), field($0, "p99_us"))
+}
+' "$1" "$2"
@@ -0,0 +1,350 @@
+/***************************************************************************
+ *   Micro-benchmark for the tag_decode kernels.                           *
+ *                                                                         *
+ *   Compares the old read path (a size query and a type switch per        *
+ *   element, each value fetched through an accessor that locks the tag    *
+ *   and checks bounds, as plc_tag_get_uint32() and friends do) with one   *
+ *   copy of the buffer and a single tag_decode pass, for text output and  *
+ *   for conversion to native values, after checking that both give the    *
+ *   same text and values.  No PLC is needed.                              *
+ *                                                                         *
+ *   decode_bench [elements] [rounds]                                      *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include "abex_util.h"
+#include "tag_decode.h"
+
+#define DEFAULT_ELEMENTS (100000)
+#define DEFAULT_ROUNDS (20)
+
+/* stand-in for a libplctag tag: a buffer behind a mutex */
+struct fake_tag_s {
+    pthread_mutex_t mutex;
+    uint8_t *data;
+    int size;
+};
+
+static int fake_get_size(struct fake_tag_s *tag)
+{
+    int size;
+
+    pthread_mutex_lock(&tag->mutex);
+    size = tag->size;
+    pthread_mutex_unlock(&tag->mutex);
+
+    return size;
+}
+
+static uint64_t fake_get(struct fake_tag_s *tag, int offset, int width)
+{
+    uint64_t val = 0;
+    int i;
+
+    pthread_mutex_lock(&tag->mutex);
+    if(offset >= 0 && offset + width <= tag->size) {
+        for(i = width - 1; i >= 0; i--) {
+            val = (val << 8) | tag->data[offset + i];
+        }
+    }
+    pthread_mutex_unlock(&tag->mutex);
+
+    return val;
+}
+
+static void fake_get_raw_bytes(struct fake_tag_s *tag, uint8_t *dst, int size)
+{
+    pthread_mutex_lock(&tag->mutex);
+    memcpy(dst, tag->data, (size_t)size);
+    pthread_mutex_unlock(&tag->mutex);
+}
+
+static float to_float(uint64_t bits)
+{
+    uint32_t b = (uint32_t)bits;
+    float f;
+
+    memcpy(&f, &b, sizeof(f));
+
+    return f;
+}
+
+static double to_double(uint64_t bits)
+{
+    double d;
+
+    memcpy(&d, &bits, sizeof(d));
+
+    return d;
+}
+
+/* the loop rw_tag used before, per element: size query, switch, accessor, printf */
+static void old_text(struct fake_tag_s *tag, int data_type, struct abex_buf_s *out)
+{
+    int width = (data_type & 0xFF) / 8;
+    int index = 0;
+
+    while(index < fake_get_size(tag)) {
+        uint64_t val = fake_get(tag, index, width);
+
+        switch(data_type) {
+        case PLC_LIB_UINT8:
+        case PLC_LIB_UINT16:
+        case PLC_LIB_UINT32:
+            abex_buf_printf(out, "%u ", (unsigned)val);
+            break;
+
+        case PLC_LIB_UINT64:
+            abex_buf_printf(out, "%" PRIu64 " ", val);
+            break;
+
+        case PLC_LIB_SINT8:
+            abex_buf_printf(out, "%d ", (int8_t)val);
+            break;
+
+        case PLC_LIB_SINT16:
+            abex_buf_printf(out, "%d ", (int16_t)val);
+            break;
+
+        case PLC_LIB_SINT32:
+            abex_buf_printf(out, "%d ", (int32_t)val);
+            break;
+
+        case PLC_LIB_SINT64:
+            abex_buf_printf(out, "%" PRId64 " ", (int64_t)val);
+            break;
+
+        case PLC_LIB_REAL32:
+            abex_buf_printf(out, "%f ", (double)to_float(val));
+            break;
+
+        case PLC_LIB_REAL64:
+            abex_buf_printf(out, "%lf ", to_double(val));
+            break;
+        }
+
+        index += width;
+    }
+}
+
+/* per element accessors into a native array */
+static void old_native(struct fake_tag_s *tag, int data_type, void *dst)
+{
+    int width = (data_type & 0xFF) / 8;
+    int index = 0;
+    int i = 0;
+
+    while(index < fake_get_size(tag)) {
+        uint64_t val = fake_get(tag, index, width);
+
+        switch(width) {
+        case 1: ((uint8_t *)dst)[i] = (uint8_t)val; break;
+        case 2: ((uint16_t *)dst)[i] = (uint16_t)val; break;
+        case 4: ((uint32_t *)dst)[i] = (uint32_t)val; break;
+        case 8: ((uint64_t *)dst)[i] = val; break;
+        }
+
+        index += width;
+        i++;
+    }
+}
+
+/* per bit accessors for a packed BOOL array */
+static void old_bits(struct fake_tag_s *tag, uint8_t *dst)
+{
+    int bit = 0;
+
+    while(bit / 8 < fake_get_size(tag)) {
+        dst[bit] = (uint8_t)((fake_get(tag, bit / 8, 1) >> (bit % 8)) & 1);
+        bit++;
+    }
+}
+
+static void new_text(struct fake_tag_s *tag, int data_type, uint8_t *scratch, struct abex_buf_s *out)
+{
+    int size = fake_get_size(tag);
+
+    fake_get_raw_bytes(tag, scratch, size);
+    tag_decode_text(data_type, scratch, tag_decode_count(data_type, (size_t)size), out);
+}
+
+static void new_native(struct fake_tag_s *tag, int data_type, uint8_t *scratch, void *dst)
+{
+    int size = fake_get_size(tag);
+
+    fake_get_raw_bytes(tag, scratch, size);
+    tag_decode_native(data_type, scratch, tag_decode_count(data_type, (size_t)size), dst);
+}
+
+/*
+ * Run both paths once on the tag and compare their text (printf's on the
+ * old side) and native values byte for byte.  Returns 0 if they agree.
+ */
+static int compare_paths(struct fake_tag_s *tag, int data_type, uint8_t *scratch, uint8_t *native, uint8_t *expected,
+                         struct abex_buf_s *old_out, struct abex_buf_s *new_out)
+{
+    size_t count = tag_decode_count(data_type, (size_t)tag->size);
+    size_t width = data_type == PLC_LIB_BOOL ? 1 : (size_t)((data_type & 0xFF) / 8);
+
+    if(data_type == PLC_LIB_BOOL) {
+        old_bits(tag, expected);
+    } else {
+        abex_buf_reset(old_out);
+        abex_buf_reset(new_out);
+        old_text(tag, data_type, old_out);
+        new_text(tag, data_type, scratch, new_out);
+
+        if(old_out->len != new_out->len || (old_out->len && memcmp(old_out->data, new_out->data, old_out->len))) {
+            return 1;
+        }
+
+        old_native(tag, data_type, expected);
+    }
+
+    new_native(tag, data_type, scratch, native);
+
+    return count && memcmp(expected, native, count * width) != 0;
+}
+
+/* abex_time_ms() is too coarse for a single round */
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static double ns_per_elem(double start_ns, int rounds, size_t count)
+{
+    return (now_ns() - start_ns) / ((double)rounds * (double)count);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        int data_type;
+    } types[] = {
+        {"uint8", PLC_LIB_UINT8}, {"sint8", PLC_LIB_SINT8},
+        {"uint16", PLC_LIB_UINT16}, {"sint16", PLC_LIB_SINT16},
+        {"uint32", PLC_LIB_UINT32}, {"sint32", PLC_LIB_SINT32},
+        {"uint64", PLC_LIB_UINT64}, {"sint64", PLC_LIB_SINT64},
+        {"real32", PLC_LIB_REAL32}, {"real64", PLC_LIB_REAL64},
+        {"bool", PLC_LIB_BOOL}
+    };
+    int elements = argc > 1 ? atoi(argv[1]) : DEFAULT_ELEMENTS;
+    int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    struct abex_buf_s out = {NULL, 0, 0};
+    struct abex_buf_s old_out = {NULL, 0, 0};
+    struct fake_tag_s tag;
+    uint8_t *scratch;
+    uint8_t *native;
+    uint8_t *expected;
+    size_t t;
+    int i;
+
+    if(elements <= 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: decode_bench [elements] [rounds]\n");
+        return 1;
+    }
+
+    pthread_mutex_init(&tag.mutex, NULL);
+    tag.size = elements * 8;
+    tag.data = malloc((size_t)tag.size);
+    scratch = malloc((size_t)tag.size);
+    native = malloc((size_t)tag.size * 8);
+    expected = malloc((size_t)tag.size * 8);
+    if(!tag.data || !scratch || !native || !expected) {
+        fprintf(stderr, "Unable to allocate memory!\n");
+        return 1;
+    }
+
+    /* small values, so reals are not all NaN or huge */
+    srand(1);
+    for(i = 0; i < tag.size; i++) {
+        tag.data[i] = (uint8_t)((i % 8 == 7 || i % 8 == 3) ? 0x40 : rand());
+    }
+
+    printf("%d elements, %d rounds, ns per element\n", elements, rounds);
+    printf("%-8s %10s %10s %8s %10s %10s %8s\n", "type", "text old", "text new", "speedup", "native old",
+           "native new", "speedup");
+
+    for(t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        int data_type = types[t].data_type;
+        size_t count;
+        double text_old = 0.0;
+        double text_new = 0.0;
+        double native_old;
+        double native_new;
+        double start;
+        int r;
+
+        /* the same number of elements of each type, bits for BOOL */
+        tag.size = data_type == PLC_LIB_BOOL ? elements / 8 : elements * ((data_type & 0xFF) / 8);
+        count = tag_decode_count(data_type, (size_t)tag.size);
+
+        /* a faster path that prints or converts something else is no speedup */
+        if(compare_paths(&tag, data_type, scratch, native, expected, &old_out, &out)) {
+            fprintf(stderr, "%s: old and new paths disagree!\n", types[t].name);
+            return 1;
+        }
+
+        if(data_type != PLC_LIB_BOOL) {
+            start = now_ns();
+            for(r = 0; r < rounds; r++) {
+                abex_buf_reset(&out);
+                old_text(&tag, data_type, &out);
+            }
+            text_old = ns_per_elem(start, rounds, count);
+        }
+
+        start = now_ns();
+        for(r = 0; r < rounds; r++) {
+            abex_buf_reset(&out);
+            new_text(&tag, data_type, scratch, &out);
+        }
+        text_new = ns_per_elem(start, rounds, count);
+
+        start = now_ns();
+        for(r = 0; r < rounds; r++) {
+            if(data_type == PLC_LIB_BOOL) {
+                old_bits(&tag, native);
+            } else {
+                old_native(&tag, data_type, native);
+            }
+        }
+        native_old = ns_per_elem(start, rounds, count);
+
+        start = now_ns();
+        for(r = 0; r < rounds; r++) {
+            new_native(&tag, data_type, scratch, native);
+        }
+        native_new = ns_per_elem(start, rounds, count);
+
+        if(data_type == PLC_LIB_BOOL) {
+            printf("%-8s %10s %10.2f %8s", types[t].name, "-", text_new, "-");
+        } else {
+            printf("%-8s %10.2f %10.2f %7.1fx", types[t].name, text_old, text_new,
+                   text_new > 0.0 ? text_old / text_new : 0.0);
+        }
+
+        printf(" %10.2f %10.2f %7.1fx\n", native_old, native_new, native_new > 0.0 ? native_old / native_new : 0.0);
+    }
+
+    abex_buf_free(&out);
+    abex_buf_free(&old_out);
+    free(expected);
+    free(native);
+    free(scratch);
+    free(tag.data);
+    pthread_mutex_destroy(&tag.mutex);
+
+    return 0;
+}
@@ -0,0 +1,593 @@
+/***************************************************************************
+ *   End-to-end benchmark of rw_tag and tag_list against a local           *
+ *   controller: libplctag's ab_server on loopback, started with the       *
+ *   synthetic tags of each case.  Reads, array reads from 1 to 100k       *
+ *   elements and writes go through one rw_tag --serve process, as from    *
+ *   Abex.Tag; listings run tag_list once per operation.                   *
+ *                                                                         *
+ *   Every case gives a line of ops/s and latency percentiles, and the     *
+ *   rw_tag cases a line per phase timed by rw_tag --stats.  Results of    *
+ *   two commits can be put side by side with bench/compare.sh.            *
+ *                                                                         *
+ *   plc_bench --ab-server=PATH --bin-dir=DIR [--out=FILE] [--label=TEXT]  *
+ *             [--case=PREFIX] [--quick]                                   *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "abex_util.h"
+#include "frame_io.h"
+#include "tag_stats.h"
+
+#define BENCH_GATEWAY "127.0.0.1"
+#define BENCH_PORT (44818)
+#define BENCH_PLC "protocol=ab-eip&gateway=" BENCH_GATEWAY "&path=1,0&plc=ControlLogix"
+
+/* ab_server gets this long to listen */
+#define SERVER_START_MS (10000)
+
+#define PATH_SIZE (1024)
+#define ATTRS_SIZE (256)
+
+enum {
+    CASE_READ,
+    CASE_WRITE,
+    CASE_LIST
+};
+
+/*
+ * Read and write cases use the tags of one ab_server, which gets a DINT
+ * array of elements for each.  List cases start their own with elements
+ * synthetic tags.
+ */
+struct bench_case_s {
+    const char *name;
+    int kind;
+    const char *tag;
+    int elements;
+    int binary;
+    int ops;
+};
+
+static const struct bench_case_s cases[] = {
+    {"read_single", CASE_READ, "BenchDint", 1, 0, 2000},
+    {"read_array_1", CASE_READ, "BenchArray1", 1, 1, 2000},
+    {"read_array_10", CASE_READ, "BenchArray10", 10, 1, 2000},
+    {"read_array_100", CASE_READ, "BenchArray100", 100, 1, 1000},
+    {"read_array_1000", CASE_READ, "BenchArray1000", 1000, 1, 500},
+    {"read_array_10000", CASE_READ, "BenchArray10000", 10000, 1, 100},
+    {"read_array_100000", CASE_READ, "BenchArray100000", 100000, 1, 20},
+    {"read_array_text_1000", CASE_READ, "BenchArray1000", 1000, 0, 500},
+    {"write_single", CASE_WRITE, "BenchWrite", 1, 0, 2000},
+    {"write_array_1000", CASE_WRITE, "BenchWriteArray", 1000, 0, 200},
+    {"list_1000", CASE_LIST, NULL, 1000, 0, 10},
+    {"list_10000", CASE_LIST, NULL, 10000, 0, 5},
+    {"list_50000", CASE_LIST, NULL, 50000, 0, 3}
+};
+
+#define CASE_COUNT ((int)(sizeof(cases) / sizeof(cases[0])))
+
+struct bench_options_s {
+    const char *ab_server;
+    const char *bin_dir;
+    const char *case_prefix;
+    int quick;
+};
+
+/* rw_tag --serve as a child, talked to through two pipes */
+struct bench_serve_s {
+    pid_t pid;
+    int to_fd;
+    int from_fd;
+};
+
+
+static int wanted(const struct bench_options_s *opts, const struct bench_case_s *c)
+{
+    return !opts->case_prefix || !strncmp(c->name, opts->case_prefix, strlen(opts->case_prefix));
+}
+
+/* cases may share a tag, ab_server gets each one once */
+static int first_with_tag(int index)
+{
+    int i;
+
+    for(i = 0; i < index; i++) {
+        if(cases[i].tag && !strcmp(cases[i].tag, cases[index].tag)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int case_ops(const struct bench_options_s *opts, const struct bench_case_s *c)
+{
+    int ops = opts->quick ? c->ops / 10 : c->ops;
+
+    return ops > 0 ? ops : 1;
+}
+
+
+/* fork and exec argv, with stdin/stdout on the given fds (-1: /dev/null) */
+static pid_t spawn(char **argv, int in_fd, int out_fd)
+{
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+
+        dup2(in_fd >= 0 ? in_fd : null_fd, 0);
+        dup2(out_fd >= 0 ? out_fd : null_fd, 1);
+        dup2(null_fd, 2);
+
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+static void stop_child(pid_t pid)
+{
+    if(pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/* 1 once something listens on the EtherNet/IP port */
+static int server_listening(void)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int rc;
+
+    if(fd < 0) {
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    inet_pton(AF_INET, BENCH_GATEWAY, &addr.sin_addr);
+
+    rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    close(fd);
+
+    return rc == 0;
+}
+
+
+/*
+ * Start ab_server with the read/write tags (list_tags == 0) or with
+ * list_tags synthetic ones of a few types, and wait until it listens.
+ */
+static pid_t start_server(const struct bench_options_s *opts, int list_tags)
+{
+    struct abex_buf_s specs = {NULL, 0, 0};
+    char **argv;
+    int argc = 0;
+    int count = list_tags > 0 ? list_tags : CASE_COUNT;
+    int64_t deadline;
+    pid_t pid;
+    size_t offset;
+    int i;
+
+    if(server_listening()) {
+        fprintf(stderr, "ERROR: something already listens on %s:%d\n", BENCH_GATEWAY, BENCH_PORT);
+        return -1;
+    }
+
+    argv = calloc((size_t)count + 4, sizeof(*argv));
+    if(!argv) {
+        return -1;
+    }
+
+    /* every spec NUL terminated in one buffer, pointed to once it stops moving */
+    abex_buf_printf(&specs, "--plc=ControlLogix");
+    abex_buf_append(&specs, "", 1);
+    abex_buf_printf(&specs, "--path=1,0");
+    abex_buf_append(&specs, "", 1);
+
+    for(i = 0; i < count; i++) {
+        if(list_tags > 0) {
+            static const char *types[] = {"DINT[1]", "REAL[1]", "INT[10]", "DINT[100]"};
+
+            abex_buf_printf(&specs, "--tag=Synth_%05d:%s", i, types[i % 4]);
+        } else if(cases[i].kind != CASE_LIST && first_with_tag(i)) {
+            abex_buf_printf(&specs, "--tag=%s:DINT[%d]", cases[i].tag, cases[i].elements);
+        } else {
+            continue;
+        }
+
+        abex_buf_append(&specs, "", 1);
+    }
+
+    argv[argc++] = (char *)opts->ab_server;
+    for(offset = 0; offset < specs.len; offset += strlen(specs.data + offset) + 1) {
+        argv[argc++] = specs.data + offset;
+    }
+    argv[argc] = NULL;
+
+    pid = spawn(argv, -1, -1);
+
+    deadline = abex_time_ms() + SERVER_START_MS;
+    while(pid > 0 && !server_listening()) {
+        if(abex_time_ms() > deadline || waitpid(pid, NULL, WNOHANG) == pid) {
+            fprintf(stderr, "ERROR: %s did not start listening on %s:%d\n", opts->ab_server, BENCH_GATEWAY,
+                    BENCH_PORT);
+            stop_child(pid);
+            pid = -1;
+            break;
+        }
+
+        abex_sleep_ms(50);
+    }
+
+    free(argv);
+    abex_buf_free(&specs);
+
+    return pid;
+}
+
+
+static int start_serve(const struct bench_options_s *opts, struct bench_serve_s *serve)
+{
+    char program[PATH_SIZE];
+    char *argv[4];
+    int to_child[2];
+    int from_child[2];
+
+    snprintf(program, sizeof(program), "%s/rw_tag", opts->bin_dir);
+    argv[0] = program;
+    argv[1] = "--serve";
+    argv[2] = "--stats";
+    argv[3] = NULL;
+
+    if(pipe(to_child) || pipe(from_child)) {
+        return -1;
+    }
+
+    /* the server must not hold its own stdin open, or it never sees EOF. */
+    fcntl(to_child[1], F_SETFD, FD_CLOEXEC);
+    fcntl(from_child[0], F_SETFD, FD_CLOEXEC);
+
+    serve->pid = spawn(argv, to_child[0], from_child[1]);
+    close(to_child[0]);
+    close(from_child[1]);
+
+    serve->to_fd = to_child[1];
+    serve->from_fd = from_child[0];
+
+    return serve->pid > 0 ? 0 : -1;
+}
+
+static void stop_serve(struct bench_serve_s *serve)
+{
+    /* EOF on stdin ends the server. */
+    close(serve->to_fd);
+    waitpid(serve->pid, NULL, 0);
+    close(serve->from_fd);
+}
+
+/* one request, argv NUL separated; returns the status byte, -1 if the server is gone */
+static int request(struct bench_serve_s *serve, char **argv, int argc, struct abex_buf_s *frame,
+                   struct abex_buf_s *reply)
+{
+    uint8_t header[4] = {0, 0, 0, 0};
+    uint32_t len;
+    int i;
+
+    abex_buf_reset(frame);
+    abex_buf_append(frame, header, sizeof(header));
+    for(i = 0; i < argc; i++) {
+        abex_buf_append(frame, argv[i], strlen(argv[i]) + (i + 1 < argc ? 1 : 0));
+    }
+
+    len = (uint32_t)(frame->len - sizeof(header));
+    frame->data[0] = (char)(len >> 24);
+    frame->data[1] = (char)(len >> 16);
+    frame->data[2] = (char)(len >> 8);
+    frame->data[3] = (char)len;
+
+    if(write(serve->to_fd, frame->data, frame->len) != (ssize_t)frame->len) {
+        return -1;
+    }
+
+    if(frame_read(serve->from_fd, reply) <= 0 || reply->len < 1) {
+        return -1;
+    }
+
+    return (uint8_t)reply->data[0];
+}
+
+
+/* "<case> total ops=N errors=N ops_s=X p50_us=N p90_us=N p99_us=N max_us=N" */
+static void report_case(FILE *out, const char *name, int ops, int errors, int64_t elapsed_us,
+                        const struct tag_stats_hist_s *hist)
+{
+    double ops_s = elapsed_us > 0 ? (double)ops * 1e6 / (double)elapsed_us : 0.0;
+
+    fprintf(out, "%s total ops=%d errors=%d ops_s=%.1f p50_us=%" PRId64 " p90_us=%" PRId64 " p99_us=%" PRId64
+            " max_us=%" PRId64 "\n", name, ops, errors, ops_s, tag_stats_percentile(hist, 50.0),
+            tag_stats_percentile(hist, 90.0), tag_stats_percentile(hist, 99.0), hist->max_us);
+    fflush(out);
+}
+
+/* the server's phase lines of a --stats-dump, as "<case> <phase> count=N ..." */
+static void report_phases(FILE *out, const char *name, const char *dump, size_t len)
+{
+    const char *line = dump;
+    const char *end = dump + len;
+
+    while(line < end) {
+        const char *eol = memchr(line, '\n', (size_t)(end - line));
+        size_t line_len = eol ? (size_t)(eol - line) : (size_t)(end - line);
+
+        /* the request total is the client side one, seen from the port */
+        if(line_len > strlen("phase ") && !strncmp(line, "phase ", strlen("phase "))
+           && strncmp(line, "phase total ", strlen("phase total "))) {
+            fprintf(out, "%s %.*s\n", name, (int)(line_len - strlen("phase ")), line + strlen("phase "));
+        }
+
+        line += line_len + 1;
+    }
+}
+
+
+static int run_rw_case(struct bench_serve_s *serve, const struct bench_case_s *c, int ops, FILE *out)
+{
+    static struct tag_stats_s stats;
+    struct abex_buf_s frame = {NULL, 0, 0};
+    struct abex_buf_s reply = {NULL, 0, 0};
+    struct abex_buf_s values = {NULL, 0, 0};
+    char attrs[ATTRS_SIZE];
+    char *argv[8];
+    char *dump_argv[2] = {"--stats-dump", "--reset"};
+    int argc = 0;
+    int errors = 0;
+    int64_t start_us;
+    int i;
+
+    snprintf(attrs, sizeof(attrs), BENCH_PLC "&elem_size=4&elem_count=%d&name=%s", c->elements, c->tag);
+
+    argv[argc++] = "-t";
+    argv[argc++] = "sint32";
+
+    if(c->kind == CASE_WRITE) {
+        for(i = 0; i < c->elements; i++) {
+            abex_buf_printf(&values, i ? ",%d" : "%d", i);
+        }
+
+        argv[argc++] = "-w";
+        argv[argc++] = values.data;
+    }
+
+    if(c->binary) {
+        argv[argc++] = "--format=binary";
+    }
+
+    argv[argc++] = "-p";
+    argv[argc++] = attrs;
+
+    /* the first request creates the tag and connects, it is not counted. */
+    if(request(serve, argv, argc, &frame, &reply) != 0) {
+        fprintf(stderr, "ERROR: %s failed: %.*s\n", c->name, reply.len > 0 ? (int)reply.len - 1 : 0,
+                reply.len > 0 ? reply.data + 1 : "");
+        fprintf(out, "%s skipped\n", c->name);
+        abex_buf_free(&frame);
+        abex_buf_free(&reply);
+        abex_buf_free(&values);
+        return 1;
+    }
+
+    request(serve, dump_argv, 2, &frame, &reply);
+
+    memset(&stats, 0, sizeof(stats));
+    stats.enabled = 1;
+
+    start_us = abex_time_us();
+    for(i = 0; i < ops; i++) {
+        int64_t sent_us = abex_time_us();
+        int rc = request(serve, argv, argc, &frame, &reply);
+
+        if(rc < 0) {
+            fprintf(stderr, "ERROR: rw_tag --serve exited during %s\n", c->name);
+            exit(1);
+        }
+
+        tag_stats_since(&stats, TAG_STATS_TOTAL, sent_us);
+        errors += rc ? 1 : 0;
+    }
+
+    report_case(out, c->name, ops, errors, abex_time_us() - start_us, &stats.phases[TAG_STATS_TOTAL]);
+
+    if(request(serve, dump_argv, 2, &frame, &reply) == 0) {
+        report_phases(out, c->name, reply.data + 1, reply.len - 1);
+    }
+
+    abex_buf_free(&frame);
+    abex_buf_free(&reply);
+    abex_buf_free(&values);
+
+    return 0;
+}
+
+/* run tag_list ops times against a server with c->elements tags, output thrown away */
+static int run_list_case(const struct bench_options_s *opts, const struct bench_case_s *c, int ops, FILE *out)
+{
+    static struct tag_stats_s stats;
+    char program[PATH_SIZE];
+    char *argv[5];
+    int errors = 0;
+    int64_t start_us;
+    pid_t server;
+    int i;
+
+    server = start_server(opts, c->elements);
+    if(server < 0) {
+        return 1;
+    }
+
+    snprintf(program, sizeof(program), "%s/tag_list", opts->bin_dir);
+    argv[0] = program;
+    argv[1] = BENCH_GATEWAY;
+    argv[2] = "1,0";
+    argv[3] = "--format=binary";
+    argv[4] = NULL;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.enabled = 1;
+
+    start_us = abex_time_us();
+    for(i = 0; i < ops; i++) {
+        int64_t sent_us = abex_time_us();
+        pid_t pid = spawn(argv, -1, -1);
+        int status = 1;
+
+        if(pid > 0) {
+            waitpid(pid, &status, 0);
+        }
+
+        tag_stats_since(&stats, TAG_STATS_TOTAL, sent_us);
+
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            errors++;
+        }
+    }
+
+    /* a simulator without @tags support fails every listing, that is not a failed run. */
+    if(errors == ops) {
+        fprintf(stderr, "WARNING: tag_list failed against %s, skipping %s\n", opts->ab_server, c->name);
+        fprintf(out, "%s skipped\n", c->name);
+    } else {
+        report_case(out, c->name, ops, errors, abex_time_us() - start_us, &stats.phases[TAG_STATS_TOTAL]);
+    }
+
+    stop_child(server);
+
+    return 0;
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: plc_bench --ab-server=PATH --bin-dir=DIR [options]\n");
+    fprintf(stderr, "  --ab-server=PATH - libplctag's ab_server, it must be free to listen on %s:%d\n",
+            BENCH_GATEWAY, BENCH_PORT);
+    fprintf(stderr, "  --bin-dir=DIR    - directory of rw_tag and tag_list\n");
+    fprintf(stderr, "  --out=FILE       - write the results to FILE instead of stdout\n");
+    fprintf(stderr, "  --label=TEXT     - first line of the results, e.g. the commit\n");
+    fprintf(stderr, "  --case=PREFIX    - only the cases whose name starts with PREFIX\n");
+    fprintf(stderr, "  --quick          - a tenth of the operations\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_options_s opts;
+    struct bench_serve_s serve;
+    const char *out_file = NULL;
+    const char *label = NULL;
+    FILE *out = stdout;
+    pid_t server = -1;
+    int failed = 0;
+    int i;
+
+    memset(&opts, 0, sizeof(opts));
+
+    for(i = 1; i < argc; i++) {
+        if(!strncmp(argv[i], "--ab-server=", strlen("--ab-server="))) {
+            opts.ab_server = argv[i] + strlen("--ab-server=");
+        } else if(!strncmp(argv[i], "--bin-dir=", strlen("--bin-dir="))) {
+            opts.bin_dir = argv[i] + strlen("--bin-dir=");
+        } else if(!strncmp(argv[i], "--out=", strlen("--out="))) {
+            out_file = argv[i] + strlen("--out=");
+        } else if(!strncmp(argv[i], "--label=", strlen("--label="))) {
+            label = argv[i] + strlen("--label=");
+        } else if(!strncmp(argv[i], "--case=", strlen("--case="))) {
+            opts.case_prefix = argv[i] + strlen("--case=");
+        } else if(!strcmp(argv[i], "--quick")) {
+            opts.quick = 1;
+        } else {
+            fprintf(stderr, "ERROR: unknown option %s\n", argv[i]);
+            usage();
+        }
+    }
+
+    if(!opts.ab_server || !opts.bin_dir) {
+        usage();
+    }
+
+    if(out_file) {
+        out = fopen(out_file, "w");
+        if(!out) {
+            fprintf(stderr, "ERROR: unable to open %s\n", out_file);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(out, "# %s\n", label ? label : "plc_bench");
+    fprintf(out, "# <case> total ops=N errors=N ops_s=X p50_us=N p90_us=N p99_us=N max_us=N\n");
+    fprintf(out, "# <case> <rw_tag phase> count=N sum_us=N p50_us=N p90_us=N p99_us=N max_us=N\n");
+
+    for(i = 0; i < CASE_COUNT; i++) {
+        const struct bench_case_s *c = &cases[i];
+
+        if(!wanted(&opts, c)) {
+            continue;
+        }
+
+        if(c->kind == CASE_LIST) {
+            /* every listing case has a server of its own. */
+            if(server > 0) {
+                stop_serve(&serve);
+                stop_child(server);
+                server = -1;
+            }
+
+            failed += run_list_case(&opts, c, case_ops(&opts, c), out);
+            continue;
+        }
+
+        if(server < 0) {
+            server = start_server(&opts, 0);
+            if(server < 0) {
+                return 1;
+            }
+
+            if(start_serve(&opts, &serve)) {
+                fprintf(stderr, "ERROR: unable to start %s/rw_tag\n", opts.bin_dir);
+                stop_child(server);
+                return 1;
+            }
+        }
+
+        failed += run_rw_case(&serve, c, case_ops(&opts, c), out);
+    }
+
+    if(server > 0) {
+        stop_serve(&serve);
+        stop_child(server);
+    }
+
+    if(out != stdout) {
+        fclose(out);
+    }
+
+    return failed ? 1 : 0;
+}
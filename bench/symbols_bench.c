@@ -0,0 +1,418 @@
+/***************************************************************************
+ *   Micro-benchmark and fuzz harness for the @tags listing decoder.       *
+ *                                                                         *
+ *   Compares the old tag_list path (an accessor call that locks the tag   *
+ *   and checks bounds for every field and every name byte, names copied   *
+ *   into a fixed buffer, program names duplicated) with one copy of the   *
+ *   response and tag_symbols_next(), names left in place.  Listings are  *
+ *   the files given, as saved by tag_list --capture=DIR, or a synthetic   *
+ *   one.  Both decoders must agree on every listing before it is timed.   *
+ *                                                                         *
+ *   --fuzz=N decodes N copies of the listings cut short and with bytes    *
+ *   flipped at random, checking that every entry stays inside the copy.  *
+ *   Build with -fsanitize=address to have stray reads reported as well.  *
+ *                                                                         *
+ *   symbols_bench [--tags=N] [--rounds=N] [--fuzz=N] [listing...]        *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "abex_util.h"
+#include "tag_symbols.h"
+
+#define DEFAULT_TAGS (10000)
+#define DEFAULT_ROUNDS (20)
+#define OLD_NAME_SIZE (400)
+
+/* stand-in for a libplctag tag: a buffer behind a mutex */
+struct fake_tag_s {
+    pthread_mutex_t mutex;
+    uint8_t *data;
+    int size;
+};
+
+static int fake_get_size(struct fake_tag_s *tag)
+{
+    int size;
+
+    pthread_mutex_lock(&tag->mutex);
+    size = tag->size;
+    pthread_mutex_unlock(&tag->mutex);
+
+    return size;
+}
+
+static uint32_t fake_get(struct fake_tag_s *tag, int offset, int width)
+{
+    uint32_t val = 0;
+    int i;
+
+    pthread_mutex_lock(&tag->mutex);
+    if(offset >= 0 && offset + width <= tag->size) {
+        for(i = width - 1; i >= 0; i--) {
+            val = (val << 8) | tag->data[offset + i];
+        }
+    }
+    pthread_mutex_unlock(&tag->mutex);
+
+    return val;
+}
+
+static void fake_get_raw_bytes(struct fake_tag_s *tag, uint8_t *dst, int size)
+{
+    pthread_mutex_lock(&tag->mutex);
+    memcpy(dst, tag->data, (size_t)size);
+    pthread_mutex_unlock(&tag->mutex);
+}
+
+/* what both decoders add up, so neither loop is optimized away and they can be compared */
+struct summary_s {
+    uint32_t entries;
+    uint32_t programs;
+    uint32_t system;
+    uint32_t hash;
+};
+
+static uint32_t hash_bytes(uint32_t hash, const char *data, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static void summarize(struct summary_s *sum, uint32_t instance_id, uint16_t symbol_type, const uint32_t *dims,
+                      const char *name, size_t name_len)
+{
+    sum->entries++;
+    sum->hash = (sum->hash ^ instance_id ^ symbol_type ^ dims[0] ^ dims[1] ^ dims[2]) * 16777619u;
+    sum->hash = hash_bytes(sum->hash, name, name_len);
+
+    if(tag_symbol_is_system(symbol_type, name, name_len)) {
+        sum->system++;
+    }
+}
+
+/* the loop tag_list used before: accessors per field and per name byte */
+static void old_decode(struct fake_tag_s *tag, struct summary_s *sum)
+{
+    int offset = 0;
+
+    do {
+        uint32_t instance_id;
+        uint16_t symbol_type;
+        uint16_t name_len;
+        uint32_t dims[3];
+        char name[OLD_NAME_SIZE] = {0,};
+        char *program;
+        int i;
+
+        if(offset + TAG_SYMBOL_HEADER_SIZE > fake_get_size(tag)) {
+            break;
+        }
+
+        instance_id = fake_get(tag, offset, 4);
+        symbol_type = (uint16_t)fake_get(tag, offset + 4, 2);
+        (void)fake_get(tag, offset + 6, 2);
+        dims[0] = fake_get(tag, offset + 8, 4);
+        dims[1] = fake_get(tag, offset + 12, 4);
+        dims[2] = fake_get(tag, offset + 16, 4);
+        name_len = (uint16_t)fake_get(tag, offset + 20, 2);
+        offset += TAG_SYMBOL_HEADER_SIZE;
+
+        if(name_len >= OLD_NAME_SIZE - 1) {
+            name_len = OLD_NAME_SIZE - 2;
+        }
+        for(i = 0; i < (int)name_len && offset < fake_get_size(tag); i++) {
+            name[i] = (char)fake_get(tag, offset, 1);
+            offset++;
+            name[i + 1] = 0;
+        }
+
+        summarize(sum, instance_id, symbol_type, dims, name, strlen(name));
+
+        if(strncmp(name, "Program:", strlen("Program:")) == 0) {
+            program = malloc(strlen(name) + 1);
+            if(program) {
+                strcpy(program, name);
+                sum->programs++;
+                free(program);
+            }
+        }
+    } while(offset < fake_get_size(tag));
+}
+
+/* one copy, then entries straight from it */
+static void new_decode(struct fake_tag_s *tag, struct abex_buf_s *raw, struct summary_s *sum)
+{
+    struct tag_symbols_s symbols;
+    struct tag_symbol_s symbol;
+    int size = fake_get_size(tag);
+
+    abex_buf_reset(raw);
+    if(abex_buf_reserve(raw, (size_t)size)) {
+        fprintf(stderr, "Unable to allocate memory!\n");
+        exit(1);
+    }
+
+    fake_get_raw_bytes(tag, (uint8_t *)raw->data, size);
+    raw->len = (size_t)size;
+
+    tag_symbols_init(&symbols, (const uint8_t *)raw->data, raw->len);
+
+    while(tag_symbols_next(&symbols, &symbol) > 0) {
+        const char *name = raw->data + symbol.name_offset;
+
+        summarize(sum, symbol.instance_id, symbol.symbol_type, symbol.array_dims, name, symbol.name_len);
+
+        if(symbol.name_len >= strlen("Program:") && !memcmp(name, "Program:", strlen("Program:"))) {
+            sum->programs++;
+        }
+    }
+}
+
+static void put_le(struct abex_buf_s *buf, uint32_t val, int width)
+{
+    uint8_t bytes[4];
+    int i;
+
+    for(i = 0; i < width; i++) {
+        bytes[i] = (uint8_t)(val >> (8 * i));
+    }
+
+    abex_buf_append(buf, bytes, (size_t)width);
+}
+
+static void add_entry(struct abex_buf_s *buf, uint32_t instance_id, uint16_t symbol_type, uint16_t element_length,
+                      uint32_t dim, const char *name)
+{
+    put_le(buf, instance_id, 4);
+    put_le(buf, symbol_type, 2);
+    put_le(buf, element_length, 2);
+    put_le(buf, dim, 4);
+    put_le(buf, 0, 4);
+    put_le(buf, 0, 4);
+    put_le(buf, (uint32_t)strlen(name), 2);
+    abex_buf_append(buf, name, strlen(name));
+}
+
+/* a controller listing with the mix of names and types a real one has */
+static void synthetic_listing(struct abex_buf_s *buf, int tags)
+{
+    char name[64];
+    int i;
+
+    for(i = 0; i < tags; i++) {
+        if(i % 100 == 99) {
+            snprintf(name, sizeof(name), "Program:Line%d_Station%d", i / 1000, i % 1000);
+            add_entry(buf, (uint32_t)(i * 3 + 1), 0x1068, 0, 0, name);
+        } else if(i % 50 == 7) {
+            snprintf(name, sizeof(name), "__SystemDiag%d", i);
+            add_entry(buf, (uint32_t)(i * 3 + 1), 0x10C4, 4, 0, name);
+        } else if(i % 3 == 0) {
+            snprintf(name, sizeof(name), "Conveyor_%d_Speed_Setpoint", i);
+            add_entry(buf, (uint32_t)(i * 3 + 1), 0x00CA, 4, 0, name);
+        } else if(i % 3 == 1) {
+            snprintf(name, sizeof(name), "Motor%d_RunHours", i);
+            add_entry(buf, (uint32_t)(i * 3 + 1), 0x20C4, 4, 64, name);
+        } else {
+            snprintf(name, sizeof(name), "Recipe%d", i);
+            add_entry(buf, (uint32_t)(i * 3 + 1), (uint16_t)(0x8000 | (i & 0xFFF)), 88, 0, name);
+        }
+    }
+}
+
+static int load_file(const char *file, struct abex_buf_s *buf)
+{
+    char chunk[4096];
+    size_t got;
+    FILE *fp = fopen(file, "rb");
+
+    if(!fp) {
+        return 1;
+    }
+
+    while((got = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        abex_buf_append(buf, chunk, got);
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+/* abex_time_ms() is too coarse for a single round */
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * Decode a damaged copy of listing.  Every entry must lie inside the copy
+ * and after the one before it, and the walk must end.  Returns 0 if so.
+ */
+static int fuzz_one(const struct abex_buf_s *listing, uint8_t *copy)
+{
+    struct tag_symbols_s symbols;
+    struct tag_symbol_s symbol;
+    size_t size = listing->len ? (size_t)rand() % (listing->len + 1) : 0;
+    size_t next = 0;
+    size_t entries = 0;
+    int flips = rand() % 8;
+    int rc;
+
+    memcpy(copy, listing->data, size);
+    while(size && flips-- > 0) {
+        copy[(size_t)rand() % size] ^= (uint8_t)(1 << (rand() % 8));
+    }
+
+    tag_symbols_init(&symbols, copy, size);
+
+    while((rc = tag_symbols_next(&symbols, &symbol)) > 0) {
+        if(symbol.name_offset != next + TAG_SYMBOL_HEADER_SIZE
+           || (size_t)symbol.name_offset + symbol.name_len > size
+           || ++entries > size / TAG_SYMBOL_HEADER_SIZE) {
+            return 1;
+        }
+
+        next = (size_t)symbol.name_offset + symbol.name_len;
+        (void)tag_symbol_dims(&symbol);
+        (void)tag_symbol_is_system(symbol.symbol_type, (const char *)copy + symbol.name_offset, symbol.name_len);
+    }
+
+    /* a listing that ends mid-entry is reported, one that ends on an entry is not */
+    return (rc < 0) != (next != size);
+}
+
+int main(int argc, char **argv)
+{
+    struct abex_buf_s listings[64];
+    struct abex_buf_s raw = {NULL, 0, 0};
+    int tags = DEFAULT_TAGS;
+    int rounds = DEFAULT_ROUNDS;
+    long fuzz = 0;
+    int count = 0;
+    int l;
+    int i;
+
+    memset(listings, 0, sizeof(listings));
+
+    for(i = 1; i < argc; i++) {
+        if(!strncmp(argv[i], "--tags=", strlen("--tags="))) {
+            tags = atoi(argv[i] + strlen("--tags="));
+        } else if(!strncmp(argv[i], "--rounds=", strlen("--rounds="))) {
+            rounds = atoi(argv[i] + strlen("--rounds="));
+        } else if(!strncmp(argv[i], "--fuzz=", strlen("--fuzz="))) {
+            fuzz = atol(argv[i] + strlen("--fuzz="));
+        } else if(argv[i][0] == '-' || count >= (int)(sizeof(listings) / sizeof(listings[0]))) {
+            count = -1;
+            break;
+        } else if(load_file(argv[i], &listings[count++])) {
+            fprintf(stderr, "Unable to read %s!\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if(count < 0 || tags <= 0 || rounds <= 0 || fuzz < 0) {
+        fprintf(stderr, "Usage: symbols_bench [--tags=N] [--rounds=N] [--fuzz=N] [listing...]\n");
+        return 1;
+    }
+
+    if(count == 0) {
+        synthetic_listing(&listings[count++], tags);
+    }
+
+    printf("%d listings, %d rounds, ns per entry\n", count, rounds);
+    printf("%-8s %10s %8s %10s %10s %8s\n", "listing", "bytes", "entries", "old", "new", "speedup");
+
+    for(l = 0; l < count; l++) {
+        struct fake_tag_s tag;
+        struct summary_s old_sum;
+        struct summary_s new_sum;
+        double entries;
+        double old_ns;
+        double new_ns;
+        double start;
+        int r;
+
+        pthread_mutex_init(&tag.mutex, NULL);
+        tag.data = (uint8_t *)listings[l].data;
+        tag.size = (int)listings[l].len;
+
+        memset(&old_sum, 0, sizeof(old_sum));
+        memset(&new_sum, 0, sizeof(new_sum));
+        old_decode(&tag, &old_sum);
+        new_decode(&tag, &raw, &new_sum);
+
+        /* names over 398 bytes were cut short before and would not match */
+        if(memcmp(&old_sum, &new_sum, sizeof(old_sum))) {
+            fprintf(stderr, "Listing %d: old and new decoders disagree (%u/%u entries, %u/%u programs)!\n", l,
+                    old_sum.entries, new_sum.entries, old_sum.programs, new_sum.programs);
+            return 1;
+        }
+
+        entries = (double)rounds * (double)(new_sum.entries ? new_sum.entries : 1);
+
+        start = now_ns();
+        for(r = 0; r < rounds; r++) {
+            old_decode(&tag, &old_sum);
+        }
+        old_ns = (now_ns() - start) / entries;
+
+        start = now_ns();
+        for(r = 0; r < rounds; r++) {
+            new_decode(&tag, &raw, &new_sum);
+        }
+        new_ns = (now_ns() - start) / entries;
+
+        printf("%-8d %10d %8u %10.2f %10.2f %7.1fx\n", l, tag.size, new_sum.entries / (uint32_t)(rounds + 1),
+               old_ns, new_ns, new_ns > 0.0 ? old_ns / new_ns : 0.0);
+
+        pthread_mutex_destroy(&tag.mutex);
+    }
+
+    if(fuzz > 0) {
+        long failures = 0;
+        long n;
+
+        srand(1);
+
+        for(n = 0; n < fuzz; n++) {
+            const struct abex_buf_s *listing = &listings[n % count];
+            uint8_t *copy = malloc(listing->len ? listing->len : 1);
+
+            if(!copy) {
+                fprintf(stderr, "Unable to allocate memory!\n");
+                return 1;
+            }
+
+            if(fuzz_one(listing, copy)) {
+                failures++;
+            }
+
+            free(copy);
+        }
+
+        printf("fuzz: %ld listings, %ld failures\n", fuzz, failures);
+        if(failures) {
+            return 1;
+        }
+    }
+
+    abex_buf_free(&raw);
+    for(l = 0; l < count; l++) {
+        abex_buf_free(&listings[l]);
+    }
+
+    return 0;
+}
@@ -18,6 +18,7 @@ defmodule Abex do
 
   - `Abex.Tag` - High-level GenServer interface for PLC communication
   - `Abex.Tag.Raw` - Low-level interface with direct access to all libplctag features
+  - `Abex.Scanner` - Fixed-cycle polling of many tags on many PLCs from one native process
 
   ## Quick Start
 
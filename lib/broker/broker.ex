@@ -0,0 +1,72 @@
+defmodule Abex.Broker do
+  @moduledoc """
+  Runs `rw_tag --broker`, a local daemon that answers the one-shot `rw_tag`
+  and `tag_list` runs of every `Abex.Tag` started with `broker: socket` (and
+  of any other program given `--broker=socket` or `ABEX_BROKER=socket`).
+
+  The broker keeps its tag handles open between requests, so the one-shot
+  runs share its PLC sessions (one per gateway, path and
+  `connection_group_id`) instead of each opening and closing a connection.
+  Requests are answered one at a time, in the order they come in from the
+  clients. Runs that find no broker on the socket go to the PLC themselves.
+
+      {:ok, _broker} = Abex.Broker.start_link(socket: "/tmp/abex.sock")
+      {:ok, tag} = Abex.Tag.start_link(ip: "10.0.0.1", persistent: false, broker: "/tmp/abex.sock")
+
+  Options: `idle_ms:` (how long an unused tag stays open), `rate_limit:` (as
+  for `Abex.Tag`, applied to every client's requests) and `stats: true`.
+  The broker stops, and removes the socket, when this process exits.
+  """
+  use GenServer
+  require Logger
+
+  defstruct port: nil, socket: nil
+
+  defp cmd_runner do
+    Application.get_env(:abex, :cmd_runner, Abex.CmdWrapper)
+  end
+
+  def start_link(args, opts \\ []) do
+    GenServer.start_link(__MODULE__, args, opts)
+  end
+
+  def stop(pid), do: GenServer.stop(pid)
+
+  def init(args) do
+    socket = Keyword.fetch!(args, :socket)
+    port = cmd_runner().open(rw_tag_cmd(), ["--broker", "--socket=#{socket}", "--watch-stdin"] ++ broker_args(args))
+
+    {:ok, %__MODULE__{port: port, socket: socket}}
+  end
+
+  def terminate(_reason, %{port: nil}), do: :ok
+  def terminate(_reason, %{port: port}), do: cmd_runner().close(port)
+
+  def handle_info({port, {:exit_status, status}}, %{port: port} = state) do
+    Logger.error("(#{__MODULE__}) rw_tag broker on #{state.socket} exited with status #{status}.")
+    {:stop, {:exit_status, status}, %{state | port: nil}}
+  end
+
+  def handle_info(_msg, state), do: {:noreply, state}
+
+  defp broker_args(args) do
+    limits = args[:rate_limit] || []
+
+    [
+      {"--idle-ms", args[:idle_ms]},
+      {"--rate-limit", limits[:rate]},
+      {"--burst", limits[:burst]},
+      {"--max-concurrent", limits[:max_concurrent]},
+      {"--limit-dir", limits[:dir]}
+    ]
+    |> Enum.reject(fn {_key, value} -> is_nil(value) end)
+    |> Enum.map(fn {key, value} -> "#{key}=#{value}" end)
+    |> Kernel.++(if args[:stats], do: ["--stats"], else: [])
+  end
+
+  defp rw_tag_cmd do
+    :code.priv_dir(:abex)
+    |> to_string()
+    |> Path.join("rw_tag")
+  end
+end
@@ -2,7 +2,19 @@ defmodule Abex.CmdBehaviour do
   @moduledoc """
   Behaviour for command execution.
   This allows mocking in tests.
+
+  `cmd/2` runs a native program once. `open/2`, `request/3` and `close/1`
+  drive a long-lived native program (e.g. `rw_tag --serve`) through a port,
+  where each request is a list of arguments and each response has the same
+  `{output, exit_status}` shape as `cmd/2`. A response sent in pieces (status
+  2, more follows) is picked up with `next_response/2`. `send/2` sends a
+  request without waiting, its response arrives as a port message.
   """
 
   @callback cmd(binary(), list()) :: {binary(), non_neg_integer()}
+  @callback open(binary(), list()) :: term()
+  @callback request(term(), list(), timeout()) :: {binary(), non_neg_integer()} | {:error, term()}
+  @callback next_response(term(), timeout()) :: {binary(), non_neg_integer()} | {:error, term()}
+  @callback send(term(), list()) :: :ok | {:error, term()}
+  @callback close(term()) :: :ok
 end
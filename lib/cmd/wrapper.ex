@@ -5,6 +5,10 @@ defmodule Abex.CmdWrapper do
 
   Captures both stdout and stderr from commands to ensure debug output
   from libplctag is visible on all platforms (including Nerves).
+
+  Long-lived programs are run as ports with `{:packet, 4}` framing: a request
+  is its arguments joined with NUL bytes, a response is one status byte
+  followed by the program output.
   """
 
   @behaviour Abex.CmdBehaviour
@@ -14,4 +18,42 @@ defmodule Abex.CmdWrapper do
     # Merge stderr into stdout so debug logs are captured
     MuonTrap.cmd(command, args, stderr_to_stdout: true)
   end
+
+  @impl true
+  def open(command, args) do
+    Port.open({:spawn_executable, command}, [:binary, :exit_status, {:packet, 4}, args: args])
+  end
+
+  @impl true
+  def request(port, args, timeout) do
+    Port.command(port, Enum.join(args, <<0>>))
+    next_response(port, timeout)
+  rescue
+    # the program exited and the port is already gone
+    ArgumentError -> {:error, :closed}
+  end
+
+  @impl true
+  def send(port, args) do
+    Port.command(port, Enum.join(args, <<0>>))
+    :ok
+  rescue
+    ArgumentError -> {:error, :closed}
+  end
+
+  @impl true
+  def next_response(port, timeout) do
+    receive do
+      {^port, {:data, <<status, data::binary>>}} -> {data, status}
+      {^port, {:exit_status, status}} -> {:error, {:exit_status, status}}
+    after
+      timeout -> {:error, :timeout}
+    end
+  end
+
+  @impl true
+  def close(port) do
+    if Port.info(port) != nil, do: Port.close(port)
+    :ok
+  end
 end
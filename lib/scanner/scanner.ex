@@ -0,0 +1,175 @@
+defmodule Abex.Scanner do
+  @moduledoc """
+  Polls many tags on many PLCs from one native `scanner` process.
+
+  Each tag is a keyword list like the ones given to `Abex.Tag.read/2`, plus
+  the `ip:` of its PLC (and optionally `path:` and `cpu:`). The scanner runs
+  one worker thread per PLC, reads every tag once per `cycle_ms`, and never
+  has more than `per_gateway` requests in flight on one PLC or
+  `max_inflight` in total.
+
+  As soon as a PLC's cycle is done, the subscriber receives:
+
+    - `{:abex_scan, scanner, gateway, cycle, [{tag_name, {:ok, values} | {:error, reason}}]}`
+
+  Results are in completion order. The scanner stops when the subscriber
+  exits or on `stop/1`.
+
+  With `stats: true` every PLC's worker times each phase of its cycles, and
+  with `stats_every: n` it sends them every `n` cycles as
+
+    - `{:abex_scan_stats, scanner, gateway, stats}`
+
+  where `stats` is parsed by `Abex.Stats.parse/1`.
+
+      {:ok, scanner} =
+        Abex.Scanner.start_link(
+          subscriber: self(),
+          cycle_ms: 500,
+          tags: [
+            [ip: "10.0.0.1", name: "Speed", data_type: "real32", elem_size: 4, elem_count: 1],
+            [ip: "10.0.0.2", name: "Count", data_type: "sint32", elem_size: 4, elem_count: 1]
+          ]
+        )
+  """
+  use GenServer
+  require Logger
+
+  alias Abex.Tag.Types
+
+  defstruct port: nil,
+            subscriber: nil,
+            names: {},
+            data_types: {},
+            format: :text
+
+  defp cmd_runner do
+    Application.get_env(:abex, :cmd_runner, Abex.CmdWrapper)
+  end
+
+  # results go to the caller unless a `subscriber:` is given
+  def start_link(args, opts \\ []),
+    do: GenServer.start_link(__MODULE__, Keyword.put_new(args, :subscriber, self()), opts)
+
+  def stop(pid), do: GenServer.stop(pid)
+
+  def init(args) do
+    subscriber = Keyword.fetch!(args, :subscriber)
+    tags = Keyword.fetch!(args, :tags)
+    format = Keyword.get(args, :format, :text)
+
+    Process.monitor(subscriber)
+
+    specs = Enum.flat_map(tags, fn params -> ["-s", "#{params[:data_type]} #{tag_attrs(params)}"] end)
+    port = cmd_runner().open(scanner_cmd(), scanner_args(args, format) ++ specs)
+
+    state = %__MODULE__{
+      port: port,
+      subscriber: subscriber,
+      names: tags |> Enum.map(& &1[:name]) |> List.to_tuple(),
+      data_types: tags |> Enum.map(& &1[:data_type]) |> List.to_tuple(),
+      format: format
+    }
+
+    {:ok, state}
+  end
+
+  def terminate(_reason, %{port: nil}), do: :ok
+  def terminate(_reason, %{port: port}), do: cmd_runner().close(port)
+
+  def handle_info({port, {:data, <<0, cycle::binary>>}}, %{port: port} = state) do
+    {gateway, number, results} = parse_cycle(cycle, state)
+    send(state.subscriber, {:abex_scan, self(), gateway, number, results})
+    {:noreply, state}
+  end
+
+  # "stats <gateway>" then the report
+  def handle_info({port, {:data, <<2, "stats ", report::binary>>}}, %{port: port} = state) do
+    [gateway, report] = String.split(report, "\n", parts: 2)
+    send(state.subscriber, {:abex_scan_stats, self(), gateway, Abex.Stats.parse(report)})
+    {:noreply, state}
+  end
+
+  def handle_info({port, {:data, <<_status, reason::binary>>}}, %{port: port} = state) do
+    Logger.error("(#{__MODULE__}) scanner: #{reason}")
+    {:noreply, state}
+  end
+
+  def handle_info({port, {:exit_status, status}}, %{port: port} = state) do
+    Logger.error("(#{__MODULE__}) scanner exited with status #{status}.")
+    {:stop, {:exit_status, status}, %{state | port: nil}}
+  end
+
+  def handle_info({:DOWN, _ref, :process, subscriber, _reason}, %{subscriber: subscriber} = state),
+    do: {:stop, :normal, state}
+
+  def handle_info(_msg, state), do: {:noreply, state}
+
+  defp scanner_cmd do
+    :code.priv_dir(:abex)
+    |> to_string()
+    |> Path.join("scanner")
+  end
+
+  defp scanner_args(args, format) do
+    [
+      {"--cycle-ms", args[:cycle_ms]},
+      {"--max-inflight", args[:max_inflight]},
+      {"--per-gateway", args[:per_gateway]},
+      {"--stats-every", args[:stats_every]}
+    ]
+    |> Enum.reject(fn {_key, value} -> is_nil(value) end)
+    |> Enum.map(fn {key, value} -> "#{key}=#{value}" end)
+    |> Kernel.++(if format == :binary, do: ["--format=binary"], else: [])
+    |> Kernel.++(if args[:stats], do: ["--stats"], else: [])
+  end
+
+  defp tag_attrs(params) do
+    "protocol=ab-eip&gateway=#{params[:ip]}&path=#{params[:path] || "1,0"}&plc=#{params[:cpu] || "lgx"}" <>
+      "&elem_size=#{params[:elem_size]}&elem_count=#{params[:elem_count]}&name=#{params[:name]}"
+  end
+
+  # text: "cycle <n> <gateway>", then "<tag index> ok <values>" or "<tag index> error <reason>"
+  defp parse_cycle(cycle, %{format: :text} = state) do
+    ["cycle " <> header | lines] = String.split(cycle, "\n", trim: true)
+    [number, gateway] = String.split(header, " ", parts: 2)
+
+    results =
+      Enum.map(lines, fn line ->
+        [tag, result] = String.split(line, " ", parts: 2)
+        tag = String.to_integer(tag)
+        {elem(state.names, tag), parse_result(result, elem(state.data_types, tag))}
+      end)
+
+    {gateway, String.to_integer(number), results}
+  end
+
+  # binary: uint32 cycle, uint16-prefixed gateway, then per tag a uint32 index,
+  # an int32 status and a binary block or a uint16-prefixed error
+  defp parse_cycle(<<number::little-32, len::little-16, gateway::binary-size(len), results::binary>>, state),
+    do: {gateway, number, decode_results(results, state, [])}
+
+  defp parse_result("ok " <> values, data_type),
+    do: {:ok, values |> String.split(" ", trim: true) |> Enum.map(&Types.parse(&1, data_type))}
+
+  defp parse_result("error " <> reason, _data_type), do: {:error, reason}
+
+  defp decode_results(<<>>, _state, acc), do: Enum.reverse(acc)
+
+  defp decode_results(
+         <<tag::little-32, 0::little-signed-32, 1, _flags, data_type::little-16, elem_size::little-32,
+           _elem_count::little-32, data_len::little-32, data::binary-size(data_len), rest::binary>>,
+         state,
+         acc
+       ) do
+    result = {elem(state.names, tag), {:ok, Types.decode_elements(data, data_type, elem_size)}}
+    decode_results(rest, state, [result | acc])
+  end
+
+  defp decode_results(
+         <<tag::little-32, _status::little-signed-32, len::little-16, reason::binary-size(len), rest::binary>>,
+         state,
+         acc
+       ),
+       do: decode_results(rest, state, [{elem(state.names, tag), {:error, reason}} | acc])
+end
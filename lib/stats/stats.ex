@@ -0,0 +1,104 @@
+defmodule Abex.Stats do
+  @moduledoc """
+  Parses the `--stats` report of the native programs, as returned by
+  `Abex.Tag.stats/2` and sent by `Abex.Scanner` with `stats: true`.
+
+  The report has one line per phase (`lib_check`, `limit_wait`, `create`,
+  `status`, `read`, `write`, `decode`, `output` and `total`), per counter and
+  per gateway:
+
+      phase read count=120 sum_us=250000 p50_us=1900 p90_us=2600 p99_us=4100 max_us=9800
+      counter bytes_read 4800
+      gateway 10.0.0.1 srtt_us=2000 rttvar_us=500 samples=120 attempts=122 timeouts=2
+
+  and becomes
+
+      %{
+        phases: %{read: %{count: 120, sum_us: 250000, p50_us: 1900, p90_us: 2600, p99_us: 4100, max_us: 9800}},
+        counters: %{bytes_read: 4800},
+        gateways: %{"10.0.0.1" => %{srtt_us: 2000, rttvar_us: 500, samples: 120, attempts: 122, timeouts: 2}}
+      }
+
+  Phases nothing was timed for are left out. Each phase map has the shape of
+  `:telemetry` measurements, so forwarding them is one call per phase:
+
+      {:ok, stats} = Abex.Tag.stats(pid, reset: true)
+
+      for {phase, measurements} <- stats.phases do
+        :telemetry.execute([:abex, :rw_tag, phase], measurements, %{ip: ip})
+      end
+  """
+
+  # only names the native programs use become atoms
+  @names ~w(lib_check limit_wait create status read write decode output total
+            bytes_read bytes_written errors cache_hits coalesced overruns
+            count sum_us p50_us p90_us p99_us max_us
+            srtt_us rttvar_us samples attempts timeouts)
+         |> Map.new(&{&1, String.to_atom(&1)})
+
+  def parse(report) do
+    report
+    |> String.split("\n", trim: true)
+    |> Enum.reduce(%{phases: %{}, counters: %{}, gateways: %{}}, &parse_line/2)
+  end
+
+  @doc """
+  Combines the reports of several `rw_tag` servers, such as the workers of
+  one `Abex.Tag`. Counts, sums and counters add up; percentiles and maxima
+  are the highest of the reports, so they are an upper bound. A gateway
+  keeps the round trip estimate of the server with the most samples.
+  """
+  def merge([]), do: %{phases: %{}, counters: %{}, gateways: %{}}
+
+  def merge(reports) do
+    Enum.reduce(reports, fn report, acc ->
+      %{
+        phases: Map.merge(acc.phases, report.phases, fn _phase, a, b -> merge_phase(a, b) end),
+        counters: Map.merge(acc.counters, report.counters, fn _counter, a, b -> a + b end),
+        gateways: Map.merge(acc.gateways, report.gateways, fn _gateway, a, b -> merge_gateway(a, b) end)
+      }
+    end)
+  end
+
+  defp merge_phase(a, b) do
+    Map.merge(a, b, fn
+      key, x, y when key in [:count, :sum_us] -> x + y
+      _percentile, x, y -> max(x, y)
+    end)
+  end
+
+  defp merge_gateway(a, b) do
+    {rtt, _other} = if Map.get(a, :samples, 0) >= Map.get(b, :samples, 0), do: {a, b}, else: {b, a}
+
+    Map.merge(a, b, fn
+      key, x, y when key in [:samples, :attempts, :timeouts] -> x + y
+      key, _x, _y -> Map.get(rtt, key)
+    end)
+  end
+
+  defp parse_line("phase " <> line, acc) do
+    [phase | fields] = String.split(line, " ", trim: true)
+    put_in(acc, [:phases, name(phase)], parse_fields(fields))
+  end
+
+  defp parse_line("counter " <> line, acc) do
+    [counter, value] = String.split(line, " ", trim: true)
+    put_in(acc, [:counters, name(counter)], String.to_integer(value))
+  end
+
+  defp parse_line("gateway " <> line, acc) do
+    [gateway | fields] = String.split(line, " ", trim: true)
+    put_in(acc, [:gateways, gateway], parse_fields(fields))
+  end
+
+  defp parse_line(_other, acc), do: acc
+
+  defp parse_fields(fields) do
+    Map.new(fields, fn field ->
+      [key, value] = String.split(field, "=", parts: 2)
+      {name(key), String.to_integer(value)}
+    end)
+  end
+
+  defp name(name), do: Map.get(@names, name, name)
+end
@@ -0,0 +1,146 @@
+defmodule Abex.SampleRing do
+  @moduledoc """
+  Reads the ring file written by `rw_tag --sample` (see `Abex.Tag.sample/3`).
+
+  The layout is in `src/sample_ring.h`: a 64-byte header, one 64-byte entry
+  per tag, then `capacity` fixed-size records. Sample `n` (from 0) lives in
+  slot `rem(n, capacity)` and carries `seq = n + 1`. The sampler never waits
+  for readers, so a record is only trusted if its `seq` is the same before and
+  after the read. Samples the sampler already overwrote are skipped and
+  counted as lost.
+
+  A native reader (NIF, historian) maps the same file with `sample_ring.h` and
+  reads the records in place; this module reads them with `pread` so it needs
+  no native code.
+
+      {:ok, ring} = Abex.SampleRing.open("/tmp/line1.ring")
+      {:ok, samples, next, lost} = Abex.SampleRing.read(ring, 0)
+      :ok = Abex.SampleRing.consume(ring, next)
+
+  Each sample is `%{seq: n, timestamp_ns: t, tag: name, status: s, values: [...]}`,
+  with `values: []` when `status` is not 0 (the libplctag status of the read).
+  """
+
+  alias Abex.Tag.Types
+
+  @magic "ABEXRING"
+  @version 1
+  @header_size 64
+  @tag_entry_size 64
+  @head_offset 32
+  @tail_offset 40
+  @overruns_offset 48
+
+  defstruct fd: nil, capacity: 0, record_size: 0, records_offset: 0, tags: {}
+
+  def open(path) do
+    with {:ok, fd} <- :file.open(path, [:read, :write, :raw, :binary]) do
+      case read_layout(fd) do
+        {:ok, ring} ->
+          {:ok, ring}
+
+        error ->
+          :file.close(fd)
+          error
+      end
+    end
+  end
+
+  def close(%__MODULE__{fd: fd}), do: :file.close(fd)
+
+  @doc "Number of samples written so far; the next one will be sample `head`."
+  def head(%__MODULE__{fd: fd}), do: read_u64(fd, @head_offset)
+
+  @doc "Samples the sampler overwrote before `consume/2` got past them."
+  def overruns(%__MODULE__{fd: fd}), do: read_u64(fd, @overruns_offset)
+
+  @doc """
+  Reads the samples from `next` up to the current head. Returns the samples,
+  where to continue from, and how many were overwritten before they could be
+  read.
+  """
+  def read(%__MODULE__{} = ring, next) do
+    head = head(ring)
+    first = max(next, head - ring.capacity)
+    {samples, lost} = read_records(ring, first, head, [], first - next)
+    {:ok, samples, head, lost}
+  end
+
+  @doc """
+  Tells the sampler every sample before `next` was read, so overwriting them
+  is not counted as an overrun. Only one reader should consume.
+  """
+  def consume(%__MODULE__{fd: fd}, next), do: :file.pwrite(fd, @tail_offset, <<next::little-64>>)
+
+  defp read_layout(fd) do
+    case :file.pread(fd, 0, @header_size) do
+      {:ok,
+       <<@magic, @version::little-32, header_size::little-32, record_size::little-32, capacity::little-32,
+         _data_size::little-32, tag_count::little-32, _counters::binary-size(24), records_offset::little-32,
+         _reserved::little-32>>} ->
+        {:ok, entries} = :file.pread(fd, header_size, tag_count * @tag_entry_size)
+
+        {:ok,
+         %__MODULE__{
+           fd: fd,
+           capacity: capacity,
+           record_size: record_size,
+           records_offset: records_offset,
+           tags: parse_tags(entries, [])
+         }}
+
+      {:ok, _other} ->
+        {:error, :bad_ring}
+
+      other ->
+        other
+    end
+  end
+
+  defp parse_tags(<<>>, acc), do: acc |> Enum.reverse() |> List.to_tuple()
+
+  defp parse_tags(
+         <<data_type::little-16, elem_size::little-16, _elem_count::little-32, name::binary-size(56), rest::binary>>,
+         acc
+       ) do
+    name = name |> :binary.split(<<0>>) |> hd()
+    parse_tags(rest, [{name, data_type, elem_size} | acc])
+  end
+
+  defp read_records(_ring, n, head, acc, lost) when n >= head, do: {Enum.reverse(acc), lost}
+
+  defp read_records(ring, n, head, acc, lost) do
+    offset = ring.records_offset + rem(n, ring.capacity) * ring.record_size
+    {:ok, record} = :file.pread(ring.fd, offset, ring.record_size)
+
+    # the record is ours only if the sampler did not start reusing it during the pread
+    case {record, read_u64(ring.fd, offset)} do
+      {<<seq::little-64, _rest::binary>>, seq} when seq == n + 1 ->
+        read_records(ring, n + 1, head, [parse_record(record, ring) | acc], lost)
+
+      _overwritten ->
+        read_records(ring, n + 1, head, acc, lost + 1)
+    end
+  end
+
+  defp parse_record(
+         <<seq::little-64, timestamp_ns::little-signed-64, tag::little-32, status::little-signed-32,
+           data_len::little-32, _reserved::little-32, data::binary-size(data_len), _padding::binary>>,
+         ring
+       ) do
+    {name, data_type, elem_size} = elem(ring.tags, tag)
+
+    %{
+      seq: seq - 1,
+      timestamp_ns: timestamp_ns,
+      tag: name,
+      status: status,
+      values: Types.decode_elements(data, data_type, elem_size)
+    }
+  end
+
+  defp read_u64(fd, offset) do
+    {:ok, <<value::little-64>>} = :file.pread(fd, offset, 8)
+    value
+  end
+end
@@ -0,0 +1,67 @@
+defmodule Abex.Tag.Sampler do
+  @moduledoc """
+  High-rate sampling of a set of tags into a ring file, started with
+  `Abex.Tag.sample/3`.
+
+  Runs `rw_tag --sample` behind a port. The native side keeps the tags open,
+  reads all of them every `interval_ms` and writes each raw tag buffer with a
+  timestamp into the memory-mapped file `ring`, overwriting the oldest of
+  `records` samples. Nothing goes through the port per sample; read the file
+  with `Abex.SampleRing` or a native reader.
+
+  The owner receives `{:abex_sampling, sampler, ring}` once sampling started.
+  The sampler stops when the owner exits or on `Abex.Tag.stop_sampling/1`.
+  """
+  use GenServer
+  require Logger
+
+  defstruct port: nil, owner: nil
+
+  defp cmd_runner do
+    Application.get_env(:abex, :cmd_runner, Abex.CmdWrapper)
+  end
+
+  def start(args), do: GenServer.start(__MODULE__, args)
+
+  def stop(pid), do: GenServer.stop(pid)
+
+  def init(args) do
+    owner = Keyword.fetch!(args, :owner)
+    opts = Keyword.fetch!(args, :opts)
+
+    Process.monitor(owner)
+
+    specs = Enum.flat_map(Keyword.fetch!(args, :specs), fn spec -> ["-s", spec] end)
+    port = cmd_runner().open(Keyword.fetch!(args, :cmd), ["--sample"] ++ sample_args(opts) ++ specs)
+
+    {:ok, %__MODULE__{port: port, owner: owner}}
+  end
+
+  def terminate(_reason, %{port: nil}), do: :ok
+  def terminate(_reason, %{port: port}), do: cmd_runner().close(port)
+
+  def handle_info({port, {:data, <<0, "ready ", ring::binary>>}}, %{port: port} = state) do
+    send(state.owner, {:abex_sampling, self(), ring})
+    {:noreply, state}
+  end
+
+  def handle_info({port, {:exit_status, status}}, %{port: port} = state) do
+    Logger.error("(#{__MODULE__}) rw_tag sampler exited with status #{status}.")
+    {:stop, {:exit_status, status}, %{state | port: nil}}
+  end
+
+  def handle_info({:DOWN, _ref, :process, owner, _reason}, %{owner: owner} = state),
+    do: {:stop, :normal, state}
+
+  def handle_info(_msg, state), do: {:noreply, state}
+
+  defp sample_args(opts) do
+    [
+      {"--ring", Keyword.fetch!(opts, :ring)},
+      {"--interval-ms", opts[:interval_ms]},
+      {"--records", opts[:records]}
+    ]
+    |> Enum.reject(fn {_key, value} -> is_nil(value) end)
+    |> Enum.map(fn {key, value} -> "#{key}=#{value}" end)
+  end
+end
@@ -0,0 +1,131 @@
+defmodule Abex.Tag.Subscription do
+  @moduledoc """
+  Change-driven reads of a set of tags, started with `Abex.Tag.subscribe/3`.
+
+  Runs `rw_tag --subscribe` behind a port. The native side keeps the tags
+  open, reads them every `interval_ms` (through libplctag's
+  `auto_sync_read_ms` unless `auto_sync: false`) and only reports elements
+  that changed. Integer tags change on any difference; REAL tags can use an
+  absolute `deadband` and/or a percentage `deadband_pct`.
+
+  The subscriber receives:
+
+    - `{:abex_changes, subscription, [{tag_name, element_index, value}]}`
+    - `{:abex_error, subscription, [{tag_name, reason}]}`
+
+  The subscription stops when the subscriber exits or on `Abex.Tag.unsubscribe/1`.
+  """
+  use GenServer
+  require Logger
+
+  alias Abex.Tag.Types
+
+  defstruct port: nil,
+            subscriber: nil,
+            names: {},
+            data_types: {},
+            format: :text
+
+  defp cmd_runner do
+    Application.get_env(:abex, :cmd_runner, Abex.CmdWrapper)
+  end
+
+  def start(args), do: GenServer.start(__MODULE__, args)
+
+  def stop(pid), do: GenServer.stop(pid)
+
+  def init(args) do
+    subscriber = Keyword.fetch!(args, :subscriber)
+    tags = Keyword.fetch!(args, :tags)
+    opts = Keyword.get(args, :opts, [])
+    format = Keyword.get(args, :format, :text)
+
+    Process.monitor(subscriber)
+
+    specs = Enum.flat_map(Keyword.fetch!(args, :specs), fn spec -> ["-s", spec] end)
+    port = cmd_runner().open(Keyword.fetch!(args, :cmd), ["--subscribe"] ++ subscribe_args(opts, format) ++ specs)
+
+    state = %__MODULE__{
+      port: port,
+      subscriber: subscriber,
+      names: tags |> Enum.map(& &1[:name]) |> List.to_tuple(),
+      data_types: tags |> Enum.map(& &1[:data_type]) |> List.to_tuple(),
+      format: format
+    }
+
+    {:ok, state}
+  end
+
+  def terminate(_reason, %{port: nil}), do: :ok
+  def terminate(_reason, %{port: port}), do: cmd_runner().close(port)
+
+  def handle_info({port, {:data, <<0, changes::binary>>}}, %{port: port} = state) do
+    send(state.subscriber, {:abex_changes, self(), parse_changes(changes, state)})
+    {:noreply, state}
+  end
+
+  def handle_info({port, {:data, <<_status, errors::binary>>}}, %{port: port} = state) do
+    send(state.subscriber, {:abex_error, self(), parse_errors(errors, state)})
+    {:noreply, state}
+  end
+
+  def handle_info({port, {:exit_status, status}}, %{port: port} = state) do
+    Logger.error("(#{__MODULE__}) rw_tag subscription exited with status #{status}.")
+    {:stop, {:exit_status, status}, %{state | port: nil}}
+  end
+
+  def handle_info({:DOWN, _ref, :process, subscriber, _reason}, %{subscriber: subscriber} = state),
+    do: {:stop, :normal, state}
+
+  def handle_info(_msg, state), do: {:noreply, state}
+
+  defp subscribe_args(opts, format) do
+    [
+      {"--interval-ms", opts[:interval_ms]},
+      {"--deadband", opts[:deadband]},
+      {"--deadband-pct", opts[:deadband_pct]}
+    ]
+    |> Enum.reject(fn {_key, value} -> is_nil(value) end)
+    |> Enum.map(fn {key, value} -> "#{key}=#{value}" end)
+    |> Kernel.++(if opts[:auto_sync] == false, do: ["--no-auto-sync"], else: [])
+    |> Kernel.++(if format == :binary, do: ["--format=binary"], else: [])
+  end
+
+  # text: "<tag index> <element index> <value>" per line
+  defp parse_changes(changes, %{format: :text} = state) do
+    changes
+    |> String.split("\n", trim: true)
+    |> Enum.map(fn line ->
+      [tag, element, value] = String.split(line, " ")
+      tag = String.to_integer(tag)
+      {elem(state.names, tag), String.to_integer(element), Types.parse(value, elem(state.data_types, tag))}
+    end)
+  end
+
+  # binary: runs of uint32 tag index, uint32 first element, uint32 count, raw elements
+  defp parse_changes(changes, state), do: parse_runs(changes, state, [])
+
+  defp parse_runs(<<>>, _state, acc), do: acc |> Enum.reverse() |> List.flatten()
+
+  defp parse_runs(<<tag::little-32, first::little-32, count::little-32, rest::binary>>, state, acc) do
+    data_type = elem(state.data_types, tag)
+    size = Types.size(data_type)
+    <<data::binary-size(count * size), rest::binary>> = rest
+
+    values =
+      for {raw, offset} <- Enum.with_index(for <<x::binary-size(size) <- data>>, do: x) do
+        {elem(state.names, tag), first + offset, Types.decode_value(raw, data_type)}
+      end
+
+    parse_runs(rest, state, [values | acc])
+  end
+
+  defp parse_errors(errors, state) do
+    errors
+    |> String.split("\n", trim: true)
+    |> Enum.map(fn line ->
+      [tag, reason] = String.split(line, " ", parts: 2)
+      {elem(state.names, String.to_integer(tag)), reason}
+    end)
+  end
+end
@@ -1,13 +1,106 @@
 defmodule Abex.Tag do
   @moduledoc """
   Handles Tag interactions with an Allen-Bradley PLC.
+
+  Reads and writes go through long-lived `rw_tag --serve` ports, so tag
+  handles (and their PLC connection) are reused between calls. Pass
+  `persistent: false` to run `rw_tag` once per call instead.
+
+  The process itself never waits on the PLC: native calls run in up to
+  `max_concurrency` (default 2) `Abex.Tag.Worker`s, each with its own port,
+  and the rest wait in line. A slow tag or a long `get_all_tags` therefore
+  only holds up one worker. Identical reads (and listings) asked for while
+  one is queued or in flight share its answer instead of going to the PLC
+  again; writes always run on their own.
+
+  With `format: :binary`, `rw_tag` returns the raw tag buffer behind a small
+  header instead of printf text, which is decoded with one binary match and
+  keeps full float precision.
+
+  With `catalog_dir: dir`, `get_all_tags` keeps a catalog of the controller's
+  tags in `dir` and answers from it while the controller is unchanged, and
+  reads and writes may leave out `data_type`, `elem_size` and `elem_count`
+  for tags in the catalog. `get_all_tags(pid, udts: true)` also stores the UDT
+  templates there, and `read_udt/2` then reads a whole UDT tag at once and
+  returns its members.
+
+  With `rate_limit: [rate: 20, burst: 2, max_concurrent: 2, dir: "/tmp/abex"]`
+  (any subset), `rw_tag` paces requests to the PLC: at most `rate` per second
+  (bursts of `burst`) and `max_concurrent` in flight, waiting in line with the
+  other callers. With `dir`, every process using that directory shares the
+  limits of each gateway. `limit_stats/1` tells how long requests waited.
+
+  Each attempt times out after a few round trips to the PLC (tracked per
+  gateway), and timed out reads are sent again until the request deadline.
+  `retry: [deadline_ms: 2000, retries: 3, writes: true]` (any subset) sets the
+  deadline (default 5000, keep it under 10000), the number of retries
+  (default 2) and whether writes are retried too (they are not by default, a
+  write that timed out may still have reached the PLC).
+
+  Large arrays can be read in part: `start: 1200, count: 500` reads
+  `Arr[1200]` to `Arr[1699]`. With `fragment: n` as well, `rw_tag` reads
+  them `n` elements at a time, a few pieces in flight at once, and sends
+  every piece as soon as it is in, so `rw_tag` never holds the whole array.
+  `read/2` still returns all the values at once; with `stream: true` too,
+  each piece goes to the caller as `{:abex_fragment, name, values}` as soon
+  as it is in, so the first values arrive after one round trip, and the call
+  returns `:ok` after the last one. The deadline applies to each few pieces,
+  not to the whole read.
+
+  Calls wait for their request however many are in line before it, each
+  native request has its own timeout. Pass `timeout:` to bound the whole
+  call instead.
+
+  With `max_age_ms: n` (for the process, or per read), a read of a tag the
+  `rw_tag` server read in the last `n` ms is answered from that tag buffer
+  without going to the PLC, and identical tags in one `read_many/2` share a
+  single request. Any write makes the next reads go to the PLC again. Pass
+  `age: true` to a read to get `{:ok, values, age_ms}`, the age of the data.
+  Each worker has its own cache.
+
+  With `write_behind: true` (or `write_behind: [flush_ms: 50, max_inflight:
+  16]`), writes go through an `Abex.Tag.WriteQueue` instead: writes to a tag
+  that come in faster than the PLC takes them are merged so only the latest
+  value is sent, and writes to different tags go out together. `write/3`
+  still waits for the result unless given `wait: false`.
+
+  With `broker: socket` (and `persistent: false`), the one-shot `rw_tag` and
+  `tag_list` runs go through the `Abex.Broker` listening on `socket` and
+  share its PLC sessions, or connect themselves when no broker answers there.
+
+  With `stats: true`, the `rw_tag` servers time every phase of every request
+  (create, status wait, read or write, decode, output) and `stats/2` returns
+  their percentiles, ready to forward as `:telemetry` events, see
+  `Abex.Stats`.
   """
   use GenServer
   require Logger
 
+  alias Abex.Tag.Types
+
+  # per native request; the call itself waits for the request, see call/3
+  @request_timeout 10000
+
   defstruct ip: nil,
             path: nil,
-            cpu: nil
+            cpu: nil,
+            persistent: true,
+            format: :text,
+            catalog_dir: nil,
+            rate_limit: nil,
+            retry: nil,
+            stats: false,
+            max_concurrency: 2,
+            max_age_ms: nil,
+            write_behind: nil,
+            broker: nil,
+            write_queue: nil,
+            limit_wait: %{requests: 0, total_ms: 0, max_ms: 0, last_ms: 0},
+            port: nil,
+            workers: [],
+            idle: [],
+            queue: nil,
+            inflight: %{}
 
   defp cmd_runner do
     Application.get_env(:abex, :cmd_runner, Abex.CmdWrapper)
@@ -27,70 +120,641 @@ defmodule Abex.Tag do
     state = %__MODULE__{
       ip: Keyword.fetch!(args, :ip),
       path: Keyword.get(args, :path, "1,0"),
-      cpu: Keyword.get(args, :cpu, "lgx")
+      cpu: Keyword.get(args, :cpu, "lgx"),
+      persistent: Keyword.get(args, :persistent, true),
+      format: Keyword.get(args, :format, :text),
+      catalog_dir: Keyword.get(args, :catalog_dir),
+      rate_limit: Keyword.get(args, :rate_limit),
+      retry: Keyword.get(args, :retry),
+      stats: Keyword.get(args, :stats, false),
+      max_concurrency: Keyword.get(args, :max_concurrency, 2),
+      max_age_ms: Keyword.get(args, :max_age_ms),
+      write_behind: Keyword.get(args, :write_behind),
+      broker: Keyword.get(args, :broker),
+      queue: :queue.new()
     }
 
-    {:ok, state}
+    {:ok, start_write_queue(state)}
   end
 
-  def get_all_tags(pid), do: GenServer.call(pid, :get_all_tags, 15000)
+  @doc """
+  Lists controller and program tags. Filtering happens in `tag_list`, so
+  only the tags asked for are transferred and parsed:
+
+    - `prefix:` / `glob:` - tag names starting with / matching (`*`, `?`), a string or a list
+    - `program:` / `exclude_program:` - programs to list / to skip, a string or a list
+    - `skip_system: true` - leave out system tags (flagged by the controller or named `__*`)
+    - `refresh: true` / `max_age: seconds` - with `catalog_dir`, force or bound a re-download
+    - `udts: true` - fetch the UDT templates too; with `format: :binary` they come back under
+      `:udts`, with `catalog_dir` they are kept for `read_udt/2`
+  """
+  def get_all_tags(pid, opts \\ []), do: call(pid, :get_all_tags, opts)
+
+  @doc """
+  Reads a tag. With `fragment:` and `stream: true`, every piece is sent to the
+  caller as `{:abex_fragment, name, values}` as soon as it is in and the call
+  returns `:ok` after the last one, or `{:error, reason}` after the pieces
+  that did arrive.
+  """
+  def read(pid, params) do
+    params = if params[:stream], do: Keyword.put(params, :stream_to, self()), else: params
+    call(pid, :read, params)
+  end
+
+  @doc """
+  Writes `value:` to a tag. With `write_behind`, `wait: false` returns `:ok`
+  as soon as the write is queued.
+  """
+  def write(pid, params, opts \\ []) do
+    kind = if Keyword.get(opts, :wait, true), do: :write, else: :write_behind
+    call(pid, kind, params)
+  end
+
+  # one native request for many tags, results come back in the same order
+  def read_many(pid, tags), do: GenServer.call(pid, {:read_many, tags}, :infinity)
+
+  @doc """
+  Reads a UDT tag in one request and returns `%{member => values}`, for every
+  member or only `members:` (dotted paths such as `"Inner.Small"`). Needs
+  `catalog_dir` and a listing with `udts: true`.
+  """
+  def read_udt(pid, params), do: call(pid, :read_udt, params)
+
+  @doc """
+  Starts an `Abex.Tag.Subscription` that sends the caller only the elements of
+  `tags` that changed. Options: `:interval_ms`, `:deadband`, `:deadband_pct`
+  and `auto_sync: false`.
+  """
+  def subscribe(pid, tags, opts \\ []), do: GenServer.call(pid, {:subscribe, tags, opts}, 15000)
 
-  def read(pid, params), do: GenServer.call(pid, {:read, params}, 15000)
+  def unsubscribe(subscription), do: Abex.Tag.Subscription.stop(subscription)
 
-  def write(pid, params), do: GenServer.call(pid, {:write, params}, 15000)
+  @doc """
+  Starts an `Abex.Tag.Sampler` that reads `tags` every `:interval_ms` into
+  the ring file `:ring` (required), keeping the last `:records` samples. The
+  caller gets `{:abex_sampling, sampler, ring}` once it runs; read the samples
+  with `Abex.SampleRing`.
+  """
+  def sample(pid, tags, opts), do: GenServer.call(pid, {:sample, tags, opts}, 15000)
+
+  def stop_sampling(sampler), do: Abex.Tag.Sampler.stop(sampler)
+
+  @doc """
+  Time spent waiting for the `rate_limit` turn: `%{requests: n, total_ms: t,
+  max_ms: m, last_ms: l}`. Only requests through the `rw_tag` server are
+  counted.
+  """
+  def limit_stats(pid), do: GenServer.call(pid, :limit_stats)
+
+  @doc """
+  Phase timings of the `rw_tag` servers since they started or since the last
+  `reset: true`, parsed by `Abex.Stats.parse/1` and combined with
+  `Abex.Stats.merge/1`. Needs `stats: true`, without it only the gateway
+  round trips are filled in.
+  """
+  def stats(pid, opts \\ []), do: call(pid, :stats, opts)
+
+  # Requests wait in line for a worker, and each native request already has
+  # its own timeout, so a call waits as long as its request takes unless the
+  # caller bounds it with `timeout:`.
+  defp call(pid, kind, params) do
+    {timeout, params} = Keyword.pop(params, :timeout, :infinity)
+    GenServer.call(pid, {kind, params}, timeout)
+  end
 
   def terminate(reason, state) do
+    # a worker's port closes with it, the write queue still writes what it has
+    Enum.each(state.workers, &Process.exit(&1, :shutdown))
+    if state.write_queue, do: Process.exit(state.write_queue, :shutdown)
     Logger.error("(#{__MODULE__}) Error: #{inspect({reason, state})}.")
   end
 
-  def handle_call(:get_all_tags, _from, %{ip: ip, path: path, cpu: _cpu} = state) do
+  def handle_call({:read_udt, _params}, _from, %{catalog_dir: nil} = state),
+    do: {:reply, {:error, :no_catalog_dir}, state}
+
+  def handle_call({:subscribe, tags, opts}, {subscriber, _tag}, state) do
+    args = [
+      cmd: rw_tag_cmd(),
+      subscriber: subscriber,
+      tags: tags,
+      specs: Enum.map(tags, fn params -> "#{params[:data_type]} #{tag_attrs(params, state)}" end),
+      format: state.format,
+      opts: opts
+    ]
+
+    {:reply, Abex.Tag.Subscription.start(args), state}
+  end
+
+  def handle_call({:sample, tags, opts}, {owner, _tag}, state) do
+    args = [
+      cmd: rw_tag_cmd(),
+      owner: owner,
+      specs: Enum.map(tags, fn params -> "#{params[:data_type]} #{tag_attrs(params, state)}" end),
+      opts: opts
+    ]
+
+    {:reply, Abex.Tag.Sampler.start(args), state}
+  end
+
+  def handle_call({:write, params}, from, %{write_queue: queue} = state) when queue != nil do
+    Abex.Tag.WriteQueue.write(queue, queued_write_args(params, state), from)
+    {:noreply, state}
+  end
+
+  def handle_call({:write_behind, _params}, _from, %{write_queue: nil} = state),
+    do: {:reply, {:error, :no_write_behind}, state}
+
+  def handle_call({:write_behind, params}, _from, state) do
+    Abex.Tag.WriteQueue.write(state.write_queue, queued_write_args(params, state), nil)
+    {:reply, :ok, state}
+  end
+
+  def handle_call(:limit_stats, _from, state), do: {:reply, state.limit_wait, state}
+
+  def handle_call({:stats, _opts}, _from, %{persistent: false} = state),
+    do: {:reply, {:error, :not_persistent}, state}
+
+  # every worker has its own rw_tag server, so each one is asked and the reports merged
+  def handle_call({:stats, _opts} = request, from, state) do
+    state = if state.workers == [], do: start_worker(state) |> elem(1), else: state
+    key = {:stats, make_ref()}
+
+    Enum.each(state.workers, &Abex.Tag.Worker.run(&1, key, request))
+
+    job = %{from: [from], left: length(state.workers), reports: []}
+    {:noreply, %{state | inflight: Map.put(state.inflight, key, job)}}
+  end
+
+  # the rest talk to the PLC and run in a worker, see submit/3
+  def handle_call(request, from, state), do: {:noreply, submit(state, request, from)}
+
+  def handle_info({:abex_done, _worker, {:stats, _ref} = key, reply, _wait}, state) do
+    job = state.inflight[key]
+    job = %{job | left: job.left - 1, reports: [reply | job.reports]}
+
+    if job.left == 0 do
+      Enum.each(job.from, &GenServer.reply(&1, merge_stats(job.reports)))
+      {:noreply, %{state | inflight: Map.delete(state.inflight, key)}}
+    else
+      {:noreply, %{state | inflight: Map.put(state.inflight, key, job)}}
+    end
+  end
+
+  def handle_info({:abex_done, worker, key, reply, wait}, state) do
+    {job, inflight} = Map.pop(state.inflight, key)
+    Enum.each(job.from, &GenServer.reply(&1, reply))
+
+    state = %{
+      state
+      | inflight: inflight,
+        idle: [worker | state.idle],
+        limit_wait: merge_wait(state.limit_wait, wait)
+    }
+
+    {:noreply, dispatch(state)}
+  end
+
+  def handle_info(_msg, state), do: {:noreply, state}
+
+  @doc false
+  # runs in an Abex.Tag.Worker, with the worker's copy of the state
+  def run({:get_all_tags, opts}, %{ip: ip, path: path, cpu: _cpu} = state) do
     read_all_tags_cmd =
       :code.priv_dir(:abex)
       |> to_string()
       |> Path.join("tag_list")
 
+    task = if state.format == :binary, do: :get_all_tags_binary, else: :get_all_tags
+
     response =
-      cmd_runner().cmd(read_all_tags_cmd, [ip, path])
-      |> assemble_response(:get_all_tags)
+      cmd_runner().cmd(
+        read_all_tags_cmd,
+        [ip, path] ++
+          format_args(state) ++
+          tag_list_filters(opts) ++
+          tag_list_udt_args(opts) ++
+          tag_list_catalog_args(opts, state) ++ retry_args(state.retry) ++ broker_args(state.broker)
+      )
+      |> assemble_response(task)
       |> encapsulate_response()
 
-    {:reply, response, state}
+    {response, state}
   end
 
-  def handle_call({:read, params}, _from, %{ip: ip, path: path, cpu: cpu} = state) do
-    read_tag_cmd =
-      :code.priv_dir(:abex)
-      |> to_string()
-      |> Path.join("rw_tag")
+  def run({:read, params}, state) do
+    cmd_args = tag_attrs(params, state)
+    sink = piece_sink(params, state.format)
+
+    {response, state} =
+      run_rw_tag(
+        type_args(params) ++
+          format_args(state) ++
+          slice_args(params) ++ cache_args(params, state) ++ catalog_args(state) ++ ["-p", cmd_args],
+        state,
+        sink
+      )
 
-    cmd_args =
-      "protocol=ab-eip&gateway=#{ip}&path=#{path}&plc=#{cpu}&elem_size=#{params[:elem_size]}&elem_count=#{params[:elem_count]}&name=#{params[:name]}"
+    {response, age} = take_age(response, params[:age], state.format)
 
     response =
-      cmd_runner().cmd(read_tag_cmd, ["-t", params[:data_type], "-p", cmd_args])
-      |> assemble_response(:read)
-      |> data_type_parser(params[:data_type])
+      response
+      |> parse_read(state.format, params[:data_type])
       |> encapsulate_response()
+      |> put_age(age)
+      |> stream_piece(params)
 
-    {:reply, response, state}
+    {response, state}
   end
 
-  def handle_call({:write, params}, _from,%{ip: ip, path: path, cpu: cpu} = state) do
-    write_tag_cmd =
-      :code.priv_dir(:abex)
-      |> to_string()
-      |> Path.join("rw_tag")
+  def run({:read_udt, params}, state) do
+    {response, state} =
+      run_rw_tag(
+        format_args(state) ++ catalog_args(state) ++ member_args(params) ++ ["-p", tag_attrs(params, state)],
+        state
+      )
 
-    cmd_args =
-        "protocol=ab-eip&gateway=#{ip}&path=#{path}&plc=#{cpu}&elem_size=#{params[:elem_size]}&elem_count=#{params[:elem_count]}&name=#{params[:name]}"
+    task = if state.format == :binary, do: :read_udt_binary, else: :read_udt
+
+    {response |> assemble_response(task) |> encapsulate_response(), state}
+  end
+
+  def run({:read_many, tags}, state) do
+    specs = Enum.flat_map(tags, fn params -> ["-s", "#{params[:data_type] || "auto"} #{tag_attrs(params, state)}"] end)
+
+    {response, state} = run_rw_tag(format_args(state) ++ cache_args([], state) ++ catalog_args(state) ++ specs, state)
 
     response =
-      cmd_runner().cmd(write_tag_cmd, ["-t", params[:data_type], "-w", params[:value] , "-p", cmd_args])
-      |> assemble_response(:write)
+      response
+      |> parse_batch(state.format, tags)
+      |> encapsulate_response()
+
+    {response, state}
+  end
+
+  def run({:stats, opts}, state) do
+    state = open_port(state)
+    limited = state.rate_limit != nil
+    args = if opts[:reset], do: ["--stats-dump", "--reset"], else: ["--stats-dump"]
+
+    # not a tag request, so no retry options and no limit wait to record
+    case cmd_runner().request(state.port, args, @request_timeout) do
+      {:error, _reason} = error -> {error, close_port(state)}
+      {<<_waited::little-32, report::binary>>, 0} when limited -> {{:ok, Abex.Stats.parse(report)}, state}
+      {report, 0} -> {{:ok, Abex.Stats.parse(report)}, state}
+      {reason, _status} -> {{:error, reason}, state}
+    end
+  end
+
+  def run({:write, params}, state) do
+    cmd_args = tag_attrs(params, state)
+
+    {response, state} =
+      run_rw_tag(
+        type_args(params) ++ slice_args(params) ++ catalog_args(state) ++ write_args(params, cmd_args, state),
+        state
+      )
+
+    {assemble_response(response, :write), state}
+  end
+
+  # a request identical to one queued or in flight waits for its answer
+  # instead of asking the PLC again; writes are never shared
+  defp submit(state, request, from) do
+    key = request_key(request)
+
+    case state.inflight do
+      %{^key => job} ->
+        %{state | inflight: Map.put(state.inflight, key, %{job | from: [from | job.from]})}
+
+      _none ->
+        job = %{request: request, from: [from]}
+        dispatch(%{state | inflight: Map.put(state.inflight, key, job), queue: :queue.in(key, state.queue)})
+    end
+  end
+
+  defp request_key({:write, _params}), do: make_ref()
+  defp request_key({:read_many, tags}), do: {:read_many, tags}
+  defp request_key({kind, params}), do: {kind, Enum.sort(params)}
+
+  # hand queued requests to idle workers, starting up to max_concurrency of them
+  defp dispatch(state) do
+    with {{:value, key}, queue} <- :queue.out(state.queue),
+         {worker, state} <- idle_worker(state) do
+      Abex.Tag.Worker.run(worker, key, state.inflight[key].request)
+      dispatch(%{state | queue: queue})
+    else
+      _empty_or_busy -> state
+    end
+  end
+
+  defp idle_worker(%{idle: [worker | idle]} = state), do: {worker, %{state | idle: idle}}
+
+  defp idle_worker(%{workers: workers, max_concurrency: max} = state) when length(workers) < max do
+    {worker, state} = start_worker(state)
+    {worker, %{state | idle: List.delete(state.idle, worker)}}
+  end
+
+  defp idle_worker(_state), do: :busy
+
+  defp start_worker(state) do
+    config = %{state | workers: [], idle: [], queue: :queue.new(), inflight: %{}}
+    {:ok, worker} = Abex.Tag.Worker.start_link(self(), config)
+    {worker, %{state | workers: state.workers ++ [worker], idle: state.idle ++ [worker]}}
+  end
+
+  defp merge_wait(wait, %{requests: 0}), do: wait
+
+  defp merge_wait(wait, done) do
+    %{
+      requests: wait.requests + done.requests,
+      total_ms: wait.total_ms + done.total_ms,
+      max_ms: max(wait.max_ms, done.max_ms),
+      last_ms: done.last_ms
+    }
+  end
+
+  defp merge_stats(reports) do
+    case Enum.find(reports, &match?({:error, _reason}, &1)) do
+      nil -> {:ok, reports |> Enum.map(&elem(&1, 1)) |> Abex.Stats.merge()}
+      error -> error
+    end
+  end
+
+  defp start_write_queue(%{write_behind: nil} = state), do: state
+  defp start_write_queue(%{write_behind: false} = state), do: state
+
+  defp start_write_queue(%{write_behind: opts} = state) do
+    opts = if opts == true, do: [], else: opts
+
+    args =
+      ["--write-queue"] ++
+        Enum.flat_map([flush_ms: "--flush-ms", max_inflight: "--max-inflight"], fn {key, arg} ->
+          if opts[key], do: ["#{arg}=#{opts[key]}"], else: []
+        end) ++ limit_args(state.rate_limit) ++ stats_args(state)
+
+    {:ok, queue} = Abex.Tag.WriteQueue.start_link(rw_tag_cmd(), args)
+    %{state | write_queue: queue}
+  end
+
+  # the same arguments as a --serve write
+  defp queued_write_args(params, state) do
+    retry_args(state.retry) ++
+      type_args(params) ++ slice_args(params) ++ catalog_args(state) ++ write_args(params, tag_attrs(params, state), state)
+  end
+
+  # retry options go first, a --payload must stay the last argument
+  defp run_rw_tag(args, state, sink \\ nil)
+
+  defp run_rw_tag(args, %{persistent: false} = state, _sink),
+    do:
+      {cmd_runner().cmd(
+         rw_tag_cmd(),
+         retry_args(state.retry) ++ args ++ limit_args(state.rate_limit) ++ broker_args(state.broker)
+       ), state}
+
+  defp run_rw_tag(args, state, sink) do
+    state = open_port(state)
+    limited = state.rate_limit != nil
+
+    state.port
+    |> cmd_runner().request(retry_args(state.retry) ++ args, @request_timeout)
+    |> collect_response(state, limited, sink, [])
+  end
+
+  defp collect_response({:error, _reason} = error, state, _limited, _sink, _acc) do
+    # the server is gone or out of sync, start a fresh one next time
+    {error, close_port(state)}
+  end
 
-    {:reply, response, state}
+  # status 2: a piece of a fragment: read, more frames follow; streamed
+  # pieces go to the caller right away instead of waiting for the rest
+  defp collect_response({data, 2}, state, limited, sink, acc) do
+    data = if limited, do: binary_part(data, 4, byte_size(data) - 4), else: data
+    acc = keep_piece(sink, data, acc)
+
+    state.port
+    |> cmd_runner().next_response(@request_timeout)
+    |> collect_response(state, limited, sink, acc)
+  end
+
+  # --report-wait puts the limit wait in front of every response
+  defp collect_response({<<waited::little-32, data::binary>>, status}, state, true, _sink, acc),
+    do: {{join_pieces(acc, data, status), status}, record_wait(state, waited)}
+
+  defp collect_response({data, status}, state, _limited, _sink, acc),
+    do: {{join_pieces(acc, data, status), status}, state}
+
+  # stream: true sends each piece of a read to the caller as it comes in
+  defp piece_sink(params, format) do
+    if params[:stream_to] do
+      fn data ->
+        {data, 0}
+        |> parse_read(format, params[:data_type])
+        |> encapsulate_response()
+        |> stream_piece(params)
+      end
+    end
+  end
+
+  defp keep_piece(nil, data, acc), do: [acc | data]
+
+  defp keep_piece(sink, data, acc) do
+    sink.(data)
+    acc
+  end
+
+  # the last piece (or a one-shot run's whole answer) is streamed too
+  defp stream_piece({:ok, values} = response, params) do
+    case params[:stream_to] do
+      nil ->
+        response
+
+      caller ->
+        send(caller, {:abex_fragment, params[:name], values})
+        :ok
+    end
+  end
+
+  defp stream_piece(response, _params), do: response
+
+  # a read that fails part way only returns the error
+  defp join_pieces(acc, data, 0), do: IO.iodata_to_binary([acc | data])
+  defp join_pieces(_acc, data, _status), do: data
+
+  defp open_port(%{port: nil} = state) do
+    args = ["--serve"] ++ serve_limit_args(state.rate_limit) ++ stats_args(state)
+    %{state | port: cmd_runner().open(rw_tag_cmd(), args)}
+  end
+
+  defp open_port(state), do: state
+
+  defp serve_limit_args(nil), do: []
+  defp serve_limit_args(limits), do: ["--report-wait" | limit_args(limits)]
+
+  defp stats_args(%{stats: true}), do: ["--stats"]
+  defp stats_args(_state), do: []
+
+  defp limit_args(nil), do: []
+
+  defp limit_args(limits) do
+    [
+      {"--rate-limit", limits[:rate]},
+      {"--burst", limits[:burst]},
+      {"--max-concurrent", limits[:max_concurrent]},
+      {"--limit-dir", limits[:dir]}
+    ]
+    |> Enum.reject(fn {_key, value} -> is_nil(value) end)
+    |> Enum.map(fn {key, value} -> "#{key}=#{value}" end)
+  end
+
+  defp broker_args(nil), do: []
+  defp broker_args(socket), do: ["--broker=#{socket}"]
+
+  defp retry_args(nil), do: []
+
+  defp retry_args(retry) do
+    [{"--deadline-ms", retry[:deadline_ms]}, {"--retries", retry[:retries]}]
+    |> Enum.reject(fn {_key, value} -> is_nil(value) end)
+    |> Enum.map(fn {key, value} -> "#{key}=#{value}" end)
+    |> Kernel.++(if retry[:writes], do: ["--retry-writes"], else: [])
+  end
+
+  defp record_wait(%{limit_wait: wait} = state, waited) do
+    wait = %{
+      requests: wait.requests + 1,
+      total_ms: wait.total_ms + waited,
+      max_ms: max(wait.max_ms, waited),
+      last_ms: waited
+    }
+
+    %{state | limit_wait: wait}
+  end
+
+  defp close_port(%{port: nil} = state), do: state
+
+  defp close_port(%{port: port} = state) do
+    cmd_runner().close(port)
+    %{state | port: nil}
+  end
+
+  defp rw_tag_cmd do
+    :code.priv_dir(:abex)
+    |> to_string()
+    |> Path.join("rw_tag")
+  end
+
+  defp tag_attrs(params, %{ip: ip, path: path, cpu: cpu}) do
+    "protocol=ab-eip&gateway=#{ip}&path=#{path}&plc=#{cpu}&elem_size=#{params[:elem_size]}&elem_count=#{params[:elem_count]}&name=#{params[:name]}"
+  end
+
+  defp format_args(%{format: :binary}), do: ["--format=binary"]
+  defp format_args(_state), do: []
+
+  # without a data type rw_tag takes it from the catalog
+  defp type_args(params) do
+    case params[:data_type] do
+      nil -> []
+      data_type -> ["-t", data_type]
+    end
+  end
+
+  defp catalog_args(%{catalog_dir: nil}), do: []
+  defp catalog_args(%{catalog_dir: dir}), do: ["--catalog-dir=#{dir}"]
+
+  defp tag_list_catalog_args(_opts, %{catalog_dir: nil}), do: []
+
+  defp tag_list_catalog_args(opts, state) do
+    catalog_args(state) ++
+      if(opts[:refresh], do: ["--refresh"], else: []) ++
+      if(opts[:max_age], do: ["--max-age=#{opts[:max_age]}"], else: [])
+  end
+
+  defp tag_list_udt_args(opts), do: if(opts[:udts], do: ["--udts"], else: [])
+
+  defp member_args(params) do
+    case params[:members] do
+      nil -> ["--members"]
+      members -> ["--members=#{Enum.join(List.wrap(members), ",")}"]
+    end
+  end
+
+  # start: reads elem_count (or count, or writes the given values) from Arr[start] on
+  defp slice_args(params) do
+    [{"--start", params[:start]}, {"--count", params[:count]}, {"--fragment", params[:fragment]}]
+    |> Enum.reject(fn {_key, value} -> is_nil(value) end)
+    |> Enum.map(fn {key, value} -> "#{key}=#{value}" end)
+  end
+
+  # max_age_ms: a read at most this old will do; age: true also asks how old it is
+  defp cache_args(params, state) do
+    max_age = Keyword.get(params, :max_age_ms, state.max_age_ms)
+
+    if(max_age, do: ["--max-age-ms=#{max_age}"], else: []) ++ if(params[:age], do: ["--report-age"], else: [])
+  end
+
+  # --report-age puts the age of the data in ms in front of the values
+  defp take_age({<<age::little-32, data::binary>>, 0}, true, :binary), do: {{data, 0}, age}
+
+  defp take_age({data, 0}, true, _text) do
+    [age, values] = String.split(data, " ", parts: 2)
+    {{values, 0}, String.to_integer(age)}
+  end
+
+  defp take_age(response, _age, _format), do: {response, nil}
+
+  defp put_age({:ok, values}, age) when is_integer(age), do: {:ok, values, age}
+  defp put_age(response, _age), do: response
+
+  # a list of numbers goes to the server as one raw payload in binary format
+  defp write_args(params, cmd_args, %{format: :binary, persistent: true}) when is_list(params[:value]) do
+    values = params[:value]
+    data_type = params[:data_type]
+
+    if data_type && Types.numeric?(data_type) && Enum.all?(values, &is_number/1) do
+      payload = for value <- values, into: <<>>, do: Types.encode(value, data_type)
+      ["-p", cmd_args, "--payload=#{byte_size(payload)}", payload]
+    else
+      ["-w", write_values(values, data_type), "-p", cmd_args]
+    end
+  end
+
+  defp write_args(params, cmd_args, _state) when is_list(params[:value]),
+    do: ["-w", write_values(params[:value], params[:data_type]), "-p", cmd_args]
+
+  defp write_args(params, cmd_args, _state),
+    do: ["-w", Types.format(params[:value], params[:data_type]), "-p", cmd_args]
+
+  defp write_values(values, data_type), do: Enum.map_join(values, ",", &Types.format(&1, data_type))
+
+  defp parse_read(response, :binary, _data_type), do: assemble_response(response, :read_binary)
+
+  defp parse_read(response, _text, data_type) do
+    response
+    |> assemble_response(:read)
+    |> data_type_parser(data_type)
+  end
+
+  # batch results: one {:ok, values} | {:error, reason} per requested tag
+  defp parse_batch({:error, _reason} = error, _format, _tags), do: error
+  defp parse_batch({reason, 1}, _format, _tags), do: {:error, reason}
+  defp parse_batch({data, 0}, :binary, _tags), do: decode_batch(data, [])
+
+  defp parse_batch({data, 0}, _text, tags) do
+    data
+    |> String.split("\n", trim: true)
+    |> Enum.zip(tags)
+    |> Enum.map(fn {line, params} -> parse_batch_line(line, params[:data_type]) end)
   end
 
+  defp parse_batch(reason, _format, _tags), do: {:error, reason}
+
+  defp parse_batch_line("ok " <> values, data_type) do
+    {:ok, values |> String.split(" ", trim: true) |> data_type_parser(data_type)}
+  end
+
+  defp parse_batch_line("error " <> reason, _data_type), do: {:error, reason}
+
+  defp assemble_response({:error, _reason} = error, _task), do: error
   defp assemble_response({reason, 1}, _task), do: {:error, reason}
   defp assemble_response({_data, 0}, :write), do: :ok
   defp assemble_response({data, 0}, :read) do
@@ -99,12 +763,28 @@ defmodule Abex.Tag do
     |> List.delete("")
   end
 
+  defp assemble_response({data, 0}, :read_binary), do: decode_binary(data)
+
+  # one "<member> <values>" line per member
+  defp assemble_response({data, 0}, :read_udt) do
+    for line <- String.split(data, "\n", trim: true), into: %{} do
+      [member | values] = String.split(line, " ", trim: true)
+      {member, Enum.map(values, &Types.parse(&1, nil))}
+    end
+  end
+
+  defp assemble_response({data, 0}, :read_udt_binary), do: decode_udt_members(data, %{})
+
   defp assemble_response({data, 0}, :get_all_tags) do
     {data, %{}}
     |> assemble_control_tags()
     |> assemble_program_tags()
   end
 
+  defp assemble_response({data, 0}, :get_all_tags_binary) do
+    decode_tag_records(data, nil, %{controller_tags: %{}, program_tags: %{}})
+  end
+
   defp assemble_response(reason, _task), do: {:error, reason}
 
   defp assemble_tag_map([], acc), do: acc
@@ -151,12 +831,114 @@ defmodule Abex.Tag do
     {str_prog_data, Map.put(acc, :controller_tags, ctrl_tags)}
   end
 
+  defp tag_list_filters(opts) do
+    filters =
+      for {key, option} <- [prefix: "--prefix", glob: "--glob", program: "--program", exclude_program: "--exclude-program"],
+          value <- List.wrap(opts[key]),
+          do: "#{option}=#{value}"
+
+    filters ++ if(opts[:skip_system], do: ["--skip-system"], else: [])
+  end
+
+  # tag_list --format=binary: kind, instance id, type, element length, dims, name
+  defp decode_tag_records(<<>>, _program, acc), do: acc
+
+  defp decode_tag_records(<<1, _::binary-size(20), len::little-16, name::binary-size(len), rest::binary>>, _program, acc),
+    do: decode_tag_records(rest, name, put_in(acc, [:program_tags, name], %{}))
+
+  # --udts: a template (id, handle, instance size) followed by its members
+  defp decode_tag_records(
+         <<3, id::little-32, handle::little-16, _el::little-16, size::little-32, _::binary-size(8),
+           len::little-16, name::binary-size(len), rest::binary>>,
+         _program,
+         acc
+       ) do
+    udt = %{template_id: id, handle: handle, size: size, members: []}
+    decode_tag_records(rest, {:udt, name}, Map.update(acc, :udts, %{name => udt}, &Map.put(&1, name, udt)))
+  end
+
+  defp decode_tag_records(
+         <<4, offset::little-32, type::little-16, el::little-16, count::little-32, bit::little-32, _::little-32,
+           len::little-16, name::binary-size(len), rest::binary>>,
+         {:udt, udt},
+         acc
+       ) do
+    member = %{name: name, offset: offset, type: type, element_length: el, count: count, bit: bit}
+    decode_tag_records(rest, {:udt, udt}, update_in(acc, [:udts, udt, :members], &(&1 ++ [member])))
+  end
+
+  defp decode_tag_records(
+         <<kind, id::little-32, type::little-16, el::little-16, d0::little-32, d1::little-32, d2::little-32,
+           len::little-16, name::binary-size(len), rest::binary>>,
+         program,
+         acc
+       ) do
+    # same shape as the text listing
+    new_tag = %{
+      tag_instance_id: id |> Integer.to_string(16) |> String.downcase(),
+      tag_type: type |> Integer.to_string(16) |> String.downcase(),
+      element_length: el,
+      array_dim: "(#{d0}, #{d1}, #{d2})"
+    }
+
+    acc =
+      case kind do
+        0 -> put_in(acc, [:controller_tags, name], new_tag)
+        _program_tag -> put_in(acc, [:program_tags, program, name], new_tag)
+      end
+
+    decode_tag_records(rest, program, acc)
+  end
+
+  defp decode_tag_records(data, _program, _acc), do: {:error, {:bad_binary_response, data}}
+
   defp encapsulate_response(response) when is_tuple(response), do: response
   defp encapsulate_response(response), do: {:ok, response}
 
+  # a type left out came from the catalog, see Types.parse/2
   defp data_type_parser(raw_data, _any_data_type) when is_tuple(raw_data), do: raw_data
-  defp data_type_parser(raw_data, "real32"), do: Enum.map(raw_data, fn(x) -> String.to_float(x) end)
-  defp data_type_parser(raw_data, _any_data_type), do: Enum.map(raw_data, fn(x) -> String.to_integer(x) end)
+  defp data_type_parser(raw_data, data_type), do: Enum.map(raw_data, &Types.parse(&1, data_type))
+
+  # rw_tag --format=binary: 16-byte little-endian header, then raw elements,
+  # one such block per piece of a fragment: read
+  defp decode_binary(data), do: decode_blocks(data, [])
+
+  defp decode_blocks(
+         <<1, _flags, data_type::little-16, elem_size::little-32, _elem_count::little-32,
+           data_len::little-32, data::binary-size(data_len), rest::binary>>,
+         acc
+       ),
+       do: decode_blocks(rest, [Types.decode_elements(data, data_type, elem_size) | acc])
+
+  defp decode_blocks(data, []), do: {:error, {:bad_binary_response, data}}
+  defp decode_blocks(_rest, acc), do: acc |> Enum.reverse() |> Enum.concat()
+
+  # --members --format=binary: uint16-prefixed member name, then a binary block
+  defp decode_udt_members(<<>>, acc), do: acc
+
+  defp decode_udt_members(
+         <<len::little-16, member::binary-size(len), 1, _flags, data_type::little-16, elem_size::little-32,
+           _elem_count::little-32, data_len::little-32, data::binary-size(data_len), rest::binary>>,
+         acc
+       ),
+       do: decode_udt_members(rest, Map.put(acc, member, Types.decode_elements(data, data_type, elem_size)))
+
+  defp decode_udt_members(data, _acc), do: {:error, {:bad_binary_response, data}}
+
+  # batch records: int32 status, then a binary block or a uint16-prefixed error
+  defp decode_batch(<<>>, acc), do: Enum.reverse(acc)
+
+  defp decode_batch(
+         <<0::little-signed-32, 1, _flags, data_type::little-16, elem_size::little-32,
+           _elem_count::little-32, data_len::little-32, data::binary-size(data_len), rest::binary>>,
+         acc
+       ),
+       do: decode_batch(rest, [{:ok, Types.decode_elements(data, data_type, elem_size)} | acc])
+
+  defp decode_batch(<<_status::little-signed-32, len::little-16, reason::binary-size(len), rest::binary>>, acc),
+    do: decode_batch(rest, [{:error, reason} | acc])
+
+  defp decode_batch(data, _acc), do: {:error, {:bad_binary_response, data}}
 
   defp set_ld_library_path(priv_dir) do
     System.get_env("LD_LIBRARY_PATH", "")
@@ -0,0 +1,135 @@
+defmodule Abex.Tag.Types do
+  @moduledoc """
+  The `data_type`s of the native programs, one place for every module that
+  sends or decodes values (the Elixir side of `src/tag_decode.h`).
+
+    - `"uint8"` ... `"uint64"`, `"sint8"` ... `"sint64"`, `"real32"`, `"real64"`;
+      a REAL that is not finite is `:infinity`, `:neg_infinity` or `:nan`, and
+      writes take those atoms too
+    - `"bool"` - a packed BOOL array, one 0 or 1 per bit (reads only)
+    - `"bit"` - one bit of an integer (`name: "Flags.3"`) or a BOOL tag, `0` or `1`;
+      writes take `0`, `1`, `true` or `false`
+    - `"string"` - Logix STRING (`elem_size: 88`), as an Elixir binary of up to 82 bytes
+
+  In text output a STRING is quoted, with `\\"`, `\\\\` and `\\xHH` escapes for
+  quotes, backslashes, spaces and bytes outside printable ASCII, so values
+  never contain a space. In binary blocks it keeps its 88-byte layout: a
+  `uint32` length, 82 characters and 2 bytes of padding.
+  """
+
+  @string_size 88
+
+  @doc "Bytes per element of a type name."
+  def size("string"), do: @string_size
+  # BOOL arrays are described as bytes in binary output, see tag_decode.c
+  def size(bits) when bits in ["bool", "bit"], do: 1
+  def size(<<_kind::binary-size(4), bits::binary>>), do: div(String.to_integer(bits), 8)
+
+  @doc "Whether values of the type can go to `rw_tag` as a raw `--payload`."
+  def numeric?(<<kind::binary-size(4), _bits::binary>>) when kind in ["uint", "sint", "real"], do: true
+  def numeric?(_data_type), do: false
+
+  @doc "One value of a text response. Without a type (taken from the catalog) numbers are guessed."
+  def parse(value, "real" <> _bits) do
+    case Float.parse(value) do
+      {float, ""} -> float
+      _not_finite -> parse_not_finite(String.downcase(value))
+    end
+  end
+
+  def parse(<<?", _rest::binary>> = value, data_type) when data_type in ["string", nil], do: unquote_string(value)
+
+  # integers print without a point, floats with one or as "nan" / "inf"
+  def parse(value, nil) do
+    case Integer.parse(value) do
+      {integer, ""} -> integer
+      _float -> parse(value, "real")
+    end
+  end
+
+  def parse(value, _integer), do: String.to_integer(value)
+
+  @doc "One value for `rw_tag -w`."
+  def format(value, "string"), do: quote_string(to_string(value))
+  def format(:infinity, _real), do: "inf"
+  def format(:neg_infinity, _real), do: "-inf"
+  def format(:nan, _real), do: "nan"
+  def format(value, _data_type), do: to_string(value)
+
+  @doc "One value of a raw `--payload`, see `numeric?/1`."
+  def encode(value, "uint" <> bits), do: <<value::little-unsigned-size(String.to_integer(bits))>>
+  def encode(value, "sint" <> bits), do: <<value::little-signed-size(String.to_integer(bits))>>
+  def encode(value, "real" <> bits), do: <<value::little-float-size(String.to_integer(bits))>>
+
+  @doc "The elements of a binary block, by PLC_LIB_* code: 0x1xx unsigned, 0x2xx signed, 0x3xx float, 0x4xx STRING."
+  def decode_elements(data, data_type, size) when div(data_type, 256) == 1,
+    do: for(<<x::little-unsigned-size(size)-unit(8) <- data>>, do: x)
+
+  def decode_elements(data, data_type, size) when div(data_type, 256) == 2,
+    do: for(<<x::little-signed-size(size)-unit(8) <- data>>, do: x)
+
+  def decode_elements(data, data_type, size) when div(data_type, 256) == 4,
+    do: for(<<x::binary-size(size) <- data>>, do: decode_string(x))
+
+  def decode_elements(data, _data_type, size),
+    do: for(<<x::binary-size(size) <- data>>, do: decode_float(x))
+
+  @doc "One raw element of a type name, as in `rw_tag --subscribe --format=binary` runs."
+  def decode_value(raw, "string"), do: decode_string(raw)
+  def decode_value(raw, bits) when bits in ["bool", "bit"], do: :binary.decode_unsigned(raw, :little)
+  def decode_value(raw, "uint" <> _bits), do: :binary.decode_unsigned(raw, :little)
+
+  def decode_value(raw, "sint" <> _bits) do
+    bits = bit_size(raw)
+    <<value::little-signed-size(bits)>> = raw
+    value
+  end
+
+  def decode_value(raw, _real), do: decode_float(raw)
+
+  defp decode_float(<<x::little-float-32>>), do: x
+  defp decode_float(<<x::little-float-64>>), do: x
+  # NaN and infinities do not match float segments
+  defp decode_float(<<0x7F800000::little-32>>), do: :infinity
+  defp decode_float(<<0xFF800000::little-32>>), do: :neg_infinity
+  defp decode_float(<<0x7FF0000000000000::little-64>>), do: :infinity
+  defp decode_float(<<0xFFF0000000000000::little-64>>), do: :neg_infinity
+  defp decode_float(_nan), do: :nan
+
+  # printf's "inf", "-inf", "nan" and "-nan"
+  defp parse_not_finite("-inf" <> _rest), do: :neg_infinity
+  defp parse_not_finite("inf" <> _rest), do: :infinity
+  defp parse_not_finite("+inf" <> _rest), do: :infinity
+  defp parse_not_finite(_nan), do: :nan
+
+  defp decode_string(<<len::little-32, chars::binary>>) do
+    chars = binary_part(chars, 0, byte_size(chars) - 2)
+    binary_part(chars, 0, min(len, byte_size(chars)))
+  end
+
+  defp quote_string(value) do
+    escaped =
+      for <<c <- value>>, into: "" do
+        cond do
+          c in [?", ?\\] -> <<?\\, c>>
+          c <= ?\s or c >= 0x7F -> "\\x" <> Base.encode16(<<c>>)
+          true -> <<c>>
+        end
+      end
+
+    <<?", escaped::binary, ?">>
+  end
+
+  defp unquote_string(value) do
+    value
+    |> binary_part(1, byte_size(value) - 2)
+    |> unescape("")
+  end
+
+  defp unescape(<<?\\, ?x, hex::binary-size(2), rest::binary>>, acc),
+    do: unescape(rest, <<acc::binary, Base.decode16!(hex, case: :mixed)::binary>>)
+
+  defp unescape(<<?\\, c, rest::binary>>, acc), do: unescape(rest, <<acc::binary, c>>)
+  defp unescape(<<c, rest::binary>>, acc), do: unescape(rest, <<acc::binary, c>>)
+  defp unescape(<<>>, acc), do: acc
+end
@@ -0,0 +1,33 @@
+defmodule Abex.Tag.Worker do
+  @moduledoc """
+  Runs the native calls of an `Abex.Tag` one at a time, so the `Abex.Tag`
+  process itself never waits on the PLC. Each worker owns its own
+  `rw_tag --serve` port, opened on first use.
+
+  Every answer goes back to the owner as
+  `{:abex_done, worker, key, reply, limit_wait}`, where `limit_wait` covers
+  only that request.
+  """
+  use GenServer
+  require Logger
+
+  def start_link(owner, config), do: GenServer.start_link(__MODULE__, {owner, config})
+
+  def run(worker, key, request), do: GenServer.cast(worker, {:run, key, request})
+
+  def init({owner, config}), do: {:ok, %{owner: owner, config: config}}
+
+  def handle_cast({:run, key, request}, %{config: config} = state) do
+    {reply, config} = Abex.Tag.run(request, %{config | limit_wait: %Abex.Tag{}.limit_wait})
+    send(state.owner, {:abex_done, self(), key, reply, config.limit_wait})
+    {:noreply, %{state | config: config}}
+  end
+
+  def handle_info({port, {:exit_status, status}}, %{config: %{port: port}} = state) do
+    Logger.error("(#{Abex.Tag}) rw_tag server exited with status #{status}.")
+    {:noreply, put_in(state.config.port, nil)}
+  end
+
+  # late replies from a port we already gave up on
+  def handle_info(_msg, state), do: {:noreply, state}
+end
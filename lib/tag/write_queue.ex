@@ -0,0 +1,92 @@
+defmodule Abex.Tag.WriteQueue do
+  @moduledoc """
+  Write-behind for an `Abex.Tag` started with `write_behind: true` (or
+  `write_behind: [flush_ms: 50, max_inflight: 16]`).
+
+  Every write goes to one `rw_tag --write-queue` port, which keeps at most one
+  value waiting per tag: a newer write to a tag replaces the value that has
+  not been sent yet, so a tag written faster than the PLC takes it only gets
+  its latest value. A waiting value goes out as soon as the tag's previous
+  write is done, or every `flush_ms` with that option, and writes to
+  different tags (up to `max_inflight`) are in flight together.
+
+  Callers that wait get the result of the write that carried their value or
+  the one that replaced it. Fire-and-forget writes (`wait: false`) get `:ok`
+  at once; their errors are logged.
+  """
+  use GenServer
+  require Logger
+
+  defstruct cmd: nil, args: [], port: nil, next_id: 1, waiting: %{}
+
+  defp cmd_runner do
+    Application.get_env(:abex, :cmd_runner, Abex.CmdWrapper)
+  end
+
+  def start_link(cmd, args), do: GenServer.start_link(__MODULE__, {cmd, args})
+
+  # from is answered with :ok or {:error, reason} when the write is done, nil for nobody
+  def write(queue, args, from), do: GenServer.cast(queue, {:write, args, from})
+
+  def init({cmd, args}), do: {:ok, %__MODULE__{cmd: cmd, args: args}}
+
+  def terminate(_reason, %{port: nil}), do: :ok
+
+  # queued values are still written after the port closes
+  def terminate(_reason, %{port: port}), do: cmd_runner().close(port)
+
+  def handle_cast({:write, args, from}, state) do
+    state = open_port(state)
+    {id, state} = next_id(state, from)
+
+    case cmd_runner().send(state.port, [Integer.to_string(id) | args]) do
+      :ok ->
+        {:noreply, state}
+
+      {:error, _reason} = error ->
+        {:noreply, fail_all(%{state | port: nil}, error)}
+    end
+  end
+
+  def handle_info({port, {:data, <<status, response::binary>>}}, %{port: port} = state) do
+    {id, reason} =
+      case String.split(response, " ", parts: 2) do
+        [id, reason] -> {String.to_integer(id), reason}
+        [id] -> {String.to_integer(id), nil}
+      end
+
+    reply = if status == 0, do: :ok, else: {:error, reason}
+
+    case Map.pop(state.waiting, id) do
+      {nil, _waiting} ->
+        Logger.error("(#{__MODULE__}) write failed: #{reason}")
+        {:noreply, state}
+
+      {from, waiting} ->
+        GenServer.reply(from, reply)
+        {:noreply, %{state | waiting: waiting}}
+    end
+  end
+
+  def handle_info({port, {:exit_status, status}}, %{port: port} = state) do
+    Logger.error("(#{__MODULE__}) rw_tag write queue exited with status #{status}.")
+    {:noreply, fail_all(%{state | port: nil}, {:error, {:exit_status, status}})}
+  end
+
+  def handle_info(_msg, state), do: {:noreply, state}
+
+  defp open_port(%{port: nil} = state), do: %{state | port: cmd_runner().open(state.cmd, state.args)}
+  defp open_port(state), do: state
+
+  # id 0 is a write nobody waits for
+  defp next_id(state, nil), do: {0, state}
+
+  # ids are uint32 on the native side
+  defp next_id(%{next_id: id} = state, from),
+    do: {id, %{state | next_id: rem(id, 0xFFFF_FFFF) + 1, waiting: Map.put(state.waiting, id, from)}}
+
+  defp fail_all(state, error) do
+    Enum.each(state.waiting, fn {_id, from} -> GenServer.reply(from, error) end)
+    %{state | waiting: %{}}
+  end
+end
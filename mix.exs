@@ -34,6 +34,7 @@ defmodule Abex.MixProject do
       files: [
         "lib",
         "src/*.c",
+        "src/*.h",
         "src/libplctag/libplctag.pc.in",
         "src/libplctag/src",
         "CMakeLists.txt",
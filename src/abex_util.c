@@ -0,0 +1,192 @@
+/***************************************************************************
+ *   Small helpers shared by the abex native programs.                     *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "abex_util.h"
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+int64_t abex_time_ms(void)
+{
+#if defined(_WIN32)
+    return (int64_t)GetTickCount64();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((int64_t)ts.tv_sec * 1000) + ((int64_t)ts.tv_nsec / 1000000);
+#endif
+}
+
+
+int64_t abex_time_us(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+
+    return (int64_t)(count.QuadPart / freq.QuadPart) * 1000000
+           + (int64_t)((count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((int64_t)ts.tv_sec * 1000000) + ((int64_t)ts.tv_nsec / 1000);
+#endif
+}
+
+
+void abex_sleep_ms(int ms)
+{
+    if(ms <= 0) {
+        return;
+    }
+
+#if defined(_WIN32)
+    Sleep((DWORD)ms);
+#else
+    {
+        struct timespec ts;
+
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+
+        while(nanosleep(&ts, &ts) != 0) {
+            /* interrupted, sleep the remainder. */
+        }
+    }
+#endif
+}
+
+
+int abex_buf_reserve(struct abex_buf_s *buf, size_t extra)
+{
+    size_t new_cap;
+    char *new_data;
+
+    if(buf->len + extra + 1 <= buf->cap) {
+        return 0;
+    }
+
+    new_cap = buf->cap ? buf->cap : 256;
+    while(new_cap < buf->len + extra + 1) {
+        new_cap *= 2;
+    }
+
+    new_data = realloc(buf->data, new_cap);
+    if(!new_data) {
+        return -1;
+    }
+
+    buf->data = new_data;
+    buf->cap = new_cap;
+
+    return 0;
+}
+
+
+int abex_buf_append(struct abex_buf_s *buf, const void *data, size_t len)
+{
+    if(abex_buf_reserve(buf, len)) {
+        return -1;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = 0;
+
+    return 0;
+}
+
+
+int abex_buf_printf(struct abex_buf_s *buf, const char *fmt, ...)
+{
+    va_list args;
+    int needed;
+
+    va_start(args, fmt);
+    needed = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if(needed < 0 || abex_buf_reserve(buf, (size_t)needed)) {
+        return -1;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+    va_end(args);
+
+    buf->len += (size_t)needed;
+
+    return 0;
+}
+
+
+void abex_buf_reset(struct abex_buf_s *buf)
+{
+    buf->len = 0;
+
+    if(buf->data) {
+        buf->data[0] = 0;
+    }
+}
+
+
+void abex_buf_free(struct abex_buf_s *buf)
+{
+    if(buf->data) {
+        free(buf->data);
+    }
+
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+
+/*
+ * Copy the value of key from a libplctag attribute string
+ * ("key=value&key=value").  Returns 0 if found and it fits, 1 otherwise.
+ */
+int abex_attr_value(const char *attrs, const char *key, char *value, size_t size)
+{
+    size_t key_len = strlen(key);
+    const char *p = attrs;
+
+    while(p && *p) {
+        if(!strncmp(p, key, key_len) && p[key_len] == '=') {
+            const char *start = p + key_len + 1;
+            const char *end = strchr(start, '&');
+            size_t len = end ? (size_t)(end - start) : strlen(start);
+
+            if(len >= size) {
+                return 1;
+            }
+
+            memcpy(value, start, len);
+            value[len] = 0;
+
+            return 0;
+        }
+
+        p = strchr(p, '&');
+        if(p) {
+            p++;
+        }
+    }
+
+    return 1;
+}
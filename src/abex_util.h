@@ -0,0 +1,72 @@
+/***************************************************************************
+ *   Small helpers shared by the abex native programs: a monotonic clock,  *
+ *   a growable output buffer so request handlers can build their          *
+ *   response before deciding where it goes (stdout, stderr or a frame),   *
+ *   and little-endian loads and stores for the binary formats.            *
+ ***************************************************************************/
+
+#ifndef __ABEX_UTIL_H__
+#define __ABEX_UTIL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct abex_buf_s {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+extern int64_t abex_time_ms(void);
+extern int64_t abex_time_us(void);
+extern void abex_sleep_ms(int ms);
+
+extern int abex_buf_reserve(struct abex_buf_s *buf, size_t extra);
+extern int abex_buf_append(struct abex_buf_s *buf, const void *data, size_t len);
+extern int abex_buf_printf(struct abex_buf_s *buf, const char *fmt, ...);
+extern void abex_buf_reset(struct abex_buf_s *buf);
+extern void abex_buf_free(struct abex_buf_s *buf);
+
+extern int abex_attr_value(const char *attrs, const char *key, char *value, size_t size);
+
+/*
+ * Byte-at-a-time little-endian loads and stores.  They are defined here so
+ * the decode loops still inline them: compilers turn them into plain (or
+ * byte-swapping) loads and stores, and those loops into vector code.
+ */
+static inline uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static inline void put_le16(uint8_t *p, uint16_t val)
+{
+    p[0] = (uint8_t)(val);
+    p[1] = (uint8_t)(val >> 8);
+}
+
+static inline void put_le32(uint8_t *p, uint32_t val)
+{
+    p[0] = (uint8_t)(val);
+    p[1] = (uint8_t)(val >> 8);
+    p[2] = (uint8_t)(val >> 16);
+    p[3] = (uint8_t)(val >> 24);
+}
+
+static inline void put_le64(uint8_t *p, uint64_t val)
+{
+    put_le32(p, (uint32_t)val);
+    put_le32(p + 4, (uint32_t)(val >> 32));
+}
+
+#endif
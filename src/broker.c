@@ -0,0 +1,555 @@
+/***************************************************************************
+ *   Local connection broker, see broker.h.                                *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "broker.h"
+#include "frame_io.h"
+
+#if !defined(_WIN32)
+    #include <unistd.h>
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+#endif
+
+
+/*
+ * The broker socket for this run: the last --broker=PATH argument, else
+ * $ABEX_BROKER.  NULL if neither is set or the one that counts is empty.
+ */
+const char *broker_socket_path(int argc, char **argv)
+{
+    const char *path = getenv(BROKER_ENV);
+    int i;
+
+    for(i = 1; i < argc; i++) {
+        if(!strncmp(argv[i], BROKER_ARG, strlen(BROKER_ARG))) {
+            path = argv[i] + strlen(BROKER_ARG);
+        }
+    }
+
+    return path && *path ? path : NULL;
+}
+
+
+#if !defined(_WIN32)
+
+static int unix_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        return 1;
+    }
+
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+
+/* connect to the broker at path, -1 if there is none */
+int broker_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if(unix_address(&addr, path)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/*
+ * Read the next answer frame.  Returns its status byte (the data follows
+ * it in frame), or -1 if the broker went away or took longer than
+ * timeout_ms.
+ */
+int broker_reply(int fd, struct abex_buf_s *frame, int timeout_ms)
+{
+    if(frame_wait_readable(fd, timeout_ms) <= 0 || frame_read(fd, frame) <= 0 || frame->len < 1) {
+        return -1;
+    }
+
+    return (uint8_t)frame->data[0];
+}
+
+
+void broker_disconnect(int fd)
+{
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+
+/*
+ * Listen on path, a socket file only the broker's user can connect to
+ * (0600).  A socket file nobody answers on is left over from a broker that
+ * died and is replaced; one that answers belongs to a running broker and
+ * gives BROKER_IN_USE.  Returns 0 when listening, -1 on error.
+ */
+int broker_listen(struct broker_s *broker, const char *path, int watch_fd)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+    int rc;
+
+    memset(broker, 0, sizeof(*broker));
+    broker->listen_fd = -1;
+    broker->watch_fd = watch_fd;
+
+    if(unix_address(&addr, path)) {
+        return -1;
+    }
+
+    fd = broker_connect(path);
+    if(fd >= 0) {
+        close(fd);
+        return BROKER_IN_USE;
+    }
+
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+
+    /*
+     * clients can write to PLCs through the broker: only its own user may
+     * connect, from the moment the socket file exists.
+     */
+    mask = umask(0177);
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+
+    if(rc || chmod(path, 0600) || listen(fd, BROKER_MAX_CLIENTS)) {
+        close(fd);
+        if(!rc) {
+            unlink(path);
+        }
+        return -1;
+    }
+
+    broker->path = malloc(strlen(path) + 1);
+    if(!broker->path) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    strcpy(broker->path, path);
+    broker->listen_fd = fd;
+
+    return 0;
+}
+
+
+static struct broker_client_s *find_client(struct broker_s *broker, int fd)
+{
+    int i;
+
+    for(i = 0; i < broker->client_count; i++) {
+        if(broker->clients[i].fd == fd) {
+            return &broker->clients[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static void accept_client(struct broker_s *broker)
+{
+    struct broker_client_s *client;
+    int fd = accept(broker->listen_fd, NULL, NULL);
+    int flags;
+
+    if(fd < 0) {
+        return;
+    }
+
+    /* a client turned away sees EOF and goes to the PLC itself. */
+    flags = fcntl(fd, F_GETFL, 0);
+    if(broker->client_count >= BROKER_MAX_CLIENTS || flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        close(fd);
+        return;
+    }
+
+    client = &broker->clients[broker->client_count++];
+    memset(client, 0, sizeof(*client));
+    client->fd = fd;
+    client->progress_ms = abex_time_ms();
+}
+
+
+/* size of the first request in buf with its length prefix, 0 if it is not all there, -1 if too long */
+static long whole_request(const struct abex_buf_s *buf)
+{
+    const uint8_t *p = (const uint8_t *)buf->data;
+    uint32_t len;
+
+    if(buf->len < 4) {
+        return 0;
+    }
+
+    len = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    if(len > FRAME_MAX_SIZE) {
+        return -1;
+    }
+
+    return buf->len - 4 >= len ? (long)len + 4 : 0;
+}
+
+
+/* read what the client sent so far, -1 on EOF, error or a bad length */
+static int read_client(struct broker_client_s *client)
+{
+    for(;;) {
+        ssize_t rc;
+
+        if(abex_buf_reserve(&client->in, 65536)) {
+            return -1;
+        }
+
+        rc = read(client->fd, client->in.data + client->in.len, 65536);
+        if(rc == 0) {
+            return -1;
+        }
+
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        client->in.len += (size_t)rc;
+        client->progress_ms = abex_time_ms();
+
+        if(whole_request(&client->in)) {
+            return whole_request(&client->in) < 0 ? -1 : 0;
+        }
+    }
+}
+
+
+/* send as much of the queued answers as the socket takes, -1 if the client is gone */
+static int flush_client(struct broker_client_s *client)
+{
+    while(client->out_sent < client->out.len) {
+        ssize_t rc = write(client->fd, client->out.data + client->out_sent, client->out.len - client->out_sent);
+
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        client->out_sent += (size_t)rc;
+        client->progress_ms = abex_time_ms();
+    }
+
+    abex_buf_reset(&client->out);
+    client->out_sent = 0;
+
+    return 0;
+}
+
+
+static int has_request(const struct broker_client_s *client)
+{
+    return client->out.len == 0 && whole_request(&client->in) > 0;
+}
+
+
+/*
+ * Wait up to timeout_ms for a request, taking in new clients and moving
+ * queued bytes in and out meanwhile.  Returns the fd of a client with a
+ * whole request (and no answer still queued), to go to broker_take(),
+ * BROKER_IDLE if there is none, or BROKER_STOP on EOF of the watched fd
+ * or when polling fails.  Clients that hang up, send a bad frame or stall
+ * for BROKER_STALL_MS are dropped here.
+ */
+int broker_next(struct broker_s *broker, int timeout_ms)
+{
+    struct pollfd fds[BROKER_MAX_CLIENTS + 2];
+    int first = broker->watch_fd >= 0 ? 2 : 1;
+    int polled;
+    int count;
+    int64_t now;
+    int rc;
+    int i;
+
+    fds[0].fd = broker->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = broker->watch_fd;
+    fds[1].events = POLLIN;
+
+    for(i = 0; i < broker->client_count; i++) {
+        struct broker_client_s *client = &broker->clients[i];
+
+        fds[first + i].fd = client->fd;
+
+        if(client->out.len) {
+            fds[first + i].events = POLLOUT;
+        } else if(whole_request(&client->in)) {
+            /* its turn comes without waiting, it is not read until then. */
+            fds[first + i].events = 0;
+            timeout_ms = 0;
+        } else {
+            fds[first + i].events = POLLIN;
+        }
+    }
+
+    count = first + broker->client_count;
+    for(i = 0; i < count; i++) {
+        fds[i].revents = 0;
+    }
+
+    rc = poll(fds, (nfds_t)count, timeout_ms);
+    if(rc < 0) {
+        /* a signal: the caller decides whether it means stop. */
+        return errno == EINTR ? BROKER_IDLE : BROKER_STOP;
+    }
+
+    if(first == 2 && fds[1].revents) {
+        char byte;
+
+        /* nothing is expected there, EOF means the owner is gone. */
+        if(read(broker->watch_fd, &byte, 1) <= 0) {
+            return BROKER_STOP;
+        }
+    }
+
+    /* clients accepted now are polled next time. */
+    polled = count - first;
+    now = abex_time_ms();
+
+    /* backwards, so dropping a client (the last one moves into its place) skips nobody. */
+    for(i = polled - 1; i >= 0; i--) {
+        struct broker_client_s *client = &broker->clients[i];
+        short revents = fds[first + i].revents;
+        int waiting = client->out.len || (client->in.len && !whole_request(&client->in));
+        int gone = 0;
+
+        if(revents & POLLOUT) {
+            gone = flush_client(client);
+        } else if(revents & POLLIN) {
+            gone = read_client(client);
+        } else if(revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            gone = 1;
+        } else if(waiting && now - client->progress_ms > BROKER_STALL_MS) {
+            gone = 1;
+        }
+
+        if(gone) {
+            broker_drop(broker, client->fd);
+        }
+    }
+
+    if(fds[0].revents & POLLIN) {
+        accept_client(broker);
+    }
+
+    /* whole requests are answered in turn, so no client goes first every time. */
+    for(i = 0; i < broker->client_count; i++) {
+        int index = (broker->next + i) % broker->client_count;
+
+        if(has_request(&broker->clients[index])) {
+            broker->next = index + 1;
+            return broker->clients[index].fd;
+        }
+    }
+
+    return BROKER_IDLE;
+}
+
+
+/* move the client's next request into request, as frame_read() would */
+int broker_take(struct broker_s *broker, int fd, struct abex_buf_s *request)
+{
+    struct broker_client_s *client = find_client(broker, fd);
+    long size = client ? whole_request(&client->in) : 0;
+
+    abex_buf_reset(request);
+
+    if(size <= 0 || abex_buf_append(request, client->in.data + 4, (size_t)size - 4)) {
+        return -1;
+    }
+
+    memmove(client->in.data, client->in.data + size, client->in.len - (size_t)size);
+    client->in.len -= (size_t)size;
+    client->progress_ms = abex_time_ms();
+
+    return 1;
+}
+
+
+/*
+ * Queue an answer frame for the client on fd and send what its socket
+ * takes now; broker_next() sends the rest.  -1 if the client is gone.
+ */
+int broker_send(struct broker_s *broker, int fd, uint8_t status, const void *data, size_t len)
+{
+    struct broker_client_s *client = find_client(broker, fd);
+    uint8_t header[5];
+    uint32_t frame_len = (uint32_t)(len + 1);
+
+    if(!client) {
+        return -1;
+    }
+
+    header[0] = (uint8_t)(frame_len >> 24);
+    header[1] = (uint8_t)(frame_len >> 16);
+    header[2] = (uint8_t)(frame_len >> 8);
+    header[3] = (uint8_t)(frame_len);
+    header[4] = status;
+
+    if(client->out.len == 0) {
+        client->progress_ms = abex_time_ms();
+    }
+
+    if(abex_buf_append(&client->out, header, sizeof(header)) || (len && abex_buf_append(&client->out, data, len))) {
+        return -1;
+    }
+
+    return flush_client(client);
+}
+
+
+/* forget a client that went away (or misbehaved) and close its socket */
+void broker_drop(struct broker_s *broker, int fd)
+{
+    struct broker_client_s *client = find_client(broker, fd);
+
+    if(client) {
+        abex_buf_free(&client->in);
+        abex_buf_free(&client->out);
+        *client = broker->clients[--broker->client_count];
+    }
+
+    close(fd);
+}
+
+
+void broker_shutdown(struct broker_s *broker)
+{
+    while(broker->client_count > 0) {
+        broker_drop(broker, broker->clients[0].fd);
+    }
+
+    if(broker->listen_fd >= 0) {
+        close(broker->listen_fd);
+    }
+
+    if(broker->path) {
+        unlink(broker->path);
+        free(broker->path);
+    }
+
+    memset(broker, 0, sizeof(*broker));
+    broker->listen_fd = -1;
+    broker->watch_fd = -1;
+}
+
+#else
+
+int broker_connect(const char *path)
+{
+    (void)path;
+
+    return -1;
+}
+
+int broker_reply(int fd, struct abex_buf_s *frame, int timeout_ms)
+{
+    (void)fd;
+    (void)frame;
+    (void)timeout_ms;
+
+    return -1;
+}
+
+void broker_disconnect(int fd)
+{
+    (void)fd;
+}
+
+int broker_listen(struct broker_s *broker, const char *path, int watch_fd)
+{
+    (void)path;
+
+    memset(broker, 0, sizeof(*broker));
+    broker->listen_fd = -1;
+    broker->watch_fd = watch_fd;
+
+    return -1;
+}
+
+int broker_next(struct broker_s *broker, int timeout_ms)
+{
+    (void)broker;
+    (void)timeout_ms;
+
+    return BROKER_STOP;
+}
+
+int broker_take(struct broker_s *broker, int fd, struct abex_buf_s *request)
+{
+    (void)broker;
+    (void)fd;
+    (void)request;
+
+    return -1;
+}
+
+int broker_send(struct broker_s *broker, int fd, uint8_t status, const void *data, size_t len)
+{
+    (void)broker;
+    (void)fd;
+    (void)status;
+    (void)data;
+    (void)len;
+
+    return -1;
+}
+
+void broker_drop(struct broker_s *broker, int fd)
+{
+    (void)broker;
+    (void)fd;
+}
+
+void broker_shutdown(struct broker_s *broker)
+{
+    memset(broker, 0, sizeof(*broker));
+    broker->listen_fd = -1;
+    broker->watch_fd = -1;
+}
+
+#endif
@@ -0,0 +1,94 @@
+/***************************************************************************
+ *   Local connection broker.  rw_tag --broker listens on a Unix domain    *
+ *   socket and answers the same framed requests as rw_tag --serve, for    *
+ *   any number of clients, one request at a time.  Client sockets are     *
+ *   non-blocking, so a client that stalls mid-frame only loses its own    *
+ *   connection (after BROKER_STALL_MS).  One-shot rw_tag and              *
+ *   tag_list runs that reach it send their request there instead of       *
+ *   opening a connection of their own, so they share the broker's tag     *
+ *   handles and the PLC sessions libplctag keeps under them (one per      *
+ *   gateway, path and connection_group_id, as the attribute strings ask). *
+ *                                                                         *
+ *   Clients find the socket with --broker=PATH or the ABEX_BROKER         *
+ *   environment variable, and go to the PLC themselves when nothing       *
+ *   answers there.  An empty --broker= turns the broker off.              *
+ *   The socket file is made 0600, so only the broker's own user can       *
+ *   connect and write to PLCs through it.                                 *
+ *                                                                         *
+ *   POSIX only: on Windows there is nothing to listen on or connect to.  *
+ ***************************************************************************/
+
+#ifndef __BROKER_H__
+#define __BROKER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "abex_util.h"
+
+#define BROKER_ENV "ABEX_BROKER"
+#define BROKER_ARG "--broker="
+
+#define BROKER_MAX_CLIENTS (64)
+
+/* how long a client waits for an answer, requests from other clients go first */
+#define BROKER_REPLY_TIMEOUT_MS (60000)
+
+/* a client that leaves a request half sent or an answer unread this long is dropped */
+#define BROKER_STALL_MS (5000)
+
+/* broker_next results besides a client fd */
+#define BROKER_IDLE (-1)
+#define BROKER_STOP (-2)
+
+/* broker_listen result when another broker already answers on the socket */
+#define BROKER_IN_USE (-2)
+
+/*
+ * Client sockets are non-blocking: what comes in and what goes out is
+ * buffered here, so a client that stops sending or reading mid-frame
+ * holds up nobody but itself.
+ */
+struct broker_client_s {
+    int fd;
+
+    /* bytes read, the next request first; only read while no whole request waits */
+    struct abex_buf_s in;
+
+    /* answer frames queued for the client, sent from out_sent on */
+    struct abex_buf_s out;
+    size_t out_sent;
+
+    /* the last time a half-sent request or a queued answer moved */
+    int64_t progress_ms;
+};
+
+struct broker_s {
+    int listen_fd;
+
+    /* -1, or an fd whose EOF stops the broker (stdin of an Erlang port) */
+    int watch_fd;
+
+    struct broker_client_s clients[BROKER_MAX_CLIENTS];
+    int client_count;
+
+    /* where the next broker_next() starts looking, so no client goes first every time */
+    int next;
+
+    char *path;
+};
+
+/* clients */
+extern const char *broker_socket_path(int argc, char **argv);
+extern int broker_connect(const char *path);
+extern int broker_reply(int fd, struct abex_buf_s *frame, int timeout_ms);
+extern void broker_disconnect(int fd);
+
+/* rw_tag --broker */
+extern int broker_listen(struct broker_s *broker, const char *path, int watch_fd);
+extern int broker_next(struct broker_s *broker, int timeout_ms);
+extern int broker_take(struct broker_s *broker, int fd, struct abex_buf_s *request);
+extern int broker_send(struct broker_s *broker, int fd, uint8_t status, const void *data, size_t len);
+extern void broker_drop(struct broker_s *broker, int fd);
+extern void broker_shutdown(struct broker_s *broker);
+
+#endif
@@ -0,0 +1,255 @@
+/***************************************************************************
+ *   Length-prefixed framing on stdin/stdout, see frame_io.h.              *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "frame_io.h"
+
+#if defined(_WIN32)
+    #include <io.h>
+    #define read_fd(fd, buf, len) _read((fd), (buf), (unsigned int)(len))
+    #define write_fd(fd, buf, len) _write((fd), (buf), (unsigned int)(len))
+#else
+    #include <unistd.h>
+    #include <poll.h>
+    #define read_fd(fd, buf, len) read((fd), (buf), (len))
+    #define write_fd(fd, buf, len) write((fd), (buf), (len))
+#endif
+
+
+/*
+ * Wait until fd has data (or EOF) to read.  Returns 1 if readable, 0 on
+ * timeout and -1 on error.  A negative timeout waits forever.
+ */
+int frame_wait_readable(int fd, int timeout_ms)
+{
+#if defined(_WIN32)
+    (void)fd;
+    (void)timeout_ms;
+
+    /* no poll() on pipes, just let the next read block. */
+    return 1;
+#else
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    do {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while(rc < 0 && errno == EINTR);
+
+    if(rc < 0) {
+        return -1;
+    }
+
+    return rc > 0 ? 1 : 0;
+#endif
+}
+
+
+static int read_fully(int fd, void *data, size_t len)
+{
+    char *p = data;
+    size_t got = 0;
+
+    while(got < len) {
+        long rc = (long)read_fd(fd, p + got, len - got);
+
+        if(rc == 0) {
+            /* EOF, fine if nothing was read yet. */
+            return got == 0 ? 0 : -1;
+        }
+
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        got += (size_t)rc;
+    }
+
+    return 1;
+}
+
+
+static int write_fully(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    size_t put = 0;
+
+    while(put < len) {
+        long rc = (long)write_fd(fd, p + put, len - put);
+
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        put += (size_t)rc;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Read one frame into the buffer.  Returns 1 when a frame was read, 0 on
+ * a clean EOF and -1 on error or a malformed frame.
+ */
+int frame_read(int fd, struct abex_buf_s *frame)
+{
+    uint8_t header[4];
+    uint32_t len;
+    int rc;
+
+    abex_buf_reset(frame);
+
+    rc = read_fully(fd, header, sizeof(header));
+    if(rc <= 0) {
+        return rc;
+    }
+
+    len = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+    if(len > FRAME_MAX_SIZE) {
+        return -1;
+    }
+
+    /* make room, then read straight into the buffer. */
+    if(abex_buf_reserve(frame, len)) {
+        return -1;
+    }
+
+    if(len > 0 && read_fully(fd, frame->data, len) <= 0) {
+        return -1;
+    }
+
+    frame->len = len;
+    frame->data[len] = 0;
+
+    return 1;
+}
+
+
+int frame_write(int fd, uint8_t status, const void *data, size_t len)
+{
+    uint8_t header[5];
+    uint32_t frame_len = (uint32_t)(len + 1);
+
+    header[0] = (uint8_t)(frame_len >> 24);
+    header[1] = (uint8_t)(frame_len >> 16);
+    header[2] = (uint8_t)(frame_len >> 8);
+    header[3] = (uint8_t)(frame_len);
+    header[4] = status;
+
+    if(write_fully(fd, header, sizeof(header))) {
+        return -1;
+    }
+
+    if(len > 0 && write_fully(fd, data, len)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write a request: the arguments NUL-separated and, when the last one is
+ * --payload=<n>, the payload bytes after its NUL.  argv does not include
+ * the program name.
+ */
+int frame_write_args(int fd, int argc, char **argv, const void *payload, size_t payload_len)
+{
+    struct abex_buf_s frame = {NULL, 0, 0};
+    uint8_t header[4] = {0, 0, 0, 0};
+    uint32_t len;
+    int rc = 0;
+    int i;
+
+    abex_buf_append(&frame, header, sizeof(header));
+
+    for(i = 0; i < argc; i++) {
+        /* the separator is the NUL after each argument, none after the last without a payload. */
+        rc |= abex_buf_append(&frame, argv[i], strlen(argv[i]) + (i + 1 < argc || payload_len ? 1 : 0));
+    }
+
+    if(payload_len) {
+        rc |= abex_buf_append(&frame, payload, payload_len);
+    }
+
+    if(rc || frame.len - sizeof(header) > FRAME_MAX_SIZE) {
+        abex_buf_free(&frame);
+        return -1;
+    }
+
+    len = (uint32_t)(frame.len - sizeof(header));
+    frame.data[0] = (char)(len >> 24);
+    frame.data[1] = (char)(len >> 16);
+    frame.data[2] = (char)(len >> 8);
+    frame.data[3] = (char)len;
+
+    rc = write_fully(fd, frame.data, frame.len);
+    abex_buf_free(&frame);
+
+    return rc;
+}
+
+
+/*
+ * Split a request frame into an argv array in place.  argv[0] is set to
+ * the program name so the result can go straight to the normal argument
+ * parser.  A --payload=<n> argument ends the list: the n bytes after its
+ * NUL are binary data and are left as they are.  Returns the argument
+ * count or -1 if there are too many or the payload length is wrong.
+ */
+int frame_split_args(struct abex_buf_s *frame, char *program, char **argv, int max_args)
+{
+    int argc = 0;
+    size_t start = 0;
+    size_t i;
+
+    argv[argc++] = program;
+
+    if(frame->len == 0) {
+        return argc;
+    }
+
+    for(i = 0; i <= frame->len; i++) {
+        /* the buffer is always NUL terminated one past len. */
+        if(frame->data[i] == 0) {
+            /* ignore a trailing separator. */
+            if(i == frame->len && start == i) {
+                break;
+            }
+
+            if(argc >= max_args) {
+                return -1;
+            }
+
+            argv[argc++] = frame->data + start;
+
+            if(!strncmp(frame->data + start, FRAME_PAYLOAD_ARG, strlen(FRAME_PAYLOAD_ARG))) {
+                size_t payload_len = (size_t)strtoul(frame->data + start + strlen(FRAME_PAYLOAD_ARG), NULL, 10);
+                size_t remaining = i < frame->len ? frame->len - i - 1 : 0;
+
+                return remaining == payload_len ? argc : -1;
+            }
+
+            start = i + 1;
+        }
+    }
+
+    return argc;
+}
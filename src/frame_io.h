@@ -0,0 +1,31 @@
+/***************************************************************************
+ *   Length-prefixed framing on stdin/stdout, compatible with Erlang ports *
+ *   opened with {:packet, 4}.                                             *
+ *                                                                         *
+ *   Every frame is a 32-bit big-endian length followed by that many       *
+ *   bytes.  Requests are NUL-separated argument lists, exactly as they    *
+ *   would appear on the command line.  Responses start with one status    *
+ *   byte (the exit code the one-shot command would have returned)         *
+ *   followed by the command output.                                       *
+ ***************************************************************************/
+
+#ifndef __FRAME_IO_H__
+#define __FRAME_IO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "abex_util.h"
+
+#define FRAME_MAX_SIZE (64 * 1024 * 1024)
+#define FRAME_MAX_ARGS (256)
+
+/* last argument of a request followed by raw bytes, "--payload=<n>" */
+#define FRAME_PAYLOAD_ARG "--payload="
+
+extern int frame_wait_readable(int fd, int timeout_ms);
+extern int frame_read(int fd, struct abex_buf_s *frame);
+extern int frame_write(int fd, uint8_t status, const void *data, size_t len);
+extern int frame_write_args(int fd, int argc, char **argv, const void *payload, size_t payload_len);
+extern int frame_split_args(struct abex_buf_s *frame, char *program, char **argv, int max_args);
+
+#endif
@@ -0,0 +1,529 @@
+/***************************************************************************
+ *   Per-gateway request limits shared between processes.                  *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "compat_utils.h"
+#include <libplctag/lib/libplctag.h>
+#include "abex_util.h"
+#include "gateway_limit.h"
+
+#if defined(_WIN32)
+    #include <process.h>
+    #define getpid _getpid
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <unistd.h>
+    #include <pthread.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#define GATEWAY_NAME_SIZE (256)
+#define STATE_FILE_SIZE (1024)
+
+/* how often a blocked gateway_limit_acquire looks again */
+#define POLL_INTERVAL_MS (1)
+
+#define TICKET_NONE (0)
+#define TICKET_QUEUED (1)
+#define TICKET_GRANTED (2)
+
+#if !defined(_WIN32)
+/* threads of one process (the scanner) share the state without the file lock */
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Take one of the limit options.  Returns 1 if arg was a limit option, 0
+ * if it was not, -1 if its value is bad.
+ */
+int gateway_limit_parse_arg(struct gateway_limit_config_s *config, const char *arg)
+{
+    if(!strncmp(arg, "--rate-limit=", strlen("--rate-limit="))) {
+        config->rate = atof(arg + strlen("--rate-limit="));
+        return config->rate > 0.0 ? 1 : -1;
+    }
+
+    if(!strncmp(arg, "--burst=", strlen("--burst="))) {
+        config->burst = atoi(arg + strlen("--burst="));
+        return config->burst > 0 ? 1 : -1;
+    }
+
+    if(!strncmp(arg, "--max-concurrent=", strlen("--max-concurrent="))) {
+        config->max_concurrent = atoi(arg + strlen("--max-concurrent="));
+        return config->max_concurrent > 0 ? 1 : -1;
+    }
+
+    if(!strncmp(arg, "--limit-dir=", strlen("--limit-dir="))) {
+        free(config->dir);
+        config->dir = compat_strdup(arg + strlen("--limit-dir="));
+        return config->dir ? 1 : -1;
+    }
+
+    return 0;
+}
+
+
+int gateway_limit_enabled(const struct gateway_limit_s *limit)
+{
+    return limit->config.rate > 0.0 || limit->config.max_concurrent > 0;
+}
+
+
+#if !defined(_WIN32)
+static void lock_file(int fd, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+
+    while(fcntl(fd, type == F_UNLCK ? F_SETLK : F_SETLKW, &fl) && errno == EINTR) {
+        /* interrupted, try again. */
+    }
+}
+#endif
+
+static void lock_state(struct gateway_limit_entry_s *entry)
+{
+#if !defined(_WIN32)
+    pthread_mutex_lock(&state_mutex);
+
+    if(entry->fd >= 0) {
+        lock_file(entry->fd, F_WRLCK);
+    }
+#else
+    (void)entry;
+#endif
+}
+
+static void unlock_state(struct gateway_limit_entry_s *entry)
+{
+#if !defined(_WIN32)
+    if(entry->fd >= 0) {
+        lock_file(entry->fd, F_UNLCK);
+    }
+
+    pthread_mutex_unlock(&state_mutex);
+#else
+    (void)entry;
+#endif
+}
+
+
+static void init_state(struct gateway_limit_state_s *state, int burst)
+{
+    memset(state, 0, sizeof(*state));
+    memcpy(state->magic, GATEWAY_LIMIT_MAGIC, sizeof(GATEWAY_LIMIT_MAGIC));
+    state->version = GATEWAY_LIMIT_VERSION;
+    state->tokens = (double)burst;
+    state->refill_ms = abex_time_ms();
+}
+
+
+#if !defined(_WIN32)
+/*
+ * Map the state file of a gateway, creating it if needed.  A file left by
+ * another version is reset.  Called with the process mutex held.
+ */
+static int open_state_file(struct gateway_limit_entry_s *entry, const char *dir, int burst)
+{
+    char file[STATE_FILE_SIZE];
+    char name[GATEWAY_NAME_SIZE];
+    struct stat st;
+    void *map;
+    size_t i;
+
+    compat_snprintf(name, sizeof(name), "%s", entry->gateway);
+    for(i = 0; name[i]; i++) {
+        if(!isalnum((unsigned char)name[i]) && name[i] != '.' && name[i] != '-') {
+            name[i] = '_';
+        }
+    }
+
+    if((size_t)compat_snprintf(file, sizeof(file), "%s/%s.abexlim", dir, name) >= sizeof(file)) {
+        return 1;
+    }
+
+    /* only processes of the same user share the limits */
+    entry->fd = open(file, O_RDWR | O_CREAT, 0600);
+    if(entry->fd < 0) {
+        return 1;
+    }
+
+    lock_file(entry->fd, F_WRLCK);
+
+    if(fstat(entry->fd, &st) || (st.st_size < (off_t)sizeof(*entry->state)
+                                 && ftruncate(entry->fd, (off_t)sizeof(*entry->state)))) {
+        lock_file(entry->fd, F_UNLCK);
+        return 1;
+    }
+
+    map = mmap(NULL, sizeof(*entry->state), PROT_READ | PROT_WRITE, MAP_SHARED, entry->fd, 0);
+    if(map == MAP_FAILED) {
+        lock_file(entry->fd, F_UNLCK);
+        return 1;
+    }
+
+    entry->state = map;
+
+    if(memcmp(entry->state->magic, GATEWAY_LIMIT_MAGIC, sizeof(GATEWAY_LIMIT_MAGIC))
+       || entry->state->version != GATEWAY_LIMIT_VERSION
+       || entry->state->waiter_count > GATEWAY_LIMIT_SLOTS) {
+        init_state(entry->state, burst);
+    }
+
+    lock_file(entry->fd, F_UNLCK);
+
+    return 0;
+}
+#endif
+
+
+static void free_entry(struct gateway_limit_entry_s *entry)
+{
+    if(entry->state) {
+#if !defined(_WIN32)
+        if(entry->fd >= 0) {
+            munmap(entry->state, sizeof(*entry->state));
+        } else {
+            free(entry->state);
+        }
+#else
+        free(entry->state);
+#endif
+    }
+
+#if !defined(_WIN32)
+    if(entry->fd >= 0) {
+        close(entry->fd);
+    }
+#endif
+
+    free(entry->gateway);
+    free(entry);
+}
+
+static struct gateway_limit_entry_s *find_entry(struct gateway_limit_s *limit, const char *gateway)
+{
+    struct gateway_limit_entry_s *entry;
+    int burst = limit->config.burst > 0 ? limit->config.burst : 1;
+
+    for(entry = limit->head; entry; entry = entry->next) {
+        if(!strcmp(entry->gateway, gateway)) {
+            return entry;
+        }
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if(!entry) {
+        return NULL;
+    }
+
+    entry->fd = -1;
+    entry->gateway = compat_strdup(gateway);
+    if(!entry->gateway) {
+        free_entry(entry);
+        return NULL;
+    }
+
+#if !defined(_WIN32)
+    if(limit->config.dir) {
+        if(open_state_file(entry, limit->config.dir, burst)) {
+            free_entry(entry);
+            return NULL;
+        }
+    }
+#endif
+
+    /* no directory (or Windows): the limits only hold in this process. */
+    if(!entry->state) {
+        entry->state = malloc(sizeof(*entry->state));
+        if(!entry->state) {
+            free_entry(entry);
+            return NULL;
+        }
+
+        init_state(entry->state, burst);
+    }
+
+    entry->next = limit->head;
+    limit->head = entry;
+
+    return entry;
+}
+
+
+static int process_gone(int32_t pid)
+{
+#if !defined(_WIN32)
+    return pid != (int32_t)getpid() && kill((pid_t)pid, 0) && errno == ESRCH;
+#else
+    (void)pid;
+    return 0;
+#endif
+}
+
+/* forget what processes that died while waiting or holding a slot left behind */
+static void reap_state(struct gateway_limit_state_s *state, int at_cap)
+{
+    int i;
+
+    while(state->waiter_count > 0 && process_gone(state->waiters[0].pid)) {
+        state->waiter_count--;
+        memmove(&state->waiters[0], &state->waiters[1], state->waiter_count * sizeof(state->waiters[0]));
+    }
+
+    if(!at_cap) {
+        return;
+    }
+
+    for(i = 0; i < GATEWAY_LIMIT_SLOTS; i++) {
+        if(state->holders[i].pid && process_gone(state->holders[i].pid)) {
+            state->holders[i].pid = 0;
+            state->holders[i].count = 0;
+        }
+    }
+}
+
+static int in_flight(const struct gateway_limit_state_s *state)
+{
+    int count = 0;
+    int i;
+
+    for(i = 0; i < GATEWAY_LIMIT_SLOTS; i++) {
+        count += state->holders[i].count;
+    }
+
+    return count;
+}
+
+static void add_holder(struct gateway_limit_state_s *state, int32_t pid, int32_t delta)
+{
+    int free_slot = -1;
+    int i;
+
+    for(i = 0; i < GATEWAY_LIMIT_SLOTS; i++) {
+        if(state->holders[i].pid == pid) {
+            state->holders[i].count += delta;
+            if(state->holders[i].count <= 0) {
+                state->holders[i].pid = 0;
+                state->holders[i].count = 0;
+            }
+
+            return;
+        }
+
+        if(!state->holders[i].pid && free_slot < 0) {
+            free_slot = i;
+        }
+    }
+
+    /* more processes than slots are not counted, better than blocking them. */
+    if(delta > 0 && free_slot >= 0) {
+        state->holders[free_slot].pid = pid;
+        state->holders[free_slot].count = delta;
+    }
+}
+
+static void refill(struct gateway_limit_state_s *state, const struct gateway_limit_config_s *config, int64_t now)
+{
+    double burst = (double)(config->burst > 0 ? config->burst : 1);
+
+    if(config->rate <= 0.0) {
+        return;
+    }
+
+    if(now > state->refill_ms) {
+        state->tokens += (double)(now - state->refill_ms) * config->rate / 1000.0;
+        state->refill_ms = now;
+    }
+
+    if(state->tokens > burst) {
+        state->tokens = burst;
+    }
+}
+
+
+/*
+ * Queue a request for the gateway in attrs, or see whether a queued one
+ * may go now.  Call it again until it returns GATEWAY_LIMIT_GRANTED, then
+ * gateway_limit_release() once the request is done, or
+ * gateway_limit_cancel() to give up.  The ticket must start zeroed.
+ * Returns a PLCTAG error if the shared state cannot be opened.
+ */
+int gateway_limit_try(struct gateway_limit_s *limit, const char *attrs, struct gateway_limit_ticket_s *ticket)
+{
+    struct gateway_limit_state_s *state;
+    int32_t pid = (int32_t)getpid();
+    int64_t now = abex_time_ms();
+    int rc = GATEWAY_LIMIT_WAIT;
+
+    if(ticket->state == TICKET_GRANTED) {
+        return GATEWAY_LIMIT_GRANTED;
+    }
+
+    if(!gateway_limit_enabled(limit)) {
+        ticket->state = TICKET_GRANTED;
+        return GATEWAY_LIMIT_GRANTED;
+    }
+
+    if(!ticket->entry) {
+        char gateway[GATEWAY_NAME_SIZE];
+
+        if(abex_attr_value(attrs, "gateway", gateway, sizeof(gateway))) {
+            ticket->state = TICKET_GRANTED;
+            return GATEWAY_LIMIT_GRANTED;
+        }
+
+#if !defined(_WIN32)
+        pthread_mutex_lock(&state_mutex);
+#endif
+        ticket->entry = find_entry(limit, gateway);
+        ticket->id = ++limit->next_id;
+#if !defined(_WIN32)
+        pthread_mutex_unlock(&state_mutex);
+#endif
+
+        if(!ticket->entry) {
+            return PLCTAG_ERR_OPEN;
+        }
+    }
+
+    state = ticket->entry->state;
+
+    lock_state(ticket->entry);
+
+    reap_state(state, limit->config.max_concurrent > 0 && in_flight(state) >= limit->config.max_concurrent);
+
+    if(ticket->state == TICKET_NONE && state->waiter_count < GATEWAY_LIMIT_SLOTS) {
+        state->waiters[state->waiter_count].pid = pid;
+        state->waiters[state->waiter_count].id = ticket->id;
+        state->waiter_count++;
+
+        ticket->state = TICKET_QUEUED;
+        ticket->queued_ms = now;
+        ticket->entry->full = 0;
+    } else if(ticket->state == TICKET_NONE && !ticket->entry->full) {
+        /* still waits, but outside the queue, so it may be served out of turn */
+        fprintf(stderr, "WARNING: gateway %s: all %d waiter slots are taken, requests wait outside the queue\n",
+                ticket->entry->gateway, GATEWAY_LIMIT_SLOTS);
+        ticket->entry->full = 1;
+    }
+
+    refill(state, &limit->config, now);
+
+    if(ticket->state == TICKET_QUEUED
+       && state->waiters[0].pid == pid && state->waiters[0].id == ticket->id
+       && (limit->config.rate <= 0.0 || state->tokens >= 1.0)
+       && (limit->config.max_concurrent <= 0 || in_flight(state) < limit->config.max_concurrent)) {
+        state->waiter_count--;
+        memmove(&state->waiters[0], &state->waiters[1], state->waiter_count * sizeof(state->waiters[0]));
+
+        if(limit->config.rate > 0.0) {
+            state->tokens -= 1.0;
+        }
+
+        add_holder(state, pid, 1);
+
+        ticket->state = TICKET_GRANTED;
+        ticket->waited_ms = now - ticket->queued_ms;
+        rc = GATEWAY_LIMIT_GRANTED;
+    }
+
+    unlock_state(ticket->entry);
+
+    return rc;
+}
+
+
+/* wait for the gateway for up to timeout_ms, returns a PLCTAG status */
+int gateway_limit_acquire(struct gateway_limit_s *limit, const char *attrs, int timeout_ms,
+                          struct gateway_limit_ticket_s *ticket)
+{
+    int64_t deadline = abex_time_ms() + timeout_ms;
+    int rc;
+
+    memset(ticket, 0, sizeof(*ticket));
+
+    while((rc = gateway_limit_try(limit, attrs, ticket)) == GATEWAY_LIMIT_WAIT) {
+        if(abex_time_ms() >= deadline) {
+            gateway_limit_cancel(limit, ticket);
+            return PLCTAG_ERR_TIMEOUT;
+        }
+
+        abex_sleep_ms(POLL_INTERVAL_MS);
+    }
+
+    return rc < 0 ? rc : PLCTAG_STATUS_OK;
+}
+
+
+/* leave the queue without sending the request */
+void gateway_limit_cancel(struct gateway_limit_s *limit, struct gateway_limit_ticket_s *ticket)
+{
+    struct gateway_limit_state_s *state;
+    int32_t pid = (int32_t)getpid();
+    uint32_t i;
+
+    if(ticket->state == TICKET_GRANTED) {
+        gateway_limit_release(limit, ticket);
+        return;
+    }
+
+    if(ticket->state == TICKET_QUEUED) {
+        state = ticket->entry->state;
+
+        lock_state(ticket->entry);
+
+        for(i = 0; i < state->waiter_count; i++) {
+            if(state->waiters[i].pid == pid && state->waiters[i].id == ticket->id) {
+                state->waiter_count--;
+                memmove(&state->waiters[i], &state->waiters[i + 1], (state->waiter_count - i) * sizeof(state->waiters[0]));
+                break;
+            }
+        }
+
+        unlock_state(ticket->entry);
+    }
+
+    memset(ticket, 0, sizeof(*ticket));
+}
+
+
+/* the request is done, free its in-flight slot */
+void gateway_limit_release(struct gateway_limit_s *limit, struct gateway_limit_ticket_s *ticket)
+{
+    (void)limit;
+
+    if(ticket->state == TICKET_GRANTED && ticket->entry) {
+        lock_state(ticket->entry);
+        add_holder(ticket->entry->state, (int32_t)getpid(), -1);
+        unlock_state(ticket->entry);
+    }
+
+    ticket->state = TICKET_NONE;
+    ticket->entry = NULL;
+}
+
+
+void gateway_limit_clear(struct gateway_limit_s *limit)
+{
+    while(limit->head) {
+        struct gateway_limit_entry_s *next = limit->head->next;
+
+        free_entry(limit->head);
+        limit->head = next;
+    }
+
+    free(limit->config.dir);
+    limit->config.dir = NULL;
+}
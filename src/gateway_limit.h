@@ -0,0 +1,97 @@
+/***************************************************************************
+ *   Per-gateway request limits: a token bucket (requests per second with  *
+ *   a burst) and a cap on requests in flight, shared by every process     *
+ *   that points at the same --limit-dir.  Waiters are served in the order *
+ *   they arrived, so one busy client cannot starve the others.            *
+ *                                                                         *
+ *   Without a directory the limits only hold within one process.          *
+ ***************************************************************************/
+
+#ifndef __GATEWAY_LIMIT_H__
+#define __GATEWAY_LIMIT_H__
+
+#include <stdint.h>
+
+#define GATEWAY_LIMIT_MAGIC "ABEXLIM"
+#define GATEWAY_LIMIT_VERSION (1)
+
+/* waiters and in-flight holders tracked per gateway */
+#define GATEWAY_LIMIT_SLOTS (64)
+
+/* gateway_limit_try results */
+#define GATEWAY_LIMIT_WAIT (0)
+#define GATEWAY_LIMIT_GRANTED (1)
+
+struct gateway_limit_config_s {
+    /* requests per second, 0 for no rate limit */
+    double rate;
+    int burst;
+
+    /* requests in flight per gateway, 0 for no cap */
+    int max_concurrent;
+
+    /* directory of the shared state files, NULL for this process only */
+    char *dir;
+};
+
+/*
+ * Shared state of one gateway, the whole content of its state file.  All
+ * fields are only touched under the file lock (and the process mutex).
+ */
+struct gateway_limit_state_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t waiter_count;
+
+    double tokens;
+    int64_t refill_ms;
+
+    /* FIFO of waiting requests, the head is served first */
+    struct {
+        int32_t pid;
+        uint32_t id;
+    } waiters[GATEWAY_LIMIT_SLOTS];
+
+    /* requests in flight per process, so a dead process can be cleaned up */
+    struct {
+        int32_t pid;
+        int32_t count;
+    } holders[GATEWAY_LIMIT_SLOTS];
+};
+
+struct gateway_limit_entry_s {
+    struct gateway_limit_entry_s *next;
+    char *gateway;
+    int fd;
+    struct gateway_limit_state_s *state;
+
+    /* the waiter slots were found full, reported once until a waiter fits again */
+    int full;
+};
+
+struct gateway_limit_s {
+    struct gateway_limit_config_s config;
+    struct gateway_limit_entry_s *head;
+    uint32_t next_id;
+};
+
+/* one waiting or granted request */
+struct gateway_limit_ticket_s {
+    struct gateway_limit_entry_s *entry;
+    uint32_t id;
+    int state;
+    int64_t queued_ms;
+    int64_t waited_ms;
+};
+
+extern int gateway_limit_parse_arg(struct gateway_limit_config_s *config, const char *arg);
+extern int gateway_limit_enabled(const struct gateway_limit_s *limit);
+
+extern int gateway_limit_try(struct gateway_limit_s *limit, const char *attrs, struct gateway_limit_ticket_s *ticket);
+extern int gateway_limit_acquire(struct gateway_limit_s *limit, const char *attrs, int timeout_ms,
+                                 struct gateway_limit_ticket_s *ticket);
+extern void gateway_limit_cancel(struct gateway_limit_s *limit, struct gateway_limit_ticket_s *ticket);
+extern void gateway_limit_release(struct gateway_limit_s *limit, struct gateway_limit_ticket_s *ticket);
+extern void gateway_limit_clear(struct gateway_limit_s *limit);
+
+#endif
@@ -32,6 +32,46 @@
  *                   handling of options, fixed includes.                 *
  *                                                                        *
  * 2025-01-XX  Updated for libplctag v2.6.12 API                          *
+ *                                                                        *
+ * 2026-10-16  Added --serve mode for Erlang ports with cached tags.      *
+ *                                                                        *
+ * 2026-10-16  Added --format=binary output of raw tag data.              *
+ *                                                                        *
+ * 2026-10-16  Added batch reads of many tags in one invocation.          *
+ *                                                                        *
+ * 2026-10-16  Added --subscribe mode that only reports changed values.   *
+ *                                                                        *
+ * 2026-10-16  Writes take a list of values or a binary payload, and      *
+ *             --start/--count select a slice of an array.                *
+ *                                                                        *
+ * 2026-10-16  --catalog-dir fills in type and sizes from the tag catalog.*
+ *                                                                        *
+ * 2026-10-16  --members reads a UDT once and decodes its members.        *
+ *                                                                        *
+ * 2026-10-16  Reads convert the whole buffer at once, added bool arrays. *
+ *                                                                        *
+ * 2026-10-16  Per-gateway rate and in-flight limits (--rate-limit etc.). *
+ *                                                                        *
+ * 2026-10-16  Attempt timeouts from per-gateway RTT, read retries and a  *
+ *             total --deadline-ms instead of a fixed 5 s per step.       *
+ *                                                                        *
+ * 2026-10-16  --stats times each phase of a request, --serve keeps       *
+ *             histograms and answers --stats-dump requests.              *
+ *                                                                        *
+ * 2026-10-16  --fragment=N reads a large slice in pieces of N elements   *
+ *             and writes each piece out as soon as it arrives.           *
+ *                                                                        *
+ * 2026-10-16  --max-age-ms answers reads from a recent tag buffer,       *
+ *             --report-age tells how old the data is.                    *
+ *                                                                        *
+ * 2026-10-16  --sample writes timestamped tag buffers to a memory-mapped *
+ *             ring file for high-rate sampling.                          *
+ *                                                                        *
+ * 2026-10-16  --write-queue: write-behind mode, queued writes per tag    *
+ *             with the last value winning, sent concurrently.            *
+ *                                                                        *
+ * 2026-10-16  --broker serves requests from many clients on a Unix       *
+ *             socket; one-shot runs go through it when it is there.      *
  **************************************************************************/
 
 #define POSIX_C_SOURCE 200809L
@@ -43,300 +83,3716 @@
 #include <inttypes.h>
 #include "compat_utils.h"
 #include <libplctag/lib/libplctag.h>
+#include "abex_util.h"
+#include "frame_io.h"
+#include "tag_cache.h"
+#include "tag_catalog.h"
+#include "tag_decode.h"
+#include "gateway_limit.h"
+#include "tag_rtt.h"
+#include "tag_stats.h"
+#include "sample_ring.h"
+#include "broker.h"
+
+#if !defined(_WIN32)
+    #include <signal.h>
+    #include <unistd.h>
+#endif
 
-#define PLC_LIB_UINT8   (0x108)
-#define PLC_LIB_SINT8   (0x208)
-#define PLC_LIB_UINT16  (0x110)
-#define PLC_LIB_SINT16  (0x210)
-#define PLC_LIB_UINT32  (0x120)
-#define PLC_LIB_SINT32  (0x220)
-#define PLC_LIB_UINT64  (0x140)
-#define PLC_LIB_SINT64  (0x240)
-#define PLC_LIB_REAL32  (0x320)
-#define PLC_LIB_REAL64  (0x340)
-
-#define DATA_TIMEOUT 5000
 #define REQUIRED_VERSION 2, 2, 1
 
-static int data_type = 0;
-static char *write_str = NULL;
-static char *path = NULL;
+#define FORMAT_TEXT    (0)
+#define FORMAT_BINARY  (1)
+
+/* --format=binary output is a tag_decode binary block, see tag_decode.h */
+#define BINARY_HEADER_SIZE  TAG_DECODE_BLOCK_HEADER_SIZE
+
+/* longest catalog file name */
+#define CATALOG_FILE_SIZE (1024)
+
+/* longest line accepted in a batch file */
+#define TAG_SPEC_SIZE (1024)
+
+/* how often batch mode polls the status of pending tags */
+#define POLL_INTERVAL_MS (1)
+
+/* --fragment: pieces in flight at once, and the --serve status of every piece but the last */
+#define FRAGMENT_WINDOW (4)
+#define STATUS_MORE (2)
+
+/* subscribe mode defaults */
+#define DEFAULT_INTERVAL_MS (500)
+#define RETRY_MS (5000)
+
+/* UDT member types, see tag_list --udts */
+#define TYPE_IS_STRUCT  (0x8000)
+#define TYPE_UDT_ID     (0x0FFF)
+#define TYPE_BOOL       (0xC1)
+
+/* members Logix adds to hold BOOLs, not shown when listing all members */
+#define HIDDEN_MEMBER_PREFIX "ZZZZZZZZZZ"
+
+/* sample mode default period */
+#define DEFAULT_SAMPLE_MS (20)
+
+/* serve mode: close tags idle for this long, check every SWEEP_INTERVAL_MS */
+#define DEFAULT_IDLE_MS (30000)
+#define SWEEP_INTERVAL_MS (1000)
+
+struct rw_request_s {
+    int data_type;
+    int format;
+    char *write_str;
+    char *path;
+
+    /* batch mode: "<type> <attribute string>" per tag */
+    char **specs;
+    int spec_count;
+    char *batch_file;
+
+    /* --start/--count: only this part of an array tag */
+    int sliced;
+    int start;
+    int count;
+
+    /* --fragment=<n>: read in pieces of n elements, each written out as it comes in */
+    int fragment;
+
+    /* --payload=<n>: raw little-endian element bytes to write */
+    int payload_arg;
+    size_t payload_len;
+
+    /* --catalog-dir: look up missing type and sizes in tag_list's catalog */
+    char *catalog_dir;
+
+    /* --members[=a,b.c]: decode these (or all) members of a UDT tag */
+    int members;
+    char *member_list;
+
+    /* --deadline-ms, --retries, --retry-writes */
+    struct tag_rtt_config_s retry;
+
+    /* --max-age-ms: reads may be answered from a buffer read this recently; --report-age */
+    int max_age_ms;
+    int report_age;
+};
+
+#define RW_REQUEST_INIT {0, FORMAT_TEXT, NULL, NULL, NULL, 0, NULL, 0, 0, 0, 0, 0, 0, NULL, 0, NULL, TAG_RTT_CONFIG_INIT, 0, 0}
+
+int data_type_from_name(const char *name)
+{
+    return tag_decode_type(name);
+}
+
+static void free_request(struct rw_request_s *req)
+{
+    int i;
+
+    for(i = 0; i < req->spec_count; i++) {
+        free(req->specs[i]);
+    }
+
+    if(req->specs) {
+        free(req->specs);
+    }
+
+    if(req->batch_file) {
+        free(req->batch_file);
+    }
+
+    if(req->write_str) {
+        free(req->write_str);
+    }
+
+    if(req->path) {
+        free(req->path);
+    }
+
+    if(req->catalog_dir) {
+        free(req->catalog_dir);
+    }
+
+    if(req->member_list) {
+        free(req->member_list);
+    }
+
+    memset(req, 0, sizeof(*req));
+}
+
+static int add_spec(struct rw_request_s *req, const char *spec)
+{
+    char **specs = realloc(req->specs, sizeof(char *) * (size_t)(req->spec_count + 1));
+
+    if(!specs) {
+        return 1;
+    }
+
+    req->specs = specs;
+    req->specs[req->spec_count] = compat_strdup(spec);
+    if(!req->specs[req->spec_count]) {
+        return 1;
+    }
+
+    req->spec_count++;
+
+    return 0;
+}
+
+
+/*
+ * Read batch specs, one per line, from a file or "-" for stdin.  Blank
+ * lines and lines starting with # are skipped.
+ */
+static int load_batch_file(struct rw_request_s *req, struct abex_buf_s *out)
+{
+    FILE *file = stdin;
+    char line[TAG_SPEC_SIZE];
+    int rc = 0;
+
+    if(strcmp(req->batch_file, "-")) {
+        file = fopen(req->batch_file, "r");
+        if(!file) {
+            abex_buf_printf(out, "ERROR: unable to open batch file %s\n", req->batch_file);
+            return 1;
+        }
+    }
+
+    while(fgets(line, sizeof(line), file)) {
+        size_t len = strlen(line);
+
+        while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r' || line[len-1] == ' ')) {
+            line[--len] = 0;
+        }
+
+        if(len == 0 || line[0] == '#') {
+            continue;
+        }
 
-void parse_args(int argc, char **argv)
+        if(add_spec(req, line)) {
+            abex_buf_printf(out, "ERROR: unable to allocate memory for batch spec!\n");
+            rc = 1;
+            break;
+        }
+    }
+
+    if(file != stdin) {
+        fclose(file);
+    }
+
+    return rc;
+}
+
+int parse_args(int argc, char **argv, struct rw_request_s *req, struct abex_buf_s *out)
 {
     int i = 1;
+    int rc;
 
     while(i < argc) {
         if(!strcmp(argv[i],"-t")) {
             i++; /* get the arg next */
             if(i < argc) {
-                if(!compat_strcasecmp("uint8",argv[i])) {
-                    data_type = PLC_LIB_UINT8;
-                } else if(!compat_strcasecmp("sint8",argv[i])) {
-                    data_type = PLC_LIB_SINT8;
-                } else if(!compat_strcasecmp("uint16",argv[i])) {
-                    data_type = PLC_LIB_UINT16;
-                } else if(!compat_strcasecmp("sint16",argv[i])) {
-                    data_type = PLC_LIB_SINT16;
-                } else if(!compat_strcasecmp("uint32",argv[i])) {
-                    data_type = PLC_LIB_UINT32;
-                } else if(!compat_strcasecmp("sint32",argv[i])) {
-                    data_type = PLC_LIB_SINT32;
-                } else if(!compat_strcasecmp("uint64",argv[i])) {
-                    data_type = PLC_LIB_UINT64;
-                } else if(!compat_strcasecmp("sint64",argv[i])) {
-                    data_type = PLC_LIB_SINT64;
-                } else if(!compat_strcasecmp("real32",argv[i])) {
-                    data_type = PLC_LIB_REAL32;
-                } else if(!compat_strcasecmp("real64",argv[i])) {
-                    data_type = PLC_LIB_REAL64;
-                } else {
-                    fprintf(stderr, "ERROR: unknown data type: %s\n",argv[i]);
-                    exit(1);
+                req->data_type = data_type_from_name(argv[i]);
+                if(!req->data_type) {
+                    abex_buf_printf(out, "ERROR: unknown data type: %s\n",argv[i]);
+                    return 1;
                 }
             } else {
-                fprintf(stderr, "ERROR: you must have a value after -t\n");
-                exit(1);
+                abex_buf_printf(out, "ERROR: you must have a value after -t\n");
+                return 1;
             }
         } else if(!strcmp(argv[i],"-w")) {
             i++;
             if(i < argc) {
-                write_str = compat_strdup(argv[i]);
+                req->write_str = compat_strdup(argv[i]);
             } else {
-                fprintf(stderr, "ERROR: you must have a value to write after -w\n");
-                exit(1);
+                abex_buf_printf(out, "ERROR: you must have a value to write after -w\n");
+                return 1;
+            }
+        } else if(!strncmp(argv[i],"--format=",strlen("--format="))) {
+            const char *format = argv[i] + strlen("--format=");
+
+            if(!compat_strcasecmp("text",format)) {
+                req->format = FORMAT_TEXT;
+            } else if(!compat_strcasecmp("binary",format)) {
+                req->format = FORMAT_BINARY;
+            } else {
+                abex_buf_printf(out, "ERROR: unknown output format: %s\n",format);
+                return 1;
             }
         } else if(!strcmp(argv[i],"-p")) {
             i++;
             if(i < argc) {
-                path = compat_strdup(argv[i]);
+                req->path = compat_strdup(argv[i]);
             } else {
-                fprintf(stderr, "ERROR: you must have a tag string after -p\n");
-                exit(1);
+                abex_buf_printf(out, "ERROR: you must have a tag string after -p\n");
+                return 1;
             }
+        } else if(!strcmp(argv[i],"-s")) {
+            i++;
+            if(i < argc) {
+                if(add_spec(req, argv[i])) {
+                    abex_buf_printf(out, "ERROR: unable to allocate memory for batch spec!\n");
+                    return 1;
+                }
+            } else {
+                abex_buf_printf(out, "ERROR: you must have a tag spec after -s\n");
+                return 1;
+            }
+        } else if(!strncmp(argv[i],"--batch=",strlen("--batch="))) {
+            req->batch_file = compat_strdup(argv[i] + strlen("--batch="));
+        } else if(!strncmp(argv[i],"--start=",strlen("--start="))) {
+            req->sliced = 1;
+            req->start = atoi(argv[i] + strlen("--start="));
+            if(req->start < 0) {
+                abex_buf_printf(out, "ERROR: --start must not be negative\n");
+                return 1;
+            }
+        } else if(!strncmp(argv[i],"--count=",strlen("--count="))) {
+            req->sliced = 1;
+            req->count = atoi(argv[i] + strlen("--count="));
+            if(req->count <= 0) {
+                abex_buf_printf(out, "ERROR: --count must be greater than zero\n");
+                return 1;
+            }
+        } else if(!strncmp(argv[i],"--fragment=",strlen("--fragment="))) {
+            req->sliced = 1;
+            req->fragment = atoi(argv[i] + strlen("--fragment="));
+            if(req->fragment <= 0) {
+                abex_buf_printf(out, "ERROR: --fragment must be greater than zero\n");
+                return 1;
+            }
+        } else if(!strncmp(argv[i],"--max-age-ms=",strlen("--max-age-ms="))) {
+            req->max_age_ms = atoi(argv[i] + strlen("--max-age-ms="));
+            if(req->max_age_ms < 0) {
+                abex_buf_printf(out, "ERROR: --max-age-ms must not be negative\n");
+                return 1;
+            }
+        } else if(!strcmp(argv[i],"--report-age")) {
+            req->report_age = 1;
+        } else if(!strncmp(argv[i],"--catalog-dir=",strlen("--catalog-dir="))) {
+            req->catalog_dir = compat_strdup(argv[i] + strlen("--catalog-dir="));
+        } else if(!strcmp(argv[i],"--members")) {
+            req->members = 1;
+        } else if(!strncmp(argv[i],"--members=",strlen("--members="))) {
+            req->members = 1;
+            req->member_list = compat_strdup(argv[i] + strlen("--members="));
+        } else if(!strncmp(argv[i],"--payload=",strlen("--payload="))) {
+            req->payload_arg = i;
+            req->payload_len = (size_t)strtoul(argv[i] + strlen("--payload="), NULL, 10);
+        } else if((rc = tag_rtt_parse_arg(&req->retry, argv[i])) < 0) {
+            abex_buf_printf(out, "ERROR: bad retry option: %s\n", argv[i]);
+            return 1;
         }
 
         i++;
     }
+
+    return 0;
 }
 
 
-int main(int argc, char **argv)
+/*
+ * Convert a list of write values ("1,2,3", "1 2 3", quoted strings) to
+ * little-endian element bytes in data, the same layout --format=binary
+ * reads return.
+ */
+static int encode_values(int data_type, const char *values, struct abex_buf_s *data, struct abex_buf_s *out)
 {
-    int32_t tag = 0;
-    int is_write = 0;
-    uint64_t u_val;
-    int64_t i_val;
-    double f_val;
-    int i;
-    int rc;
+    const char *bad;
+    int rc = tag_decode_values(data_type, values, data, &bad);
 
-    /* check library version */
-    if(plc_tag_check_lib_version(REQUIRED_VERSION) != PLCTAG_STATUS_OK) {
-        fprintf(stderr, "ERROR: Required library version %d.%d.%d not available!\n", REQUIRED_VERSION);
-        exit(1);
+    if(rc < 0) {
+        abex_buf_printf(out, "ERROR: unable to allocate memory for write values!\n");
+        return 1;
     }
 
-    parse_args(argc, argv);
+    if(rc && bad) {
+        abex_buf_printf(out, "ERROR: bad format for write value: %s\n", bad);
+        return 1;
+    }
 
-    /* check arguments */
-    if(!path || !data_type) {
-        fprintf(stderr, "ERROR: Missing required arguments -p (path) or -t (type)\n");
-        exit(1);
+    if(rc) {
+        abex_buf_printf(out, "ERROR: bad data type!\n");
+        return 1;
     }
 
-    /* convert any write values */
-    if(write_str && strlen(write_str)) {
-        is_write = 1;
+    if(data->len == 0) {
+        abex_buf_printf(out, "ERROR: no values to write\n");
+        return 1;
+    }
 
-        switch(data_type) {
-        case PLC_LIB_UINT8:
-        case PLC_LIB_UINT16:
-        case PLC_LIB_UINT32:
-        case PLC_LIB_UINT64:
-            if(compat_sscanf(write_str,"%" SCNu64,&u_val) != 1) {
-                fprintf(stderr, "ERROR: bad format for unsigned integer for write value.\n");
-                exit(1);
-            }
-            break;
+    return 0;
+}
 
-        case PLC_LIB_SINT8:
-        case PLC_LIB_SINT16:
-        case PLC_LIB_SINT32:
-        case PLC_LIB_SINT64:
-            if(compat_sscanf(write_str,"%" SCNd64,&i_val) != 1) {
-                fprintf(stderr, "ERROR: bad format for signed integer for write value.\n");
-                exit(1);
-            }
-            break;
 
-        case PLC_LIB_REAL32:
-        case PLC_LIB_REAL64:
-            if(compat_sscanf(write_str,"%lf",&f_val) != 1) {
-                fprintf(stderr, "ERROR: bad format for floating point for write value.\n");
-                exit(1);
+/*
+ * Rewrite a tag attribute string to address count elements of an array
+ * starting at start: name=Arr becomes name=Arr[start] and elem_count is
+ * replaced.  A count of 0 keeps the elem_count already in the string.
+ */
+static int slice_attrs(const char *attrs, int start, int count, struct abex_buf_s *sliced, struct abex_buf_s *out)
+{
+    const char *p = attrs;
+    int have_name = 0;
+    int have_count = 0;
+
+    while(*p) {
+        const char *amp = strchr(p, '&');
+        size_t len = amp ? (size_t)(amp - p) : strlen(p);
+
+        if(sliced->len > 0) {
+            abex_buf_append(sliced, "&", 1);
+        }
+
+        if(!strncmp(p, "name=", strlen("name="))) {
+            if(p[len-1] == ']') {
+                abex_buf_printf(out, "ERROR: --start needs a tag name without an index\n");
+                return 1;
             }
-            break;
 
-        default:
-            fprintf(stderr, "ERROR: bad data type!\n");
-            exit(1);
-            break;
+            abex_buf_append(sliced, p, len);
+            abex_buf_printf(sliced, "[%d]", start);
+            have_name = 1;
+        } else if(!strncmp(p, "elem_count=", strlen("elem_count=")) && count > 0) {
+            abex_buf_printf(sliced, "elem_count=%d", count);
+            have_count = 1;
+        } else {
+            abex_buf_append(sliced, p, len);
+        }
+
+        p += len;
+        if(*p) {
+            p++;
         }
-    } else {
-        is_write = 0;
     }
 
-    /* create the tag */
-    tag = plc_tag_create(path, DATA_TIMEOUT);
-    if(tag < 0) {
-        fprintf(stderr, "ERROR %s: error creating tag!\n", plc_tag_decode_error(tag));
-        if(path) free(path);
-        if(write_str) free(write_str);
-        exit(1);
+    if(!have_name) {
+        abex_buf_printf(out, "ERROR: --start needs a name= in the tag string\n");
+        return 1;
     }
 
-    if((rc = plc_tag_status(tag)) != PLCTAG_STATUS_OK) {
-        fprintf(stderr, "ERROR: tag creation error, tag status: %s\n",plc_tag_decode_error(rc));
-        plc_tag_destroy(tag);
-        if(path) free(path);
-        if(write_str) free(write_str);
-        exit(1);
+    if(!have_count && count > 0) {
+        abex_buf_printf(sliced, "&elem_count=%d", count);
     }
 
-    do {
-        if(!is_write) {
-            int index = 0;
+    return 0;
+}
 
-            rc = plc_tag_read(tag, DATA_TIMEOUT);
-            if(rc != PLCTAG_STATUS_OK) {
-                fprintf(stderr, "ERROR: tag read error, tag status: %s\n",plc_tag_decode_error(rc));
-                exit(1);
-            }
 
-            /* display the data */
-            for(i=0; index < plc_tag_get_size(tag); i++) {
-                switch(data_type) {
-                case PLC_LIB_UINT8:
-                    printf("%u ", plc_tag_get_uint8(tag,index));
-                    index += 1;
-                    break;
-
-                case PLC_LIB_UINT16:
-                    printf("%u ", plc_tag_get_uint16(tag,index));
-                    index += 2;
-                    break;
-
-                case PLC_LIB_UINT32:
-                    printf("%u ", plc_tag_get_uint32(tag,index));
-                    index += 4;
-                    break;
-
-                case PLC_LIB_UINT64:
-                    printf("%" PRIu64 " ", plc_tag_get_uint64(tag,index));
-                    index += 8;
-                    break;
-
-                case PLC_LIB_SINT8:
-                    printf("%d ", plc_tag_get_int8(tag,index));
-                    index += 1;
-                    break;
-
-                case PLC_LIB_SINT16:
-                    printf("%d ", plc_tag_get_int16(tag,index));
-                    index += 2;
-                    break;
-
-                case PLC_LIB_SINT32:
-                    printf("%d ", plc_tag_get_int32(tag,index));
-                    index += 4;
-                    break;
-
-                case PLC_LIB_SINT64:
-                    printf("%" PRId64 " ", plc_tag_get_int64(tag,index));
-                    index += 8;
-                    break;
-
-                case PLC_LIB_REAL32:
-                    printf("%f ", plc_tag_get_float32(tag,index));
-                    index += 4;
-                    break;
-
-                case PLC_LIB_REAL64:
-                    printf("%lf ", plc_tag_get_float64(tag,index));
-                    index += 8;
-                    break;
-                }
-            }
+/*
+ * A single value for a tag of several elements only writes the first one:
+ * the attribute string with elem_count=1, so the rest of the array is not
+ * written back from a stale buffer.  Returns 0 when the tag has one element
+ * and attrs applies as it is.
+ */
+static int single_element_attrs(const char *attrs, struct abex_buf_s *single)
+{
+    const char *p = attrs;
+    char value[32];
+
+    if(abex_attr_value(attrs, "elem_count", value, sizeof(value)) || atoi(value) <= 1) {
+        return 0;
+    }
+
+    while(*p) {
+        const char *amp = strchr(p, '&');
+        size_t len = amp ? (size_t)(amp - p) : strlen(p);
+
+        if(single->len > 0) {
+            abex_buf_append(single, "&", 1);
+        }
+
+        if(!strncmp(p, "elem_count=", strlen("elem_count="))) {
+            abex_buf_printf(single, "elem_count=1");
         } else {
-            switch(data_type) {
-            case PLC_LIB_UINT8:
-                rc = plc_tag_set_uint8(tag,0,(uint8_t)u_val);
-                break;
+            abex_buf_append(single, p, len);
+        }
 
-            case PLC_LIB_UINT16:
-                rc = plc_tag_set_uint16(tag,0, (uint16_t)u_val);
-                break;
+        p += len;
+        if(*p) {
+            p++;
+        }
+    }
 
-            case PLC_LIB_UINT32:
-                rc = plc_tag_set_uint32(tag,0,(uint32_t)u_val);
-                break;
+    return 1;
+}
 
-            case PLC_LIB_UINT64:
-                rc = plc_tag_set_uint64(tag,0,(uint64_t)u_val);
-                break;
+/*
+ * Copy the whole tag buffer out in one call, instead of one locked and
+ * bounds-checked accessor call per element.  The copy is kept between
+ * requests.  A BIT is the one byte 0 or 1: libplctag knows which bit of
+ * the buffer the tag name picked.
+ */
+static int copy_tag_data(int32_t tag, int data_type, const uint8_t **data, size_t *size)
+{
+    static struct abex_buf_s scratch = {NULL, 0, 0};
+    static uint8_t bit;
+    int tag_size = plc_tag_get_size(tag);
+    int rc;
 
-            case PLC_LIB_SINT8:
-                rc = plc_tag_set_int8(tag,0,(int8_t)i_val);
-                break;
+    if(tag_size < 0) {
+        return tag_size;
+    }
 
-            case PLC_LIB_SINT16:
-                rc = plc_tag_set_int16(tag,0,(int16_t)i_val);
-                break;
+    if(data_type == PLC_LIB_BIT) {
+        rc = plc_tag_get_bit(tag, 0);
+        if(rc < 0) {
+            return rc;
+        }
 
-            case PLC_LIB_SINT32:
-                rc = plc_tag_set_int32(tag,0,(int32_t)i_val);
-                break;
+        bit = (uint8_t)rc;
+        *data = &bit;
+        *size = 1;
 
-            case PLC_LIB_SINT64:
-                rc = plc_tag_set_int64(tag,0,(int64_t)i_val);
-                break;
+        return PLCTAG_STATUS_OK;
+    }
 
-            case PLC_LIB_REAL32:
-                rc = plc_tag_set_float32(tag,0,(float)f_val);
-                break;
+    abex_buf_reset(&scratch);
+    if(abex_buf_reserve(&scratch, (size_t)tag_size)) {
+        return PLCTAG_ERR_NO_MEM;
+    }
 
-            case PLC_LIB_REAL64:
-                rc = plc_tag_set_float64(tag,0,f_val);
-                break;
-            }
+    rc = plc_tag_get_raw_bytes(tag, 0, (uint8_t *)scratch.data, tag_size);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
 
-            if(rc != PLCTAG_STATUS_OK) {
-                fprintf(stderr, "ERROR: error setting data: %s!\n",plc_tag_decode_error(rc));
-                break;
-            }
+    *data = (const uint8_t *)scratch.data;
+    *size = (size_t)tag_size;
 
-            /* write the data */
-            rc = plc_tag_write(tag, DATA_TIMEOUT);
-            if(rc != PLCTAG_STATUS_OK) {
-                fprintf(stderr, "ERROR: error writing data: %s!\n",plc_tag_decode_error(rc));
-            } else {
-                printf("%s ",write_str);
-            }
-        }
-    } while(0);
+    return PLCTAG_STATUS_OK;
+}
 
-    if(write_str) {
-        free(write_str);
+
+/* put write data in the tag buffer, a BIT through libplctag's read-modify-write of the one bit */
+static int set_tag_data(int32_t tag, int data_type, const uint8_t *data, size_t len)
+{
+    if(data_type == PLC_LIB_BIT) {
+        return plc_tag_set_bit(tag, 0, data[0]);
     }
 
-    if(path) {
-        free(path);
+    return plc_tag_set_raw_bytes(tag, 0, (uint8_t *)data, (int)len);
+}
+
+
+/* longest wait for a gateway limit during the current request, see --report-wait */
+static int64_t request_waited_ms = 0;
+
+/* round trip times per gateway, kept for the life of the process */
+static struct tag_rtt_table_s rtt_table = {NULL};
+
+/* --stats: phase timings of every request, see tag_stats.h */
+static struct tag_stats_s stats;
+
+/*
+ * Where --fragment reads send each finished piece of their output before
+ * going on with an empty buffer.  Without one, the pieces pile up in out.
+ */
+static void (*partial_sink)(struct abex_buf_s *out) = NULL;
+
+/* --broker: answers are queued on the client and sent as its socket takes them */
+static struct broker_s *serve_broker = NULL;
+
+/* time left until deadline, at least 1 ms as 0 means "do not wait" to libplctag */
+static int time_left(int64_t deadline)
+{
+    int64_t left = deadline - abex_time_ms();
+
+    return left > 0 ? (int)left : 1;
+}
+
+static void note_limit_wait(const struct gateway_limit_ticket_s *ticket)
+{
+    if(ticket->waited_ms > request_waited_ms) {
+        request_waited_ms = ticket->waited_ms;
     }
+}
 
-    if(tag) {
-        plc_tag_destroy(tag);
+/*
+ * Block until the gateway limits let a request go, giving up at the
+ * request deadline.
+ */
+static int wait_for_limit(struct gateway_limit_s *limit, const char *attrs, int64_t deadline,
+                          struct gateway_limit_ticket_s *ticket, struct abex_buf_s *out)
+{
+    int64_t start_us = abex_time_us();
+    int rc = gateway_limit_acquire(limit, attrs, time_left(deadline), ticket);
+
+    tag_stats_since(&stats, TAG_STATS_LIMIT_WAIT, start_us);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        abex_buf_printf(out, "ERROR %s: no turn within the gateway request limit\n", plc_tag_decode_error(rc));
+        return 1;
     }
 
+    note_limit_wait(ticket);
+
     return 0;
 }
+
+
+/*
+ * Append the tag buffer to out in the --format=binary layout.  BOOL
+ * arrays are unpacked to one uint8 0 or 1 per bit.
+ */
+int append_binary(int32_t tag, int data_type, struct abex_buf_s *out)
+{
+    const uint8_t *data;
+    size_t size;
+    int rc;
+
+    rc = copy_tag_data(tag, data_type, &data, &size);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    if(tag_decode_block(data_type, data, size, out)) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * Append the tag buffer to out as text, one value per element followed by
+ * a space.
+ */
+int append_text(int32_t tag, int data_type, struct abex_buf_s *out)
+{
+    const uint8_t *data;
+    size_t size;
+    int rc;
+
+    rc = copy_tag_data(tag, data_type, &data, &size);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    if(tag_decode_text(data_type, data, tag_decode_count(data_type, size), out)) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/* floating point value of one element, used for deadband checks */
+static double get_real(int data_type, const uint8_t *p)
+{
+    if(data_type == PLC_LIB_REAL32) {
+        uint32_t bits = get_le32(p);
+        float val;
+
+        memcpy(&val, &bits, sizeof(val));
+
+        return (double)val;
+    } else {
+        uint64_t bits = get_le64(p);
+        double val;
+
+        memcpy(&val, &bits, sizeof(val));
+
+        return val;
+    }
+}
+
+/* copy attrs to resolved with elem_size and elem_count set, unless they are given */
+static void fill_size_attrs(const char *attrs, uint32_t elem_size, uint32_t elem_count, struct abex_buf_s *resolved)
+{
+    int have_size = 0;
+    int have_count = 0;
+    const char *p = attrs;
+
+    while(*p) {
+        const char *amp = strchr(p, '&');
+        size_t len = amp ? (size_t)(amp - p) : strlen(p);
+
+        if(resolved->len > 0) {
+            abex_buf_append(resolved, "&", 1);
+        }
+
+        if(len == strlen("elem_size=") && !strncmp(p, "elem_size=", len)) {
+            abex_buf_printf(resolved, "elem_size=%u", (unsigned)elem_size);
+            have_size = 1;
+        } else if(len == strlen("elem_count=") && !strncmp(p, "elem_count=", len)) {
+            abex_buf_printf(resolved, "elem_count=%u", (unsigned)elem_count);
+            have_count = 1;
+        } else {
+            if(!strncmp(p, "elem_size=", strlen("elem_size="))) {
+                have_size = 1;
+            } else if(!strncmp(p, "elem_count=", strlen("elem_count="))) {
+                have_count = 1;
+            }
+
+            abex_buf_append(resolved, p, len);
+        }
+
+        p += len;
+        if(*p) {
+            p++;
+        }
+    }
+
+    if(!have_size) {
+        abex_buf_printf(resolved, "&elem_size=%u", (unsigned)elem_size);
+    }
+
+    if(!have_count) {
+        abex_buf_printf(resolved, "&elem_count=%u", (unsigned)elem_count);
+    }
+}
+
+
+/*
+ * Fill in what the caller left out from the tag catalog written by
+ * tag_list --catalog-dir: the data type if *data_type is 0, and elem_size
+ * and elem_count when they are missing or empty in attrs.  The completed
+ * attribute string goes to resolved.
+ */
+static int resolve_from_catalog(const char *catalog_dir, const char *attrs, int *data_type,
+                                struct abex_buf_s *resolved, struct abex_buf_s *out)
+{
+    struct tag_catalog_s cat;
+    const struct tag_catalog_entry_s *entry;
+    char file[CATALOG_FILE_SIZE];
+    char name[TAG_SPEC_SIZE];
+    char *index;
+    uint32_t elem_size;
+    uint32_t elem_count;
+
+    if(abex_attr_value(attrs, "name", name, sizeof(name))) {
+        abex_buf_printf(out, "ERROR: no tag name in the tag string\n");
+        return 1;
+    }
+
+    if(tag_catalog_file_for_attrs(file, sizeof(file), catalog_dir, attrs) || tag_catalog_open(&cat, file)) {
+        abex_buf_printf(out, "ERROR: no tag catalog for this gateway in %s, run tag_list --catalog-dir first\n", catalog_dir);
+        return 1;
+    }
+
+    /* Arr[3] is one element of Arr */
+    index = strchr(name, '[');
+    if(index) {
+        *index = 0;
+    }
+
+    entry = tag_catalog_find(&cat, name);
+    if(!entry) {
+        abex_buf_printf(out, "ERROR: %s is not in the tag catalog\n", name);
+        tag_catalog_close(&cat);
+        return 1;
+    }
+
+    if(!*data_type) {
+        *data_type = tag_catalog_data_type(entry->tag_type);
+        if(!*data_type) {
+            abex_buf_printf(out, "ERROR: %s does not have an atomic type, a data type must be given\n", name);
+            tag_catalog_close(&cat);
+            return 1;
+        }
+    }
+
+    elem_size = entry->elem_length;
+    elem_count = index ? 1 : tag_catalog_elem_count(entry);
+
+    tag_catalog_close(&cat);
+
+    fill_size_attrs(attrs, elem_size, elem_count, resolved);
+
+    return 0;
+}
+
+
+/*
+ * Find a member by its dotted path inside a UDT, e.g. Inner.Small or
+ * Axis[2].Pos.  Sets the byte offset of the member (of the indexed
+ * element for a UDT array) and the index given on the last part, -1 if
+ * none.  Returns NULL if the path does not name a member.
+ */
+static const struct tag_catalog_entry_s *find_member_path(const struct tag_catalog_s *cat,
+                                                          const struct tag_catalog_entry_s *udt, const char *path,
+                                                          uint32_t *offset, int *index)
+{
+    const struct tag_catalog_entry_s *member;
+
+    *offset = 0;
+
+    for(;;) {
+        size_t len = strcspn(path, ".[");
+
+        member = tag_catalog_find_member(cat, udt, path, len);
+        if(!member) {
+            return NULL;
+        }
+
+        *offset += member->instance_id;
+        *index = -1;
+        path += len;
+
+        if(*path == '[') {
+            char *end;
+            long i = strtol(path + 1, &end, 10);
+
+            if(*end != ']' || i < 0 || (uint32_t)i >= (member->dims[0] ? member->dims[0] : 1)) {
+                return NULL;
+            }
+
+            *index = (int)i;
+            path = end + 1;
+        }
+
+        if(!*path) {
+            return member;
+        }
+
+        if(*path != '.' || !(member->tag_type & TYPE_IS_STRUCT)) {
+            return NULL;
+        }
+
+        udt = tag_catalog_find_udt(cat, member->tag_type & TYPE_UDT_ID);
+        if(!udt) {
+            return NULL;
+        }
+
+        if(*index > 0) {
+            *offset += (uint32_t)*index * udt->dims[0];
+        }
+
+        path++;
+    }
+}
+
+static int append_udt_members(const struct tag_catalog_s *cat, const struct tag_catalog_entry_s *udt,
+                              const char *prefix, const uint8_t *data, size_t size, uint32_t offset, int format,
+                              struct abex_buf_s *out, struct abex_buf_s *errors);
+
+/*
+ * Decode one member at offset in the UDT data.  Text is "<name> <values>"
+ * per line; binary is a uint16 name length, the name and a binary block.
+ * A BOOL member comes out as one uint8 0 or 1.  UDT members are expanded
+ * into their own members.  Problems are reported in errors.
+ */
+static int append_member(const struct tag_catalog_s *cat, const struct tag_catalog_entry_s *member, const char *name,
+                         const uint8_t *data, size_t size, uint32_t offset, int index, int format,
+                         struct abex_buf_s *out, struct abex_buf_s *errors)
+{
+    uint32_t count = (index < 0 && member->dims[0]) ? member->dims[0] : 1;
+    uint8_t bool_value;
+    const uint8_t *values;
+    int data_type;
+    uint32_t elem_size;
+    uint32_t i;
+
+    if(member->tag_type & TYPE_IS_STRUCT) {
+        const struct tag_catalog_entry_s *udt = tag_catalog_find_udt(cat, member->tag_type & TYPE_UDT_ID);
+        char prefix[TAG_SPEC_SIZE];
+
+        if(!udt) {
+            abex_buf_printf(errors, "ERROR: no template for %s in the tag catalog, run tag_list --udts\n", name);
+            return 1;
+        }
+
+        for(i = 0; i < count; i++) {
+            uint32_t element = index < 0 ? i : (uint32_t)index;
+
+            if(index < 0 && member->dims[0]) {
+                compat_snprintf(prefix, sizeof(prefix), "%s[%u]", name, (unsigned)element);
+            } else {
+                compat_snprintf(prefix, sizeof(prefix), "%s", name);
+            }
+
+            if(append_udt_members(cat, udt, prefix, data, size, offset + element * udt->dims[0], format, out,
+                                  errors)) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    if((member->tag_type & 0xFF) == TYPE_BOOL) {
+        if(offset >= size) {
+            abex_buf_printf(errors, "ERROR: member %s is outside the tag data\n", name);
+            return 1;
+        }
+
+        bool_value = (uint8_t)((data[offset] >> member->dims[1]) & 1);
+        values = &bool_value;
+        data_type = PLC_LIB_UINT8;
+        count = 1;
+    } else {
+        data_type = tag_catalog_data_type(member->tag_type);
+        if(!data_type) {
+            abex_buf_printf(errors, "ERROR: member %s has an unsupported type %x\n", name, (unsigned)member->tag_type);
+            return 1;
+        }
+
+        elem_size = tag_decode_size(data_type);
+        if(index > 0) {
+            offset += (uint32_t)index * elem_size;
+        }
+
+        if((uint64_t)offset + (uint64_t)count * elem_size > size) {
+            abex_buf_printf(errors, "ERROR: member %s is outside the tag data\n", name);
+            return 1;
+        }
+
+        values = data + offset;
+    }
+
+    if(format == FORMAT_BINARY) {
+        uint8_t header[BINARY_HEADER_SIZE];
+        uint8_t name_len[2];
+        uint32_t data_len = tag_decode_block_header(header, data_type, count);
+
+        put_le16(name_len, (uint16_t)strlen(name));
+        abex_buf_append(out, name_len, sizeof(name_len));
+        abex_buf_append(out, name, strlen(name));
+        abex_buf_append(out, header, sizeof(header));
+        abex_buf_append(out, values, data_len);
+
+        return 0;
+    }
+
+    /* the values come with a space after each, the last one makes way for the newline. */
+    abex_buf_printf(out, "%s ", name);
+    if(tag_decode_text(data_type, values, count, out)) {
+        abex_buf_printf(errors, "ERROR: unable to allocate memory for member %s\n", name);
+        return 1;
+    }
+    out->data[out->len - 1] = '\n';
+
+    return 0;
+}
+
+/* every member of a UDT, nested UDTs expanded, named <prefix>.<member> */
+static int append_udt_members(const struct tag_catalog_s *cat, const struct tag_catalog_entry_s *udt,
+                              const char *prefix, const uint8_t *data, size_t size, uint32_t offset, int format,
+                              struct abex_buf_s *out, struct abex_buf_s *errors)
+{
+    const struct tag_catalog_entry_s *end = cat->entries + cat->header->entry_count;
+    const struct tag_catalog_entry_s *member;
+    char name[TAG_SPEC_SIZE];
+
+    for(member = udt + 1; member < end && member->kind == TAG_CATALOG_UDT_MEMBER; member++) {
+        const char *member_name = tag_catalog_name(cat, member);
+
+        if(!strncmp(member_name, HIDDEN_MEMBER_PREFIX, strlen(HIDDEN_MEMBER_PREFIX))) {
+            continue;
+        }
+
+        if(*prefix) {
+            compat_snprintf(name, sizeof(name), "%s.%s", prefix, member_name);
+        } else {
+            compat_snprintf(name, sizeof(name), "%s", member_name);
+        }
+
+        if(append_member(cat, member, name, data, size, offset + member->instance_id, -1, format, out, errors)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * --members: read a UDT tag in one request and decode its members using
+ * the templates in the tag catalog (tag_list --catalog-dir --udts).  With
+ * no list, every member is decoded.
+ */
+static int run_udt_read(struct tag_cache_s *cache, struct gateway_limit_s *limit, struct rw_request_s *req,
+                        struct abex_buf_s *out)
+{
+    struct gateway_limit_ticket_s ticket;
+    struct tag_catalog_s cat;
+    const struct tag_catalog_entry_s *entry;
+    const struct tag_catalog_entry_s *udt;
+    struct abex_buf_s resolved = {NULL, 0, 0};
+    struct abex_buf_s data = {NULL, 0, 0};
+    struct abex_buf_s values = {NULL, 0, 0};
+    struct tag_rtt_s *rtt;
+    int64_t deadline = abex_time_ms() + req->retry.deadline_ms;
+    int64_t start_us;
+    char file[CATALOG_FILE_SIZE];
+    char name[TAG_SPEC_SIZE];
+    char *index;
+    int32_t tag;
+    int size;
+    int rc = 1;
+
+    if(!req->path || !req->catalog_dir) {
+        abex_buf_printf(out, "ERROR: --members needs -p (path) and --catalog-dir\n");
+        return 1;
+    }
+
+    if(abex_attr_value(req->path, "name", name, sizeof(name))) {
+        abex_buf_printf(out, "ERROR: no tag name in the tag string\n");
+        return 1;
+    }
+
+    if(tag_catalog_file_for_attrs(file, sizeof(file), req->catalog_dir, req->path) || tag_catalog_open(&cat, file)) {
+        abex_buf_printf(out, "ERROR: no tag catalog for this gateway in %s, run tag_list --catalog-dir first\n",
+                        req->catalog_dir);
+        return 1;
+    }
+
+    index = strchr(name, '[');
+    if(index) {
+        *index = 0;
+    }
+
+    entry = tag_catalog_find(&cat, name);
+    if(!entry) {
+        abex_buf_printf(out, "ERROR: %s is not in the tag catalog\n", name);
+        tag_catalog_close(&cat);
+        return 1;
+    }
+
+    udt = (entry->tag_type & TYPE_IS_STRUCT) ? tag_catalog_find_udt(&cat, entry->tag_type & TYPE_UDT_ID) : NULL;
+    if(!udt) {
+        abex_buf_printf(out, "ERROR: %s is not a UDT with a template in the tag catalog, run tag_list --udts\n", name);
+        tag_catalog_close(&cat);
+        return 1;
+    }
+
+    /* one element of the UDT, all members come from the same read. */
+    fill_size_attrs(req->path, entry->elem_length, 1, &resolved);
+
+    if(wait_for_limit(limit, resolved.data, deadline, &ticket, out)) {
+        abex_buf_free(&resolved);
+        tag_catalog_close(&cat);
+        return 1;
+    }
+
+    rtt = tag_rtt_for(&rtt_table, resolved.data);
+    start_us = abex_time_us();
+    tag = tag_cache_get(cache, resolved.data, time_left(deadline));
+    tag_stats_since(&stats, TAG_STATS_CREATE, start_us);
+    abex_buf_free(&resolved);
+    if(tag < 0) {
+        abex_buf_printf(out, "ERROR %s: error creating tag!\n", plc_tag_decode_error(tag));
+        gateway_limit_release(limit, &ticket);
+        tag_catalog_close(&cat);
+        return 1;
+    }
+
+    do {
+        if((rc = plc_tag_status(tag)) != PLCTAG_STATUS_OK) {
+            abex_buf_printf(out, "ERROR: tag creation error, tag status: %s\n",plc_tag_decode_error(rc));
+            break;
+        }
+
+        start_us = abex_time_us();
+        rc = tag_rtt_request(rtt, tag, 0, tag_rtt_retries(&req->retry, 0), deadline);
+        tag_stats_since(&stats, TAG_STATS_READ, start_us);
+        if(rc != PLCTAG_STATUS_OK) {
+            abex_buf_printf(out, "ERROR: tag read error, tag status: %s\n",plc_tag_decode_error(rc));
+            break;
+        }
+
+        size = plc_tag_get_size(tag);
+        if(size < 0 || abex_buf_reserve(&data, (size_t)size)) {
+            rc = size < 0 ? size : PLCTAG_ERR_NO_MEM;
+            abex_buf_printf(out, "ERROR: unable to copy tag data: %s\n",plc_tag_decode_error(rc));
+            break;
+        }
+
+        rc = plc_tag_get_raw_bytes(tag, 0, (uint8_t *)data.data, size);
+        if(rc != PLCTAG_STATUS_OK) {
+            abex_buf_printf(out, "ERROR: unable to copy tag data: %s\n",plc_tag_decode_error(rc));
+            break;
+        }
+
+        data.len = (size_t)size;
+        stats.bytes_read += (uint64_t)size;
+    } while(0);
+
+    gateway_limit_release(limit, &ticket);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        /* the connection may be gone, start over next time. */
+        tag_cache_evict(cache, tag);
+        abex_buf_free(&data);
+        tag_catalog_close(&cat);
+        return 1;
+    }
+
+    /* decoding errors are not PLC errors, the tag stays cached. */
+    start_us = abex_time_us();
+
+    if(!req->member_list) {
+        rc = append_udt_members(&cat, udt, "", (const uint8_t *)data.data, data.len, 0, req->format, &values, out);
+    } else {
+        char *list = req->member_list;
+
+        while(!rc && *list) {
+            size_t len = strcspn(list, ",");
+            const struct tag_catalog_entry_s *member;
+            char path[TAG_SPEC_SIZE];
+            uint32_t offset;
+            int member_index;
+
+            compat_snprintf(path, sizeof(path), "%.*s", (int)len, list);
+            list += len;
+            if(*list) {
+                list++;
+            }
+
+            member = find_member_path(&cat, udt, path, &offset, &member_index);
+            if(!member) {
+                abex_buf_printf(out, "ERROR: %s has no member %s\n", name, path);
+                rc = 1;
+                break;
+            }
+
+            rc = append_member(&cat, member, path, (const uint8_t *)data.data, data.len, offset, member_index,
+                               req->format, &values, out);
+        }
+    }
+
+    /* only the error goes out, not the members decoded before it. */
+    if(!rc) {
+        abex_buf_append(out, values.data, values.len);
+    }
+
+    tag_stats_since(&stats, TAG_STATS_DECODE, start_us);
+
+    abex_buf_free(&values);
+    abex_buf_free(&data);
+    tag_catalog_close(&cat);
+
+    return rc ? 1 : 0;
+}
+
+
+struct batch_item_s {
+    int data_type;
+    char *attrs;
+    struct abex_buf_s resolved;
+    int32_t tag;
+    int status;
+    int state;
+    int64_t deadline;
+    struct gateway_limit_ticket_s ticket;
+    struct tag_rtt_op_s op;
+
+    /* start of the current step, for --stats */
+    int64_t step_us;
+
+    /* index of an earlier item with the same attribute string, or -1 */
+    int same_as;
+};
+
+#define BATCH_QUEUED    (0)
+#define BATCH_CREATING  (1)
+#define BATCH_READING   (2)
+#define BATCH_DONE      (3)
+
+
+static void finish_item(struct gateway_limit_s *limit, struct batch_item_s *item, int status)
+{
+    if(status == PLCTAG_ERR_TIMEOUT && item->tag > 0) {
+        plc_tag_abort(item->tag);
+    }
+
+    gateway_limit_release(limit, &item->ticket);
+    item->status = status;
+    item->state = BATCH_DONE;
+}
+
+/*
+ * Move the items along until all of them are done: wait for a turn on
+ * the gateway, create the tag (or take it from the cache), then read it.
+ * Nothing blocks, so without limits every create and then every read is
+ * in flight at once and libplctag can pack them into multi-service
+ * packets.  Reads that time out are retried up to retries times, all of
+ * it before the item deadline.  With max_age_ms, an item whose cached tag
+ * was read that recently is done at once with the buffer it has.
+ */
+static void run_batch_items(struct tag_cache_s *cache, struct gateway_limit_s *limit, struct batch_item_s *items, int count,
+                            int retries, int max_age_ms)
+{
+    int pending;
+    int rc;
+    int i;
+
+    do {
+        int64_t now = abex_time_ms();
+
+        pending = 0;
+
+        for(i = 0; i < count; i++) {
+            struct batch_item_s *item = &items[i];
+
+            /* a recent enough read needs neither a turn nor a request. */
+            if(item->state == BATCH_QUEUED && max_age_ms > 0) {
+                int64_t age_ms;
+
+                item->tag = tag_cache_fresh(cache, item->attrs, max_age_ms, &age_ms);
+                if(item->tag > 0) {
+                    stats.cache_hits++;
+                    finish_item(limit, item, PLCTAG_STATUS_OK);
+                    continue;
+                }
+            }
+
+            if(item->state == BATCH_QUEUED) {
+                rc = gateway_limit_try(limit, item->attrs, &item->ticket);
+                if(rc == GATEWAY_LIMIT_WAIT) {
+                    if(now > item->deadline) {
+                        gateway_limit_cancel(limit, &item->ticket);
+                        finish_item(limit, item, PLCTAG_ERR_TIMEOUT);
+                    } else {
+                        pending++;
+                    }
+
+                    continue;
+                }
+
+                if(rc < 0) {
+                    finish_item(limit, item, rc);
+                    continue;
+                }
+
+                note_limit_wait(&item->ticket);
+                tag_stats_add(&stats, TAG_STATS_LIMIT_WAIT, item->ticket.waited_ms * 1000);
+
+                item->step_us = abex_time_us();
+                item->tag = tag_cache_get(cache, item->attrs, 0);
+                tag_stats_since(&stats, TAG_STATS_CREATE, item->step_us);
+                if(item->tag < 0) {
+                    finish_item(limit, item, item->tag);
+                    continue;
+                }
+
+                item->state = BATCH_CREATING;
+            }
+
+            /* a cached tag is ready at once and goes straight on to its read. */
+            if(item->state == BATCH_CREATING) {
+                rc = plc_tag_status(item->tag);
+                if(rc == PLCTAG_STATUS_PENDING) {
+                    if(now > item->deadline) {
+                        finish_item(limit, item, PLCTAG_ERR_TIMEOUT);
+                    } else {
+                        pending++;
+                    }
+
+                    continue;
+                }
+
+                if(rc == PLCTAG_STATUS_OK) {
+                    tag_stats_since(&stats, TAG_STATS_STATUS, item->step_us);
+
+                    item->step_us = abex_time_us();
+                    rc = tag_rtt_op_start(&item->op, tag_rtt_for(&rtt_table, item->attrs), item->tag, 0, retries,
+                                          item->deadline);
+                }
+
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    finish_item(limit, item, rc);
+                    continue;
+                }
+
+                item->state = BATCH_READING;
+            }
+
+            if(item->state == BATCH_READING) {
+                rc = tag_rtt_op_poll(&item->op);
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    tag_stats_since(&stats, TAG_STATS_READ, item->step_us);
+                    if(rc == PLCTAG_STATUS_OK) {
+                        tag_cache_mark_read(cache, item->tag);
+                        if(plc_tag_get_size(item->tag) > 0) {
+                            stats.bytes_read += (uint64_t)plc_tag_get_size(item->tag);
+                        }
+                    }
+
+                    finish_item(limit, item, rc);
+                } else {
+                    pending++;
+                }
+            }
+        }
+
+        if(pending) {
+            abex_sleep_ms(POLL_INTERVAL_MS);
+        }
+    } while(pending);
+}
+
+
+/*
+ * Read many tags at once.  All tags are created and read without blocking
+ * so libplctag can pack the requests into multi-service packets on the
+ * shared connection, then the results are written in spec order with a
+ * status for each tag.  One bad tag does not fail the batch.  With gateway
+ * limits, each tag waits for its own turn.
+ *
+ * Text output is one line per tag, "ok <values>" or "error <message>".
+ * Binary output is, per tag, an int32 status followed by either the usual
+ * binary block or a uint16 length and the error message.
+ */
+int run_batch(struct tag_cache_s *cache, struct gateway_limit_s *limit, struct rw_request_s *req, struct abex_buf_s *out)
+{
+    struct batch_item_s *items = calloc((size_t)req->spec_count, sizeof(*items));
+    int64_t deadline = abex_time_ms() + req->retry.deadline_ms;
+    int64_t start_us;
+    int i, j;
+
+    if(!items) {
+        abex_buf_printf(out, "ERROR: unable to allocate memory for batch!\n");
+        return 1;
+    }
+
+    /* parse the specs, the tags are created once they get their turn. */
+    for(i = 0; i < req->spec_count; i++) {
+        char *spec = req->specs[i];
+        char *sep = strchr(spec, ' ');
+
+        items[i].same_as = -1;
+        items[i].state = BATCH_DONE;
+        items[i].deadline = deadline;
+
+        if(!sep) {
+            items[i].status = PLCTAG_ERR_BAD_PARAM;
+            continue;
+        }
+
+        *sep = 0;
+        items[i].data_type = data_type_from_name(spec);
+        items[i].attrs = sep + 1;
+
+        /* "auto" takes the type from the catalog. */
+        if(req->catalog_dir && (items[i].data_type || !compat_strcasecmp(spec, "auto"))) {
+            struct abex_buf_s ignored = {NULL, 0, 0};
+
+            if(resolve_from_catalog(req->catalog_dir, items[i].attrs, &items[i].data_type, &items[i].resolved, &ignored)) {
+                items[i].status = PLCTAG_ERR_NOT_FOUND;
+                abex_buf_free(&ignored);
+                continue;
+            }
+
+            items[i].attrs = items[i].resolved.data;
+        }
+
+        if(!items[i].data_type) {
+            items[i].status = PLCTAG_ERR_BAD_PARAM;
+            continue;
+        }
+
+        /* the same tag twice in one batch shares one read, not the error of a spec that already failed. */
+        for(j = 0; j < i; j++) {
+            if(items[j].state == BATCH_QUEUED && !strcmp(items[j].attrs, items[i].attrs)) {
+                items[i].same_as = j;
+                break;
+            }
+        }
+
+        if(items[i].same_as < 0) {
+            items[i].state = BATCH_QUEUED;
+        }
+    }
+
+    run_batch_items(cache, limit, items, req->spec_count, tag_rtt_retries(&req->retry, 0), req->max_age_ms);
+
+    start_us = abex_time_us();
+
+    for(i = 0; i < req->spec_count; i++) {
+        struct batch_item_s *item = &items[i];
+        struct batch_item_s *read = item->same_as < 0 ? item : &items[item->same_as];
+        int status = read->status;
+
+        if(req->format == FORMAT_BINARY) {
+            uint8_t header[4];
+
+            if(status == PLCTAG_STATUS_OK) {
+                size_t start = out->len;
+
+                put_le32(header, 0);
+                abex_buf_append(out, header, sizeof(header));
+
+                status = append_binary(read->tag, item->data_type, out);
+                if(status != PLCTAG_STATUS_OK) {
+                    out->len = start;
+                }
+            }
+
+            if(status != PLCTAG_STATUS_OK) {
+                const char *msg = plc_tag_decode_error(status);
+
+                put_le32(header, (uint32_t)status);
+                abex_buf_append(out, header, sizeof(header));
+                put_le16(header, (uint16_t)strlen(msg));
+                abex_buf_append(out, header, 2);
+                abex_buf_append(out, msg, strlen(msg));
+            }
+        } else if(status == PLCTAG_STATUS_OK) {
+            size_t start = out->len;
+
+            abex_buf_printf(out, "ok ");
+            status = append_text(read->tag, item->data_type, out);
+            if(status != PLCTAG_STATUS_OK) {
+                out->len = start;
+                abex_buf_printf(out, "error %s\n", plc_tag_decode_error(status));
+            } else {
+                abex_buf_printf(out, "\n");
+            }
+        } else {
+            abex_buf_printf(out, "error %s\n", plc_tag_decode_error(status));
+        }
+    }
+
+    tag_stats_since(&stats, TAG_STATS_DECODE, start_us);
+
+    /* failed tags are recreated on the next request. */
+    for(i = 0; i < req->spec_count; i++) {
+        if(items[i].tag > 0 && items[i].same_as < 0 && items[i].status != PLCTAG_STATUS_OK) {
+            tag_cache_evict(cache, items[i].tag);
+        }
+
+        abex_buf_free(&items[i].resolved);
+    }
+
+    free(items);
+
+    return 0;
+}
+
+
+/*
+ * --fragment: read count elements from name[start] as tags of at most
+ * req->fragment elements, FRAGMENT_WINDOW of them in flight at once, and
+ * hand every piece to partial_sink as soon as it and the pieces before it
+ * are in.  Only a window of pieces is held at a time and the first values
+ * go out after one round trip.  Text output is the same as one big read,
+ * binary output has a block per piece.  Each window gets the whole
+ * deadline.  A failed piece ends the read with an error after the pieces
+ * already sent.
+ */
+static int run_fragmented_read(struct tag_cache_s *cache, struct gateway_limit_s *limit, struct rw_request_s *req,
+                               const char *tag_attrs, struct abex_buf_s *out)
+{
+    struct batch_item_s items[FRAGMENT_WINDOW];
+    char value[32];
+    int count = req->count;
+    int offset = 0;
+    int64_t start_us;
+    int rc = 0;
+    int i, n;
+
+    if(count == 0 && !abex_attr_value(tag_attrs, "elem_count", value, sizeof(value))) {
+        count = atoi(value);
+    }
+
+    if(count <= 0) {
+        abex_buf_printf(out, "ERROR: --fragment needs --count or an elem_count in the tag string\n");
+        return 1;
+    }
+
+    while(offset < count && !rc) {
+        memset(items, 0, sizeof(items));
+
+        for(n = 0; n < FRAGMENT_WINDOW && offset + n * req->fragment < count; n++) {
+            int first = offset + n * req->fragment;
+            int len = count - first < req->fragment ? count - first : req->fragment;
+
+            items[n].data_type = req->data_type;
+            items[n].same_as = -1;
+            items[n].deadline = abex_time_ms() + req->retry.deadline_ms;
+
+            if(slice_attrs(tag_attrs, req->start + first, len, &items[n].resolved, out)) {
+                rc = 1;
+                n++;
+                break;
+            }
+
+            items[n].attrs = items[n].resolved.data;
+            items[n].state = BATCH_QUEUED;
+        }
+
+        if(!rc) {
+            run_batch_items(cache, limit, items, n, tag_rtt_retries(&req->retry, 0), req->max_age_ms);
+        }
+
+        for(i = 0; i < n && !rc; i++) {
+            int status = items[i].status;
+
+            if(status == PLCTAG_STATUS_OK) {
+                start_us = abex_time_us();
+                status = req->format == FORMAT_BINARY ? append_binary(items[i].tag, req->data_type, out)
+                                                      : append_text(items[i].tag, req->data_type, out);
+                tag_stats_since(&stats, TAG_STATS_DECODE, start_us);
+            }
+
+            if(status != PLCTAG_STATUS_OK) {
+                abex_buf_printf(out, "ERROR: tag read error at element %d, tag status: %s\n",
+                                req->start + offset + i * req->fragment, plc_tag_decode_error(status));
+                rc = 1;
+            } else if(offset + (i + 1) * req->fragment < count && partial_sink) {
+                start_us = abex_time_us();
+                partial_sink(out);
+                tag_stats_since(&stats, TAG_STATS_OUTPUT, start_us);
+            }
+        }
+
+        /* failed pieces are recreated on the next request. */
+        for(i = 0; i < n; i++) {
+            if(items[i].tag > 0 && items[i].status != PLCTAG_STATUS_OK) {
+                tag_cache_evict(cache, items[i].tag);
+            }
+
+            abex_buf_free(&items[i].resolved);
+        }
+
+        offset += n * req->fragment;
+    }
+
+    return rc;
+}
+
+
+/*
+ * Append the result of a single read, with --report-age led by the age of
+ * the data in ms: a uint32 in binary format, a number and a space in text.
+ */
+static int append_read(struct rw_request_s *req, int32_t tag, int64_t age_ms, struct abex_buf_s *out)
+{
+    int64_t start_us = abex_time_us();
+    int rc;
+
+    if(req->report_age && req->format == FORMAT_BINARY) {
+        uint8_t age[4];
+
+        put_le32(age, (uint32_t)age_ms);
+        abex_buf_append(out, age, sizeof(age));
+    } else if(req->report_age) {
+        abex_buf_printf(out, "%" PRId64 " ", age_ms);
+    }
+
+    rc = req->format == FORMAT_BINARY ? append_binary(tag, req->data_type, out) : append_text(tag, req->data_type, out);
+    tag_stats_since(&stats, TAG_STATS_DECODE, start_us);
+
+    return rc;
+}
+
+
+/*
+ * Get the bytes of a --payload write.  Framed requests carry them in the
+ * frame right after the --payload argument, one-shot runs read them from
+ * stdin.
+ */
+static int load_payload(struct rw_request_s *req, char **argv, int framed, struct abex_buf_s *data, struct abex_buf_s *out)
+{
+    if(abex_buf_reserve(data, req->payload_len)) {
+        abex_buf_printf(out, "ERROR: unable to allocate memory for payload!\n");
+        return 1;
+    }
+
+    if(framed) {
+        const char *arg = argv[req->payload_arg];
+
+        memcpy(data->data, arg + strlen(arg) + 1, req->payload_len);
+    } else if(fread(data->data, 1, req->payload_len, stdin) != req->payload_len) {
+        abex_buf_printf(out, "ERROR: expected %lu payload bytes on stdin\n", (unsigned long)req->payload_len);
+        return 1;
+    }
+
+    data->len = req->payload_len;
+    data->data[data->len] = 0;
+
+    return 0;
+}
+
+
+/*
+ * Run one read or write request.  All output, data or error message, goes
+ * to out.  Returns the exit status for the request: 0 on success, 1 on
+ * error.  Tags come from (and stay in) the cache.  framed is set when argv
+ * came from a --serve frame.
+ *
+ * Writes fill the tag buffer from a list of values (-w "1,2,3") or a raw
+ * payload and send it with a single plc_tag_write.  The values must cover
+ * every element, except that a single value only writes the first one.
+ */
+int run_request(struct tag_cache_s *cache, struct gateway_limit_s *limit, int argc, char **argv, int framed,
+                struct abex_buf_s *out)
+{
+    struct rw_request_s req = RW_REQUEST_INIT;
+    struct gateway_limit_ticket_s ticket;
+    struct abex_buf_s data = {NULL, 0, 0};
+    struct abex_buf_s attrs = {NULL, 0, 0};
+    struct abex_buf_s resolved = {NULL, 0, 0};
+    const char *tag_attrs;
+    struct tag_rtt_s *rtt;
+    int64_t deadline;
+    int64_t start_us;
+    int32_t tag = 0;
+    int is_write = 0;
+    int elem_size;
+    int size;
+    int rc;
+
+    if(parse_args(argc, argv, &req, out)) {
+        free_request(&req);
+        return 1;
+    }
+
+    /* stdin carries the frames, and a broker's files are not its clients': specs come as -s then. */
+    if(framed && req.batch_file && (serve_broker || !strcmp(req.batch_file, "-"))) {
+        abex_buf_printf(out, "ERROR: --batch does not go in a framed request, send the specs with -s\n");
+        free_request(&req);
+        return 1;
+    }
+
+    if(req.batch_file && load_batch_file(&req, out)) {
+        free_request(&req);
+        return 1;
+    }
+
+    if(req.spec_count > 0) {
+        rc = run_batch(cache, limit, &req, out);
+        free_request(&req);
+        return rc;
+    }
+
+    if(req.members) {
+        rc = run_udt_read(cache, limit, &req, out);
+        free_request(&req);
+        return rc;
+    }
+
+    /* check arguments, the type can come from the catalog */
+    if(!req.path || (!req.data_type && !req.catalog_dir)) {
+        abex_buf_printf(out, "ERROR: Missing required arguments -p (path) or -t (type)\n");
+        free_request(&req);
+        return 1;
+    }
+
+    tag_attrs = req.path;
+    if(req.catalog_dir) {
+        if(resolve_from_catalog(req.catalog_dir, req.path, &req.data_type, &resolved, out)) {
+            abex_buf_free(&resolved);
+            free_request(&req);
+            return 1;
+        }
+
+        tag_attrs = resolved.data;
+    }
+
+    elem_size = (int)tag_decode_size(req.data_type);
+
+    if(req.data_type == PLC_LIB_BOOL && (req.payload_arg || (req.write_str && strlen(req.write_str)))) {
+        abex_buf_printf(out, "ERROR: bool arrays can only be read\n");
+        abex_buf_free(&resolved);
+        free_request(&req);
+        return 1;
+    }
+
+    if(req.data_type == PLC_LIB_BIT && (req.sliced || req.fragment)) {
+        abex_buf_printf(out, "ERROR: a bit is a single value, --start, --count and --fragment do not apply\n");
+        abex_buf_free(&resolved);
+        free_request(&req);
+        return 1;
+    }
+
+    /* convert any write values */
+    if(req.payload_arg) {
+        is_write = 1;
+        rc = load_payload(&req, argv, framed, &data, out);
+    } else if(req.write_str && strlen(req.write_str)) {
+        is_write = 1;
+        rc = encode_values(req.data_type, req.write_str, &data, out);
+    } else {
+        rc = 0;
+    }
+
+    if(!rc && is_write && (data.len == 0 || data.len % (size_t)elem_size)) {
+        abex_buf_printf(out, "ERROR: write data is not a whole number of %d byte elements\n", elem_size);
+        rc = 1;
+    }
+
+    if(!rc && is_write && req.data_type == PLC_LIB_BIT && data.len != 1) {
+        abex_buf_printf(out, "ERROR: a bit takes one value\n");
+        rc = 1;
+    }
+
+    if(!rc && req.fragment) {
+        if(is_write) {
+            abex_buf_printf(out, "ERROR: --fragment only applies to reads\n");
+            rc = 1;
+        } else if(req.report_age) {
+            abex_buf_printf(out, "ERROR: --report-age does not apply to --fragment reads\n");
+            rc = 1;
+        } else {
+            rc = run_fragmented_read(cache, limit, &req, tag_attrs, out);
+            abex_buf_free(&resolved);
+            free_request(&req);
+            return rc;
+        }
+    }
+
+    /* a write to a slice covers exactly the values given. */
+    if(!rc && req.sliced) {
+        int count = req.count;
+
+        if(is_write && count == 0) {
+            count = (int)(data.len / (size_t)elem_size);
+        }
+
+        rc = slice_attrs(tag_attrs, req.start, count, &attrs, out);
+        tag_attrs = attrs.data;
+    } else if(!rc && is_write && data.len == (size_t)elem_size && single_element_attrs(tag_attrs, &attrs)) {
+        tag_attrs = attrs.data;
+    }
+
+    if(rc) {
+        abex_buf_free(&data);
+        abex_buf_free(&attrs);
+        abex_buf_free(&resolved);
+        free_request(&req);
+        return 1;
+    }
+
+    /* --max-age-ms: answer from a recent read of the same tag, without a turn or a request */
+    if(!is_write && req.max_age_ms > 0) {
+        int64_t age_ms;
+
+        tag = tag_cache_fresh(cache, tag_attrs, req.max_age_ms, &age_ms);
+        if(tag > 0) {
+            stats.cache_hits++;
+
+            rc = append_read(&req, tag, age_ms, out);
+            if(rc != PLCTAG_STATUS_OK) {
+                abex_buf_printf(out, "ERROR: unable to copy tag data: %s\n",plc_tag_decode_error(rc));
+            }
+
+            abex_buf_free(&attrs);
+            abex_buf_free(&resolved);
+            free_request(&req);
+
+            return rc != PLCTAG_STATUS_OK;
+        }
+    }
+
+    /* everything from here on, waiting for a turn included, counts against the deadline */
+    deadline = abex_time_ms() + req.retry.deadline_ms;
+
+    /* wait for our turn on the gateway, creating the tag counts as part of the request */
+    rc = wait_for_limit(limit, tag_attrs, deadline, &ticket, out);
+    if(rc) {
+        abex_buf_free(&attrs);
+        abex_buf_free(&resolved);
+        abex_buf_free(&data);
+        free_request(&req);
+        return 1;
+    }
+
+    /* get the tag, creating it if this is the first time we see it */
+    rtt = tag_rtt_for(&rtt_table, tag_attrs);
+    start_us = abex_time_us();
+    tag = tag_cache_get(cache, tag_attrs, time_left(deadline));
+    tag_stats_since(&stats, TAG_STATS_CREATE, start_us);
+    abex_buf_free(&attrs);
+    abex_buf_free(&resolved);
+    if(tag < 0) {
+        abex_buf_printf(out, "ERROR %s: error creating tag!\n", plc_tag_decode_error(tag));
+        gateway_limit_release(limit, &ticket);
+        abex_buf_free(&data);
+        free_request(&req);
+        return 1;
+    }
+
+    start_us = abex_time_us();
+    rc = plc_tag_status(tag);
+    tag_stats_since(&stats, TAG_STATS_STATUS, start_us);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        abex_buf_printf(out, "ERROR: tag creation error, tag status: %s\n",plc_tag_decode_error(rc));
+        gateway_limit_release(limit, &ticket);
+        tag_cache_evict(cache, tag);
+        abex_buf_free(&data);
+        free_request(&req);
+        return 1;
+    }
+
+    do {
+        if(!is_write) {
+            start_us = abex_time_us();
+            rc = tag_rtt_request(rtt, tag, 0, tag_rtt_retries(&req.retry, 0), deadline);
+            tag_stats_since(&stats, TAG_STATS_READ, start_us);
+            if(rc != PLCTAG_STATUS_OK) {
+                abex_buf_printf(out, "ERROR: tag read error, tag status: %s\n",plc_tag_decode_error(rc));
+                break;
+            }
+
+            tag_cache_mark_read(cache, tag);
+
+            size = plc_tag_get_size(tag);
+            if(size > 0) {
+                stats.bytes_read += (uint64_t)size;
+            }
+
+            rc = append_read(&req, tag, 0, out);
+            if(rc != PLCTAG_STATUS_OK) {
+                abex_buf_printf(out, "ERROR: unable to copy tag data: %s\n",plc_tag_decode_error(rc));
+            }
+        } else {
+            size = plc_tag_get_size(tag);
+
+            /* a bit is set with plc_tag_set_bit(), its buffer is the whole integer holding it */
+            if(req.data_type != PLC_LIB_BIT && data.len != (size_t)size) {
+                /* not a PLC error, keep the tag. */
+                abex_buf_printf(out, "ERROR: got %d values to write but the tag has %d elements\n",
+                                (int)(data.len / (size_t)elem_size), size / elem_size);
+                gateway_limit_release(limit, &ticket);
+                abex_buf_free(&data);
+                free_request(&req);
+                return 1;
+            }
+
+            rc = set_tag_data(tag, req.data_type, (const uint8_t *)data.data, data.len);
+            if(rc != PLCTAG_STATUS_OK) {
+                abex_buf_printf(out, "ERROR: error setting data: %s!\n",plc_tag_decode_error(rc));
+                break;
+            }
+
+            /* write the data, only resent after a timeout with --retry-writes */
+            tag_cache_forget_reads(cache);
+            start_us = abex_time_us();
+            rc = tag_rtt_request(rtt, tag, 1, tag_rtt_retries(&req.retry, 1), deadline);
+            tag_stats_since(&stats, TAG_STATS_WRITE, start_us);
+            if(rc == PLCTAG_STATUS_OK) {
+                stats.bytes_written += (uint64_t)data.len;
+            }
+
+            if(rc != PLCTAG_STATUS_OK) {
+                abex_buf_printf(out, "ERROR: error writing data: %s!\n",plc_tag_decode_error(rc));
+            } else if(req.write_str) {
+                abex_buf_printf(out, "%s ",req.write_str);
+            }
+        }
+    } while(0);
+
+    gateway_limit_release(limit, &ticket);
+    abex_buf_free(&data);
+    free_request(&req);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        /* the connection may be gone, start over next time. */
+        tag_cache_evict(cache, tag);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* the phase histograms and counters, then a line per gateway with its RTT */
+static void format_stats(struct abex_buf_s *out)
+{
+    tag_stats_format(&stats, out);
+    tag_rtt_format_table(&rtt_table, out);
+}
+
+
+/* --serve sink for --fragment pieces: a STATUS_MORE frame each, see serve() */
+static int serve_report_wait = 0;
+
+/* where the request being answered came from: stdout for --serve, the client socket for --broker */
+static int serve_fd = 1;
+
+static int write_answer(int fd, uint8_t status, const void *data, size_t len)
+{
+    if(serve_broker) {
+        return broker_send(serve_broker, fd, status, data, len);
+    }
+
+    return frame_write(fd, status, data, len);
+}
+
+static void write_partial_frame(struct abex_buf_s *out)
+{
+    uint8_t waited[4] = {0, 0, 0, 0};
+
+    if(serve_report_wait) {
+        put_le32((uint8_t *)out->data, (uint32_t)request_waited_ms);
+    }
+
+    /* a closed port shows up again when the last frame is written. */
+    (void)write_answer(serve_fd, STATUS_MORE, out->data, out->len);
+
+    abex_buf_reset(out);
+    if(serve_report_wait) {
+        abex_buf_append(out, waited, sizeof(waited));
+    }
+}
+
+
+/*
+ * --catalog-fingerprint <gateway> <plc> [path]: the catalog check of
+ * tag_list, answered as "<max_instance> <instance_count>" so a tag_list
+ * going through a broker does not need a connection of its own for it.
+ */
+static int answer_fingerprint(int argc, char **argv, struct abex_buf_s *out)
+{
+    struct tag_rtt_config_s retry = TAG_RTT_CONFIG_INIT;
+    struct tag_catalog_fingerprint_s fp;
+    int rc;
+    int i;
+
+    for(i = 2; i < argc; i++) {
+        if(tag_rtt_parse_arg(&retry, argv[i]) < 0) {
+            abex_buf_printf(out, "ERROR: bad retry option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if(argc < 4) {
+        abex_buf_printf(out, "ERROR: --catalog-fingerprint needs a gateway and a PLC type\n");
+        return 1;
+    }
+
+    rc = tag_catalog_fingerprint(argv[2], argc > 4 && strncmp(argv[4], "--", 2) ? argv[4] : NULL, argv[3],
+                                 retry.deadline_ms, &fp);
+    if(rc != PLCTAG_STATUS_OK) {
+        abex_buf_printf(out, "ERROR %s: no fingerprint\n", plc_tag_decode_error(rc));
+        return 1;
+    }
+
+    abex_buf_printf(out, "%u %u\n", (unsigned)fp.max_instance, (unsigned)fp.instance_count);
+
+    return 0;
+}
+
+
+/*
+ * Answer one framed request on fd.  Returns -1 if the answer could not be
+ * written, 0 otherwise.  Used by --serve and --broker.
+ */
+static int answer_request(int fd, struct tag_cache_s *cache, struct gateway_limit_s *limit, struct abex_buf_s *request,
+                          char *program, int report_wait, struct abex_buf_s *out)
+{
+    char *req_argv[FRAME_MAX_ARGS];
+    int64_t request_us = abex_time_us();
+    int req_argc;
+    int status;
+
+    abex_buf_reset(out);
+    request_waited_ms = 0;
+    serve_fd = fd;
+
+    if(report_wait) {
+        uint8_t waited[4] = {0, 0, 0, 0};
+
+        abex_buf_append(out, waited, sizeof(waited));
+    }
+
+    req_argc = frame_split_args(request, program, req_argv, FRAME_MAX_ARGS);
+    if(req_argc < 0) {
+        abex_buf_printf(out, "ERROR: too many arguments or bad payload length in request\n");
+        status = 1;
+    } else if(req_argc > 1 && !strcmp(req_argv[1], "--stats-dump")) {
+        format_stats(out);
+
+        if(req_argc > 2 && !strcmp(req_argv[2], "--reset")) {
+            tag_stats_reset(&stats);
+        }
+
+        status = 0;
+        request_us = -1;
+    } else if(req_argc > 1 && !strcmp(req_argv[1], "--catalog-fingerprint")) {
+        status = answer_fingerprint(req_argc, req_argv, out);
+    } else {
+        status = run_request(cache, limit, req_argc, req_argv, 1, out);
+    }
+
+    if(report_wait) {
+        put_le32((uint8_t *)out->data, (uint32_t)request_waited_ms);
+    }
+
+    /* the time of a stats request is not a request time. */
+    if(request_us >= 0) {
+        int64_t output_us = abex_time_us();
+
+        if(write_answer(fd, (uint8_t)status, out->data, out->len)) {
+            return -1;
+        }
+
+        tag_stats_since(&stats, TAG_STATS_OUTPUT, output_us);
+        tag_stats_since(&stats, TAG_STATS_TOTAL, request_us);
+        stats.errors += status ? 1 : 0;
+    } else if(write_answer(fd, (uint8_t)status, out->data, out->len)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Long-lived mode for Erlang ports: read framed requests from stdin and
+ * answer each on stdout, keeping tag handles open between requests.
+ *
+ * With --report-wait every response starts with a uint32 little-endian
+ * count of milliseconds the request waited for the gateway limits.
+ *
+ * A "--stats-dump" request is answered with format_stats() (histograms
+ * only filled in with --stats), "--stats-dump --reset" also clears them.
+ * With --stats they are written to stderr on exit too.
+ *
+ * A --fragment read answers with a STATUS_MORE frame per piece and then
+ * the usual final frame.
+ */
+int serve(int argc, char **argv)
+{
+    struct tag_cache_s cache = {NULL, 0};
+    struct gateway_limit_s limit;
+    struct abex_buf_s request = {NULL, 0, 0};
+    struct abex_buf_s out = {NULL, 0, 0};
+    int idle_ms = DEFAULT_IDLE_MS;
+    int report_wait = 0;
+    int rc;
+    int i;
+
+    memset(&limit, 0, sizeof(limit));
+
+    for(i = 2; i < argc; i++) {
+        if(!strncmp(argv[i], "--idle-ms=", strlen("--idle-ms="))) {
+            idle_ms = atoi(argv[i] + strlen("--idle-ms="));
+        } else if(!strcmp(argv[i], "--report-wait")) {
+            report_wait = 1;
+            serve_report_wait = 1;
+        } else if(!strcmp(argv[i], "--stats")) {
+            /* already seen by main */
+        } else if((rc = gateway_limit_parse_arg(&limit.config, argv[i])) != 0) {
+            if(rc < 0) {
+                fprintf(stderr, "ERROR: bad limit option: %s\n", argv[i]);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "ERROR: unknown serve option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+#if !defined(_WIN32)
+    /* the port going away shows up as EOF/EPIPE, not a signal. */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    partial_sink = write_partial_frame;
+
+    for(;;) {
+        rc = frame_wait_readable(0, SWEEP_INTERVAL_MS);
+        if(rc < 0) {
+            break;
+        }
+
+        if(rc == 0) {
+            tag_cache_sweep(&cache, idle_ms);
+            continue;
+        }
+
+        rc = frame_read(0, &request);
+        if(rc <= 0) {
+            /* EOF: the port was closed. */
+            break;
+        }
+
+        if(answer_request(1, &cache, &limit, &request, argv[0], report_wait, &out)) {
+            break;
+        }
+
+        tag_cache_sweep(&cache, idle_ms);
+    }
+
+    if(stats.enabled) {
+        abex_buf_reset(&out);
+        format_stats(&out);
+        fwrite(out.data, 1, out.len, stderr);
+    }
+
+    tag_cache_clear(&cache);
+    gateway_limit_clear(&limit);
+    tag_rtt_clear(&rtt_table);
+    abex_buf_free(&request);
+    abex_buf_free(&out);
+
+    plc_tag_shutdown();
+
+    return 0;
+}
+
+
+/* SIGTERM/SIGINT: stop --broker between requests, so the socket file is removed */
+#if !defined(_WIN32)
+static volatile sig_atomic_t broker_stopping = 0;
+
+static void stop_broker(int sig)
+{
+    (void)sig;
+    broker_stopping = 1;
+}
+#else
+static int broker_stopping = 0;
+#endif
+
+
+/*
+ * Connection broker: --serve for many clients at once, over the Unix
+ * socket --socket=PATH (default $ABEX_BROKER), see broker.h.  Every client
+ * shares one tag cache, so tags and the PLC sessions under them stay open
+ * for --idle-ms after the last request that used them, whichever process
+ * sent it.  Requests are answered one at a time, in turn between clients;
+ * answers are queued per client, so one that stops reading is only
+ * dropped after BROKER_STALL_MS.
+ *
+ * --watch-stdin stops the broker when stdin closes, for Erlang ports.
+ * Limit options pace the requests of all clients together.
+ */
+int broker(int argc, char **argv)
+{
+    struct tag_cache_s cache = {NULL, 0};
+    struct gateway_limit_s limit;
+    struct broker_s broker;
+    struct abex_buf_s request = {NULL, 0, 0};
+    struct abex_buf_s out = {NULL, 0, 0};
+    const char *socket_path = getenv(BROKER_ENV);
+    int idle_ms = DEFAULT_IDLE_MS;
+    int watch_stdin = 0;
+    int fd;
+    int rc;
+    int i;
+
+    memset(&limit, 0, sizeof(limit));
+
+    for(i = 2; i < argc; i++) {
+        if(!strncmp(argv[i], "--socket=", strlen("--socket="))) {
+            socket_path = argv[i] + strlen("--socket=");
+        } else if(!strncmp(argv[i], "--idle-ms=", strlen("--idle-ms="))) {
+            idle_ms = atoi(argv[i] + strlen("--idle-ms="));
+        } else if(!strcmp(argv[i], "--watch-stdin")) {
+            watch_stdin = 1;
+        } else if(!strcmp(argv[i], "--stats")) {
+            /* already seen by main */
+        } else if((rc = gateway_limit_parse_arg(&limit.config, argv[i])) != 0) {
+            if(rc < 0) {
+                fprintf(stderr, "ERROR: bad limit option: %s\n", argv[i]);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "ERROR: unknown broker option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if(!socket_path || !*socket_path) {
+        fprintf(stderr, "ERROR: --broker needs --socket=PATH or %s\n", BROKER_ENV);
+        exit(1);
+    }
+
+    rc = broker_listen(&broker, socket_path, watch_stdin ? 0 : -1);
+    if(rc) {
+        fprintf(stderr, "ERROR: %s %s\n", rc == BROKER_IN_USE ? "another broker answers on" : "unable to listen on",
+                socket_path);
+        exit(1);
+    }
+
+#if !defined(_WIN32)
+    /* a client going away shows up as EOF/EPIPE on its socket, not a signal. */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, stop_broker);
+    signal(SIGINT, stop_broker);
+#endif
+
+    partial_sink = write_partial_frame;
+    serve_broker = &broker;
+
+    while(!broker_stopping) {
+        fd = broker_next(&broker, SWEEP_INTERVAL_MS);
+        if(fd == BROKER_STOP) {
+            break;
+        }
+
+        if(fd >= 0) {
+            /*
+             * the request is all there and the answer is queued, so a
+             * client that stalls holds up nobody; broker_next() drops it.
+             */
+            if(broker_take(&broker, fd, &request) <= 0
+               || answer_request(fd, &cache, &limit, &request, argv[0], 0, &out)) {
+                broker_drop(&broker, fd);
+            }
+        }
+
+        tag_cache_sweep(&cache, idle_ms);
+    }
+
+    if(stats.enabled) {
+        abex_buf_reset(&out);
+        format_stats(&out);
+        fwrite(out.data, 1, out.len, stderr);
+    }
+
+    serve_broker = NULL;
+    broker_shutdown(&broker);
+    tag_cache_clear(&cache);
+    gateway_limit_clear(&limit);
+    tag_rtt_clear(&rtt_table);
+    abex_buf_free(&request);
+    abex_buf_free(&out);
+
+    plc_tag_shutdown();
+
+    return 0;
+}
+
+
+struct sub_item_s {
+    int data_type;
+    char *attrs;
+    int32_t tag;
+    int creating;
+    int reading;
+    int reported;
+    int64_t retry_at;
+
+    /* current buffer and the values last sent for each element */
+    int size;
+    uint8_t *cur;
+    uint8_t *last;
+    int primed;
+};
+
+struct sub_config_s {
+    int interval_ms;
+    int auto_sync;
+    int format;
+    double deadband;
+    double deadband_pct;
+};
+
+
+/*
+ * Integers change on any difference.  Reals must move by more than the
+ * absolute deadband and/or the percentage of the last sent value, when
+ * those are set.  Comparing against the last *sent* value keeps slow drift
+ * from hiding under the deadband forever.
+ */
+static int element_changed(struct sub_config_s *config, int data_type, const uint8_t *last, const uint8_t *cur, int elem_size)
+{
+    double old_val, new_val, delta;
+
+    if(!memcmp(last, cur, (size_t)elem_size)) {
+        return 0;
+    }
+
+    if(data_type != PLC_LIB_REAL32 && data_type != PLC_LIB_REAL64) {
+        return 1;
+    }
+
+    old_val = get_real(data_type, last);
+    new_val = get_real(data_type, cur);
+
+    /* NaN compares false both ways, always report it. */
+    if(old_val != old_val || new_val != new_val) {
+        return 1;
+    }
+
+    delta = new_val - old_val;
+    if(delta < 0) {
+        delta = -delta;
+    }
+
+    if(config->deadband > 0 && delta <= config->deadband) {
+        return 0;
+    }
+
+    if(config->deadband_pct > 0) {
+        double base = old_val < 0 ? -old_val : old_val;
+
+        if(delta <= base * config->deadband_pct / 100.0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static void sub_report_error(struct sub_item_s *item, int index, int status, struct abex_buf_s *errors)
+{
+    if(item->reported != status) {
+        abex_buf_printf(errors, "%d %s\n", index, plc_tag_decode_error(status));
+        item->reported = status;
+    }
+}
+
+
+static void sub_drop_tag(struct sub_item_s *item)
+{
+    if(item->tag > 0) {
+        plc_tag_destroy(item->tag);
+    }
+
+    item->tag = 0;
+    item->creating = 0;
+    item->reading = 0;
+    item->primed = 0;
+    item->retry_at = abex_time_ms() + RETRY_MS;
+}
+
+
+/*
+ * Compare the tag buffer with what was last sent and append the changed
+ * elements.  Text output is "<tag index> <element index> <value>" per
+ * line.  Binary output groups consecutive changed elements into runs of
+ * uint32 tag index, uint32 first element, uint32 count and the raw bytes.
+ */
+static int sub_emit_changes(struct sub_config_s *config, struct sub_item_s *item, int index, struct abex_buf_s *changes)
+{
+    int elem_size = (int)tag_decode_size(item->data_type);
+    int size = plc_tag_get_size(item->tag);
+    int count;
+    int rc;
+    int i;
+
+    if(size <= 0) {
+        return size < 0 ? size : PLCTAG_STATUS_OK;
+    }
+
+    if(size != item->size) {
+        uint8_t *cur = realloc(item->cur, (size_t)size);
+        uint8_t *last = realloc(item->last, (size_t)size);
+
+        if(cur) {
+            item->cur = cur;
+        }
+
+        if(last) {
+            item->last = last;
+        }
+
+        if(!cur || !last) {
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        item->size = size;
+        item->primed = 0;
+    }
+
+    rc = plc_tag_get_raw_bytes(item->tag, 0, item->cur, size);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    count = size / elem_size;
+
+    for(i = 0; i < count; i++) {
+        int first = i;
+        uint8_t header[12];
+
+        while(i < count && (!item->primed || element_changed(config, item->data_type, item->last + (i * elem_size), item->cur + (i * elem_size), elem_size))) {
+            memcpy(item->last + (i * elem_size), item->cur + (i * elem_size), (size_t)elem_size);
+
+            if(config->format == FORMAT_TEXT) {
+                abex_buf_printf(changes, "%d %d ", index, i);
+                if(tag_decode_text(item->data_type, item->cur + (i * elem_size), 1, changes) == 0) {
+                    changes->data[changes->len - 1] = '\n';
+                }
+            }
+
+            i++;
+        }
+
+        if(config->format == FORMAT_BINARY && i > first) {
+            put_le32(header, (uint32_t)index);
+            put_le32(header + 4, (uint32_t)first);
+            put_le32(header + 8, (uint32_t)(i - first));
+            abex_buf_append(changes, header, sizeof(header));
+            abex_buf_append(changes, item->cur + (first * elem_size), (size_t)((i - first) * elem_size));
+        }
+    }
+
+    item->primed = 1;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * One step of the per-tag state machine: (re)create, wait for the create,
+ * read, compare and emit.  Nothing here blocks.
+ */
+static void sub_poll_item(struct sub_config_s *config, struct sub_item_s *item, int index, struct abex_buf_s *changes, struct abex_buf_s *errors)
+{
+    int rc;
+
+    if(item->tag <= 0) {
+        if(abex_time_ms() < item->retry_at) {
+            return;
+        }
+
+        item->tag = plc_tag_create(item->attrs, 0);
+        if(item->tag < 0) {
+            sub_report_error(item, index, item->tag, errors);
+            sub_drop_tag(item);
+            return;
+        }
+
+        item->creating = 1;
+    }
+
+    rc = plc_tag_status(item->tag);
+    if(rc == PLCTAG_STATUS_PENDING) {
+        /* still creating or reading, look again next tick. */
+        return;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        sub_report_error(item, index, rc, errors);
+        sub_drop_tag(item);
+        return;
+    }
+
+    if(item->creating) {
+        item->creating = 0;
+    } else if(item->reading || (config->auto_sync && item->primed)) {
+        item->reading = 0;
+
+        rc = sub_emit_changes(config, item, index, changes);
+        if(rc != PLCTAG_STATUS_OK) {
+            sub_report_error(item, index, rc, errors);
+            sub_drop_tag(item);
+            return;
+        }
+
+        /* back to normal after an error. */
+        item->reported = PLCTAG_STATUS_OK;
+    }
+
+    /* auto sync tags are kept fresh by libplctag once the first read is in. */
+    if(!config->auto_sync || !item->primed) {
+        rc = plc_tag_read(item->tag, 0);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+            sub_report_error(item, index, rc, errors);
+            sub_drop_tag(item);
+            return;
+        }
+
+        item->reading = 1;
+    }
+}
+
+
+/*
+ * Keep a set of tags open, read them every interval and emit only the
+ * elements that changed, as frames on stdout (same framing as --serve
+ * responses: status 0 for changes, 1 for errors).  Runs until stdin is
+ * closed.
+ */
+int subscribe(int argc, char **argv)
+{
+    struct rw_request_s req = RW_REQUEST_INIT;
+    struct sub_config_s config = {DEFAULT_INTERVAL_MS, 1, FORMAT_TEXT, 0.0, 0.0};
+    struct abex_buf_s changes = {NULL, 0, 0};
+    struct abex_buf_s errors = {NULL, 0, 0};
+    struct abex_buf_s input = {NULL, 0, 0};
+    struct sub_item_s *items = NULL;
+    int64_t next_tick;
+    int rc = 0;
+    int i;
+
+    for(i = 2; i < argc; i++) {
+        if(!strncmp(argv[i], "--interval-ms=", strlen("--interval-ms="))) {
+            config.interval_ms = atoi(argv[i] + strlen("--interval-ms="));
+        } else if(!strncmp(argv[i], "--deadband=", strlen("--deadband="))) {
+            config.deadband = atof(argv[i] + strlen("--deadband="));
+        } else if(!strncmp(argv[i], "--deadband-pct=", strlen("--deadband-pct="))) {
+            config.deadband_pct = atof(argv[i] + strlen("--deadband-pct="));
+        } else if(!strcmp(argv[i], "--no-auto-sync")) {
+            config.auto_sync = 0;
+        }
+    }
+
+    if(config.interval_ms <= 0) {
+        fprintf(stderr, "ERROR: --interval-ms must be greater than zero\n");
+        exit(1);
+    }
+
+    if(parse_args(argc, argv, &req, &errors) || (req.batch_file && load_batch_file(&req, &errors))) {
+        fprintf(stderr, "%s", errors.data);
+        exit(1);
+    }
+
+    if(req.spec_count == 0) {
+        fprintf(stderr, "ERROR: --subscribe needs at least one -s spec or --batch file\n");
+        exit(1);
+    }
+
+    config.format = req.format;
+
+    items = calloc((size_t)req.spec_count, sizeof(*items));
+    if(!items) {
+        fprintf(stderr, "ERROR: unable to allocate memory for subscription!\n");
+        exit(1);
+    }
+
+    for(i = 0; i < req.spec_count; i++) {
+        char *spec = req.specs[i];
+        char *sep = strchr(spec, ' ');
+        struct abex_buf_s attrs = {NULL, 0, 0};
+
+        if(sep) {
+            *sep = 0;
+            items[i].data_type = data_type_from_name(spec);
+        }
+
+        /* changes are tracked per element, a packed bool array has none; bits come from libplctag, not the buffer. */
+        if(!sep || !items[i].data_type || items[i].data_type == PLC_LIB_BOOL || items[i].data_type == PLC_LIB_BIT) {
+            fprintf(stderr, "ERROR: bad subscription spec: %s\n", spec);
+            exit(1);
+        }
+
+        /* let libplctag poll in the background where the PLC supports it. */
+        if(config.auto_sync && !strstr(sep + 1, "auto_sync_read_ms=")) {
+            abex_buf_printf(&attrs, "%s&auto_sync_read_ms=%d", sep + 1, config.interval_ms);
+        } else {
+            abex_buf_printf(&attrs, "%s", sep + 1);
+        }
+
+        items[i].attrs = attrs.data;
+    }
+
+#if !defined(_WIN32)
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    next_tick = abex_time_ms();
+
+    for(;;) {
+        int64_t now = abex_time_ms();
+        int wait_ms = next_tick > now ? (int)(next_tick - now) : 0;
+
+        rc = frame_wait_readable(0, wait_ms);
+        if(rc < 0) {
+            break;
+        }
+
+        if(rc > 0) {
+            /* nothing is expected on stdin, EOF means we are done. */
+            if(frame_read(0, &input) <= 0) {
+                rc = 0;
+                break;
+            }
+
+            continue;
+        }
+
+        now = abex_time_ms();
+        if(now < next_tick) {
+            continue;
+        }
+
+        /* skip ticks we were too slow for instead of bursting. */
+        next_tick += config.interval_ms;
+        if(next_tick <= now) {
+            next_tick = now + config.interval_ms;
+        }
+
+        abex_buf_reset(&changes);
+        abex_buf_reset(&errors);
+
+        for(i = 0; i < req.spec_count; i++) {
+            sub_poll_item(&config, &items[i], i, &changes, &errors);
+        }
+
+        if(errors.len > 0 && frame_write(1, 1, errors.data, errors.len)) {
+            break;
+        }
+
+        if(changes.len > 0 && frame_write(1, 0, changes.data, changes.len)) {
+            break;
+        }
+    }
+
+    for(i = 0; i < req.spec_count; i++) {
+        if(items[i].tag > 0) {
+            plc_tag_destroy(items[i].tag);
+        }
+
+        free(items[i].attrs);
+        free(items[i].cur);
+        free(items[i].last);
+    }
+
+    free(items);
+    free_request(&req);
+    abex_buf_free(&changes);
+    abex_buf_free(&errors);
+    abex_buf_free(&input);
+
+    plc_tag_shutdown();
+
+    return rc < 0 ? 1 : 0;
+}
+
+
+struct sample_item_s {
+    int data_type;
+    char *attrs;
+    int32_t tag;
+    int reading;
+    int64_t start_us;
+};
+
+
+/* put the result of one read into the ring, straight from the tag buffer */
+static void sample_record(struct sample_ring_s *ring, struct sample_item_s *item, int index, int status)
+{
+    struct sample_ring_record_s *record;
+    uint8_t *data = sample_ring_claim(ring, &record);
+    int size = status == PLCTAG_STATUS_OK ? plc_tag_get_size(item->tag) : 0;
+
+    /* the buffer grew past the ring's records, which were sized when the tags were created */
+    if(size > (int)ring->header->data_size) {
+        status = PLCTAG_ERR_TOO_LARGE;
+        size = 0;
+    }
+
+    if(size > 0) {
+        status = plc_tag_get_raw_bytes(item->tag, 0, data, size);
+    }
+
+    record->timestamp_ns = sample_ring_now_ns();
+    record->tag_index = (uint32_t)index;
+    record->status = status;
+    record->data_len = status == PLCTAG_STATUS_OK && size > 0 ? (uint32_t)size : 0;
+
+    sample_ring_publish(ring, record);
+
+    if(status == PLCTAG_STATUS_OK) {
+        stats.bytes_read += record->data_len;
+    } else {
+        stats.errors++;
+    }
+}
+
+
+/*
+ * Start a read of every tag, then record each one as it finishes.  Reads
+ * still running at the next tick are aborted and recorded as timeouts, so
+ * a slow tag costs one sample, not the sampling rate.
+ */
+static void sample_tick(struct sample_ring_s *ring, struct sample_item_s *items, int count, int64_t until)
+{
+    int pending = 0;
+    int rc;
+    int i;
+
+    for(i = 0; i < count; i++) {
+        items[i].start_us = abex_time_us();
+        rc = plc_tag_read(items[i].tag, 0);
+
+        if(rc == PLCTAG_STATUS_OK || rc == PLCTAG_STATUS_PENDING) {
+            items[i].reading = 1;
+            pending++;
+        } else {
+            sample_record(ring, &items[i], i, rc);
+        }
+    }
+
+    while(pending > 0) {
+        int timed_out = abex_time_ms() >= until;
+
+        for(i = 0; i < count; i++) {
+            if(!items[i].reading) {
+                continue;
+            }
+
+            rc = plc_tag_status(items[i].tag);
+            if(rc == PLCTAG_STATUS_PENDING && !timed_out) {
+                continue;
+            }
+
+            if(rc == PLCTAG_STATUS_PENDING) {
+                plc_tag_abort(items[i].tag);
+                rc = PLCTAG_ERR_TIMEOUT;
+            }
+
+            tag_stats_since(&stats, TAG_STATS_READ, items[i].start_us);
+            sample_record(ring, &items[i], i, rc);
+            items[i].reading = 0;
+            pending--;
+        }
+
+        if(pending > 0) {
+            abex_sleep_ms(POLL_INTERVAL_MS);
+        }
+    }
+}
+
+
+/*
+ * --sample --ring=FILE: read every spec each --interval-ms and put the raw
+ * tag buffers, timestamped, into a ring file (see sample_ring.h) for
+ * another process to pick up, instead of writing values out.  The tags
+ * are created first, so each record has room for the largest of them.
+ *
+ * Writes one status 0 frame, "ready <ring file>", once sampling starts and
+ * runs until stdin is closed.  Errors before that go to stderr with exit
+ * status 1.  Subscription-style deadbands and retries do not apply: every
+ * read is recorded, failed ones with their status.
+ */
+int sample(int argc, char **argv)
+{
+    struct rw_request_s req = RW_REQUEST_INIT;
+    struct abex_buf_s errors = {NULL, 0, 0};
+    struct abex_buf_s input = {NULL, 0, 0};
+    struct sample_item_s *items = NULL;
+    struct sample_ring_s ring;
+    const char *ring_file = NULL;
+    int interval_ms = DEFAULT_SAMPLE_MS;
+    int records = SAMPLE_RING_DEFAULT_RECORDS;
+    int data_size = 0;
+    int64_t next_tick;
+    int rc = 0;
+    int i;
+
+    for(i = 2; i < argc; i++) {
+        if(!strncmp(argv[i], "--interval-ms=", strlen("--interval-ms="))) {
+            interval_ms = atoi(argv[i] + strlen("--interval-ms="));
+        } else if(!strncmp(argv[i], "--ring=", strlen("--ring="))) {
+            ring_file = argv[i] + strlen("--ring=");
+        } else if(!strncmp(argv[i], "--records=", strlen("--records="))) {
+            records = atoi(argv[i] + strlen("--records="));
+        }
+    }
+
+    if(interval_ms <= 0 || records <= 0 || !ring_file || !ring_file[0]) {
+        fprintf(stderr, "ERROR: --sample needs --ring=FILE, and --interval-ms and --records greater than zero\n");
+        exit(1);
+    }
+
+    if(parse_args(argc, argv, &req, &errors) || (req.batch_file && load_batch_file(&req, &errors))) {
+        fprintf(stderr, "%s", errors.data);
+        exit(1);
+    }
+
+    if(req.spec_count == 0) {
+        fprintf(stderr, "ERROR: --sample needs at least one -s spec or --batch file\n");
+        exit(1);
+    }
+
+    items = calloc((size_t)req.spec_count, sizeof(*items));
+    if(!items) {
+        fprintf(stderr, "ERROR: unable to allocate memory for sampling!\n");
+        exit(1);
+    }
+
+    for(i = 0; i < req.spec_count; i++) {
+        char *spec = req.specs[i];
+        char *sep = strchr(spec, ' ');
+        int size;
+
+        if(sep) {
+            *sep = 0;
+            items[i].data_type = data_type_from_name(spec);
+        }
+
+        /* records hold the tag buffer, which libplctag does not narrow to a bit. */
+        if(!sep || !items[i].data_type || items[i].data_type == PLC_LIB_BIT) {
+            fprintf(stderr, "ERROR: bad sample spec: %s\n", spec);
+            exit(1);
+        }
+
+        items[i].attrs = sep + 1;
+        items[i].tag = plc_tag_create(items[i].attrs, RETRY_MS);
+        if(items[i].tag < 0) {
+            fprintf(stderr, "ERROR %s: error creating tag %s\n", plc_tag_decode_error(items[i].tag), items[i].attrs);
+            exit(1);
+        }
+
+        size = plc_tag_get_size(items[i].tag);
+        if(size > data_size) {
+            data_size = size;
+        }
+    }
+
+    if(sample_ring_create(&ring, ring_file, (uint32_t)records, (uint32_t)data_size, (uint32_t)req.spec_count)) {
+        fprintf(stderr, "ERROR: unable to create the ring file %s\n", ring_file);
+        exit(1);
+    }
+
+    for(i = 0; i < req.spec_count; i++) {
+        struct sample_ring_tag_s *entry = &ring.tags[i];
+        int size = plc_tag_get_size(items[i].tag);
+
+        /* packed BOOL arrays are described as bytes, like --format=binary does. */
+        if(items[i].data_type == PLC_LIB_BOOL) {
+            entry->data_type = PLC_LIB_UINT8;
+            entry->elem_size = 1;
+            entry->elem_count = (uint32_t)(size > 0 ? size : 0);
+        } else {
+            entry->data_type = (uint16_t)items[i].data_type;
+            entry->elem_size = (uint16_t)tag_decode_size(items[i].data_type);
+            entry->elem_count = (uint32_t)tag_decode_count(items[i].data_type, (size_t)(size > 0 ? size : 0));
+        }
+
+        if(abex_attr_value(items[i].attrs, "name", entry->name, sizeof(entry->name))) {
+            entry->name[0] = 0;
+        }
+    }
+
+#if !defined(_WIN32)
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    abex_buf_reset(&errors);
+    abex_buf_printf(&errors, "ready %s", ring_file);
+    if(frame_write(1, 0, errors.data, errors.len)) {
+        rc = -1;
+    }
+
+    next_tick = abex_time_ms();
+
+    while(rc == 0) {
+        int64_t now = abex_time_ms();
+        int wait_ms = next_tick > now ? (int)(next_tick - now) : 0;
+
+        rc = frame_wait_readable(0, wait_ms);
+        if(rc < 0) {
+            break;
+        }
+
+        if(rc > 0) {
+            /* nothing is expected on stdin, EOF means we are done. */
+            rc = frame_read(0, &input) <= 0 ? 1 : 0;
+            continue;
+        }
+
+        now = abex_time_ms();
+        if(now < next_tick) {
+            continue;
+        }
+
+        /* skip ticks we were too slow for instead of bursting. */
+        next_tick += interval_ms;
+        if(next_tick <= now) {
+            next_tick = now + interval_ms;
+        }
+
+        sample_tick(&ring, items, req.spec_count, next_tick);
+    }
+
+    if(stats.enabled) {
+        abex_buf_reset(&errors);
+        format_stats(&errors);
+        abex_buf_printf(&errors, "counter overruns %" PRIu64 "\n", ring.header->overruns);
+        fwrite(errors.data, 1, errors.len, stderr);
+    }
+
+    for(i = 0; i < req.spec_count; i++) {
+        plc_tag_destroy(items[i].tag);
+    }
+
+    sample_ring_close(&ring);
+    free(items);
+    free_request(&req);
+    abex_buf_free(&errors);
+    abex_buf_free(&input);
+
+    plc_tag_shutdown();
+
+    return rc < 0 ? 1 : 0;
+}
+
+
+struct wq_entry_s {
+    struct wq_entry_s *next;
+    char *attrs;
+    int elem_size;
+    int state;
+    int due;
+    struct tag_rtt_config_s retry;
+
+    /* newest value not sent yet, and the ids (uint32) waiting for it */
+    int has_pending;
+    struct abex_buf_s pending;
+    struct abex_buf_s pending_ids;
+
+    /* value on its way out, and the ids waiting for it */
+    struct abex_buf_s sending;
+    struct abex_buf_s sending_ids;
+
+    int32_t tag;
+    int64_t deadline;
+    struct gateway_limit_ticket_s ticket;
+    struct tag_rtt_op_s op;
+    int64_t step_us;
+};
+
+struct wq_s {
+    struct wq_entry_s *head;
+    int inflight;
+    int max_inflight;
+    int flush_ms;
+
+    /* stdout is gone */
+    int closed;
+};
+
+#define WQ_IDLE     (0)
+#define WQ_TURN     (1)
+#define WQ_CREATING (2)
+#define WQ_WRITING  (3)
+
+#define DEFAULT_WQ_INFLIGHT (16)
+
+
+/*
+ * Answer every id in ids: "<id>" with status 0, or "<id> <message>" with
+ * status 1.  Fire-and-forget writes (id 0) only hear about errors, once
+ * per write however many of them were merged into it.
+ */
+static void wq_reply(struct wq_s *wq, const struct abex_buf_s *ids, int status, const char *message)
+{
+    struct abex_buf_s out = {NULL, 0, 0};
+    int anonymous = 0;
+    size_t i;
+
+    for(i = 0; i + 4 <= ids->len; i += 4) {
+        uint32_t id = get_le32((const uint8_t *)ids->data + i);
+
+        if(id == 0) {
+            anonymous = 1;
+            continue;
+        }
+
+        abex_buf_reset(&out);
+        abex_buf_printf(&out, "%lu", (unsigned long)id);
+        if(status) {
+            abex_buf_printf(&out, " %s", message);
+        }
+
+        if(frame_write(1, (uint8_t)status, out.data, out.len)) {
+            wq->closed = 1;
+        }
+    }
+
+    if(status && anonymous) {
+        abex_buf_reset(&out);
+        abex_buf_printf(&out, "0 %s", message);
+        if(frame_write(1, (uint8_t)status, out.data, out.len)) {
+            wq->closed = 1;
+        }
+    }
+
+    abex_buf_free(&out);
+}
+
+
+/* the write of entry->sending is over, with a PLCTAG status or a message of our own */
+static void wq_finish(struct wq_s *wq, struct tag_cache_s *cache, struct gateway_limit_s *limit, struct wq_entry_s *entry,
+                      int rc, const char *message)
+{
+    struct abex_buf_s out = {NULL, 0, 0};
+
+    if(rc == PLCTAG_ERR_TIMEOUT && entry->tag > 0) {
+        plc_tag_abort(entry->tag);
+    }
+
+    gateway_limit_release(limit, &entry->ticket);
+
+    if(rc == PLCTAG_STATUS_OK) {
+        wq_reply(wq, &entry->sending_ids, 0, "");
+    } else {
+        if(message) {
+            abex_buf_printf(&out, "%s", message);
+        } else if(entry->state == WQ_WRITING) {
+            abex_buf_printf(&out, "ERROR: error writing data: %s!", plc_tag_decode_error(rc));
+        } else if(entry->state == WQ_CREATING) {
+            abex_buf_printf(&out, "ERROR: tag creation error, tag status: %s", plc_tag_decode_error(rc));
+        } else {
+            abex_buf_printf(&out, "ERROR %s: no turn within the gateway request limit", plc_tag_decode_error(rc));
+        }
+
+        /* the connection may be gone, start over next time. */
+        if(!message && entry->tag > 0) {
+            tag_cache_evict(cache, entry->tag);
+        }
+
+        stats.errors++;
+        wq_reply(wq, &entry->sending_ids, 1, out.data);
+    }
+
+    abex_buf_reset(&entry->sending);
+    abex_buf_reset(&entry->sending_ids);
+    entry->tag = 0;
+    entry->state = WQ_IDLE;
+    wq->inflight--;
+
+    abex_buf_free(&out);
+}
+
+
+/* the tag is created: put the value in its buffer and start the write */
+static int wq_start_write(struct tag_cache_s *cache, struct wq_entry_s *entry, struct abex_buf_s *message)
+{
+    int size = plc_tag_get_size(entry->tag);
+    int rc;
+
+    if(entry->sending.len != (size_t)size) {
+        abex_buf_printf(message, "ERROR: got %d values to write but the tag has %d elements",
+                        (int)(entry->sending.len / (size_t)entry->elem_size), size / entry->elem_size);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    rc = plc_tag_set_raw_bytes(entry->tag, 0, (uint8_t *)entry->sending.data, (int)entry->sending.len);
+    if(rc != PLCTAG_STATUS_OK) {
+        abex_buf_printf(message, "ERROR: error setting data: %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    tag_cache_forget_reads(cache);
+    entry->step_us = abex_time_us();
+
+    return tag_rtt_op_start(&entry->op, tag_rtt_for(&rtt_table, entry->attrs), entry->tag, 1,
+                            tag_rtt_retries(&entry->retry, 1), entry->deadline);
+}
+
+
+/*
+ * Move every entry along, like run_batch_items() does for reads: wait for
+ * a turn on the gateway, create the tag (or take it from the cache), then
+ * write.  Nothing blocks, so writes to different tags are in flight
+ * together and libplctag can pack them into multi-service packets.  An
+ * entry starts its next write once its last one is done and it is due.
+ * Returns how many entries need polling again soon.
+ */
+static int wq_poll(struct wq_s *wq, struct tag_cache_s *cache, struct gateway_limit_s *limit)
+{
+    struct wq_entry_s **link = &wq->head;
+    struct abex_buf_s message = {NULL, 0, 0};
+    int busy = 0;
+    int rc;
+
+    while(*link) {
+        struct wq_entry_s *entry = *link;
+        int64_t now = abex_time_ms();
+
+        if(entry->state == WQ_IDLE && entry->has_pending && (entry->due || wq->flush_ms == 0)) {
+            if(wq->inflight >= wq->max_inflight) {
+                busy++;
+                link = &entry->next;
+                continue;
+            }
+
+            /* the buffers swap, so neither side allocates again. */
+            {
+                struct abex_buf_s tmp = entry->sending;
+
+                entry->sending = entry->pending;
+                entry->pending = tmp;
+                tmp = entry->sending_ids;
+                entry->sending_ids = entry->pending_ids;
+                entry->pending_ids = tmp;
+            }
+
+            abex_buf_reset(&entry->pending);
+            abex_buf_reset(&entry->pending_ids);
+            entry->has_pending = 0;
+            entry->due = 0;
+            entry->deadline = now + entry->retry.deadline_ms;
+            entry->state = WQ_TURN;
+            wq->inflight++;
+        }
+
+        if(entry->state == WQ_TURN) {
+            rc = gateway_limit_try(limit, entry->attrs, &entry->ticket);
+            if(rc == GATEWAY_LIMIT_WAIT) {
+                if(now > entry->deadline) {
+                    gateway_limit_cancel(limit, &entry->ticket);
+                    wq_finish(wq, cache, limit, entry, PLCTAG_ERR_TIMEOUT, NULL);
+                } else {
+                    busy++;
+                }
+            } else if(rc < 0) {
+                wq_finish(wq, cache, limit, entry, rc, NULL);
+            } else {
+                tag_stats_add(&stats, TAG_STATS_LIMIT_WAIT, entry->ticket.waited_ms * 1000);
+
+                entry->step_us = abex_time_us();
+                entry->tag = tag_cache_get(cache, entry->attrs, 0);
+                tag_stats_since(&stats, TAG_STATS_CREATE, entry->step_us);
+
+                if(entry->tag < 0) {
+                    abex_buf_reset(&message);
+                    abex_buf_printf(&message, "ERROR %s: error creating tag!", plc_tag_decode_error(entry->tag));
+                    entry->tag = 0;
+                    wq_finish(wq, cache, limit, entry, PLCTAG_ERR_CREATE, message.data);
+                } else {
+                    entry->state = WQ_CREATING;
+                }
+            }
+        }
+
+        /* a cached tag is ready at once and goes straight on to its write. */
+        if(entry->state == WQ_CREATING) {
+            rc = plc_tag_status(entry->tag);
+
+            if(rc == PLCTAG_STATUS_PENDING && now <= entry->deadline) {
+                busy++;
+            } else if(rc == PLCTAG_STATUS_PENDING) {
+                wq_finish(wq, cache, limit, entry, PLCTAG_ERR_TIMEOUT, NULL);
+            } else if(rc != PLCTAG_STATUS_OK) {
+                wq_finish(wq, cache, limit, entry, rc, NULL);
+            } else {
+                tag_stats_since(&stats, TAG_STATS_STATUS, entry->step_us);
+
+                abex_buf_reset(&message);
+                rc = wq_start_write(cache, entry, &message);
+                if(rc != PLCTAG_STATUS_PENDING) {
+                    /* not a PLC error, keep the tag. */
+                    wq_finish(wq, cache, limit, entry, rc, message.len ? message.data : NULL);
+                } else {
+                    entry->state = WQ_WRITING;
+                    busy++;
+                }
+            }
+        } else if(entry->state == WQ_WRITING) {
+            rc = tag_rtt_op_poll(&entry->op);
+            if(rc == PLCTAG_STATUS_PENDING) {
+                busy++;
+            } else {
+                tag_stats_since(&stats, TAG_STATS_WRITE, entry->step_us);
+                if(rc == PLCTAG_STATUS_OK) {
+                    stats.bytes_written += (uint64_t)entry->sending.len;
+                }
+
+                wq_finish(wq, cache, limit, entry, rc, NULL);
+            }
+        }
+
+        /* nothing to remember about a tag with nothing queued or in flight. */
+        if(entry->state == WQ_IDLE && !entry->has_pending) {
+            *link = entry->next;
+            free(entry->attrs);
+            abex_buf_free(&entry->pending);
+            abex_buf_free(&entry->pending_ids);
+            abex_buf_free(&entry->sending);
+            abex_buf_free(&entry->sending_ids);
+            free(entry);
+            continue;
+        }
+
+        link = &entry->next;
+    }
+
+    abex_buf_free(&message);
+
+    return busy;
+}
+
+
+/*
+ * Queue one framed write, "<id>\0<rw_tag write arguments>".  A write to a
+ * tag that already has a value waiting replaces that value, and the ids
+ * that waited for it wait for the new one: only the last value is sent.
+ * Errors in the request itself are answered at once.
+ */
+static void wq_submit(struct wq_s *wq, int argc, char **argv)
+{
+    struct rw_request_s req = RW_REQUEST_INIT;
+    struct abex_buf_s data = {NULL, 0, 0};
+    struct abex_buf_s attrs = {NULL, 0, 0};
+    struct abex_buf_s resolved = {NULL, 0, 0};
+    struct abex_buf_s out = {NULL, 0, 0};
+    struct abex_buf_s ids = {NULL, 0, 0};
+    struct wq_entry_s *entry;
+    struct wq_entry_s **link;
+    const char *tag_attrs;
+    uint8_t id_bytes[4];
+    uint32_t id = 0;
+    int elem_size = 0;
+    int rc = 1;
+
+    if(argc < 2) {
+        abex_buf_printf(&out, "ERROR: a queued write needs an id and arguments");
+    } else {
+        char *end = NULL;
+
+        id = (uint32_t)strtoul(argv[1], &end, 10);
+        if(!end || *end) {
+            id = 0;
+            abex_buf_printf(&out, "ERROR: bad write id: %s", argv[1]);
+        } else {
+            rc = 0;
+        }
+    }
+
+    /* the id takes the place of the program name, so argument indexes stay as in --serve. */
+    put_le32(id_bytes, id);
+    abex_buf_append(&ids, id_bytes, sizeof(id_bytes));
+
+    if(!rc) {
+        rc = parse_args(argc - 1, argv + 1, &req, &out);
+    }
+
+    if(!rc && (req.spec_count || req.batch_file || req.members || req.fragment
+               || !(req.payload_arg || (req.write_str && strlen(req.write_str))))) {
+        abex_buf_printf(&out, "ERROR: --write-queue takes one tag write per request");
+        rc = 1;
+    }
+
+    if(!rc && (!req.path || (!req.data_type && !req.catalog_dir))) {
+        abex_buf_printf(&out, "ERROR: Missing required arguments -p (path) or -t (type)");
+        rc = 1;
+    }
+
+    tag_attrs = req.path;
+    if(!rc && req.catalog_dir) {
+        rc = resolve_from_catalog(req.catalog_dir, req.path, &req.data_type, &resolved, &out);
+        tag_attrs = resolved.data;
+    }
+
+    if(!rc && req.data_type == PLC_LIB_BOOL) {
+        abex_buf_printf(&out, "ERROR: bool arrays can only be read");
+        rc = 1;
+    }
+
+    /* the queue writes whole buffers, a bit needs libplctag's read-modify-write. */
+    if(!rc && req.data_type == PLC_LIB_BIT) {
+        abex_buf_printf(&out, "ERROR: bits are not queued, write them without --write-queue");
+        rc = 1;
+    }
+
+    if(!rc) {
+        elem_size = (int)tag_decode_size(req.data_type);
+        rc = req.payload_arg ? load_payload(&req, argv + 1, 1, &data, &out)
+                             : encode_values(req.data_type, req.write_str, &data, &out);
+    }
+
+    if(!rc && (data.len == 0 || data.len % (size_t)elem_size)) {
+        abex_buf_printf(&out, "ERROR: write data is not a whole number of %d byte elements", elem_size);
+        rc = 1;
+    }
+
+    /* a write to a slice covers exactly the values given. */
+    if(!rc && req.sliced) {
+        rc = slice_attrs(tag_attrs, req.start, req.count ? req.count : (int)(data.len / (size_t)elem_size), &attrs, &out);
+        tag_attrs = attrs.data;
+    } else if(!rc && data.len == (size_t)elem_size && single_element_attrs(tag_attrs, &attrs)) {
+        tag_attrs = attrs.data;
+    }
+
+    if(rc) {
+        /* messages from the shared helpers end in a newline, frames do not. */
+        if(out.len && out.data[out.len - 1] == '\n') {
+            out.data[--out.len] = 0;
+        }
+
+        stats.errors++;
+        wq_reply(wq, &ids, 1, out.data);
+    } else {
+        for(link = &wq->head; *link && strcmp((*link)->attrs, tag_attrs); link = &(*link)->next) {
+        }
+
+        entry = *link;
+        if(!entry) {
+            entry = calloc(1, sizeof(*entry));
+            if(entry) {
+                entry->attrs = compat_strdup(tag_attrs);
+            }
+
+            if(!entry || !entry->attrs) {
+                free(entry);
+                wq_reply(wq, &ids, 1, "ERROR: unable to allocate memory for write queue!");
+                entry = NULL;
+            } else {
+                *link = entry;
+            }
+        }
+
+        if(entry) {
+            /* the newest value wins, nothing has been sent of the one it replaces. */
+            if(entry->has_pending) {
+                stats.coalesced++;
+            }
+
+            abex_buf_reset(&entry->pending);
+            abex_buf_append(&entry->pending, data.data, data.len);
+            abex_buf_append(&entry->pending_ids, id_bytes, sizeof(id_bytes));
+            entry->has_pending = 1;
+            entry->elem_size = elem_size;
+            entry->retry = req.retry;
+        }
+    }
+
+    abex_buf_free(&data);
+    abex_buf_free(&attrs);
+    abex_buf_free(&resolved);
+    abex_buf_free(&out);
+    abex_buf_free(&ids);
+    free_request(&req);
+}
+
+
+/*
+ * --write-queue: long-lived write-behind mode.  Each frame on stdin is a
+ * write, "<id>\0" followed by the arguments of a --serve write request,
+ * and is answered when it is done with a frame "<id>" (status 0) or
+ * "<id> <error>" (status 1).  Id 0 means nobody waits: only its errors are
+ * answered.
+ *
+ * Writes are queued per tag (attribute string) and a newer value replaces
+ * one that has not gone out yet, so a tag written faster than the PLC
+ * takes it gets only its latest value, and every id still gets an answer.
+ * A tag's queued value goes out when the tag's previous write is done, or
+ * with --flush-ms=N at the next N ms tick.  Up to --max-inflight writes to
+ * different tags are in flight at once.  Whatever is queued when stdin is
+ * closed is still written before exiting.
+ */
+int write_queue(int argc, char **argv)
+{
+    struct tag_cache_s cache = {NULL, 0};
+    struct gateway_limit_s limit;
+    struct abex_buf_s request = {NULL, 0, 0};
+    char *req_argv[FRAME_MAX_ARGS];
+    struct wq_s wq;
+    int idle_ms = DEFAULT_IDLE_MS;
+    int64_t next_flush;
+    int stopping = 0;
+    int busy = 0;
+    int req_argc;
+    int rc;
+    int i;
+
+    memset(&limit, 0, sizeof(limit));
+    memset(&wq, 0, sizeof(wq));
+    wq.max_inflight = DEFAULT_WQ_INFLIGHT;
+
+    for(i = 2; i < argc; i++) {
+        if(!strncmp(argv[i], "--flush-ms=", strlen("--flush-ms="))) {
+            wq.flush_ms = atoi(argv[i] + strlen("--flush-ms="));
+        } else if(!strncmp(argv[i], "--max-inflight=", strlen("--max-inflight="))) {
+            wq.max_inflight = atoi(argv[i] + strlen("--max-inflight="));
+        } else if(!strncmp(argv[i], "--idle-ms=", strlen("--idle-ms="))) {
+            idle_ms = atoi(argv[i] + strlen("--idle-ms="));
+        } else if(!strcmp(argv[i], "--stats")) {
+            /* already seen by main */
+        } else if((rc = gateway_limit_parse_arg(&limit.config, argv[i])) != 0) {
+            if(rc < 0) {
+                fprintf(stderr, "ERROR: bad limit option: %s\n", argv[i]);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "ERROR: unknown write queue option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if(wq.flush_ms < 0 || wq.max_inflight <= 0) {
+        fprintf(stderr, "ERROR: --flush-ms must not be negative and --max-inflight must be greater than zero\n");
+        exit(1);
+    }
+
+#if !defined(_WIN32)
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    next_flush = abex_time_ms() + wq.flush_ms;
+
+    while(!wq.closed) {
+        int64_t now = abex_time_ms();
+        int wait_ms = busy ? POLL_INTERVAL_MS : SWEEP_INTERVAL_MS;
+
+        if(wq.flush_ms > 0) {
+            if(now >= next_flush) {
+                struct wq_entry_s *entry;
+
+                for(entry = wq.head; entry; entry = entry->next) {
+                    entry->due = entry->has_pending;
+                }
+
+                /* skip ticks we were too slow for instead of bursting. */
+                next_flush += wq.flush_ms;
+                if(next_flush <= now) {
+                    next_flush = now + wq.flush_ms;
+                }
+            }
+
+            if(next_flush - now < wait_ms) {
+                wait_ms = (int)(next_flush - now);
+            }
+        }
+
+        busy = wq_poll(&wq, &cache, &limit);
+
+        if(stopping) {
+            if(!wq.head) {
+                break;
+            }
+
+            if(busy) {
+                abex_sleep_ms(POLL_INTERVAL_MS);
+            }
+
+            continue;
+        }
+
+        if(busy) {
+            wait_ms = POLL_INTERVAL_MS;
+        }
+
+        rc = frame_wait_readable(0, wait_ms);
+        if(rc == 0) {
+            tag_cache_sweep(&cache, idle_ms);
+            continue;
+        }
+
+        if(rc > 0) {
+            rc = frame_read(0, &request);
+        }
+
+        if(rc <= 0) {
+            /* EOF: write out what is queued, without waiting for ticks. */
+            wq.flush_ms = 0;
+            stopping = 1;
+            continue;
+        }
+
+        req_argc = frame_split_args(&request, argv[0], req_argv, FRAME_MAX_ARGS);
+        if(req_argc < 0) {
+            struct abex_buf_s ids = {NULL, 0, 0};
+            uint8_t zero[4] = {0, 0, 0, 0};
+
+            abex_buf_append(&ids, zero, sizeof(zero));
+            wq_reply(&wq, &ids, 1, "ERROR: too many arguments or bad payload length in request");
+            abex_buf_free(&ids);
+        } else {
+            wq_submit(&wq, req_argc, req_argv);
+        }
+    }
+
+    if(stats.enabled) {
+        abex_buf_reset(&request);
+        format_stats(&request);
+        fwrite(request.data, 1, request.len, stderr);
+    }
+
+    tag_cache_clear(&cache);
+    gateway_limit_clear(&limit);
+    tag_rtt_clear(&rtt_table);
+    abex_buf_free(&request);
+
+    plc_tag_shutdown();
+
+    return 0;
+}
+
+
+/* one-shot sink for --fragment pieces, errors still go to stderr at the end */
+static void write_partial_stdout(struct abex_buf_s *out)
+{
+    fwrite(out->data, 1, out->len, stdout);
+    fflush(stdout);
+    abex_buf_reset(out);
+}
+
+
+/* a one-shot run's arguments as the broker gets them, see broker_request_args() */
+struct broker_args_s {
+    char **argv;
+    int argc;
+
+    /* batch specs and absolute paths made for them */
+    char **owned;
+    int owned_count;
+};
+
+#define BROKER_ARGS_INIT {NULL, 0, NULL, 0}
+
+static char *own_string(struct broker_args_s *args, char *str)
+{
+    char **owned = str ? realloc(args->owned, sizeof(char *) * (size_t)(args->owned_count + 1)) : NULL;
+
+    if(!owned) {
+        free(str);
+        return NULL;
+    }
+
+    args->owned = owned;
+    args->owned[args->owned_count++] = str;
+
+    return str;
+}
+
+static void free_broker_args(struct broker_args_s *args)
+{
+    int i;
+
+    for(i = 0; i < args->owned_count; i++) {
+        free(args->owned[i]);
+    }
+
+    free(args->owned);
+    free(args->argv);
+}
+
+/* path relative to this process' working directory, not the broker's */
+static char *absolute_path(const char *path)
+{
+#if !defined(_WIN32)
+    char cwd[CATALOG_FILE_SIZE];
+    char *abs;
+
+    if(path[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+        abs = malloc(strlen(cwd) + strlen(path) + 2);
+        if(abs) {
+            sprintf(abs, "%s/%s", cwd, path);
+        }
+
+        return abs;
+    }
+#endif
+
+    return compat_strdup(path);
+}
+
+/*
+ * The arguments of a one-shot run as the broker should see them: less
+ * --broker=, with --batch files read here (the broker's stdin and working
+ * directory are not ours) and sent as -s specs, and --catalog-dir made
+ * absolute.  Returns 0, or 1 with the error in out.
+ */
+static int broker_request_args(int argc, char **argv, struct broker_args_s *args, struct abex_buf_s *out)
+{
+    struct rw_request_s batch = RW_REQUEST_INIT;
+    int rc = 0;
+    int i;
+
+    for(i = 1; i < argc && !rc; i++) {
+        if(!strncmp(argv[i], "--batch=", strlen("--batch="))) {
+            batch.batch_file = compat_strdup(argv[i] + strlen("--batch="));
+            rc = !batch.batch_file || load_batch_file(&batch, out);
+            free(batch.batch_file);
+            batch.batch_file = NULL;
+        }
+    }
+
+    args->argv = malloc(sizeof(char *) * (size_t)(argc + 2 * batch.spec_count));
+    if(rc || !args->argv) {
+        free_request(&batch);
+        return 1;
+    }
+
+    args->argv[args->argc++] = argv[0];
+
+    for(i = 1; i < argc && !rc; i++) {
+        if(!strncmp(argv[i], "--catalog-dir=", strlen("--catalog-dir="))) {
+            char *dir = absolute_path(argv[i] + strlen("--catalog-dir="));
+            char *arg = dir ? malloc(strlen("--catalog-dir=") + strlen(dir) + 1) : NULL;
+
+            if(arg) {
+                sprintf(arg, "--catalog-dir=%s", dir);
+            }
+
+            free(dir);
+            rc = !(args->argv[args->argc++] = own_string(args, arg));
+        } else if(strncmp(argv[i], "--batch=", strlen("--batch=")) && strncmp(argv[i], BROKER_ARG, strlen(BROKER_ARG))) {
+            args->argv[args->argc++] = argv[i];
+        }
+    }
+
+    for(i = 0; i < batch.spec_count && !rc; i++) {
+        args->argv[args->argc++] = "-s";
+        rc = !(args->argv[args->argc++] = own_string(args, batch.specs[i]));
+        batch.specs[i] = NULL;
+    }
+
+    free_request(&batch);
+
+    if(rc) {
+        abex_buf_printf(out, "ERROR: unable to allocate memory for the broker request!\n");
+    }
+
+    return rc;
+}
+
+
+/*
+ * A one-shot run sent to the broker on fd as one request: the arguments
+ * from broker_request_args(), with a --payload moved last and its bytes
+ * read from stdin.  --fragment pieces are written out as they arrive, the
+ * final answer goes to out.  Returns the status of the request.
+ */
+static int run_via_broker(int fd, int argc, char **argv, struct abex_buf_s *out)
+{
+    char *req_argv[FRAME_MAX_ARGS];
+    struct abex_buf_s payload = {NULL, 0, 0};
+    struct abex_buf_s reply = {NULL, 0, 0};
+    char *payload_arg = NULL;
+    int req_argc = 0;
+    int status;
+    int i;
+
+    for(i = 1; i < argc && req_argc < FRAME_MAX_ARGS - 1; i++) {
+        if(!strncmp(argv[i], FRAME_PAYLOAD_ARG, strlen(FRAME_PAYLOAD_ARG))) {
+            payload_arg = argv[i];
+        } else {
+            req_argv[req_argc++] = argv[i];
+        }
+    }
+
+    if(payload_arg) {
+        size_t len = (size_t)strtoul(payload_arg + strlen(FRAME_PAYLOAD_ARG), NULL, 10);
+
+        if(abex_buf_reserve(&payload, len) || fread(payload.data, 1, len, stdin) != len) {
+            abex_buf_printf(out, "ERROR: expected %lu payload bytes on stdin\n", (unsigned long)len);
+            abex_buf_free(&payload);
+            return 1;
+        }
+
+        payload.len = len;
+        req_argv[req_argc++] = payload_arg;
+    }
+
+    if(frame_write_args(fd, req_argc, req_argv, payload.data, payload.len)) {
+        abex_buf_printf(out, "ERROR: unable to send the request to the broker\n");
+        abex_buf_free(&payload);
+        return 1;
+    }
+
+    abex_buf_free(&payload);
+
+    /* the broker may have done a write before going away, so there is no second try. */
+    while((status = broker_reply(fd, &reply, BROKER_REPLY_TIMEOUT_MS)) == STATUS_MORE) {
+        fwrite(reply.data + 1, 1, reply.len - 1, stdout);
+        fflush(stdout);
+    }
+
+    if(status < 0) {
+        abex_buf_printf(out, "ERROR: no answer from the broker\n");
+        status = 1;
+    } else {
+        abex_buf_append(out, reply.data + 1, reply.len - 1);
+    }
+
+    abex_buf_free(&reply);
+
+    return status;
+}
+
+
+int main(int argc, char **argv)
+{
+    struct tag_cache_s cache = {NULL, 0};
+    struct gateway_limit_s limit;
+    struct abex_buf_s out = {NULL, 0, 0};
+    struct broker_args_s broker_args = BROKER_ARGS_INIT;
+    const char *broker_path;
+    int64_t start_us = abex_time_us();
+    int64_t output_us;
+    int broker_fd;
+    int rc;
+    int i;
+
+    /* check library version */
+    if(plc_tag_check_lib_version(REQUIRED_VERSION) != PLCTAG_STATUS_OK) {
+        fprintf(stderr, "ERROR: Required library version %d.%d.%d not available!\n", REQUIRED_VERSION);
+        exit(1);
+    }
+
+    /* --stats: time this run (or every --serve request), written to stderr at the end */
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--stats")) {
+            stats.enabled = 1;
+        }
+    }
+
+    tag_stats_since(&stats, TAG_STATS_LIB_CHECK, start_us);
+
+    if(argc > 1 && !strcmp(argv[1], "--serve")) {
+        return serve(argc, argv);
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "--subscribe")) {
+        return subscribe(argc, argv);
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "--sample")) {
+        return sample(argc, argv);
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "--write-queue")) {
+        return write_queue(argc, argv);
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "--broker")) {
+        return broker(argc, argv);
+    }
+
+    /* limits only pace this one run unless they share a --limit-dir. */
+    memset(&limit, 0, sizeof(limit));
+    for(i = 1; i < argc; i++) {
+        if(gateway_limit_parse_arg(&limit.config, argv[i]) < 0) {
+            fprintf(stderr, "ERROR: bad limit option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    /* with a broker listening, its connections are used instead of opening new ones. */
+    broker_path = broker_socket_path(argc, argv);
+    broker_fd = broker_path ? broker_connect(broker_path) : -1;
+    rc = 0;
+
+    if(broker_fd >= 0) {
+        rc = broker_request_args(argc, argv, &broker_args, &out);
+
+        /* more specs than one request takes: read them from here. */
+        if(!rc && broker_args.argc > FRAME_MAX_ARGS) {
+            broker_disconnect(broker_fd);
+            broker_fd = -1;
+        }
+    }
+
+    if(rc) {
+        broker_disconnect(broker_fd);
+    } else if(broker_fd >= 0) {
+        rc = run_via_broker(broker_fd, broker_args.argc, broker_args.argv, &out);
+        broker_disconnect(broker_fd);
+    } else {
+        partial_sink = write_partial_stdout;
+        rc = broker_args.argv ? run_request(&cache, &limit, broker_args.argc, broker_args.argv, 0, &out)
+                              : run_request(&cache, &limit, argc, argv, 0, &out);
+    }
+
+    free_broker_args(&broker_args);
+
+    output_us = abex_time_us();
+    if(out.len > 0) {
+        fwrite(out.data, 1, out.len, rc ? stderr : stdout);
+        fflush(rc ? stderr : stdout);
+    }
+
+    if(stats.enabled) {
+        tag_stats_since(&stats, TAG_STATS_OUTPUT, output_us);
+        tag_stats_since(&stats, TAG_STATS_TOTAL, start_us);
+        stats.errors += rc ? 1 : 0;
+
+        abex_buf_reset(&out);
+        format_stats(&out);
+        fwrite(out.data, 1, out.len, stderr);
+    }
+
+    tag_cache_clear(&cache);
+    gateway_limit_clear(&limit);
+    tag_rtt_clear(&rtt_table);
+    abex_buf_free(&out);
+
+    return rc;
+}
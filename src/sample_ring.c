@@ -0,0 +1,288 @@
+/***************************************************************************
+ *   Memory-mapped ring of timestamped tag samples.                        *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sample_ring.h"
+
+#if !defined(_WIN32)
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#define RECORD_HEADER_SIZE (sizeof(struct sample_ring_record_s))
+
+
+int64_t sample_ring_now_ns(void)
+{
+#if defined(_WIN32)
+    return (int64_t)time(NULL) * 1000000000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ((int64_t)ts.tv_sec * 1000000000) + (int64_t)ts.tv_nsec;
+#endif
+}
+
+
+#if !defined(_WIN32)
+
+/* GCC and Clang builtins, the producer and readers may be on other cores */
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int map_file(struct sample_ring_s *ring, size_t size)
+{
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+
+    if(map == MAP_FAILED) {
+        return 1;
+    }
+
+    ring->map_size = size;
+    ring->header = (struct sample_ring_header_s *)map;
+    ring->tags = (struct sample_ring_tag_s *)((uint8_t *)map + ring->header->header_size);
+    ring->records = (uint8_t *)map + ring->header->records_offset;
+
+    return 0;
+}
+
+
+/*
+ * Create (or start over) the ring file at path with room for capacity
+ * samples of up to data_size bytes.  The caller fills in ring->tags.
+ * Returns 0 on success.
+ */
+int sample_ring_create(struct sample_ring_s *ring, const char *path, uint32_t capacity, uint32_t data_size,
+                       uint32_t tag_count)
+{
+    struct sample_ring_header_s header;
+    size_t size;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, SAMPLE_RING_MAGIC, sizeof(header.magic));
+    header.version = SAMPLE_RING_VERSION;
+    header.header_size = (uint32_t)sizeof(header);
+    header.record_size = (uint32_t)((RECORD_HEADER_SIZE + data_size + 7) & ~(size_t)7);
+    header.capacity = capacity;
+    header.data_size = data_size;
+    header.tag_count = tag_count;
+    header.records_offset = header.header_size + tag_count * (uint32_t)sizeof(struct sample_ring_tag_s);
+
+    size = (size_t)header.records_offset + (size_t)capacity * header.record_size;
+
+    /* readers of an earlier run keep their old file instead of seeing it change under them. */
+    unlink(path);
+
+    ring->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(ring->fd < 0) {
+        return 1;
+    }
+
+    if(ftruncate(ring->fd, (off_t)size) || pwrite(ring->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+       || map_file(ring, size)) {
+        close(ring->fd);
+        ring->fd = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Start the next sample: returns where its data goes and sets *record to
+ * its header, to be filled in and passed to sample_ring_publish().  A
+ * sample the readers have not consumed yet is overwritten and counted.
+ */
+uint8_t *sample_ring_claim(struct sample_ring_s *ring, struct sample_ring_record_s **record)
+{
+    struct sample_ring_header_s *header = ring->header;
+    uint64_t n = header->head;
+    struct sample_ring_record_s *rec;
+
+    if(n >= header->capacity && LOAD_ACQUIRE(&header->tail) <= n - header->capacity) {
+        STORE_RELEASE(&header->overruns, header->overruns + 1);
+    }
+
+    rec = (struct sample_ring_record_s *)(ring->records + (size_t)(n % header->capacity) * header->record_size);
+
+    /* readers of the old sample see it go away before any byte changes. */
+    STORE_RELEASE(&rec->seq, (uint64_t)0);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    *record = rec;
+
+    return (uint8_t *)rec + RECORD_HEADER_SIZE;
+}
+
+
+void sample_ring_publish(struct sample_ring_s *ring, struct sample_ring_record_s *record)
+{
+    uint64_t n = ring->header->head;
+
+    STORE_RELEASE(&record->seq, n + 1);
+    STORE_RELEASE(&ring->header->head, n + 1);
+}
+
+
+/* map an existing ring for reading.  Returns 0 on success. */
+int sample_ring_attach(struct sample_ring_s *ring, const char *path)
+{
+    struct sample_ring_header_s header;
+    struct stat st;
+
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = open(path, O_RDWR);
+    if(ring->fd < 0) {
+        return 1;
+    }
+
+    if(pread(ring->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+       || memcmp(header.magic, SAMPLE_RING_MAGIC, sizeof(header.magic)) || header.version != SAMPLE_RING_VERSION
+       || fstat(ring->fd, &st) || (size_t)st.st_size < (size_t)header.records_offset + (size_t)header.capacity * header.record_size
+       || map_file(ring, (size_t)st.st_size)) {
+        close(ring->fd);
+        ring->fd = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* number of samples published so far */
+uint64_t sample_ring_head(const struct sample_ring_s *ring)
+{
+    return LOAD_ACQUIRE(&ring->header->head);
+}
+
+
+/*
+ * Sample n in place, or NULL if it was overwritten or is not there yet.
+ * The data follows the record header.  Check sample_ring_still_valid()
+ * after using it.
+ */
+const struct sample_ring_record_s *sample_ring_get(const struct sample_ring_s *ring, uint64_t n)
+{
+    const struct sample_ring_record_s *rec;
+
+    rec = (const struct sample_ring_record_s *)(ring->records + (size_t)(n % ring->header->capacity) *
+                                                ring->header->record_size);
+
+    return LOAD_ACQUIRE(&rec->seq) == n + 1 ? rec : NULL;
+}
+
+
+/* whether the data read from record was all sample n */
+int sample_ring_still_valid(const struct sample_ring_record_s *record, uint64_t n)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return LOAD_ACQUIRE(&record->seq) == n + 1;
+}
+
+
+/* every sample before n has been read, so overwriting them is no overrun */
+void sample_ring_consumed(struct sample_ring_s *ring, uint64_t n)
+{
+    STORE_RELEASE(&ring->header->tail, n);
+}
+
+
+void sample_ring_close(struct sample_ring_s *ring)
+{
+    if(ring->header) {
+        munmap(ring->header, ring->map_size);
+    }
+
+    if(ring->fd >= 0) {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+#else
+
+/* no shared memory mapping here, --sample reports that it cannot open the ring. */
+int sample_ring_create(struct sample_ring_s *ring, const char *path, uint32_t capacity, uint32_t data_size,
+                       uint32_t tag_count)
+{
+    (void)path;
+    (void)capacity;
+    (void)data_size;
+    (void)tag_count;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    return 1;
+}
+
+uint8_t *sample_ring_claim(struct sample_ring_s *ring, struct sample_ring_record_s **record)
+{
+    (void)ring;
+    *record = NULL;
+
+    return NULL;
+}
+
+void sample_ring_publish(struct sample_ring_s *ring, struct sample_ring_record_s *record)
+{
+    (void)ring;
+    (void)record;
+}
+
+int sample_ring_attach(struct sample_ring_s *ring, const char *path)
+{
+    return sample_ring_create(ring, path, 0, 0, 0);
+}
+
+uint64_t sample_ring_head(const struct sample_ring_s *ring)
+{
+    (void)ring;
+
+    return 0;
+}
+
+const struct sample_ring_record_s *sample_ring_get(const struct sample_ring_s *ring, uint64_t n)
+{
+    (void)ring;
+    (void)n;
+
+    return NULL;
+}
+
+int sample_ring_still_valid(const struct sample_ring_record_s *record, uint64_t n)
+{
+    (void)record;
+    (void)n;
+
+    return 0;
+}
+
+void sample_ring_consumed(struct sample_ring_s *ring, uint64_t n)
+{
+    (void)ring;
+    (void)n;
+}
+
+void sample_ring_close(struct sample_ring_s *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+#endif
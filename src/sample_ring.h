@@ -0,0 +1,100 @@
+/***************************************************************************
+ *   Memory-mapped ring of timestamped tag samples, written by            *
+ *   rw_tag --sample and read in place by any process that maps the file  *
+ *   (a NIF, a historian).                                                *
+ *                                                                         *
+ *   One producer, any number of readers, no locks: a record is claimed   *
+ *   by zeroing its seq, filled in, then published by storing its seq and *
+ *   the new head with release ordering.  A reader checks the record seq  *
+ *   before and after using the data; a changed seq means the producer    *
+ *   lapped it.  The producer never waits.  A reader that wants overruns  *
+ *   counted stores how far it got in tail.                                *
+ *                                                                         *
+ *   File layout (little-endian): the header, tag_count tag entries, then *
+ *   capacity records of record_size bytes.  Sample n (from 0) is in slot *
+ *   n % capacity and has seq n + 1.                                       *
+ *                                                                         *
+ *   POSIX only.                                                           *
+ ***************************************************************************/
+
+#ifndef __SAMPLE_RING_H__
+#define __SAMPLE_RING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SAMPLE_RING_MAGIC "ABEXRING"
+#define SAMPLE_RING_VERSION (1)
+
+#define SAMPLE_RING_NAME_SIZE (56)
+#define SAMPLE_RING_DEFAULT_RECORDS (4096)
+
+struct sample_ring_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t data_size;
+    uint32_t tag_count;
+
+    /* samples written (producer), samples consumed (reader), samples overwritten unread */
+    uint64_t head;
+    uint64_t tail;
+    uint64_t overruns;
+
+    /* offset of the first record */
+    uint32_t records_offset;
+    uint32_t reserved;
+};
+
+/* what each tag index in the records stands for */
+struct sample_ring_tag_s {
+    uint16_t data_type;
+    uint16_t elem_size;
+    uint32_t elem_count;
+    char name[SAMPLE_RING_NAME_SIZE];
+};
+
+struct sample_ring_record_s {
+    /* sample number + 1, 0 while the producer writes the record */
+    uint64_t seq;
+
+    /* wall clock when the read finished, ns since the epoch */
+    int64_t timestamp_ns;
+
+    uint32_t tag_index;
+
+    /* PLCTAG status of the read, data_len is 0 unless it is PLCTAG_STATUS_OK */
+    int32_t status;
+    uint32_t data_len;
+    uint32_t reserved;
+
+    /* data_size bytes of tag buffer follow */
+};
+
+struct sample_ring_s {
+    int fd;
+    size_t map_size;
+    struct sample_ring_header_s *header;
+    struct sample_ring_tag_s *tags;
+    uint8_t *records;
+};
+
+/* producer */
+extern int sample_ring_create(struct sample_ring_s *ring, const char *path, uint32_t capacity, uint32_t data_size,
+                              uint32_t tag_count);
+extern uint8_t *sample_ring_claim(struct sample_ring_s *ring, struct sample_ring_record_s **record);
+extern void sample_ring_publish(struct sample_ring_s *ring, struct sample_ring_record_s *record);
+
+/* readers */
+extern int sample_ring_attach(struct sample_ring_s *ring, const char *path);
+extern uint64_t sample_ring_head(const struct sample_ring_s *ring);
+extern const struct sample_ring_record_s *sample_ring_get(const struct sample_ring_s *ring, uint64_t n);
+extern int sample_ring_still_valid(const struct sample_ring_record_s *record, uint64_t n);
+extern void sample_ring_consumed(struct sample_ring_s *ring, uint64_t n);
+
+extern int64_t sample_ring_now_ns(void);
+extern void sample_ring_close(struct sample_ring_s *ring);
+
+#endif
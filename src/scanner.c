@@ -0,0 +1,800 @@
+/***************************************************************************
+ *   Scan many tags on many controllers from one process.                  *
+ *                                                                         *
+ *   Tags are grouped by gateway and every gateway gets a worker thread    *
+ *   that reads its tags once per cycle without blocking, with at most     *
+ *   --per-gateway requests in flight on that gateway and --max-inflight   *
+ *   across all of them.  Each gateway's results are written as one frame  *
+ *   (same framing as rw_tag --serve) as soon as its cycle is done.        *
+ *                                                                         *
+ *   scanner [options] -s "<type> <attribute string>" ... | --config=FILE  *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "compat_utils.h"
+#include <libplctag/lib/libplctag.h>
+#include "abex_util.h"
+#include "frame_io.h"
+#include "tag_decode.h"
+#include "gateway_limit.h"
+#include "tag_rtt.h"
+#include "tag_stats.h"
+
+#define REQUIRED_VERSION 2, 2, 1
+
+#define FORMAT_TEXT    (0)
+#define FORMAT_BINARY  (1)
+
+#define DEFAULT_CYCLE_MS (1000)
+#define DEFAULT_MAX_INFLIGHT (64)
+#define DEFAULT_PER_GATEWAY (4)
+
+/* workers poll pending tags this often and check for shutdown at least this often */
+#define POLL_INTERVAL_MS (1)
+#define STOP_CHECK_MS (50)
+
+#define TAG_SPEC_SIZE (1024)
+#define GATEWAY_SIZE (256)
+
+/*
+ * Frames are status 0 and hold one gateway's results for one cycle.
+ *
+ * Text:   "cycle <n> <gateway>" then "<spec index> ok <values>" or
+ *         "<spec index> error <message>" per tag, one per line.
+ * Binary: uint32 cycle, uint16 gateway length, gateway, then per tag a
+ *         uint32 spec index and an int32 status followed by a binary block
+ *         (status 0) or a uint16 length and the error message.
+ *
+ * Tags come in the order they finished.  A status 1 frame holds a fatal
+ * error message.
+ *
+ * With --stats a gateway answers a "stats" frame on stdin, and every
+ * --stats-every cycles, with a status 2 frame: "stats <gateway>" then the
+ * lines of tag_stats_format() and tag_rtt_format() for that gateway.
+ */
+
+enum {
+    ITEM_WAITING,
+    ITEM_CREATING,
+    ITEM_READING,
+    ITEM_DONE
+};
+
+struct scan_item_s {
+    int index;
+    int data_type;
+    char *attrs;
+    int32_t tag;
+    int state;
+    int64_t deadline;
+    struct gateway_limit_ticket_s ticket;
+    struct tag_rtt_op_s op;
+
+    /* start of the current state, for --stats */
+    int64_t step_us;
+};
+
+struct scan_gateway_s {
+    char name[GATEWAY_SIZE];
+    struct scan_item_s *items;
+    int count;
+    int capacity;
+    pthread_t thread;
+    struct abex_buf_s out;
+    struct abex_buf_s scratch;
+
+    /* only touched by the gateway's worker */
+    struct tag_rtt_s rtt;
+    struct tag_stats_s stats;
+    long stats_seen;
+};
+
+struct scan_config_s {
+    int cycle_ms;
+    int max_inflight;
+    int per_gateway;
+    long cycles;
+    int format;
+
+    /* --deadline-ms for creating and reading one tag, --retries for timed out reads */
+    struct tag_rtt_config_s retry;
+
+    /* --stats, and --stats-every cycles to send them without being asked */
+    int stats;
+    long stats_every;
+};
+
+/* state shared by the workers, all under mutex */
+struct scan_shared_s {
+    pthread_mutex_t mutex;
+    int in_flight;
+    int stop;
+    int finished;
+
+    /* bumped by every "stats" frame, each worker answers once per bump */
+    long stats_requested;
+};
+
+static struct scan_config_s config = {DEFAULT_CYCLE_MS, DEFAULT_MAX_INFLIGHT, DEFAULT_PER_GATEWAY, 0, FORMAT_TEXT,
+                                      TAG_RTT_CONFIG_INIT, 0, 0};
+static struct scan_shared_s shared;
+
+/* --rate-limit etc., shared by all workers */
+static struct gateway_limit_s limit;
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* take one of the --max-inflight request slots, 0 if none is free */
+static int slot_acquire(void)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&shared.mutex);
+    if(shared.in_flight < config.max_inflight) {
+        shared.in_flight++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&shared.mutex);
+
+    return ok;
+}
+
+static void slot_release(void)
+{
+    pthread_mutex_lock(&shared.mutex);
+    shared.in_flight--;
+    pthread_mutex_unlock(&shared.mutex);
+}
+
+static int stopping(void)
+{
+    int stop;
+
+    pthread_mutex_lock(&shared.mutex);
+    stop = shared.stop;
+    pthread_mutex_unlock(&shared.mutex);
+
+    return stop;
+}
+
+
+static void decode_result(struct scan_gateway_s *gw, struct scan_item_s *item, int status)
+{
+    int size;
+
+    /* copy the buffer out once and convert it in one pass. */
+    if(status == PLCTAG_STATUS_OK) {
+        size = plc_tag_get_size(item->tag);
+        abex_buf_reset(&gw->scratch);
+
+        if(size < 0) {
+            status = size;
+        } else if(abex_buf_reserve(&gw->scratch, (size_t)size)) {
+            status = PLCTAG_ERR_NO_MEM;
+        } else if(item->data_type == PLC_LIB_BIT) {
+            /* libplctag knows which bit of the buffer the tag name picked */
+            status = plc_tag_get_bit(item->tag, 0);
+            gw->scratch.data[0] = (char)(status > 0);
+            gw->scratch.len = 1;
+            status = status < 0 ? status : PLCTAG_STATUS_OK;
+        } else {
+            status = plc_tag_get_raw_bytes(item->tag, 0, (uint8_t *)gw->scratch.data, size);
+            gw->scratch.len = (size_t)size;
+        }
+    }
+
+    if(config.format == FORMAT_BINARY) {
+        uint8_t header[8];
+        size_t start = gw->out.len;
+
+        put_le32(header, (uint32_t)item->index);
+        put_le32(header + 4, (uint32_t)status);
+        abex_buf_append(&gw->out, header, sizeof(header));
+
+        if(status == PLCTAG_STATUS_OK
+           && !tag_decode_block(item->data_type, (const uint8_t *)gw->scratch.data, gw->scratch.len, &gw->out)) {
+            return;
+        }
+
+        if(status == PLCTAG_STATUS_OK) {
+            /* out of memory while decoding */
+            gw->out.len = start;
+            status = PLCTAG_ERR_NO_MEM;
+            put_le32(header + 4, (uint32_t)status);
+            abex_buf_append(&gw->out, header, sizeof(header));
+        }
+
+        put_le16(header, (uint16_t)strlen(plc_tag_decode_error(status)));
+        abex_buf_append(&gw->out, header, 2);
+        abex_buf_append(&gw->out, plc_tag_decode_error(status), strlen(plc_tag_decode_error(status)));
+    } else if(status == PLCTAG_STATUS_OK) {
+        abex_buf_printf(&gw->out, "%d ok ", item->index);
+        tag_decode_text(item->data_type, (const uint8_t *)gw->scratch.data,
+                        tag_decode_count(item->data_type, gw->scratch.len), &gw->out);
+        abex_buf_append(&gw->out, "\n", 1);
+    } else {
+        abex_buf_printf(&gw->out, "%d error %s\n", item->index, plc_tag_decode_error(status));
+    }
+}
+
+/* add a tag's result to the gateway's frame */
+static void append_result(struct scan_gateway_s *gw, struct scan_item_s *item, int status)
+{
+    int64_t start_us = abex_time_us();
+    int size = status == PLCTAG_STATUS_OK ? plc_tag_get_size(item->tag) : 0;
+
+    if(size > 0) {
+        gw->stats.bytes_read += (uint64_t)size;
+    }
+
+    if(status != PLCTAG_STATUS_OK) {
+        gw->stats.errors++;
+    }
+
+    decode_result(gw, item, status);
+    tag_stats_since(&gw->stats, TAG_STATS_DECODE, start_us);
+}
+
+/* report a failed tag and drop its handle, it is created again next cycle */
+static void fail_item(struct scan_gateway_s *gw, struct scan_item_s *item, int status)
+{
+    if(item->tag > 0) {
+        plc_tag_abort(item->tag);
+        plc_tag_destroy(item->tag);
+    }
+
+    item->tag = 0;
+    item->state = ITEM_DONE;
+    append_result(gw, item, status);
+}
+
+/* create the tag if needed, else start a read, both before the item deadline */
+static void start_item(struct scan_gateway_s *gw, struct scan_item_s *item)
+{
+    int rc;
+
+    item->step_us = abex_time_us();
+
+    if(item->tag <= 0) {
+        item->tag = plc_tag_create(item->attrs, 0);
+        tag_stats_since(&gw->stats, TAG_STATS_CREATE, item->step_us);
+        item->step_us = abex_time_us();
+        if(item->tag < 0) {
+            fail_item(gw, item, item->tag);
+            return;
+        }
+
+        item->state = ITEM_CREATING;
+        return;
+    }
+
+    rc = tag_rtt_op_start(&item->op, &gw->rtt, item->tag, 0, config.retry.retries, item->deadline);
+    if(rc != PLCTAG_STATUS_PENDING) {
+        fail_item(gw, item, rc);
+        return;
+    }
+
+    item->state = ITEM_READING;
+}
+
+/* move a pending tag along, timed out reads are retried, returns 1 if its state changed */
+static int poll_item(struct scan_gateway_s *gw, struct scan_item_s *item)
+{
+    int rc = item->state == ITEM_READING ? tag_rtt_op_poll(&item->op) : plc_tag_status(item->tag);
+
+    if(rc == PLCTAG_STATUS_PENDING) {
+        if(item->state == ITEM_CREATING && abex_time_ms() > item->deadline) {
+            fail_item(gw, item, PLCTAG_ERR_TIMEOUT);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        fail_item(gw, item, rc);
+        return 1;
+    }
+
+    tag_stats_since(&gw->stats, item->state == ITEM_CREATING ? TAG_STATS_STATUS : TAG_STATS_READ, item->step_us);
+
+    if(item->state == ITEM_CREATING) {
+        /* the creation slot carries over to the read. */
+        start_item(gw, item);
+        return 1;
+    }
+
+    item->state = ITEM_DONE;
+    append_result(gw, item, PLCTAG_STATUS_OK);
+
+    return 1;
+}
+
+
+/*
+ * Read every tag of a gateway once, keeping up to --per-gateway of them
+ * in flight and never more than the free --max-inflight slots.  With
+ * gateway limits a tag also waits for its turn, in line with every other
+ * process using the same --limit-dir.
+ */
+static void run_cycle(struct scan_gateway_s *gw)
+{
+    int next = 0;
+    int active = 0;
+    int done = 0;
+    int i;
+
+    for(i = 0; i < gw->count; i++) {
+        gw->items[i].state = ITEM_WAITING;
+    }
+
+    while(done < gw->count) {
+        int progress = 0;
+
+        while(active < config.per_gateway && next < gw->count && slot_acquire()) {
+            struct scan_item_s *item = &gw->items[next];
+            int rc = gateway_limit_try(&limit, item->attrs, &item->ticket);
+
+            if(rc == GATEWAY_LIMIT_WAIT) {
+                slot_release();
+                break;
+            }
+
+            if(rc < 0) {
+                fail_item(gw, item, rc);
+            } else {
+                tag_stats_add(&gw->stats, TAG_STATS_LIMIT_WAIT, item->ticket.waited_ms * 1000);
+                item->deadline = abex_time_ms() + config.retry.deadline_ms;
+                start_item(gw, item);
+            }
+
+            next++;
+            active++;
+            progress = 1;
+        }
+
+        for(i = 0; i < next; i++) {
+            struct scan_item_s *item = &gw->items[i];
+
+            if(item->state == ITEM_CREATING || item->state == ITEM_READING) {
+                progress |= poll_item(gw, item);
+            }
+
+            if(item->state == ITEM_DONE) {
+                /* each finished tag frees its slot once. */
+                item->state = ITEM_WAITING;
+                item->deadline = -1;
+                active--;
+                done++;
+                slot_release();
+                gateway_limit_release(&limit, &item->ticket);
+            }
+        }
+
+        if(!progress) {
+            abex_sleep_ms(POLL_INTERVAL_MS);
+        }
+    }
+}
+
+static void write_frame(uint8_t status, struct abex_buf_s *buf)
+{
+    pthread_mutex_lock(&output_mutex);
+    frame_write(1, status, buf->data, buf->len);
+    pthread_mutex_unlock(&output_mutex);
+}
+
+/* "stats <gateway>" then the phase, counter and gateway lines, see tag_stats.h */
+static void format_stats(struct scan_gateway_s *gw, struct abex_buf_s *out)
+{
+    abex_buf_printf(out, "stats %s\n", gw->name);
+    tag_stats_format(&gw->stats, out);
+    tag_rtt_format(&gw->rtt, gw->name, out);
+}
+
+/* send the stats if asked for since the last time, or every --stats-every cycles */
+static void report_stats(struct scan_gateway_s *gw, long cycle)
+{
+    long requested;
+
+    pthread_mutex_lock(&shared.mutex);
+    requested = shared.stats_requested;
+    pthread_mutex_unlock(&shared.mutex);
+
+    if(requested == gw->stats_seen && (config.stats_every == 0 || cycle % config.stats_every != 0)) {
+        return;
+    }
+
+    gw->stats_seen = requested;
+
+    abex_buf_reset(&gw->scratch);
+    format_stats(gw, &gw->scratch);
+    write_frame(2, &gw->scratch);
+}
+
+static void *gateway_worker(void *arg)
+{
+    struct scan_gateway_s *gw = arg;
+    int64_t next_tick = abex_time_ms();
+    long cycle = 0;
+    int i;
+
+    tag_rtt_init(&gw->rtt);
+    gw->stats.enabled = config.stats;
+
+    while(!stopping() && (config.cycles == 0 || cycle < config.cycles)) {
+        int64_t now = abex_time_ms();
+        int64_t start_us;
+        int64_t output_us;
+
+        if(now < next_tick) {
+            abex_sleep_ms(next_tick - now < STOP_CHECK_MS ? (int)(next_tick - now) : STOP_CHECK_MS);
+            continue;
+        }
+
+        /* skip cycles we were too slow for instead of bursting. */
+        next_tick += config.cycle_ms;
+        if(next_tick <= now) {
+            next_tick = now + config.cycle_ms;
+        }
+
+        start_us = abex_time_us();
+        abex_buf_reset(&gw->out);
+
+        if(config.format == FORMAT_BINARY) {
+            uint8_t header[6];
+            size_t len = strlen(gw->name);
+
+            put_le32(header, (uint32_t)cycle);
+            put_le16(header + 4, (uint16_t)len);
+            abex_buf_append(&gw->out, header, sizeof(header));
+            abex_buf_append(&gw->out, gw->name, len);
+        } else {
+            abex_buf_printf(&gw->out, "cycle %ld %s\n", cycle, gw->name);
+        }
+
+        run_cycle(gw);
+
+        output_us = abex_time_us();
+        write_frame(0, &gw->out);
+        tag_stats_since(&gw->stats, TAG_STATS_OUTPUT, output_us);
+        tag_stats_since(&gw->stats, TAG_STATS_TOTAL, start_us);
+        cycle++;
+
+        if(config.stats) {
+            report_stats(gw, cycle);
+        }
+    }
+
+    for(i = 0; i < gw->count; i++) {
+        if(gw->items[i].tag > 0) {
+            plc_tag_destroy(gw->items[i].tag);
+        }
+    }
+
+    pthread_mutex_lock(&shared.mutex);
+    shared.finished++;
+    pthread_mutex_unlock(&shared.mutex);
+
+    return NULL;
+}
+
+
+/* find or add the gateway of a spec's attribute string */
+static struct scan_gateway_s *gateway_for(struct scan_gateway_s **gateways, int *count, const char *attrs)
+{
+    char name[GATEWAY_SIZE];
+    struct scan_gateway_s *list;
+    int i;
+
+    if(abex_attr_value(attrs, "gateway", name, sizeof(name))) {
+        return NULL;
+    }
+
+    for(i = 0; i < *count; i++) {
+        if(!strcmp((*gateways)[i].name, name)) {
+            return &(*gateways)[i];
+        }
+    }
+
+    list = realloc(*gateways, (size_t)(*count + 1) * sizeof(*list));
+    if(!list) {
+        return NULL;
+    }
+
+    *gateways = list;
+    memset(&list[*count], 0, sizeof(list[*count]));
+    compat_snprintf(list[*count].name, sizeof(list[*count].name), "%s", name);
+
+    return &list[(*count)++];
+}
+
+static int add_spec(struct scan_gateway_s **gateways, int *gateway_count, int index, const char *spec)
+{
+    const char *sep = strchr(spec, ' ');
+    char type[32];
+    struct scan_gateway_s *gw;
+    struct scan_item_s *item;
+
+    if(!sep || (size_t)(sep - spec) >= sizeof(type)) {
+        fprintf(stderr, "ERROR: bad scan spec: %s\n", spec);
+        return 1;
+    }
+
+    compat_snprintf(type, sizeof(type), "%.*s", (int)(sep - spec), spec);
+
+    gw = gateway_for(gateways, gateway_count, sep + 1);
+    if(!gw) {
+        fprintf(stderr, "ERROR: no gateway in scan spec: %s\n", spec);
+        return 1;
+    }
+
+    if(gw->count == gw->capacity) {
+        int capacity = gw->capacity ? gw->capacity * 2 : 16;
+        struct scan_item_s *items = realloc(gw->items, (size_t)capacity * sizeof(*items));
+
+        if(!items) {
+            fprintf(stderr, "ERROR: unable to allocate memory for scan spec!\n");
+            return 1;
+        }
+
+        gw->items = items;
+        gw->capacity = capacity;
+    }
+
+    item = &gw->items[gw->count];
+    memset(item, 0, sizeof(*item));
+    item->index = index;
+    item->data_type = tag_decode_type(type);
+    item->attrs = compat_strdup(sep + 1);
+
+    if(!item->data_type || !item->attrs) {
+        fprintf(stderr, "ERROR: bad scan spec: %s\n", spec);
+        return 1;
+    }
+
+    gw->count++;
+
+    return 0;
+}
+
+/* a config file has one "<type> <attribute string>" per line, # comments */
+static int load_config(const char *file_name, struct scan_gateway_s **gateways, int *gateway_count, int *spec_count)
+{
+    FILE *file = stdin;
+    char line[TAG_SPEC_SIZE];
+    int rc = 0;
+
+    if(strcmp(file_name, "-")) {
+        file = fopen(file_name, "r");
+        if(!file) {
+            fprintf(stderr, "ERROR: unable to open config file %s\n", file_name);
+            return 1;
+        }
+    }
+
+    while(!rc && fgets(line, sizeof(line), file)) {
+        size_t len = strlen(line);
+
+        while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r' || line[len-1] == ' ')) {
+            line[--len] = 0;
+        }
+
+        if(len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        rc = add_spec(gateways, gateway_count, (*spec_count)++, line);
+    }
+
+    if(file != stdin) {
+        fclose(file);
+    }
+
+    return rc;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: scanner [options] -s \"<type> <attribute string>\" ... | --config=FILE\n");
+    fprintf(stderr, "  --cycle-ms=N      - start a scan of each gateway every N ms (default %d)\n", DEFAULT_CYCLE_MS);
+    fprintf(stderr, "  --max-inflight=N  - requests in flight across all gateways (default %d)\n", DEFAULT_MAX_INFLIGHT);
+    fprintf(stderr, "  --per-gateway=N   - requests in flight per gateway (default %d)\n", DEFAULT_PER_GATEWAY);
+    fprintf(stderr, "  --cycles=N        - stop after N cycles (default: run until stdin is closed)\n");
+    fprintf(stderr, "  --format=text|binary\n");
+    fprintf(stderr, "  --rate-limit=R, --burst=N, --max-concurrent=N, --limit-dir=DIR\n");
+    fprintf(stderr, "                    - per-gateway request limits, see rw_tag\n");
+    fprintf(stderr, "  --deadline-ms=N   - time allowed to create and read one tag (default %d)\n",
+            TAG_RTT_DEFAULT_DEADLINE_MS);
+    fprintf(stderr, "  --retries=N       - times a timed out read is sent again (default %d)\n", TAG_RTT_DEFAULT_RETRIES);
+    fprintf(stderr, "  --stats           - time each phase per gateway, sent on a \"stats\" frame and written\n");
+    fprintf(stderr, "                      to stderr at exit\n");
+    fprintf(stderr, "  --stats-every=N   - also send them every N cycles\n");
+    exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct scan_gateway_s *gateways = NULL;
+    struct abex_buf_s input = {NULL, 0, 0};
+    int gateway_count = 0;
+    int spec_count = 0;
+    int started = 0;
+    int input_open = 1;
+    int64_t lib_check_us = abex_time_us();
+    int rc = 0;
+    int i;
+
+    if(plc_tag_check_lib_version(REQUIRED_VERSION) != PLCTAG_STATUS_OK) {
+        fprintf(stderr, "Required library version %d.%d.%d not available!\n", REQUIRED_VERSION);
+        exit(1);
+    }
+
+    lib_check_us = abex_time_us() - lib_check_us;
+
+    for(i = 1; i < argc; i++) {
+        if(!strncmp(argv[i], "--cycle-ms=", strlen("--cycle-ms="))) {
+            config.cycle_ms = atoi(argv[i] + strlen("--cycle-ms="));
+        } else if(!strncmp(argv[i], "--max-inflight=", strlen("--max-inflight="))) {
+            config.max_inflight = atoi(argv[i] + strlen("--max-inflight="));
+        } else if(!strncmp(argv[i], "--per-gateway=", strlen("--per-gateway="))) {
+            config.per_gateway = atoi(argv[i] + strlen("--per-gateway="));
+        } else if(!strncmp(argv[i], "--cycles=", strlen("--cycles="))) {
+            config.cycles = atol(argv[i] + strlen("--cycles="));
+        } else if(!strcmp(argv[i], "--format=text")) {
+            config.format = FORMAT_TEXT;
+        } else if(!strcmp(argv[i], "--format=binary")) {
+            config.format = FORMAT_BINARY;
+        } else if(!strcmp(argv[i], "--stats")) {
+            config.stats = 1;
+        } else if(!strncmp(argv[i], "--stats-every=", strlen("--stats-every="))) {
+            config.stats = 1;
+            config.stats_every = atol(argv[i] + strlen("--stats-every="));
+        } else if((rc = gateway_limit_parse_arg(&limit.config, argv[i])) != 0) {
+            if(rc < 0) {
+                fprintf(stderr, "ERROR: bad limit option: %s\n", argv[i]);
+                exit(1);
+            }
+
+            rc = 0;
+        } else if((rc = tag_rtt_parse_arg(&config.retry, argv[i])) != 0) {
+            if(rc < 0) {
+                fprintf(stderr, "ERROR: bad retry option: %s\n", argv[i]);
+                exit(1);
+            }
+
+            rc = 0;
+        } else if(!strncmp(argv[i], "--config=", strlen("--config="))) {
+            if(load_config(argv[i] + strlen("--config="), &gateways, &gateway_count, &spec_count)) {
+                exit(1);
+            }
+        } else if(!strcmp(argv[i], "-s") && i + 1 < argc) {
+            if(add_spec(&gateways, &gateway_count, spec_count++, argv[++i])) {
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "ERROR: unknown option %s\n", argv[i]);
+            usage();
+        }
+    }
+
+    if(config.cycle_ms <= 0 || config.max_inflight <= 0 || config.per_gateway <= 0 || config.cycles < 0) {
+        fprintf(stderr, "ERROR: --cycle-ms, --max-inflight and --per-gateway must be greater than zero\n");
+        exit(1);
+    }
+
+    if(config.stats_every < 0) {
+        fprintf(stderr, "ERROR: --stats-every must not be negative\n");
+        exit(1);
+    }
+
+    if(spec_count == 0) {
+        usage();
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&shared.mutex, NULL);
+
+    for(i = 0; i < gateway_count; i++) {
+        if(pthread_create(&gateways[i].thread, NULL, gateway_worker, &gateways[i])) {
+            struct abex_buf_s msg = {NULL, 0, 0};
+
+            abex_buf_printf(&msg, "ERROR: unable to start a worker for %s\n", gateways[i].name);
+            write_frame(1, &msg);
+            abex_buf_free(&msg);
+            rc = 1;
+            break;
+        }
+
+        started++;
+    }
+
+    /*
+     * Run until stdin is closed, or every worker did its --cycles.  With
+     * --cycles a closed stdin is not a stop request, so it can be run from
+     * a shell.
+     */
+    while(!rc) {
+        int finished;
+
+        if(input_open) {
+            rc = frame_wait_readable(0, STOP_CHECK_MS);
+            if(rc < 0) {
+                break;
+            }
+
+            if(rc > 0 && frame_read(0, &input) <= 0) {
+                if(config.cycles == 0) {
+                    rc = 0;
+                    break;
+                }
+
+                input_open = 0;
+            } else if(rc > 0 && input.len == strlen("stats") && !memcmp(input.data, "stats", input.len)) {
+                pthread_mutex_lock(&shared.mutex);
+                shared.stats_requested++;
+                pthread_mutex_unlock(&shared.mutex);
+            }
+
+            rc = 0;
+        } else {
+            abex_sleep_ms(STOP_CHECK_MS);
+        }
+
+        pthread_mutex_lock(&shared.mutex);
+        finished = shared.finished;
+        pthread_mutex_unlock(&shared.mutex);
+
+        if(finished == started) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&shared.mutex);
+    shared.stop = 1;
+    pthread_mutex_unlock(&shared.mutex);
+
+    for(i = 0; i < started; i++) {
+        pthread_join(gateways[i].thread, NULL);
+    }
+
+    if(config.stats) {
+        struct abex_buf_s out = {NULL, 0, 0};
+
+        for(i = 0; i < started; i++) {
+            /* the library is checked once for all gateways. */
+            tag_stats_add(&gateways[i].stats, TAG_STATS_LIB_CHECK, lib_check_us);
+            format_stats(&gateways[i], &out);
+        }
+
+        fwrite(out.data, 1, out.len, stderr);
+        abex_buf_free(&out);
+    }
+
+    for(i = 0; i < gateway_count; i++) {
+        int j;
+
+        for(j = 0; j < gateways[i].count; j++) {
+            free(gateways[i].items[j].attrs);
+        }
+
+        free(gateways[i].items);
+        abex_buf_free(&gateways[i].out);
+        abex_buf_free(&gateways[i].scratch);
+    }
+
+    free(gateways);
+    abex_buf_free(&input);
+    gateway_limit_clear(&limit);
+
+    plc_tag_shutdown();
+
+    return rc ? 1 : 0;
+}
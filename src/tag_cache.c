@@ -0,0 +1,213 @@
+/***************************************************************************
+ *   Cache of created libplctag handles keyed by attribute string.         *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compat_utils.h"
+#include <libplctag/lib/libplctag.h>
+#include "abex_util.h"
+#include "tag_cache.h"
+
+
+static uint32_t hash_attrs(const char *attrs)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    while(*attrs) {
+        hash ^= (uint8_t)*attrs++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static void free_entry(struct tag_cache_entry_s *entry)
+{
+    if(entry->tag > 0) {
+        plc_tag_destroy(entry->tag);
+    }
+
+    free(entry->attrs);
+    free(entry);
+}
+
+
+/*
+ * Look up the handle for attrs, creating it if needed.  Returns the tag
+ * handle or a negative libplctag error if the tag could not be created.
+ * With a zero timeout the returned handle may still be pending, callers
+ * should check plc_tag_status() before using it.
+ */
+int32_t tag_cache_get(struct tag_cache_s *cache, const char *attrs, int timeout)
+{
+    struct tag_cache_entry_s **walker = &cache->head;
+    struct tag_cache_entry_s *entry;
+    uint32_t hash = hash_attrs(attrs);
+    int32_t tag;
+
+    while(*walker) {
+        entry = *walker;
+
+        if(entry->hash == hash && !strcmp(entry->attrs, attrs)) {
+            /* move to the front, hot tags stay cheap to find. */
+            *walker = entry->next;
+            entry->next = cache->head;
+            cache->head = entry;
+
+            entry->last_used_ms = abex_time_ms();
+
+            return entry->tag;
+        }
+
+        walker = &entry->next;
+    }
+
+    tag = plc_tag_create(attrs, timeout);
+    if(tag < 0) {
+        return tag;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if(!entry || !(entry->attrs = compat_strdup(attrs))) {
+        if(entry) {
+            free(entry);
+        }
+
+        plc_tag_destroy(tag);
+
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    entry->hash = hash;
+    entry->tag = tag;
+    entry->last_used_ms = abex_time_ms();
+    entry->next = cache->head;
+
+    cache->head = entry;
+    cache->count++;
+
+    return tag;
+}
+
+
+/*
+ * Drop a handle, for instance after a failed read, so the next request
+ * creates it again from scratch.
+ */
+void tag_cache_evict(struct tag_cache_s *cache, int32_t tag)
+{
+    struct tag_cache_entry_s **walker = &cache->head;
+
+    while(*walker) {
+        struct tag_cache_entry_s *entry = *walker;
+
+        if(entry->tag == tag) {
+            *walker = entry->next;
+            cache->count--;
+            free_entry(entry);
+
+            return;
+        }
+
+        walker = &entry->next;
+    }
+}
+
+
+/*
+ * The handle for attrs if it was read within the last max_age_ms, else 0.
+ * Never creates a tag.  *age_ms is set to the age of that read.
+ */
+int32_t tag_cache_fresh(struct tag_cache_s *cache, const char *attrs, int max_age_ms, int64_t *age_ms)
+{
+    struct tag_cache_entry_s *entry;
+    uint32_t hash = hash_attrs(attrs);
+    int64_t now = abex_time_ms();
+
+    for(entry = cache->head; entry; entry = entry->next) {
+        if(entry->hash == hash && !strcmp(entry->attrs, attrs)) {
+            if(entry->read_ms <= 0 || now - entry->read_ms > max_age_ms) {
+                return 0;
+            }
+
+            entry->last_used_ms = now;
+            *age_ms = now - entry->read_ms;
+
+            return entry->tag;
+        }
+    }
+
+    return 0;
+}
+
+
+/* a read of tag just finished, its buffer is now the freshest value */
+void tag_cache_mark_read(struct tag_cache_s *cache, int32_t tag)
+{
+    struct tag_cache_entry_s *entry;
+
+    for(entry = cache->head; entry; entry = entry->next) {
+        if(entry->tag == tag) {
+            entry->read_ms = abex_time_ms();
+            return;
+        }
+    }
+}
+
+
+/*
+ * After a write, no buffer is trusted any more: the write may have gone to
+ * an overlapping slice or an alias of a cached tag.
+ */
+void tag_cache_forget_reads(struct tag_cache_s *cache)
+{
+    struct tag_cache_entry_s *entry;
+
+    for(entry = cache->head; entry; entry = entry->next) {
+        entry->read_ms = 0;
+    }
+}
+
+
+/*
+ * Destroy every handle that has not been used for idle_ms.  Returns the
+ * number of handles closed.
+ */
+int tag_cache_sweep(struct tag_cache_s *cache, int idle_ms)
+{
+    struct tag_cache_entry_s **walker = &cache->head;
+    int64_t cutoff = abex_time_ms() - idle_ms;
+    int closed = 0;
+
+    while(*walker) {
+        struct tag_cache_entry_s *entry = *walker;
+
+        if(entry->last_used_ms < cutoff) {
+            *walker = entry->next;
+            cache->count--;
+            free_entry(entry);
+            closed++;
+        } else {
+            walker = &entry->next;
+        }
+    }
+
+    return closed;
+}
+
+
+void tag_cache_clear(struct tag_cache_s *cache)
+{
+    while(cache->head) {
+        struct tag_cache_entry_s *entry = cache->head;
+
+        cache->head = entry->next;
+        free_entry(entry);
+    }
+
+    cache->count = 0;
+}
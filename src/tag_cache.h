@@ -0,0 +1,42 @@
+/***************************************************************************
+ *   Cache of created libplctag handles keyed by attribute string.         *
+ *                                                                         *
+ *   Creating a tag costs a session and a CIP forward open, so long-lived  *
+ *   modes keep handles around and only close them after they have been    *
+ *   idle for a while.                                                     *
+ *                                                                         *
+ *   The tag buffer still holds the last value read, so an entry also      *
+ *   remembers when that read finished and short-TTL reads (--max-age-ms)  *
+ *   can be answered from it without going to the PLC.                     *
+ ***************************************************************************/
+
+#ifndef __TAG_CACHE_H__
+#define __TAG_CACHE_H__
+
+#include <stdint.h>
+
+struct tag_cache_entry_s {
+    struct tag_cache_entry_s *next;
+    char *attrs;
+    uint32_t hash;
+    int32_t tag;
+    int64_t last_used_ms;
+
+    /* abex_time_ms() when the last successful read finished, 0 if none since a write */
+    int64_t read_ms;
+};
+
+struct tag_cache_s {
+    struct tag_cache_entry_s *head;
+    int count;
+};
+
+extern int32_t tag_cache_get(struct tag_cache_s *cache, const char *attrs, int timeout);
+extern void tag_cache_evict(struct tag_cache_s *cache, int32_t tag);
+extern int32_t tag_cache_fresh(struct tag_cache_s *cache, const char *attrs, int max_age_ms, int64_t *age_ms);
+extern void tag_cache_mark_read(struct tag_cache_s *cache, int32_t tag);
+extern void tag_cache_forget_reads(struct tag_cache_s *cache);
+extern int tag_cache_sweep(struct tag_cache_s *cache, int idle_ms);
+extern void tag_cache_clear(struct tag_cache_s *cache);
+
+#endif
@@ -0,0 +1,636 @@
+/***************************************************************************
+ *   On-disk catalog of a controller's tags, one file per gateway/path.    *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "compat_utils.h"
+#include <libplctag/lib/libplctag.h>
+#include "abex_util.h"
+#include "tag_catalog.h"
+#include "tag_decode.h"
+
+#if defined(_WIN32)
+    #include <process.h>
+    #define getpid _getpid
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#define CATALOG_NAME_SIZE (256)
+
+/* CIP Get_Attribute_List on the Symbol class (0x6B), instance 0 */
+#define CIP_GET_ATTRIBUTE_LIST (0x03)
+#define CIP_ATTR_MAX_INSTANCE (2)
+#define CIP_ATTR_INSTANCE_COUNT (3)
+
+
+/*
+ * Build the catalog file name for a gateway and path, keeping only
+ * characters that are safe in a file name.
+ */
+int tag_catalog_file_name(char *buf, size_t size, const char *dir, const char *gateway, const char *path)
+{
+    char name[CATALOG_NAME_SIZE];
+    size_t i;
+
+    compat_snprintf(name, sizeof(name), "%s_%s", gateway, (path && *path) ? path : "nopath");
+
+    for(i = 0; name[i]; i++) {
+        if(!isalnum((unsigned char)name[i]) && name[i] != '.' && name[i] != '-') {
+            name[i] = '_';
+        }
+    }
+
+    if((size_t)compat_snprintf(buf, size, "%s/%s.abexcat", dir, name) >= size) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* catalog file for the gateway and path in a tag attribute string */
+int tag_catalog_file_for_attrs(char *buf, size_t size, const char *dir, const char *attrs)
+{
+    char gateway[CATALOG_NAME_SIZE];
+    char path[CATALOG_NAME_SIZE];
+
+    if(abex_attr_value(attrs, "gateway", gateway, sizeof(gateway))) {
+        return 1;
+    }
+
+    if(abex_attr_value(attrs, "path", path, sizeof(path))) {
+        path[0] = 0;
+    }
+
+    return tag_catalog_file_name(buf, size, dir, gateway, path);
+}
+
+
+/*
+ * Read the Symbol class attributes "max instance" and "number of
+ * instances".  Both move whenever tags are added or removed, so they are a
+ * cheap way to tell whether a catalog is still current without listing
+ * every tag.  Returns a PLCTAG status; controllers that do not support the
+ * request just cannot be checked.
+ */
+int tag_catalog_fingerprint(const char *gateway, const char *path, const char *plc, int timeout,
+                            struct tag_catalog_fingerprint_s *fp)
+{
+    uint8_t request[] = {
+        CIP_GET_ATTRIBUTE_LIST,
+        0x02, 0x20, 0x6B, 0x24, 0x00,   /* path: class 0x6B, instance 0 */
+        0x02, 0x00,                     /* two attributes */
+        CIP_ATTR_MAX_INSTANCE, 0x00,
+        CIP_ATTR_INSTANCE_COUNT, 0x00
+    };
+    char attrs[CATALOG_NAME_SIZE * 2];
+    int32_t tag;
+    int offset;
+    int size;
+    int count;
+    int width;
+    int rc;
+    int i;
+
+    memset(fp, 0, sizeof(*fp));
+
+    if(path && *path) {
+        compat_snprintf(attrs, sizeof(attrs), "protocol=ab-eip&gateway=%s&path=%s&plc=%s&name=@raw", gateway, path, plc);
+    } else {
+        compat_snprintf(attrs, sizeof(attrs), "protocol=ab-eip&gateway=%s&plc=%s&name=@raw", gateway, plc);
+    }
+
+    tag = plc_tag_create(attrs, timeout);
+    if(tag < 0) {
+        return tag;
+    }
+
+    do {
+        rc = plc_tag_set_size(tag, (int)sizeof(request));
+        if(rc < 0) {
+            break;
+        }
+
+        rc = plc_tag_set_raw_bytes(tag, 0, request, (int)sizeof(request));
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        rc = plc_tag_write(tag, timeout);
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        /* reply service, reserved, general status, extended status words */
+        size = plc_tag_get_size(tag);
+        if(size < 6 || plc_tag_get_uint8(tag, 0) != (CIP_GET_ATTRIBUTE_LIST | 0x80) || plc_tag_get_uint8(tag, 2) != 0) {
+            rc = PLCTAG_ERR_UNSUPPORTED;
+            break;
+        }
+
+        offset = 4 + (plc_tag_get_uint8(tag, 3) * 2);
+        count = plc_tag_get_uint16(tag, offset);
+        offset += 2;
+
+        /*
+         * instance ids are 32-bit: controllers that say so answer UDINTs,
+         * older ones UINTs.  The reply size tells which.
+         */
+        width = count > 0 && size - offset >= count * 8 ? 4 : 2;
+
+        /* each attribute: id, status, value if the status is 0 */
+        for(i = 0; i < count && offset + 4 <= size; i++) {
+            uint16_t id = plc_tag_get_uint16(tag, offset);
+            uint16_t status = plc_tag_get_uint16(tag, offset + 2);
+            uint32_t value;
+
+            offset += 4;
+            if(status != 0 || offset + width > size) {
+                break;
+            }
+
+            value = width == 4 ? plc_tag_get_uint32(tag, offset) : plc_tag_get_uint16(tag, offset);
+
+            if(id == CIP_ATTR_MAX_INSTANCE) {
+                fp->max_instance = value;
+            } else if(id == CIP_ATTR_INSTANCE_COUNT) {
+                fp->instance_count = value;
+            }
+
+            offset += width;
+        }
+
+        rc = (fp->max_instance || fp->instance_count) ? PLCTAG_STATUS_OK : PLCTAG_ERR_UNSUPPORTED;
+    } while(0);
+
+    plc_tag_destroy(tag);
+
+    return rc;
+}
+
+
+struct sort_item_s {
+    const char *name;
+    uint32_t entry;
+};
+
+static int compare_items(const void *a, const void *b)
+{
+    return compat_strcasecmp(((const struct sort_item_s *)a)->name, ((const struct sort_item_s *)b)->name);
+}
+
+
+/*
+ * Build a catalog image in out from a tag_list --format=binary record
+ * stream.  Returns 0 on success.
+ */
+int tag_catalog_build(const uint8_t *records, size_t len, const struct tag_catalog_fingerprint_s *fp,
+                      uint32_t flags, struct abex_buf_s *out)
+{
+    struct tag_catalog_header_s header;
+    struct abex_buf_s entries = {NULL, 0, 0};
+    struct abex_buf_s strings = {NULL, 0, 0};
+    struct sort_item_s *items = NULL;
+    uint32_t *index = NULL;
+    uint32_t count = 0;
+    uint32_t index_count = 0;
+    uint32_t program = TAG_CATALOG_NONE;
+    uint32_t udt = TAG_CATALOG_NONE;
+    size_t program_name = 0;
+    size_t program_len = 0;
+    size_t offset = 0;
+    uint32_t i;
+    int rc = 1;
+
+    while(offset + TAG_CATALOG_RECORD_SIZE <= len) {
+        const uint8_t *rec = records + offset;
+        struct tag_catalog_entry_s entry;
+        uint16_t name_len = get_le16(rec + 21);
+
+        if(offset + TAG_CATALOG_RECORD_SIZE + name_len > len) {
+            break;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        entry.kind = rec[0];
+        entry.instance_id = get_le32(rec + 1);
+        entry.tag_type = get_le16(rec + 5);
+        entry.elem_length = get_le16(rec + 7);
+        entry.dims[0] = get_le32(rec + 9);
+        entry.dims[1] = get_le32(rec + 13);
+        entry.dims[2] = get_le32(rec + 17);
+        entry.program = TAG_CATALOG_NONE;
+        entry.name_offset = (uint32_t)strings.len;
+
+        if(entry.kind == TAG_CATALOG_UDT) {
+            udt = count;
+        } else if(entry.kind == TAG_CATALOG_UDT_MEMBER) {
+            entry.program = udt;
+        } else if(entry.kind == TAG_CATALOG_PROGRAM) {
+            program = count;
+            program_name = strings.len;
+            program_len = name_len;
+        } else if(entry.kind == TAG_CATALOG_PROGRAM_TAG && program != TAG_CATALOG_NONE) {
+            /* program tags are addressed as Program:<name>.<tag>, reserve first so the copy source stays put. */
+            entry.program = program;
+            if(abex_buf_reserve(&strings, program_len + 1)) {
+                goto done;
+            }
+
+            abex_buf_append(&strings, strings.data + program_name, program_len);
+            abex_buf_append(&strings, ".", 1);
+        }
+
+        abex_buf_append(&strings, rec + TAG_CATALOG_RECORD_SIZE, name_len);
+        entry.name_len = (uint16_t)(strings.len - entry.name_offset);
+        abex_buf_append(&strings, "", 1);
+
+        if(abex_buf_append(&entries, &entry, sizeof(entry))) {
+            goto done;
+        }
+
+        count++;
+        offset += TAG_CATALOG_RECORD_SIZE + name_len;
+    }
+
+    items = calloc(count ? count : 1, sizeof(*items));
+    index = calloc(count ? count : 1, sizeof(*index));
+    if(!items || !index || (count > 0 && !strings.data)) {
+        goto done;
+    }
+
+    /* only tags and programs are looked up by name. */
+    for(i = 0; i < count; i++) {
+        const struct tag_catalog_entry_s *entry = (const struct tag_catalog_entry_s *)entries.data + i;
+
+        if(entry->kind == TAG_CATALOG_UDT || entry->kind == TAG_CATALOG_UDT_MEMBER) {
+            continue;
+        }
+
+        items[index_count].name = strings.data + entry->name_offset;
+        items[index_count].entry = i;
+        index_count++;
+    }
+
+    qsort(items, index_count, sizeof(*items), compare_items);
+
+    for(i = 0; i < index_count; i++) {
+        index[i] = items[i].entry;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TAG_CATALOG_MAGIC, sizeof(TAG_CATALOG_MAGIC));
+    header.version = TAG_CATALOG_VERSION;
+    header.entry_count = count;
+    header.index_count = index_count;
+    header.flags = flags;
+    header.entries_offset = (uint32_t)sizeof(header);
+    header.index_offset = header.entries_offset + (uint32_t)entries.len;
+    header.strings_offset = header.index_offset + (uint32_t)(index_count * sizeof(uint32_t));
+    header.strings_size = (uint32_t)strings.len;
+    header.created = (int64_t)time(NULL);
+    header.max_instance = fp ? fp->max_instance : 0;
+    header.instance_count = fp ? fp->instance_count : 0;
+
+    if(abex_buf_append(out, &header, sizeof(header))
+       || abex_buf_append(out, entries.data, entries.len)
+       || abex_buf_append(out, index, index_count * sizeof(uint32_t))
+       || abex_buf_append(out, strings.data, strings.len)) {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    free(items);
+    free(index);
+    abex_buf_free(&entries);
+    abex_buf_free(&strings);
+
+    return rc;
+}
+
+
+/*
+ * Write a catalog image to file.  It goes to a temporary name first and is
+ * renamed, so readers never see half a catalog.
+ */
+int tag_catalog_save(const char *file, const struct abex_buf_s *data)
+{
+    /* sized for the whole file name, a cut short one could be another catalog's */
+    struct abex_buf_s tmp_file = {NULL, 0, 0};
+    FILE *fh;
+    int rc = 1;
+
+    if(abex_buf_printf(&tmp_file, "%s.%d.tmp", file, (int)getpid())) {
+        abex_buf_free(&tmp_file);
+        return 1;
+    }
+
+    fh = fopen(tmp_file.data, "wb");
+    if(!fh) {
+        abex_buf_free(&tmp_file);
+        return 1;
+    }
+
+    if(fwrite(data->data, 1, data->len, fh) != data->len) {
+        fclose(fh);
+        remove(tmp_file.data);
+        abex_buf_free(&tmp_file);
+        return 1;
+    }
+
+    fclose(fh);
+
+#if defined(_WIN32)
+    /* rename does not replace an existing file on Windows. */
+    remove(file);
+#endif
+
+    if(rename(tmp_file.data, file)) {
+        remove(tmp_file.data);
+    } else {
+        rc = 0;
+    }
+
+    abex_buf_free(&tmp_file);
+
+    return rc;
+}
+
+
+/*
+ * Check a mapped catalog before anything is read from it: a truncated or
+ * corrupted file is treated like a missing one and gets rebuilt.
+ */
+static int check_catalog(struct tag_catalog_s *cat)
+{
+    const struct tag_catalog_header_s *header = cat->map;
+    const struct tag_catalog_entry_s *entries;
+    const uint32_t *index;
+    const char *strings;
+    uint64_t entries_end;
+    uint64_t index_end;
+    uint32_t i;
+
+    if(cat->size < sizeof(*header) || memcmp(header->magic, TAG_CATALOG_MAGIC, sizeof(TAG_CATALOG_MAGIC))
+       || header->version != TAG_CATALOG_VERSION) {
+        return 1;
+    }
+
+    entries_end = (uint64_t)header->entries_offset + (uint64_t)header->entry_count * sizeof(struct tag_catalog_entry_s);
+    index_end = (uint64_t)header->index_offset + (uint64_t)header->index_count * sizeof(uint32_t);
+
+    if(entries_end > cat->size || index_end > cat->size
+       || header->index_count > header->entry_count
+       || (uint64_t)header->strings_offset + header->strings_size > cat->size
+       || header->entries_offset % sizeof(uint32_t) || header->index_offset % sizeof(uint32_t)) {
+        return 1;
+    }
+
+    entries = (const struct tag_catalog_entry_s *)((const char *)cat->map + header->entries_offset);
+    index = (const uint32_t *)((const char *)cat->map + header->index_offset);
+    strings = (const char *)cat->map + header->strings_offset;
+
+    /* every name ends with a NUL inside the strings, so none can be read past them. */
+    if(header->entry_count > 0 && (header->strings_size == 0 || strings[header->strings_size - 1])) {
+        return 1;
+    }
+
+    for(i = 0; i < header->entry_count; i++) {
+        if((uint64_t)entries[i].name_offset + entries[i].name_len >= header->strings_size
+           || strings[entries[i].name_offset + entries[i].name_len]
+           || (entries[i].program != TAG_CATALOG_NONE && entries[i].program >= header->entry_count)) {
+            return 1;
+        }
+    }
+
+    for(i = 0; i < header->index_count; i++) {
+        if(index[i] >= header->entry_count) {
+            return 1;
+        }
+    }
+
+    cat->header = header;
+    cat->entries = entries;
+    cat->index = index;
+    cat->strings = strings;
+
+    return 0;
+}
+
+
+/*
+ * Map a catalog file.  Returns 0 on success, 1 if there is no usable
+ * catalog (missing, truncated, corrupted or from another version).
+ */
+int tag_catalog_open(struct tag_catalog_s *cat, const char *file)
+{
+    memset(cat, 0, sizeof(*cat));
+
+#if defined(_WIN32)
+    {
+        FILE *fh = fopen(file, "rb");
+        long size;
+
+        if(!fh) {
+            return 1;
+        }
+
+        fseek(fh, 0, SEEK_END);
+        size = ftell(fh);
+        fseek(fh, 0, SEEK_SET);
+
+        cat->map = size > 0 ? malloc((size_t)size) : NULL;
+        if(!cat->map || fread(cat->map, 1, (size_t)size, fh) != (size_t)size) {
+            fclose(fh);
+            tag_catalog_close(cat);
+            return 1;
+        }
+
+        fclose(fh);
+        cat->size = (size_t)size;
+        cat->mapped = 1;
+    }
+#else
+    {
+        struct stat st;
+        int fd = open(file, O_RDONLY);
+
+        if(fd < 0) {
+            return 1;
+        }
+
+        if(fstat(fd, &st) || st.st_size <= 0) {
+            close(fd);
+            return 1;
+        }
+
+        cat->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if(cat->map == MAP_FAILED) {
+            cat->map = NULL;
+            return 1;
+        }
+
+        cat->size = (size_t)st.st_size;
+        cat->mapped = 1;
+    }
+#endif
+
+    if(check_catalog(cat)) {
+        tag_catalog_close(cat);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* use a catalog image already in memory, it must outlive the catalog */
+int tag_catalog_load(struct tag_catalog_s *cat, const void *data, size_t size)
+{
+    memset(cat, 0, sizeof(*cat));
+
+    cat->map = (void *)data;
+    cat->size = size;
+
+    if(check_catalog(cat)) {
+        memset(cat, 0, sizeof(*cat));
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void tag_catalog_close(struct tag_catalog_s *cat)
+{
+    if(cat->map && cat->mapped) {
+#if defined(_WIN32)
+        free(cat->map);
+#else
+        munmap(cat->map, cat->size);
+#endif
+    }
+
+    memset(cat, 0, sizeof(*cat));
+}
+
+
+const char *tag_catalog_name(const struct tag_catalog_s *cat, const struct tag_catalog_entry_s *entry)
+{
+    return cat->strings + entry->name_offset;
+}
+
+
+/* binary search by full name, not case sensitive like Logix itself */
+const struct tag_catalog_entry_s *tag_catalog_find(const struct tag_catalog_s *cat, const char *name)
+{
+    uint32_t low = 0;
+    uint32_t high = cat->header ? cat->header->index_count : 0;
+
+    while(low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const struct tag_catalog_entry_s *entry = &cat->entries[cat->index[mid]];
+        int cmp = compat_strcasecmp(name, tag_catalog_name(cat, entry));
+
+        if(cmp == 0) {
+            return entry;
+        } else if(cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* the UDT entry for a template id, or NULL if templates were not listed */
+const struct tag_catalog_entry_s *tag_catalog_find_udt(const struct tag_catalog_s *cat, uint32_t template_id)
+{
+    uint32_t i;
+
+    for(i = 0; i < cat->header->entry_count; i++) {
+        const struct tag_catalog_entry_s *entry = &cat->entries[i];
+
+        if(entry->kind == TAG_CATALOG_UDT && entry->instance_id == template_id) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* a member of a UDT by name, members follow their UDT entry */
+const struct tag_catalog_entry_s *tag_catalog_find_member(const struct tag_catalog_s *cat,
+                                                          const struct tag_catalog_entry_s *udt,
+                                                          const char *name, size_t name_len)
+{
+    const struct tag_catalog_entry_s *end = cat->entries + cat->header->entry_count;
+    const struct tag_catalog_entry_s *entry;
+
+    for(entry = udt + 1; entry < end && entry->kind == TAG_CATALOG_UDT_MEMBER; entry++) {
+        const char *member = tag_catalog_name(cat, entry);
+
+        size_t i;
+
+        if(strlen(member) != name_len) {
+            continue;
+        }
+
+        for(i = 0; i < name_len && tolower((unsigned char)member[i]) == tolower((unsigned char)name[i]); i++) { }
+
+        if(i == name_len) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * rw_tag data type (the PLC_LIB_* code) for an atomic CIP type, or 0 for
+ * anything else.  BOOL and the bit string types map to unsigned integers
+ * of their storage size, see tag_decode_cip_type().
+ */
+int tag_catalog_data_type(uint16_t tag_type)
+{
+    return tag_decode_cip_type(tag_type);
+}
+
+
+/* bytes per element of an atomic type, 0 if not atomic */
+int tag_catalog_type_size(uint16_t tag_type)
+{
+    return (int)tag_decode_size(tag_catalog_data_type(tag_type));
+}
+
+
+/* number of elements, 1 for a scalar */
+uint32_t tag_catalog_elem_count(const struct tag_catalog_entry_s *entry)
+{
+    uint32_t count = 1;
+    int i;
+
+    for(i = 0; i < 3; i++) {
+        if(entry->dims[i]) {
+            count *= entry->dims[i];
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,130 @@
+/***************************************************************************
+ *   On-disk catalog of a controller's tags, one file per gateway/path.    *
+ *                                                                         *
+ *   tag_list writes it after a full listing and serves later listings     *
+ *   from it while the controller still looks the same.  rw_tag looks tag  *
+ *   names up in it to fill in the type, element size and count.  The     *
+ *   file is read with mmap, entries are fixed size and a sorted index     *
+ *   allows binary search by name without parsing anything.                *
+ ***************************************************************************/
+
+#ifndef __TAG_CATALOG_H__
+#define __TAG_CATALOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "abex_util.h"
+
+#define TAG_CATALOG_MAGIC "ABEXCAT"
+#define TAG_CATALOG_VERSION (2)
+
+/* entry kinds, the same numbers as tag_list --format=binary records */
+#define TAG_CATALOG_CONTROLLER_TAG (0)
+#define TAG_CATALOG_PROGRAM (1)
+#define TAG_CATALOG_PROGRAM_TAG (2)
+#define TAG_CATALOG_UDT (3)
+#define TAG_CATALOG_UDT_MEMBER (4)
+
+/* header flags */
+#define TAG_CATALOG_HAS_UDTS (1)
+
+#define TAG_CATALOG_NONE (0xFFFFFFFFu)
+
+/* size of a tag_list binary record before the name */
+#define TAG_CATALOG_RECORD_SIZE (23)
+
+/*
+ * File layout, in host byte order (the magic and version are checked on
+ * open, so a foreign file is simply rebuilt):
+ *
+ *   header
+ *   entries[entry_count]       in listing order
+ *   index[index_count]         uint32 numbers of the tag entries, sorted by name
+ *   strings[strings_size]      NUL terminated names
+ *
+ * UDT templates come after the tags: a TAG_CATALOG_UDT entry followed by
+ * one TAG_CATALOG_UDT_MEMBER entry per member.  They are not in the name
+ * index, since a type may have the same name as a tag.
+ */
+struct tag_catalog_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t index_count;
+    uint32_t flags;
+    uint32_t entries_offset;
+    uint32_t index_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+
+    /* wall clock seconds when the listing was taken */
+    int64_t created;
+
+    /* cheap controller check, see tag_catalog_fingerprint() */
+    uint32_t max_instance;
+    uint32_t instance_count;
+};
+
+/*
+ * Tags and programs use the fields as named.  For a UDT, instance_id is
+ * the template id, tag_type the structure handle and dims[0] the size of
+ * one instance in bytes.  For a UDT member, instance_id is the byte offset,
+ * elem_length the element size (0 for a nested UDT, use its template),
+ * dims[0] the array count (0 for a scalar) and dims[1] the bit of a BOOL.
+ */
+struct tag_catalog_entry_s {
+    /* full name, program tags as Program:<name>.<tag> */
+    uint32_t name_offset;
+    uint16_t name_len;
+    uint8_t kind;
+    uint8_t reserved;
+
+    uint32_t instance_id;
+    uint16_t tag_type;
+    uint16_t elem_length;
+    uint32_t dims[3];
+
+    /* entry number of the owning program or UDT, or TAG_CATALOG_NONE */
+    uint32_t program;
+};
+
+struct tag_catalog_fingerprint_s {
+    uint32_t max_instance;
+    uint32_t instance_count;
+};
+
+struct tag_catalog_s {
+    void *map;
+    size_t size;
+    int mapped;
+    const struct tag_catalog_header_s *header;
+    const struct tag_catalog_entry_s *entries;
+    const uint32_t *index;
+    const char *strings;
+};
+
+extern int tag_catalog_file_name(char *buf, size_t size, const char *dir, const char *gateway, const char *path);
+extern int tag_catalog_file_for_attrs(char *buf, size_t size, const char *dir, const char *attrs);
+
+extern int tag_catalog_fingerprint(const char *gateway, const char *path, const char *plc, int timeout,
+                                   struct tag_catalog_fingerprint_s *fp);
+
+extern int tag_catalog_build(const uint8_t *records, size_t len, const struct tag_catalog_fingerprint_s *fp,
+                             uint32_t flags, struct abex_buf_s *out);
+extern int tag_catalog_save(const char *file, const struct abex_buf_s *data);
+
+extern int tag_catalog_open(struct tag_catalog_s *cat, const char *file);
+extern int tag_catalog_load(struct tag_catalog_s *cat, const void *data, size_t size);
+extern void tag_catalog_close(struct tag_catalog_s *cat);
+extern const struct tag_catalog_entry_s *tag_catalog_find(const struct tag_catalog_s *cat, const char *name);
+extern const char *tag_catalog_name(const struct tag_catalog_s *cat, const struct tag_catalog_entry_s *entry);
+extern const struct tag_catalog_entry_s *tag_catalog_find_udt(const struct tag_catalog_s *cat, uint32_t template_id);
+extern const struct tag_catalog_entry_s *tag_catalog_find_member(const struct tag_catalog_s *cat,
+                                                                 const struct tag_catalog_entry_s *udt,
+                                                                 const char *name, size_t name_len);
+
+extern int tag_catalog_data_type(uint16_t tag_type);
+extern int tag_catalog_type_size(uint16_t tag_type);
+extern uint32_t tag_catalog_elem_count(const struct tag_catalog_entry_s *entry);
+
+#endif
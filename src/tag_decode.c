@@ -0,0 +1,621 @@
+/***************************************************************************
+ *   Whole-array conversion of raw tag data.                               *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "abex_util.h"
+#include "tag_decode.h"
+
+/* tag data is little-endian, big-endian hosts swap while copying */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define HOST_BIG_ENDIAN (1)
+#else
+    #define HOST_BIG_ENDIAN (0)
+#endif
+
+/* longest text of one element with its separator: a 64-bit integer, a %f double, a quoted STRING */
+#define INT_TEXT_SIZE (22)
+#define REAL_TEXT_SIZE (320)
+#define STRING_TEXT_SIZE (3 + TAG_DECODE_STRING_CHARS * 4)
+
+/* text is written this many elements at a time, so the buffer grows with the output, not the worst case */
+#define TEXT_CHUNK (256)
+
+
+static char *format_u64(char *p, uint64_t val)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = (char)('0' + (int)(val % 10));
+        val /= 10;
+    } while(val);
+
+    while(n) {
+        *p++ = digits[--n];
+    }
+
+    return p;
+}
+
+static char *format_i64(char *p, int64_t val)
+{
+    if(val < 0) {
+        *p++ = '-';
+        return format_u64(p, (uint64_t)0 - (uint64_t)val);
+    }
+
+    return format_u64(p, (uint64_t)val);
+}
+
+static uint64_t load_u8(const uint8_t *p) { return p[0]; }
+static uint64_t load_u16(const uint8_t *p) { return get_le16(p); }
+static uint64_t load_u32(const uint8_t *p) { return get_le32(p); }
+static uint64_t load_u64(const uint8_t *p) { return get_le64(p); }
+static int64_t load_s8(const uint8_t *p) { return (int8_t)p[0]; }
+static int64_t load_s16(const uint8_t *p) { return (int16_t)get_le16(p); }
+static int64_t load_s32(const uint8_t *p) { return (int32_t)get_le32(p); }
+static int64_t load_s64(const uint8_t *p) { return (int64_t)get_le64(p); }
+
+/*
+ * One loop per integer type, with the load and the width known at compile
+ * time, so nothing is decided per element.
+ */
+#define FORMAT_INTEGERS(func, width, load, format)                  \
+    static char *func(const uint8_t *src, size_t count, char *p)    \
+    {                                                               \
+        size_t i;                                                   \
+                                                                    \
+        for(i = 0; i < count; i++) {                                \
+            p = format(p, load(src + i * (width)));                 \
+            *p++ = ' ';                                             \
+        }                                                           \
+                                                                    \
+        return p;                                                   \
+    }
+
+FORMAT_INTEGERS(format_uint8, 1, load_u8, format_u64)
+FORMAT_INTEGERS(format_uint16, 2, load_u16, format_u64)
+FORMAT_INTEGERS(format_uint32, 4, load_u32, format_u64)
+FORMAT_INTEGERS(format_uint64, 8, load_u64, format_u64)
+FORMAT_INTEGERS(format_sint8, 1, load_s8, format_i64)
+FORMAT_INTEGERS(format_sint16, 2, load_s16, format_i64)
+FORMAT_INTEGERS(format_sint32, 4, load_s32, format_i64)
+FORMAT_INTEGERS(format_sint64, 8, load_s64, format_i64)
+
+/* count is in bits */
+static char *format_bool(const uint8_t *src, size_t count, char *p)
+{
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        *p++ = (char)('0' + ((src[i / 8] >> (i % 8)) & 1));
+        *p++ = ' ';
+    }
+
+    return p;
+}
+
+static char *format_real(double val, char *p)
+{
+    int len = snprintf(p, REAL_TEXT_SIZE, "%f ", val);
+
+    return p + (len > 0 ? len : 0);
+}
+
+static char *format_real32(const uint8_t *src, size_t count, char *p)
+{
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        uint32_t bits = get_le32(src + i * 4);
+        float val;
+
+        memcpy(&val, &bits, sizeof(val));
+        p = format_real((double)val, p);
+    }
+
+    return p;
+}
+
+static char *format_real64(const uint8_t *src, size_t count, char *p)
+{
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        uint64_t bits = get_le64(src + i * 8);
+        double val;
+
+        memcpy(&val, &bits, sizeof(val));
+        p = format_real(val, p);
+    }
+
+    return p;
+}
+
+/* "text", with \" \\ and \xHH escapes so values never hold a space or a quote of their own */
+static char *format_string(const uint8_t *src, size_t count, char *p)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        const uint8_t *elem = src + i * TAG_DECODE_STRING_SIZE;
+        uint32_t len = get_le32(elem);
+        uint32_t c;
+
+        if(len > TAG_DECODE_STRING_CHARS) {
+            len = TAG_DECODE_STRING_CHARS;
+        }
+
+        *p++ = '"';
+
+        for(c = 0; c < len; c++) {
+            uint8_t ch = elem[4 + c];
+
+            if(ch == '"' || ch == '\\') {
+                *p++ = '\\';
+                *p++ = (char)ch;
+            } else if(ch <= ' ' || ch >= 0x7F) {
+                *p++ = '\\';
+                *p++ = 'x';
+                *p++ = hex[ch >> 4];
+                *p++ = hex[ch & 0x0F];
+            } else {
+                *p++ = (char)ch;
+            }
+        }
+
+        *p++ = '"';
+        *p++ = ' ';
+    }
+
+    return p;
+}
+
+
+static const char *parse_unsigned(const char *text, uint8_t *elem)
+{
+    char *end;
+
+    put_le64(elem, (uint64_t)strtoull(text, &end, 10));
+
+    return end == text ? NULL : end;
+}
+
+static const char *parse_signed(const char *text, uint8_t *elem)
+{
+    char *end;
+
+    put_le64(elem, (uint64_t)strtoll(text, &end, 10));
+
+    return end == text ? NULL : end;
+}
+
+static const char *parse_real32(const char *text, uint8_t *elem)
+{
+    char *end;
+    float val = strtof(text, &end);
+    uint32_t bits;
+
+    memcpy(&bits, &val, sizeof(bits));
+    put_le32(elem, bits);
+
+    return end == text ? NULL : end;
+}
+
+static const char *parse_real64(const char *text, uint8_t *elem)
+{
+    char *end;
+    double val = strtod(text, &end);
+    uint64_t bits;
+
+    memcpy(&bits, &val, sizeof(bits));
+    put_le64(elem, bits);
+
+    return end == text ? NULL : end;
+}
+
+/* 0, 1, false or true */
+static const char *parse_bit(const char *text, uint8_t *elem)
+{
+    if(*text == '0' || *text == '1') {
+        elem[0] = (uint8_t)(*text - '0');
+        return text + 1;
+    }
+
+    if(!strncmp(text, "false", 5)) {
+        elem[0] = 0;
+        return text + 5;
+    }
+
+    if(!strncmp(text, "true", 4)) {
+        elem[0] = 1;
+        return text + 4;
+    }
+
+    return NULL;
+}
+
+static int is_value_separator(char c)
+{
+    return c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int hex_digit(char c)
+{
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    c = (char)tolower((unsigned char)c);
+
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* a quoted string with the escapes format_string writes, or a bare word up to the next separator */
+static const char *parse_string(const char *text, uint8_t *elem)
+{
+    int quoted = *text == '"';
+    const char *p = text + quoted;
+    uint32_t len = 0;
+
+    memset(elem, 0, TAG_DECODE_STRING_SIZE);
+
+    while(*p && (quoted ? *p != '"' : !is_value_separator(*p))) {
+        uint8_t ch = (uint8_t)*p++;
+
+        if(quoted && ch == '\\') {
+            if(*p == 'x' && hex_digit(p[1]) >= 0 && hex_digit(p[2]) >= 0) {
+                ch = (uint8_t)(hex_digit(p[1]) * 16 + hex_digit(p[2]));
+                p += 3;
+            } else if(*p) {
+                ch = (uint8_t)*p++;
+            }
+        }
+
+        if(len == TAG_DECODE_STRING_CHARS) {
+            return NULL;
+        }
+
+        elem[4 + len++] = ch;
+    }
+
+    if(quoted) {
+        if(*p != '"') {
+            return NULL;
+        }
+
+        p++;
+    }
+
+    put_le32(elem, len);
+
+    return p == text ? NULL : p;
+}
+
+
+static const struct tag_decode_type_s types[] = {
+    {"bool", PLC_LIB_BOOL, PLC_LIB_UINT8, 0, 2, format_bool, NULL},
+    {"bit", PLC_LIB_BIT, PLC_LIB_UINT8, 1, 2, format_uint8, parse_bit},
+    {"uint8", PLC_LIB_UINT8, PLC_LIB_UINT8, 1, INT_TEXT_SIZE, format_uint8, parse_unsigned},
+    {"sint8", PLC_LIB_SINT8, PLC_LIB_SINT8, 1, INT_TEXT_SIZE, format_sint8, parse_signed},
+    {"uint16", PLC_LIB_UINT16, PLC_LIB_UINT16, 2, INT_TEXT_SIZE, format_uint16, parse_unsigned},
+    {"sint16", PLC_LIB_SINT16, PLC_LIB_SINT16, 2, INT_TEXT_SIZE, format_sint16, parse_signed},
+    {"uint32", PLC_LIB_UINT32, PLC_LIB_UINT32, 4, INT_TEXT_SIZE, format_uint32, parse_unsigned},
+    {"sint32", PLC_LIB_SINT32, PLC_LIB_SINT32, 4, INT_TEXT_SIZE, format_sint32, parse_signed},
+    {"uint64", PLC_LIB_UINT64, PLC_LIB_UINT64, 8, INT_TEXT_SIZE, format_uint64, parse_unsigned},
+    {"sint64", PLC_LIB_SINT64, PLC_LIB_SINT64, 8, INT_TEXT_SIZE, format_sint64, parse_signed},
+    {"real32", PLC_LIB_REAL32, PLC_LIB_REAL32, 4, REAL_TEXT_SIZE, format_real32, parse_real32},
+    {"real64", PLC_LIB_REAL64, PLC_LIB_REAL64, 8, REAL_TEXT_SIZE, format_real64, parse_real64},
+    {"string", PLC_LIB_STRING, PLC_LIB_STRING, TAG_DECODE_STRING_SIZE, STRING_TEXT_SIZE, format_string, parse_string}
+};
+
+#define TYPE_COUNT (sizeof(types) / sizeof(types[0]))
+
+/* atomic CIP types of @tags listings and UDT members; BOOL and the bit strings are unsigned integers */
+static const struct {
+    uint16_t cip_type;
+    int data_type;
+} cip_types[] = {
+    {0xC1, PLC_LIB_UINT8},      /* BOOL */
+    {0xC2, PLC_LIB_SINT8},      /* SINT */
+    {0xC3, PLC_LIB_SINT16},     /* INT */
+    {0xC4, PLC_LIB_SINT32},     /* DINT */
+    {0xC5, PLC_LIB_SINT64},     /* LINT */
+    {0xC6, PLC_LIB_UINT8},      /* USINT */
+    {0xC7, PLC_LIB_UINT16},     /* UINT */
+    {0xC8, PLC_LIB_UINT32},     /* UDINT */
+    {0xC9, PLC_LIB_UINT64},     /* ULINT */
+    {0xCA, PLC_LIB_REAL32},     /* REAL */
+    {0xCB, PLC_LIB_REAL64},     /* LREAL */
+    {0xD1, PLC_LIB_UINT8},      /* BYTE */
+    {0xD2, PLC_LIB_UINT16},     /* WORD */
+    {0xD3, PLC_LIB_UINT32},     /* DWORD */
+    {0xD4, PLC_LIB_UINT64}      /* LWORD */
+};
+
+
+/* the descriptor of a PLC_LIB_* code, NULL if unknown */
+const struct tag_decode_type_s *tag_decode_lookup(int data_type)
+{
+    size_t t;
+
+    for(t = 0; t < TYPE_COUNT; t++) {
+        if(types[t].data_type == data_type) {
+            return &types[t];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* PLC_LIB_* code for a type name such as "uint32", case-insensitive, 0 if unknown */
+int tag_decode_type(const char *name)
+{
+    size_t t;
+
+    for(t = 0; t < TYPE_COUNT; t++) {
+        const char *a = types[t].name;
+        const char *b = name;
+
+        while(*a && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+            a++;
+            b++;
+        }
+
+        if(!*a && !*b) {
+            return types[t].data_type;
+        }
+    }
+
+    return 0;
+}
+
+
+/* bytes per element in the tag buffer, 0 for packed BOOL arrays and unknown types */
+uint32_t tag_decode_size(int data_type)
+{
+    const struct tag_decode_type_s *type = tag_decode_lookup(data_type);
+
+    return type ? type->elem_size : 0;
+}
+
+
+/* PLC_LIB_* code for an atomic CIP type, 0 for structures and anything else */
+int tag_decode_cip_type(uint16_t cip_type)
+{
+    size_t t;
+
+    /* structures have bit 15 set, the low 12 bits are the type otherwise */
+    if(cip_type & 0x8000) {
+        return 0;
+    }
+
+    for(t = 0; t < sizeof(cip_types) / sizeof(cip_types[0]); t++) {
+        if(cip_types[t].cip_type == (cip_type & 0x0FFF)) {
+            return cip_types[t].data_type;
+        }
+    }
+
+    return 0;
+}
+
+
+/* number of elements in size bytes of tag data, bits for BOOL */
+size_t tag_decode_count(int data_type, size_t size)
+{
+    const struct tag_decode_type_s *type = tag_decode_lookup(data_type);
+
+    if(!type) {
+        return 0;
+    }
+
+    if(data_type == PLC_LIB_BOOL) {
+        return size * 8;
+    }
+
+    return size / type->elem_size;
+}
+
+
+/* one byte per bit, 0 or 1, bit 0 of byte 0 first */
+void tag_decode_bits(const uint8_t *src, size_t count, uint8_t *dst)
+{
+    size_t full = count / 8;
+    size_t i;
+
+    for(i = 0; i < full; i++) {
+        uint8_t bits = src[i];
+
+        dst[0] = (uint8_t)(bits & 1);
+        dst[1] = (uint8_t)((bits >> 1) & 1);
+        dst[2] = (uint8_t)((bits >> 2) & 1);
+        dst[3] = (uint8_t)((bits >> 3) & 1);
+        dst[4] = (uint8_t)((bits >> 4) & 1);
+        dst[5] = (uint8_t)((bits >> 5) & 1);
+        dst[6] = (uint8_t)((bits >> 6) & 1);
+        dst[7] = (uint8_t)((bits >> 7) & 1);
+        dst += 8;
+    }
+
+    for(i = full * 8; i < count; i++) {
+        *dst++ = (uint8_t)((src[i / 8] >> (i % 8)) & 1);
+    }
+}
+
+
+/*
+ * Convert count little-endian elements to host order in dst, an array of
+ * the matching C type (uint8_t per bit for BOOL).  Little-endian hosts just
+ * copy.
+ */
+void tag_decode_native(int data_type, const uint8_t *src, size_t count, void *dst)
+{
+    size_t width = tag_decode_size(data_type);
+    size_t i;
+
+    if(data_type == PLC_LIB_BOOL) {
+        tag_decode_bits(src, count, (uint8_t *)dst);
+        return;
+    }
+
+    /* STRINGs are passed on as they are in the tag buffer */
+    if(!HOST_BIG_ENDIAN || width == 1 || data_type == PLC_LIB_STRING) {
+        memcpy(dst, src, count * width);
+        return;
+    }
+
+    switch(width) {
+    case 2:
+        for(i = 0; i < count; i++) {
+            ((uint16_t *)dst)[i] = get_le16(src + i * 2);
+        }
+        break;
+
+    case 4:
+        for(i = 0; i < count; i++) {
+            ((uint32_t *)dst)[i] = get_le32(src + i * 4);
+        }
+        break;
+
+    case 8:
+        for(i = 0; i < count; i++) {
+            ((uint64_t *)dst)[i] = get_le64(src + i * 8);
+        }
+        break;
+    }
+}
+
+
+/*
+ * Fill in a binary block header for elem_count elements of data_type.
+ * Returns the data length.
+ */
+uint32_t tag_decode_block_header(uint8_t *header, int data_type, uint32_t elem_count)
+{
+    uint32_t elem_size = tag_decode_size(data_type);
+    uint32_t data_len = elem_count * elem_size;
+
+    header[0] = TAG_DECODE_BLOCK_VERSION;
+    header[1] = 0;
+    put_le16(header + 2, (uint16_t)data_type);
+    put_le32(header + 4, elem_size);
+    put_le32(header + 8, elem_count);
+    put_le32(header + 12, data_len);
+
+    return data_len;
+}
+
+
+/* append size bytes of tag data as a binary block, BOOL arrays unpacked to uint8 */
+int tag_decode_block(int data_type, const uint8_t *src, size_t size, struct abex_buf_s *out)
+{
+    const struct tag_decode_type_s *type = tag_decode_lookup(data_type);
+    uint8_t header[TAG_DECODE_BLOCK_HEADER_SIZE];
+    size_t count = tag_decode_count(data_type, size);
+    size_t start = out->len;
+    uint32_t data_len;
+
+    if(!type) {
+        return -1;
+    }
+
+    data_len = tag_decode_block_header(header, type->block_type, (uint32_t)count);
+
+    if(abex_buf_append(out, header, sizeof(header)) || abex_buf_reserve(out, data_len)) {
+        out->len = start;
+        return -1;
+    }
+
+    tag_decode_native(data_type, src, count, out->data + out->len);
+
+    out->len += data_len;
+    out->data[out->len] = 0;
+
+    return 0;
+}
+
+
+/*
+ * Append count elements as text, each followed by a space, the format
+ * rw_tag has always printed.  The type is looked up once and its own loop
+ * formats straight into the buffer, TEXT_CHUNK elements at a time.
+ */
+int tag_decode_text(int data_type, const uint8_t *src, size_t count, struct abex_buf_s *out)
+{
+    const struct tag_decode_type_s *type = tag_decode_lookup(data_type);
+    size_t done = 0;
+
+    if(!type || abex_buf_reserve(out, 0)) {
+        return -1;
+    }
+
+    while(done < count) {
+        size_t n = count - done < TEXT_CHUNK ? count - done : TEXT_CHUNK;
+        size_t offset = type->elem_size ? done * type->elem_size : done / 8;
+        char *end;
+
+        if(abex_buf_reserve(out, n * type->text_size)) {
+            return -1;
+        }
+
+        end = type->format(src + offset, n, out->data + out->len);
+
+        out->len = (size_t)(end - out->data);
+        done += n;
+    }
+
+    out->data[out->len] = 0;
+
+    return 0;
+}
+
+
+/*
+ * Convert a list of write values ("1,2,3", "1 2 3", or quoted STRINGs) to
+ * element bytes in data, the same layout --format=binary reads return.
+ * Returns 0, 1 with *bad at the value that does not parse (NULL if the
+ * type cannot be written), or -1 when out of memory.
+ */
+int tag_decode_values(int data_type, const char *values, struct abex_buf_s *data, const char **bad)
+{
+    const struct tag_decode_type_s *type = tag_decode_lookup(data_type);
+    uint8_t elem[TAG_DECODE_STRING_SIZE];
+    const char *p = values;
+
+    *bad = NULL;
+
+    if(!type || !type->parse) {
+        return 1;
+    }
+
+    for(;;) {
+        const char *end;
+
+        while(*p && is_value_separator(*p)) {
+            p++;
+        }
+
+        if(!*p) {
+            return 0;
+        }
+
+        end = type->parse(p, elem);
+        if(!end || (*end && !is_value_separator(*end))) {
+            *bad = p;
+            return 1;
+        }
+
+        if(abex_buf_append(data, elem, type->elem_size)) {
+            return -1;
+        }
+
+        p = end;
+    }
+}
@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Whole-array conversion of raw tag data.  The tag buffer is copied out *
+ *   once with plc_tag_get_raw_bytes and converted here in one pass per    *
+ *   type, instead of one locked, bounds-checked accessor call and one     *
+ *   type switch per element.                                              *
+ *                                                                         *
+ *   Every data type is one entry of a descriptor table (name, codes,      *
+ *   element size, and its own text format and write value parser), looked *
+ *   up once per request.  rw_tag, scanner, tag_list and the tag catalog   *
+ *   all go through it, so a new type is one more entry.                   *
+ ***************************************************************************/
+
+#ifndef __TAG_DECODE_H__
+#define __TAG_DECODE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "abex_util.h"
+
+/* rw_tag data types: kind in the high byte, bits per element in the low byte */
+#define PLC_LIB_BOOL    (0x101)
+#define PLC_LIB_UINT8   (0x108)
+#define PLC_LIB_SINT8   (0x208)
+#define PLC_LIB_UINT16  (0x110)
+#define PLC_LIB_SINT16  (0x210)
+#define PLC_LIB_UINT32  (0x120)
+#define PLC_LIB_SINT32  (0x220)
+#define PLC_LIB_UINT64  (0x140)
+#define PLC_LIB_SINT64  (0x240)
+#define PLC_LIB_REAL32  (0x320)
+#define PLC_LIB_REAL64  (0x340)
+
+/* Logix STRING: kind 4, the size is in the table (it does not fit the low byte) */
+#define PLC_LIB_STRING  (0x400)
+
+/* one bit of an integer (name=Flags.3) or a BOOL tag, read and written through libplctag's bit tags */
+#define PLC_LIB_BIT     (0x501)
+
+/* BOOL arrays are packed into 32-bit words on the wire */
+#define TAG_DECODE_BOOL_WORD (4)
+
+/* STRING: int32 length, 82 characters, 2 bytes of padding */
+#define TAG_DECODE_STRING_SIZE (88)
+#define TAG_DECODE_STRING_CHARS (82)
+
+struct tag_decode_type_s {
+    const char *name;
+    int data_type;
+
+    /* the type binary blocks describe the elements as (BOOL and BIT go out as UINT8) */
+    int block_type;
+
+    /* bytes per element in the tag buffer, 0 for packed BOOL arrays */
+    uint32_t elem_size;
+
+    /* longest text of one element with its separator */
+    size_t text_size;
+
+    /* text of count elements, each followed by a space, written at p; returns the new end */
+    char *(*format)(const uint8_t *src, size_t count, char *p);
+
+    /* one write value into elem (elem_size bytes), returns where it ends or NULL; NULL if read-only */
+    const char *(*parse)(const char *text, uint8_t *elem);
+};
+
+/*
+ * Binary block, as written by rw_tag --format=binary: a 16-byte
+ * little-endian header followed by the element bytes.
+ *
+ *   uint8_t  version       TAG_DECODE_BLOCK_VERSION
+ *   uint8_t  flags         reserved, 0
+ *   uint16_t data_type     PLC_LIB_* code (BOOL arrays and BIT are sent as UINT8)
+ *   uint32_t elem_size     bytes per element
+ *   uint32_t elem_count    number of elements
+ *   uint32_t data_len      bytes of element data that follow
+ */
+#define TAG_DECODE_BLOCK_VERSION (1)
+#define TAG_DECODE_BLOCK_HEADER_SIZE (16)
+
+extern const struct tag_decode_type_s *tag_decode_lookup(int data_type);
+extern int tag_decode_type(const char *name);
+extern uint32_t tag_decode_size(int data_type);
+extern int tag_decode_cip_type(uint16_t cip_type);
+extern size_t tag_decode_count(int data_type, size_t size);
+
+extern void tag_decode_native(int data_type, const uint8_t *src, size_t count, void *dst);
+extern void tag_decode_bits(const uint8_t *src, size_t count, uint8_t *dst);
+extern int tag_decode_text(int data_type, const uint8_t *src, size_t count, struct abex_buf_s *out);
+
+extern uint32_t tag_decode_block_header(uint8_t *header, int data_type, uint32_t elem_count);
+extern int tag_decode_block(int data_type, const uint8_t *src, size_t size, struct abex_buf_s *out);
+
+extern int tag_decode_values(int data_type, const char *values, struct abex_buf_s *data, const char **bad);
+
+#endif
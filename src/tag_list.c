@@ -22,150 +22,1162 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include "compat_utils.h"
 #include <libplctag/lib/libplctag.h>
+#include "abex_util.h"
+#include "tag_catalog.h"
+#include "tag_rtt.h"
+#include "tag_stats.h"
+#include "tag_symbols.h"
+#include "tag_decode.h"
+#include "broker.h"
+#include "frame_io.h"
 
 #define TAG_STRING_SIZE (200)
-#define TIMEOUT_MS (5000)
 #define REQUIRED_VERSION 2, 2, 1
 
+/* program listings in flight at once, see --concurrency */
+#define DEFAULT_CONCURRENCY (8)
+#define POLL_INTERVAL_MS (1)
+
+/* controller tags are written out in chunks of about this size */
+#define FLUSH_SIZE (64 * 1024)
+
+#define MAX_FILTERS (32)
+
+/* a catalog older than this is refreshed even if the controller looks unchanged */
+#define DEFAULT_MAX_AGE_S (24 * 3600)
+#define CATALOG_FILE_SIZE (1024)
+
+#define FORMAT_TEXT    (0)
+#define FORMAT_BINARY  (1)
+
+/*
+ * --format=binary: one record per entry, written as soon as it is decoded.
+ *
+ *   uint8_t  kind          RECORD_* below
+ *   uint32_t instance_id
+ *   uint16_t tag_type
+ *   uint16_t elem_length
+ *   uint32_t array_dims[3]
+ *   uint16_t name_len
+ *   char     name[name_len]
+ *
+ * All little-endian.  A RECORD_PROGRAM (name only, numbers 0) comes before
+ * the tags of each program.
+ *
+ * With --udts the templates of the listed UDT tags follow, nested ones
+ * included: a RECORD_UDT (instance_id = template id, tag_type = structure
+ * handle, array_dims[0] = instance size, array_dims[1] = member count, name
+ * = type name) then a RECORD_UDT_MEMBER per member (instance_id = byte
+ * offset, tag_type = member type, elem_length = element size or 0 for a
+ * nested UDT, array_dims[0] = array count, array_dims[1] = BOOL bit).
+ */
+#define RECORD_CONTROLLER_TAG  TAG_CATALOG_CONTROLLER_TAG
+#define RECORD_PROGRAM         TAG_CATALOG_PROGRAM
+#define RECORD_PROGRAM_TAG     TAG_CATALOG_PROGRAM_TAG
+#define RECORD_UDT             TAG_CATALOG_UDT
+#define RECORD_UDT_MEMBER      TAG_CATALOG_UDT_MEMBER
+#define RECORD_HEADER_SIZE     TAG_CATALOG_RECORD_SIZE
+
+/* member type bits, the struct and system bits are the TAG_SYMBOL_* ones */
+#define TYPE_UDT_ID     (0x0FFF)
+#define TYPE_BOOL       (0xC1)
+
+/* @udt/<id> header and member definition sizes */
+#define UDT_HEADER_SIZE (14)
+#define UDT_MEMBER_SIZE (8)
+
+struct list_options_s {
+    int format;
+
+    /* a tag is listed if it matches any prefix or glob (or there are none) */
+    char *prefixes[MAX_FILTERS];
+    int prefix_count;
+    char *globs[MAX_FILTERS];
+    int glob_count;
+
+    /* programs to list (all if none) and programs to skip */
+    char *programs[MAX_FILTERS];
+    int program_count;
+    char *excluded[MAX_FILTERS];
+    int excluded_count;
+
+    /* output goes here instead of stdout when set */
+    struct abex_buf_s *collect;
+
+    /* --udts: template ids of the listed UDTs, each one fetched once */
+    int udts;
+    uint16_t *udt_ids;
+    int udt_count;
+    int udt_capacity;
+
+    /* --skip-system: leave out system tags and __ names */
+    int skip_system;
+
+    /* --capture=DIR: save each raw listing as DIR/listing-<n>.bin */
+    const char *capture_dir;
+    int capture_count;
+
+    /* --deadline-ms and --retries per listing, timeouts from the PLC's RTT */
+    struct tag_rtt_config_s retry;
+    struct tag_rtt_s rtt;
+
+    /* program listings and templates are copied here to be decoded */
+    struct abex_buf_s scratch;
+
+    /* --broker=PATH or $ABEX_BROKER: listings are read by the broker when it answers, -1 if not */
+    int broker_fd;
+};
+
+/* the name points into the controller listing, which is kept until the programs are listed */
 struct program_entry_s {
     struct program_entry_s *next;
     char *program_name;
+    uint32_t name_offset;
+    uint16_t name_len;
+};
+
+enum {
+    JOB_WAITING,
+    JOB_CREATING,
+    JOB_READING,
+    JOB_DONE
+};
+
+/*
+ * one program's @tags listing or one UDT template, output kept until it is
+ * its turn to print
+ */
+struct program_job_s {
+    char *program_name;
+    int is_template;
+    uint16_t template_id;
+    int32_t tag;
+    int state;
+    int64_t deadline;
+    struct tag_rtt_op_s op;
+    struct abex_buf_s out;
+
+    /* start of the current state, for --stats */
+    int64_t step_us;
 };
 
-int32_t setup_tag(char *plc_ip, char *path, char *plc_type, char *program)
+/* --stats: phase timings of the run, written to stderr at the end */
+static struct tag_stats_s stats;
+
+/* time spent writing to stdout, taken out of the decode time it falls in */
+static int64_t output_us;
+
+/* Logix names are not case sensitive, neither are the filters. */
+static int prefix_match(const char *prefix, const char *name)
 {
-    int32_t tag = PLCTAG_ERR_CREATE;
-    char tag_string[TAG_STRING_SIZE] = {0,};
+    while(*prefix) {
+        if(tolower((unsigned char)*prefix++) != tolower((unsigned char)*name++)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* shell-style match, * for any run of characters and ? for any one */
+static int glob_match(const char *glob, const char *name)
+{
+    const char *star = NULL;
+    const char *retry = NULL;
 
-    /* Build tag string based on PLC type */
-    if(!program || strlen(program) == 0) {
-        if(path && strlen(path) > 0) {
-            /* Logix-style with path */
-            compat_snprintf(tag_string, TAG_STRING_SIZE-1,
-                "protocol=ab-eip&gateway=%s&path=%s&plc=%s&name=@tags", 
-                plc_ip, path, plc_type);
+    while(*name) {
+        if(*glob == '*') {
+            star = glob++;
+            retry = name;
+        } else if(*glob == '?' || (*glob && tolower((unsigned char)*glob) == tolower((unsigned char)*name))) {
+            glob++;
+            name++;
+        } else if(star) {
+            glob = star + 1;
+            name = ++retry;
         } else {
-            /* Micro800-style without path */
-            compat_snprintf(tag_string, TAG_STRING_SIZE-1,
-                "protocol=ab-eip&gateway=%s&plc=%s&name=@tags", 
-                plc_ip, plc_type);
+            return 0;
         }
-    } else {
-        if(path && strlen(path) > 0) {
-            compat_snprintf(tag_string, TAG_STRING_SIZE-1,
-                "protocol=ab-eip&gateway=%s&path=%s&plc=%s&name=%s.@tags", 
-                plc_ip, path, plc_type, program);
-        } else {
-            compat_snprintf(tag_string, TAG_STRING_SIZE-1,
-                "protocol=ab-eip&gateway=%s&plc=%s&name=%s.@tags", 
-                plc_ip, plc_type, program);
+    }
+
+    while(*glob == '*') {
+        glob++;
+    }
+
+    return *glob == 0;
+}
+
+static int tag_wanted(struct list_options_s *opts, const char *name)
+{
+    int i;
+
+    if(opts->prefix_count == 0 && opts->glob_count == 0) {
+        return 1;
+    }
+
+    for(i = 0; i < opts->prefix_count; i++) {
+        if(prefix_match(opts->prefixes[i], name)) {
+            return 1;
         }
     }
 
-    tag = plc_tag_create(tag_string, TIMEOUT_MS);
-    if(tag < 0) {
-        fprintf(stderr, "Unable to open tag! Return code %s\n", plc_tag_decode_error(tag));
-        exit(1);
+    for(i = 0; i < opts->glob_count; i++) {
+        if(glob_match(opts->globs[i], name)) {
+            return 1;
+        }
     }
 
-    return tag;
+    return 0;
 }
 
-void get_list(int32_t tag, struct program_entry_s **head)
+/* program filters may be given with or without the Program: prefix */
+static int program_in(char **list, int count, const char *program)
 {
-    int rc = PLCTAG_STATUS_OK;
-    int offset = 0;
-    int index = 0;
+    int i;
 
-    rc = plc_tag_read(tag, TIMEOUT_MS);
-    if(rc != PLCTAG_STATUS_OK) {
-        fprintf(stderr, "Unable to read tag! Return code %s\n",plc_tag_decode_error(rc));
-        exit(1);
+    if(prefix_match("Program:", program)) {
+        program += strlen("Program:");
     }
 
-    do {
-        uint32_t tag_instance_id = 0;
-        uint16_t tag_type = 0;
-        uint16_t element_length = 0;
-        uint16_t tag_name_len = 0;
-        uint32_t array_dims[3] = {0,};
-        char tag_name[TAG_STRING_SIZE * 2] = {0,};
+    for(i = 0; i < count; i++) {
+        const char *entry = list[i];
 
-        /* Check if we have enough data left */
-        if(offset + 22 > plc_tag_get_size(tag)) {
-            break;
+        if(prefix_match("Program:", entry)) {
+            entry += strlen("Program:");
         }
 
-        /* each entry looks like this:
-        uint32_t instance_id    monotonically increasing but not contiguous
-        uint16_t symbol_type    type of the symbol.
-        uint16_t element_length length of one array element in bytes.
-        uint32_t array_dims[3]  array dimensions.
-        uint16_t string_len     string length count.
-        uint8_t string_data[]   string bytes (string_len of them)
-        */
+        if(!compat_strcasecmp(entry, program)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int program_wanted(struct list_options_s *opts, const char *program)
+{
+    if(opts->program_count > 0 && !program_in(opts->programs, opts->program_count, program)) {
+        return 0;
+    }
+
+    return !program_in(opts->excluded, opts->excluded_count, program);
+}
+
+static void append_record(struct abex_buf_s *out, int kind, uint32_t instance_id, uint16_t tag_type,
+                          uint16_t elem_length, const uint32_t *dims, const char *name)
+{
+    uint8_t header[RECORD_HEADER_SIZE];
+    size_t name_len = strlen(name);
 
-        tag_instance_id = plc_tag_get_uint32(tag, offset);
-        offset += 4;
+    header[0] = (uint8_t)kind;
+    put_le32(header + 1, instance_id);
+    put_le16(header + 5, tag_type);
+    put_le16(header + 7, elem_length);
+    put_le32(header + 9, dims ? dims[0] : 0);
+    put_le32(header + 13, dims ? dims[1] : 0);
+    put_le32(header + 17, dims ? dims[2] : 0);
+    put_le16(header + 21, (uint16_t)name_len);
 
-        tag_type = plc_tag_get_uint16(tag, offset);
-        offset += 2;
+    abex_buf_append(out, header, sizeof(header));
+    abex_buf_append(out, name, name_len);
+}
 
-        element_length = plc_tag_get_uint16(tag, offset);
-        offset += 2;
+static void flush_output(struct list_options_s *opts, struct abex_buf_s *out)
+{
+    if(opts->collect) {
+        if(abex_buf_append(opts->collect, out->data, out->len)) {
+            fprintf(stderr,"Unable to allocate memory for tag listing!\n");
+            exit(1);
+        }
+    } else if(out->len > 0) {
+        int64_t start_us = abex_time_us();
 
-        array_dims[0] = plc_tag_get_uint32(tag, offset);
-        offset += 4;
-        array_dims[1] = plc_tag_get_uint32(tag, offset);
-        offset += 4;
-        array_dims[2] = plc_tag_get_uint32(tag, offset);
-        offset += 4;
+        fwrite(out->data, 1, out->len, stdout);
 
-        tag_name_len = plc_tag_get_uint16(tag, offset);
-        offset += 2;
+        if(stats.enabled) {
+            int64_t us = abex_time_us() - start_us;
 
-        /* Safety check */
-        if(tag_name_len >= (TAG_STRING_SIZE*2)-1) {
-            tag_name_len = (TAG_STRING_SIZE*2)-2;
+            tag_stats_add(&stats, TAG_STATS_OUTPUT, us);
+            output_us += us;
         }
+    }
+
+    abex_buf_reset(out);
+}
+
+/* remember the template of a UDT type to fetch it later, system types cannot be read */
+static void note_udt(struct list_options_s *opts, uint16_t tag_type)
+{
+    uint16_t id = (uint16_t)(tag_type & TYPE_UDT_ID);
+    int i;
 
-        for(int i=0; i < (int)tag_name_len && offset < plc_tag_get_size(tag); i++) {
-            tag_name[i] = (char)plc_tag_get_int8(tag,offset);
-            offset++;
-            tag_name[i+1] = 0;
+    if(!opts->udts || !(tag_type & TAG_SYMBOL_IS_STRUCT) || (tag_type & TAG_SYMBOL_IS_SYSTEM)) {
+        return;
+    }
+
+    for(i = 0; i < opts->udt_count; i++) {
+        if(opts->udt_ids[i] == id) {
+            return;
         }
+    }
 
-        index++;
+    if(opts->udt_count == opts->udt_capacity) {
+        int capacity = opts->udt_capacity ? opts->udt_capacity * 2 : 32;
+        uint16_t *ids = realloc(opts->udt_ids, (size_t)capacity * sizeof(*ids));
 
-        printf("tag_name=%s; tag_instance_id=%x; tag_type=%x; element_length=%d; array_dimensions=(%d, %d, %d)\n", 
+        if(!ids) {
+            fprintf(stderr,"Unable to allocate memory for UDT templates!\n");
+            exit(1);
+        }
+
+        opts->udt_ids = ids;
+        opts->udt_capacity = capacity;
+    }
+
+    opts->udt_ids[opts->udt_count++] = id;
+}
+
+static void emit_tag(struct list_options_s *opts, int kind, uint32_t tag_instance_id, uint16_t tag_type,
+                     uint16_t element_length, const uint32_t *array_dims, const char *tag_name, struct abex_buf_s *out)
+{
+    if(!tag_wanted(opts, tag_name)) {
+        return;
+    }
+
+    if(opts->skip_system && tag_symbol_is_system(tag_type, tag_name, strlen(tag_name))) {
+        return;
+    }
+
+    note_udt(opts, tag_type);
+
+    if(opts->format == FORMAT_BINARY) {
+        append_record(out, kind, tag_instance_id, tag_type, element_length, array_dims, tag_name);
+    } else {
+        abex_buf_printf(out, "tag_name=%s; tag_instance_id=%x; tag_type=%x; element_length=%d; array_dimensions=(%d, %d, %d)\n", 
             tag_name, tag_instance_id, tag_type, (int)element_length, 
             (int)array_dims[0], (int)array_dims[1], (int)array_dims[2]);
+    }
+}
 
-        if(head && strncmp(tag_name, "Program:", strlen("Program:")) == 0) {
-            struct program_entry_s *entry = malloc(sizeof(*entry));
+static void emit_program(struct list_options_s *opts, const char *program_name, struct abex_buf_s *out)
+{
+    if(opts->format == FORMAT_BINARY) {
+        append_record(out, RECORD_PROGRAM, 0, 0, 0, NULL, program_name);
+    } else {
+        abex_buf_printf(out, "\r\n%s!", program_name);
+    }
+}
 
+/* attribute string of a listing (@tags, <program>.@tags, @udt/<id>) */
+static void listing_attrs(char *tag_string, char *plc_ip, char *path, char *plc_type, const char *name)
+{
+    if(path && strlen(path) > 0) {
+        /* Logix-style with path */
+        compat_snprintf(tag_string, TAG_STRING_SIZE-1,
+            "protocol=ab-eip&gateway=%s&path=%s&plc=%s&name=%s",
+            plc_ip, path, plc_type, name);
+    } else {
+        /* Micro800-style without path */
+        compat_snprintf(tag_string, TAG_STRING_SIZE-1,
+            "protocol=ab-eip&gateway=%s&plc=%s&name=%s",
+            plc_ip, plc_type, name);
+    }
+}
+
+static void listing_name(char *name, char *program, int is_template, uint16_t template_id)
+{
+    if(is_template) {
+        compat_snprintf(name, TAG_STRING_SIZE-1, "@udt/%u", (unsigned)template_id);
+    } else if(!program || strlen(program) == 0) {
+        compat_snprintf(name, TAG_STRING_SIZE-1, "@tags");
+    } else {
+        compat_snprintf(name, TAG_STRING_SIZE-1, "%s.@tags", program);
+    }
+}
+
+int32_t setup_tag(char *plc_ip, char *path, char *plc_type, char *program, int timeout)
+{
+    int32_t tag = PLCTAG_ERR_CREATE;
+    char name[TAG_STRING_SIZE] = {0,};
+    char tag_string[TAG_STRING_SIZE] = {0,};
+    int64_t start_us;
+
+    listing_name(name, program, 0, 0);
+    listing_attrs(tag_string, plc_ip, path, plc_type, name);
+
+    start_us = abex_time_us();
+    tag = plc_tag_create(tag_string, timeout);
+    tag_stats_since(&stats, TAG_STATS_CREATE, start_us);
+    if(tag < 0) {
+        fprintf(stderr, "Unable to open tag! Return code %s\n", plc_tag_decode_error(tag));
+        exit(1);
+    }
+
+    return tag;
+}
+
+int32_t setup_udt_tag(char *plc_ip, char *path, char *plc_type, uint16_t template_id, int timeout)
+{
+    int32_t tag = PLCTAG_ERR_CREATE;
+    char name[TAG_STRING_SIZE] = {0,};
+    char tag_string[TAG_STRING_SIZE] = {0,};
+    int64_t start_us;
+
+    listing_name(name, NULL, 1, template_id);
+    listing_attrs(tag_string, plc_ip, path, plc_type, name);
+
+    start_us = abex_time_us();
+    tag = plc_tag_create(tag_string, timeout);
+    tag_stats_since(&stats, TAG_STATS_CREATE, start_us);
+    if(tag < 0) {
+        fprintf(stderr, "Unable to open UDT template %u! Return code %s\n", (unsigned)template_id,
+                plc_tag_decode_error(tag));
+        exit(1);
+    }
+
+    return tag;
+}
+
+
+/*
+ * Send one request to the broker and wait for its answer, left in reply
+ * after the status byte.  Returns the request status, -1 if the broker
+ * went away.
+ */
+static int broker_call(struct list_options_s *opts, int argc, char **argv, struct abex_buf_s *reply)
+{
+    char deadline[32];
+    char retries[32];
+    char *req_argv[16];
+    int i;
+
+    compat_snprintf(deadline, sizeof(deadline), "--deadline-ms=%d", opts->retry.deadline_ms);
+    compat_snprintf(retries, sizeof(retries), "--retries=%d", opts->retry.retries);
+
+    for(i = 0; i < argc; i++) {
+        req_argv[i] = argv[i];
+    }
+
+    req_argv[argc++] = deadline;
+    req_argv[argc++] = retries;
+
+    if(frame_write_args(opts->broker_fd, argc, req_argv, NULL, 0)) {
+        return -1;
+    }
+
+    return broker_reply(opts->broker_fd, reply, BROKER_REPLY_TIMEOUT_MS);
+}
+
+
+/* read a listing through the broker, as a raw uint8 array, into raw */
+static void broker_listing(char *plc_ip, char *path, char *plc_type, const char *name, struct list_options_s *opts,
+                           struct abex_buf_s *raw)
+{
+    char tag_string[TAG_STRING_SIZE] = {0,};
+    char *argv[] = {"-t", "uint8", "--format=binary", "-p", tag_string};
+    struct abex_buf_s reply = {NULL, 0, 0};
+    int64_t start_us = abex_time_us();
+    int status;
+
+    listing_attrs(tag_string, plc_ip, path, plc_type, (char *)name);
+
+    status = broker_call(opts, 5, argv, &reply);
+    tag_stats_since(&stats, TAG_STATS_READ, start_us);
+
+    if(status != 0 || reply.len < 1 + TAG_DECODE_BLOCK_HEADER_SIZE) {
+        fprintf(stderr, "Unable to read %s through the broker! %s\n", name,
+                status < 0 ? "No answer" : (reply.len > 1 ? reply.data + 1 : "Short answer"));
+        exit(1);
+    }
+
+    abex_buf_reset(raw);
+    abex_buf_append(raw, reply.data + 1 + TAG_DECODE_BLOCK_HEADER_SIZE,
+                    reply.len - 1 - TAG_DECODE_BLOCK_HEADER_SIZE);
+    stats.bytes_read += (uint64_t)raw->len;
+
+    abex_buf_free(&reply);
+}
+
+
+/* the catalog check, done by the broker on its connection */
+static int broker_fingerprint(char *plc_ip, char *path, char *plc_type, struct list_options_s *opts,
+                              struct tag_catalog_fingerprint_s *fp)
+{
+    char *argv[] = {"--catalog-fingerprint", plc_ip, plc_type, path};
+    struct abex_buf_s reply = {NULL, 0, 0};
+    unsigned max_instance;
+    unsigned instance_count;
+    int rc = PLCTAG_ERR_UNSUPPORTED;
+
+    memset(fp, 0, sizeof(*fp));
+
+    if(broker_call(opts, path ? 4 : 3, argv, &reply) == 0
+       && sscanf(reply.data + 1, "%u %u", &max_instance, &instance_count) == 2) {
+        fp->max_instance = (uint32_t)max_instance;
+        fp->instance_count = (uint32_t)instance_count;
+        rc = PLCTAG_STATUS_OK;
+    }
+
+    abex_buf_free(&reply);
+
+    return rc;
+}
+
+/*
+ * Decode a @tags listing copied into raw, one line or record per tag that
+ * passes the filters.  Program entries are added to head if it is not
+ * NULL, their names left in raw.  Controller tags go to stdout as the
+ * buffer fills up; program tags stay in out until the program's turn to be
+ * printed.
+ */
+void decode_list(struct abex_buf_s *raw, struct program_entry_s **head, struct list_options_s *opts, int kind,
+                 struct abex_buf_s *out)
+{
+    struct tag_symbols_s symbols;
+    struct tag_symbol_s symbol;
+    struct program_entry_s *entry;
+    int rc;
+
+    tag_symbols_init(&symbols, (const uint8_t *)raw->data, raw->len);
+
+    while((rc = tag_symbols_next(&symbols, &symbol)) > 0) {
+        char *tag_name = raw->data + symbol.name_offset;
+        char after = tag_name[symbol.name_len];
+
+        /*
+         * terminate the name in place for the filters and the output, the
+         * byte after it (the next entry or the spare byte of raw) is put
+         * back before that entry is decoded.
+         */
+        tag_name[symbol.name_len] = 0;
+
+        /* filtered out tags are still needed to find the programs. */
+        emit_tag(opts, kind, symbol.instance_id, symbol.symbol_type, symbol.element_length, symbol.array_dims,
+                 tag_name, out);
+
+        if(head && strncmp(tag_name, "Program:", strlen("Program:")) == 0 && program_wanted(opts, tag_name)) {
+            entry = malloc(sizeof(*entry));
             if(!entry) {
                 fprintf(stderr,"Unable to allocate memory for program entry!\n");
                 exit(1);
             }
 
+            entry->name_offset = symbol.name_offset;
+            entry->name_len = symbol.name_len;
             entry->next = *head;
-            entry->program_name = compat_strdup(tag_name);
-
             *head = entry;
         }
-    } while(rc == PLCTAG_STATUS_OK && offset < plc_tag_get_size(tag));
 
-    plc_tag_destroy(tag);
+        tag_name[symbol.name_len] = after;
+
+        if(kind == RECORD_CONTROLLER_TAG && out->len >= FLUSH_SIZE) {
+            flush_output(opts, out);
+        }
+    }
+
+    if(rc < 0) {
+        fprintf(stderr, "WARNING: the tag listing ends in a cut short entry, it is left out\n");
+    }
+
+    /* every entry is decoded, so the program names can keep their NULs. */
+    for(entry = head ? *head : NULL; entry; entry = entry->next) {
+        entry->program_name = raw->data + entry->name_offset;
+        entry->program_name[entry->name_len] = 0;
+    }
 }
 
+/* a NUL terminated name in a template, returns the offset after it */
+static size_t read_udt_name(const uint8_t *data, size_t size, size_t offset, char *name, size_t name_size)
+{
+    size_t len = 0;
 
-int main(int argc, char **argv)
+    while(offset < size) {
+        char c = (char)data[offset++];
+
+        if(!c) {
+            break;
+        }
+
+        if(len + 1 < name_size) {
+            name[len++] = c;
+        }
+    }
+
+    name[len] = 0;
+
+    return offset;
+}
+
+/*
+ * Decode a @udt/<id> template copied into raw into a RECORD_UDT and its
+ * RECORD_UDT_MEMBERs.  The definition is a header, one (metadata, type,
+ * offset) triple per member and then the names: the type name up to a ';'
+ * and the member names, all NUL terminated.  Nested UDTs are noted for
+ * the next round.
+ */
+void decode_udt(const struct abex_buf_s *raw, uint16_t template_id, struct list_options_s *opts, struct abex_buf_s *out)
 {
+    const uint8_t *data = (const uint8_t *)raw->data;
+    size_t size = raw->len;
+    uint32_t instance_size;
+    uint16_t num_members;
+    uint16_t handle;
+    uint32_t dims[3] = {0,};
+    char name[TAG_STRING_SIZE * 2];
+    size_t name_offset;
+    int i;
+
+    if(size < UDT_HEADER_SIZE) {
+        fprintf(stderr, "UDT template %u is too short!\n", (unsigned)template_id);
+        exit(1);
+    }
+
+    instance_size = get_le32(data + 6);
+    num_members = get_le16(data + 10);
+    handle = get_le16(data + 12);
+    name_offset = UDT_HEADER_SIZE + (size_t)num_members * UDT_MEMBER_SIZE;
+
+    if(name_offset > size) {
+        fprintf(stderr, "UDT template %u is too short!\n", (unsigned)template_id);
+        exit(1);
+    }
+
+    /* the type name is followed by ";n..." and a NUL. */
+    name_offset = read_udt_name(data, size, name_offset, name, sizeof(name));
+    if(strchr(name, ';')) {
+        *strchr(name, ';') = 0;
+    }
+
+    dims[0] = instance_size;
+    dims[1] = num_members;
+    append_record(out, RECORD_UDT, template_id, handle, 0, dims, name);
+
+    for(i = 0; i < num_members; i++) {
+        const uint8_t *member = data + UDT_HEADER_SIZE + i * UDT_MEMBER_SIZE;
+        uint16_t metadata = get_le16(member);
+        uint16_t type = get_le16(member + 2);
+        uint32_t offset = get_le32(member + 4);
+
+        name_offset = read_udt_name(data, size, name_offset, name, sizeof(name));
+
+        /* metadata is the bit number of a BOOL and the element count of an array. */
+        dims[0] = 0;
+        dims[1] = 0;
+        if((type & 0xFF) == TYPE_BOOL && !(type & TAG_SYMBOL_IS_STRUCT)) {
+            dims[1] = metadata;
+        } else if(type & 0x6000) {
+            dims[0] = metadata;
+        }
+
+        note_udt(opts, type);
+
+        append_record(out, RECORD_UDT_MEMBER, offset, type,
+                      (uint16_t)((type & TAG_SYMBOL_IS_STRUCT) ? 0 : tag_catalog_type_size(type)), dims, name);
+    }
+}
+
+/* --capture: keep the raw response for symbols_bench */
+static void capture_listing(struct list_options_s *opts, const struct abex_buf_s *raw)
+{
+    char file[CATALOG_FILE_SIZE];
+    FILE *fp;
+
+    compat_snprintf(file, sizeof(file), "%s/listing-%d.bin", opts->capture_dir, opts->capture_count++);
+
+    fp = fopen(file, "wb");
+    if(!fp || fwrite(raw->data, 1, raw->len, fp) != raw->len) {
+        fprintf(stderr, "Unable to write %s!\n", file);
+    }
+
+    if(fp) {
+        fclose(fp);
+    }
+}
+
+/* decode a listing or template in raw, counting the time less the time spent writing out */
+static void decode_raw(uint16_t template_id, struct program_entry_s **head, struct list_options_s *opts, int kind,
+                       struct abex_buf_s *raw, struct abex_buf_s *out)
+{
+    int64_t start_us = abex_time_us();
+    int64_t output_before = output_us;
+
+    if(opts->capture_dir && kind != RECORD_UDT) {
+        capture_listing(opts, raw);
+    }
+
+    if(kind == RECORD_UDT) {
+        decode_udt(raw, template_id, opts, out);
+    } else {
+        decode_list(raw, head, opts, kind, out);
+    }
+
+    if(stats.enabled) {
+        tag_stats_add(&stats, TAG_STATS_DECODE, abex_time_us() - start_us - (output_us - output_before));
+    }
+}
+
+/* a read came back: copy the response into raw once and decode it from there */
+static void decode_read(int32_t tag, uint16_t template_id, struct program_entry_s **head,
+                        struct list_options_s *opts, int kind, struct abex_buf_s *raw, struct abex_buf_s *out)
+{
+    int size = plc_tag_get_size(tag);
+    int rc;
+
+    abex_buf_reset(raw);
+
+    if(size < 0 || abex_buf_reserve(raw, (size_t)size)) {
+        fprintf(stderr, "Unable to allocate memory for the tag listing!\n");
+        exit(1);
+    }
+
+    rc = size > 0 ? plc_tag_get_raw_bytes(tag, 0, (uint8_t *)raw->data, size) : PLCTAG_STATUS_OK;
+    if(rc != PLCTAG_STATUS_OK) {
+        fprintf(stderr, "Unable to copy the tag listing! Return code %s\n", plc_tag_decode_error(rc));
+        exit(1);
+    }
+
+    raw->len = (size_t)size;
+    raw->data[raw->len] = 0;
+    stats.bytes_read += (uint64_t)size;
+
+    decode_raw(template_id, head, opts, kind, raw, out);
+}
+
+/* the controller listing, through the broker if there is one */
+void get_list(char *plc_ip, char *path, char *plc_type, struct program_entry_s **head, struct list_options_s *opts,
+              struct abex_buf_s *raw)
+{
+    struct abex_buf_s out = {NULL, 0, 0};
+    int64_t deadline = abex_time_ms() + opts->retry.deadline_ms;
+    int64_t start_us;
     int32_t tag;
+    int rc;
+
+    if(opts->broker_fd >= 0) {
+        broker_listing(plc_ip, path, plc_type, "@tags", opts, raw);
+        decode_raw(0, head, opts, RECORD_CONTROLLER_TAG, raw, &out);
+        flush_output(opts, &out);
+        abex_buf_free(&out);
+        return;
+    }
+
+    tag = setup_tag(plc_ip, path, plc_type, NULL, opts->retry.deadline_ms);
+
+    start_us = abex_time_us();
+    rc = tag_rtt_request(&opts->rtt, tag, 0, opts->retry.retries, deadline);
+    tag_stats_since(&stats, TAG_STATS_READ, start_us);
+    if(rc != PLCTAG_STATUS_OK) {
+        fprintf(stderr, "Unable to read tag! Return code %s\n",plc_tag_decode_error(rc));
+        exit(1);
+    }
+
+    decode_read(tag, 0, head, opts, RECORD_CONTROLLER_TAG, raw, &out);
+    flush_output(opts, &out);
+
+    abex_buf_free(&out);
+    plc_tag_destroy(tag);
+}
+
+
+/*
+ * Move a program listing or template along: creating -> reading -> done.  Nothing
+ * blocks, so many listings share the connection at once.  A read that times
+ * out is sent again while the job deadline allows.  Returns 1 if the job
+ * changed state.
+ */
+static int poll_job(struct program_job_s *job, struct list_options_s *opts)
+{
+    int rc = job->state == JOB_READING ? tag_rtt_op_poll(&job->op) : plc_tag_status(job->tag);
+
+    if(rc == PLCTAG_STATUS_PENDING) {
+        if(job->state == JOB_CREATING && abex_time_ms() > job->deadline) {
+            fprintf(stderr, "Unable to %s tag! Return code %s\n", job->state == JOB_CREATING ? "open" : "read",
+                    plc_tag_decode_error(PLCTAG_ERR_TIMEOUT));
+            exit(1);
+        }
+
+        return 0;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        fprintf(stderr, "Unable to %s tag! Return code %s\n", job->state == JOB_CREATING ? "open" : "read",
+                plc_tag_decode_error(rc));
+        exit(1);
+    }
+
+    tag_stats_since(&stats, job->state == JOB_CREATING ? TAG_STATS_STATUS : TAG_STATS_READ, job->step_us);
+
+    if(job->state == JOB_CREATING) {
+        job->step_us = abex_time_us();
+        rc = tag_rtt_op_start(&job->op, &opts->rtt, job->tag, 0, opts->retry.retries, job->deadline);
+        if(rc != PLCTAG_STATUS_PENDING) {
+            fprintf(stderr, "Unable to read tag! Return code %s\n",plc_tag_decode_error(rc));
+            exit(1);
+        }
+
+        job->state = JOB_READING;
+
+        return 1;
+    }
+
+    decode_read(job->tag, job->template_id, NULL, opts, job->is_template ? RECORD_UDT : RECORD_PROGRAM_TAG,
+                &opts->scratch, &job->out);
+
+    plc_tag_destroy(job->tag);
+    job->state = JOB_DONE;
+
+    return 1;
+}
+
+
+/*
+ * List the tags of every program (or fetch every template), up to
+ * concurrency at a time.  Output is printed in the order of the job list,
+ * each job as soon as it and all the ones before it are done.
+ */
+void run_jobs(char *plc_ip, char *path, char *plc_type, struct program_job_s *jobs, int count,
+              int concurrency, struct list_options_s *opts)
+{
+    int next_start = 0;
+    int next_print = 0;
+    int active = 0;
+    int i;
+
+    while(next_print < count) {
+        int progress = 0;
+
+        while(active < concurrency && next_start < count) {
+            struct program_job_s *job = &jobs[next_start++];
+
+            /* the broker answers one request at a time, so its listings are read in turn. */
+            if(opts->broker_fd >= 0) {
+                char name[TAG_STRING_SIZE] = {0,};
+
+                listing_name(name, job->program_name, job->is_template, job->template_id);
+                broker_listing(plc_ip, path, plc_type, name, opts, &opts->scratch);
+                decode_raw(job->template_id, NULL, opts, job->is_template ? RECORD_UDT : RECORD_PROGRAM_TAG,
+                           &opts->scratch, &job->out);
+
+                job->state = JOB_DONE;
+                progress = 1;
+                continue;
+            }
+
+            if(job->is_template) {
+                job->tag = setup_udt_tag(plc_ip, path, plc_type, job->template_id, 0);
+            } else {
+                job->tag = setup_tag(plc_ip, path, plc_type, job->program_name, 0);
+            }
+
+            job->state = JOB_CREATING;
+            job->step_us = abex_time_us();
+            job->deadline = abex_time_ms() + opts->retry.deadline_ms;
+            active++;
+        }
+
+        for(i = next_print; i < next_start; i++) {
+            if(jobs[i].state != JOB_DONE && poll_job(&jobs[i], opts)) {
+                progress = 1;
+
+                if(jobs[i].state == JOB_DONE) {
+                    active--;
+                }
+            }
+        }
+
+        while(next_print < count && jobs[next_print].state == JOB_DONE) {
+            struct program_job_s *job = &jobs[next_print++];
+
+            struct abex_buf_s header = {NULL, 0, 0};
+
+            if(!job->is_template) {
+                emit_program(opts, job->program_name, &header);
+                flush_output(opts, &header);
+            }
+
+            flush_output(opts, &job->out);
+
+            abex_buf_free(&header);
+            abex_buf_free(&job->out);
+        }
+
+        if(!progress) {
+            abex_sleep_ms(POLL_INTERVAL_MS);
+        }
+    }
+}
+
+
+/*
+ * Templates of the UDTs seen so far.  Members may be UDTs themselves, so
+ * this goes round until a round finds no new template.
+ */
+static void list_udts(char *plc_ip, char *path, char *plc_type, int concurrency, struct list_options_s *opts)
+{
+    int fetched = 0;
+
+    while(fetched < opts->udt_count) {
+        int count = opts->udt_count - fetched;
+        struct program_job_s *jobs = calloc((size_t)count, sizeof(*jobs));
+        int i;
+
+        if(!jobs) {
+            fprintf(stderr,"Unable to allocate memory for UDT templates!\n");
+            exit(1);
+        }
+
+        for(i = 0; i < count; i++) {
+            jobs[i].is_template = 1;
+            jobs[i].template_id = opts->udt_ids[fetched + i];
+            jobs[i].state = JOB_WAITING;
+        }
+
+        fetched = opts->udt_count;
+
+        run_jobs(plc_ip, path, plc_type, jobs, count, concurrency, opts);
+        free(jobs);
+    }
+}
+
+
+/* controller tags, then the tags of each program, then the UDT templates */
+static void list_tags(char *plc_ip, char *path, char *plc_type, int concurrency, struct list_options_s *opts)
+{
     struct program_entry_s *programs = NULL;
+    struct program_entry_s *program;
+    struct program_job_s *jobs;
+    struct abex_buf_s controller = {NULL, 0, 0};
+    int count = 0;
+    int i;
+
+    /* get the controller tags first. */
+    get_list(plc_ip, path, plc_type, &programs, opts, &controller);
+
+    /* get the tags for each program, in list order. */
+    if(opts->format == FORMAT_TEXT) {
+        printf("Program tags\n");
+    }
+
+    for(program = programs; program; program = program->next) {
+        count++;
+    }
+
+    jobs = calloc((size_t)(count > 0 ? count : 1), sizeof(*jobs));
+    if(!jobs) {
+        fprintf(stderr,"Unable to allocate memory for program listings!\n");
+        exit(1);
+    }
+
+    for(i = 0, program = programs; program; program = program->next, i++) {
+        jobs[i].program_name = program->program_name;
+        jobs[i].state = JOB_WAITING;
+    }
+
+    run_jobs(plc_ip, path, plc_type, jobs, count, concurrency, opts);
+
+    if(opts->udts) {
+        list_udts(plc_ip, path, plc_type, concurrency, opts);
+    }
+
+    /* now clean up */
+    while(programs) {
+        program = programs;
+        programs = programs->next;
+
+        free(program);
+    }
+
+    abex_buf_free(&controller);
+    free(jobs);
+}
+
+
+/* same output as list_tags, from a catalog */
+static void emit_catalog(struct tag_catalog_s *cat, struct list_options_s *opts)
+{
+    struct abex_buf_s out = {NULL, 0, 0};
+    uint32_t count = cat->header->entry_count;
+    int program_wanted_now = 0;
+    uint32_t i;
+
+    for(i = 0; i < count; i++) {
+        const struct tag_catalog_entry_s *entry = &cat->entries[i];
+
+        if(entry->kind == RECORD_CONTROLLER_TAG) {
+            emit_tag(opts, entry->kind, entry->instance_id, entry->tag_type, entry->elem_length, entry->dims,
+                     tag_catalog_name(cat, entry), &out);
+
+            if(out.len >= FLUSH_SIZE) {
+                flush_output(opts, &out);
+            }
+        }
+    }
+
+    flush_output(opts, &out);
+
+    if(opts->format == FORMAT_TEXT) {
+        printf("Program tags\n");
+    }
+
+    for(i = 0; i < count; i++) {
+        const struct tag_catalog_entry_s *entry = &cat->entries[i];
+        const char *name = tag_catalog_name(cat, entry);
+
+        if(entry->kind == RECORD_PROGRAM) {
+            program_wanted_now = program_wanted(opts, name);
+            if(program_wanted_now) {
+                emit_program(opts, name, &out);
+            }
+        } else if(entry->kind == RECORD_PROGRAM_TAG && program_wanted_now) {
+            /* catalog names are Program:<name>.<tag>, the listing shows <tag> */
+            const char *program_name = tag_catalog_name(cat, &cat->entries[entry->program]);
+
+            emit_tag(opts, entry->kind, entry->instance_id, entry->tag_type, entry->elem_length, entry->dims,
+                     name + strlen(program_name) + 1, &out);
+        } else if((entry->kind == RECORD_UDT || entry->kind == RECORD_UDT_MEMBER)
+                  && opts->udts && opts->format == FORMAT_BINARY) {
+            append_record(&out, entry->kind, entry->instance_id, entry->tag_type, entry->elem_length, entry->dims,
+                          name);
+        }
+
+        if(out.len >= FLUSH_SIZE) {
+            flush_output(opts, &out);
+        }
+    }
+
+    flush_output(opts, &out);
+    abex_buf_free(&out);
+}
+
+
+/*
+ * A catalog is current if it is younger than max_age and the controller
+ * fingerprint still matches.  Controllers without a fingerprint rely on
+ * max_age alone.
+ */
+static int catalog_current(const struct tag_catalog_header_s *header, int fp_rc,
+                           const struct tag_catalog_fingerprint_s *fp, long max_age, int udts)
+{
+    int64_t age = (int64_t)time(NULL) - header->created;
+
+    if(age < 0 || age > max_age) {
+        return 0;
+    }
+
+    if(udts && !(header->flags & TAG_CATALOG_HAS_UDTS)) {
+        return 0;
+    }
+
+    if(!header->max_instance && !header->instance_count) {
+        return fp_rc != PLCTAG_STATUS_OK;
+    }
+
+    return fp_rc == PLCTAG_STATUS_OK && fp->max_instance == header->max_instance
+           && fp->instance_count == header->instance_count;
+}
+
+
+/*
+ * List from the catalog file for this gateway and path if it is still
+ * current, otherwise take a full listing, save it as the new catalog and
+ * list from that.  Filters are applied when listing from the catalog, so
+ * the catalog always holds every tag.  Templates are only fetched for
+ * --udts; a catalog without them is rebuilt when they are asked for.
+ */
+static void list_with_catalog(char *plc_ip, char *path, char *plc_type, int concurrency, const char *catalog_dir,
+                              long max_age, int refresh, struct list_options_s *opts)
+{
+    struct tag_catalog_fingerprint_s fp;
+    struct tag_catalog_s cat;
+    struct abex_buf_s records = {NULL, 0, 0};
+    struct abex_buf_s image = {NULL, 0, 0};
+    struct list_options_s all;
+    char file[CATALOG_FILE_SIZE];
+    int fp_rc;
+
+    if(tag_catalog_file_name(file, sizeof(file), catalog_dir, plc_ip, path)) {
+        fprintf(stderr, "Catalog directory name is too long!\n");
+        exit(1);
+    }
+
+    /* taken before listing, so a change during the listing is caught next time. */
+    if(opts->broker_fd >= 0) {
+        fp_rc = broker_fingerprint(plc_ip, path, plc_type, opts, &fp);
+    } else {
+        fp_rc = tag_catalog_fingerprint(plc_ip, path, plc_type, opts->retry.deadline_ms, &fp);
+    }
+
+    if(!refresh && !tag_catalog_open(&cat, file)) {
+        if(catalog_current(cat.header, fp_rc, &fp, max_age, opts->udts)) {
+            emit_catalog(&cat, opts);
+            tag_catalog_close(&cat);
+            return;
+        }
+
+        tag_catalog_close(&cat);
+    }
+
+    memset(&all, 0, sizeof(all));
+    all.format = FORMAT_BINARY;
+    all.collect = &records;
+    all.udts = opts->udts;
+    all.retry = opts->retry;
+    all.rtt = opts->rtt;
+    all.capture_dir = opts->capture_dir;
+    all.broker_fd = opts->broker_fd;
+
+    list_tags(plc_ip, path, plc_type, concurrency, &all);
+    opts->rtt = all.rtt;
+    abex_buf_free(&all.scratch);
+
+    if(tag_catalog_build((const uint8_t *)records.data, records.len, fp_rc == PLCTAG_STATUS_OK ? &fp : NULL,
+                         all.udts ? TAG_CATALOG_HAS_UDTS : 0, &image)
+       || tag_catalog_load(&cat, image.data, image.len)) {
+        fprintf(stderr, "Unable to build the tag catalog!\n");
+        exit(1);
+    }
+
+    /* not being able to save only costs a full listing next time. */
+    tag_catalog_save(file, &image);
+
+    emit_catalog(&cat, opts);
+
+    tag_catalog_close(&cat);
+    abex_buf_free(&image);
+    abex_buf_free(&records);
+    free(all.udt_ids);
+}
+
+
+static void add_filter(char **list, int *count, char *value, const char *option)
+{
+    if(*count >= MAX_FILTERS) {
+        fprintf(stderr, "At most %d %s options are supported!\n", MAX_FILTERS, option);
+        exit(1);
+    }
+
+    list[(*count)++] = value;
+}
+
+
+int main(int argc, char **argv)
+{
+    char *args[4] = {NULL, NULL, NULL, NULL};
+    int nargs = 0;
+    int concurrency = DEFAULT_CONCURRENCY;
+    struct list_options_s opts;
+    char *catalog_dir = NULL;
+    long max_age = DEFAULT_MAX_AGE_S;
+    int refresh = 0;
+    int rc;
+    int i;
+    struct tag_rtt_config_s retry_defaults = TAG_RTT_CONFIG_INIT;
+    int64_t start_us = abex_time_us();
+    int64_t lib_check_us;
     char *plc_ip = NULL;
     char *path = NULL;
     char *plc_type = "ControlLogix"; /* default */
@@ -176,28 +1188,103 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    lib_check_us = abex_time_us() - start_us;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.format = FORMAT_TEXT;
+    opts.retry = retry_defaults;
+    opts.broker_fd = -1;
+    tag_rtt_init(&opts.rtt);
+
+    /* options can go anywhere, everything else is positional. */
+    for(i = 0; i < argc; i++) {
+        if(!strncmp(argv[i], "--concurrency=", strlen("--concurrency="))) {
+            concurrency = atoi(argv[i] + strlen("--concurrency="));
+            if(concurrency <= 0) {
+                fprintf(stderr, "--concurrency must be greater than zero!\n");
+                exit(1);
+            }
+        } else if(!strcmp(argv[i], "--format=text")) {
+            opts.format = FORMAT_TEXT;
+        } else if(!strcmp(argv[i], "--format=binary")) {
+            opts.format = FORMAT_BINARY;
+        } else if(!strncmp(argv[i], "--prefix=", strlen("--prefix="))) {
+            add_filter(opts.prefixes, &opts.prefix_count, argv[i] + strlen("--prefix="), "--prefix");
+        } else if(!strncmp(argv[i], "--glob=", strlen("--glob="))) {
+            add_filter(opts.globs, &opts.glob_count, argv[i] + strlen("--glob="), "--glob");
+        } else if(!strncmp(argv[i], "--program=", strlen("--program="))) {
+            add_filter(opts.programs, &opts.program_count, argv[i] + strlen("--program="), "--program");
+        } else if(!strncmp(argv[i], "--exclude-program=", strlen("--exclude-program="))) {
+            add_filter(opts.excluded, &opts.excluded_count, argv[i] + strlen("--exclude-program="), "--exclude-program");
+        } else if(!strncmp(argv[i], "--catalog-dir=", strlen("--catalog-dir="))) {
+            catalog_dir = argv[i] + strlen("--catalog-dir=");
+        } else if(!strncmp(argv[i], "--max-age=", strlen("--max-age="))) {
+            max_age = atol(argv[i] + strlen("--max-age="));
+        } else if(!strcmp(argv[i], "--refresh")) {
+            refresh = 1;
+        } else if(!strcmp(argv[i], "--udts")) {
+            opts.udts = 1;
+        } else if(!strcmp(argv[i], "--skip-system")) {
+            opts.skip_system = 1;
+        } else if(!strncmp(argv[i], "--capture=", strlen("--capture="))) {
+            opts.capture_dir = argv[i] + strlen("--capture=");
+        } else if(!strcmp(argv[i], "--stats")) {
+            stats.enabled = 1;
+        } else if(!strncmp(argv[i], BROKER_ARG, strlen(BROKER_ARG))) {
+            /* see broker_socket_path() */
+        } else if((rc = tag_rtt_parse_arg(&opts.retry, argv[i])) != 0) {
+            if(rc < 0) {
+                fprintf(stderr, "Bad retry option %s!\n", argv[i]);
+                exit(1);
+            }
+        } else if(!strncmp(argv[i], "--", 2)) {
+            fprintf(stderr, "Unknown option %s!\n", argv[i]);
+            exit(1);
+        } else if(nargs < 4) {
+            args[nargs++] = argv[i];
+        }
+    }
+
     /* Parse arguments:
      * tag_list <ip> <path>         - For Logix PLCs (backward compatible)
      * tag_list <ip> <plc_type> <path> - For any PLC type
      */
-    if(argc < 2) {
-        fprintf(stderr, "Usage: tag_list <ip> <path> OR tag_list <ip> <plc_type> [path]\n");
+    if(nargs < 2) {
+        fprintf(stderr, "Usage: tag_list <ip> <path> OR tag_list <ip> <plc_type> [path] [options]\n");
         fprintf(stderr, "  <ip>       - PLC IP address\n");
         fprintf(stderr, "  <path>     - PLC path (e.g., \"1,0\")\n");
         fprintf(stderr, "  <plc_type> - PLC type (e.g., \"ControlLogix\", \"Micro800\", \"CompactLogix\")\n");
+        fprintf(stderr, "  --concurrency=N - program listings read at once (default %d)\n", DEFAULT_CONCURRENCY);
+        fprintf(stderr, "  --format=text|binary - line per tag or binary records\n");
+        fprintf(stderr, "  --prefix=P, --glob=G - only tags whose name starts with P or matches G\n");
+        fprintf(stderr, "  --program=NAME, --exclude-program=NAME - programs to list or to skip\n");
+        fprintf(stderr, "  --catalog-dir=DIR - keep a catalog of the tags in DIR and list from it while current\n");
+        fprintf(stderr, "  --max-age=SECONDS - refresh the catalog when older (default %d), --refresh to force\n", DEFAULT_MAX_AGE_S);
+        fprintf(stderr, "  --udts - also list the UDT templates (binary format or catalog only)\n");
+        fprintf(stderr, "  --skip-system - leave out system tags and tags named __*\n");
+        fprintf(stderr, "  --capture=DIR - save every raw @tags response in DIR, see bench/symbols_bench.c\n");
+        fprintf(stderr, "  --deadline-ms=N - time allowed for each listing (default %d)\n", TAG_RTT_DEFAULT_DEADLINE_MS);
+        fprintf(stderr, "  --retries=N - times a timed out listing read is sent again (default %d)\n", TAG_RTT_DEFAULT_RETRIES);
+        fprintf(stderr, "  --broker=PATH - read the listings through the rw_tag --broker on PATH if it answers (default $%s)\n", BROKER_ENV);
+        fprintf(stderr, "  --stats - write the time taken by each phase to stderr at the end\n");
         exit(1);
     }
 
-    plc_ip = argv[1];
+    if(opts.udts && opts.format != FORMAT_BINARY && !catalog_dir) {
+        fprintf(stderr, "--udts needs --format=binary or --catalog-dir!\n");
+        exit(1);
+    }
 
-    if(argc == 3) {
+    plc_ip = args[1];
+
+    if(nargs == 3) {
         /* Backward compatible: tag_list <ip> <path> */
-        path = argv[2];
+        path = args[2];
         plc_type = "ControlLogix";
-    } else if(argc >= 4) {
+    } else if(nargs >= 4) {
         /* New format: tag_list <ip> <plc_type> [path] */
-        plc_type = argv[2];
-        path = argv[3];
+        plc_type = args[2];
+        path = args[3];
     }
 
     if(!plc_ip || strlen(plc_ip) == 0) {
@@ -220,25 +1307,34 @@ int main(int argc, char **argv)
         }
     }
 
-    /* get the controller tags first. */
-    tag = setup_tag(plc_ip, path, plc_type, NULL);
-    get_list(tag, &programs);
+    /* with a broker listening, its connection is used instead of opening a new one. */
+    if(broker_socket_path(argc, argv)) {
+        opts.broker_fd = broker_connect(broker_socket_path(argc, argv));
+    }
 
-    /* get the tags for each program. */
-    printf("Program tags\n");
-    while(programs) {
-        struct program_entry_s *program = programs;
-        printf("\r\n%s!", program->program_name);
-        tag = setup_tag(plc_ip, path, plc_type, program->program_name);
-        get_list(tag, NULL);
+    if(catalog_dir) {
+        list_with_catalog(plc_ip, path, plc_type, concurrency, catalog_dir, max_age, refresh, &opts);
+    } else {
+        list_tags(plc_ip, path, plc_type, concurrency, &opts);
+    }
 
-        /* go to the next one */
-        programs = programs->next;
+    if(stats.enabled) {
+        struct abex_buf_s out = {NULL, 0, 0};
 
-        /* now clean up */
-        free(program->program_name);
-        free(program);
+        fflush(stdout);
+
+        tag_stats_add(&stats, TAG_STATS_LIB_CHECK, lib_check_us);
+        tag_stats_since(&stats, TAG_STATS_TOTAL, start_us);
+
+        tag_stats_format(&stats, &out);
+        tag_rtt_format(&opts.rtt, plc_ip, &out);
+        fwrite(out.data, 1, out.len, stderr);
+        abex_buf_free(&out);
     }
 
+    broker_disconnect(opts.broker_fd);
+    free(opts.udt_ids);
+    abex_buf_free(&opts.scratch);
+
     return 0;
 }
@@ -0,0 +1,430 @@
+/***************************************************************************
+ *   Per-gateway round trip times, attempt timeouts and read retries.      *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "compat_utils.h"
+#include <libplctag/lib/libplctag.h>
+#include "abex_util.h"
+#include "tag_rtt.h"
+
+#define GATEWAY_NAME_SIZE (256)
+
+
+/*
+ * Take one of the retry options.  Returns 1 if arg was a retry option, 0
+ * if it was not, -1 if its value is bad.
+ */
+int tag_rtt_parse_arg(struct tag_rtt_config_s *config, const char *arg)
+{
+    if(!strncmp(arg, "--deadline-ms=", strlen("--deadline-ms="))) {
+        config->deadline_ms = atoi(arg + strlen("--deadline-ms="));
+        return config->deadline_ms > 0 ? 1 : -1;
+    }
+
+    if(!strncmp(arg, "--retries=", strlen("--retries="))) {
+        config->retries = atoi(arg + strlen("--retries="));
+        return config->retries >= 0 ? 1 : -1;
+    }
+
+    if(!strcmp(arg, "--retry-writes")) {
+        config->retry_writes = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* a write that timed out may still have reached the PLC, so it is not resent by default */
+int tag_rtt_retries(const struct tag_rtt_config_s *config, int is_write)
+{
+    return is_write && !config->retry_writes ? 0 : config->retries;
+}
+
+
+void tag_rtt_init(struct tag_rtt_s *rtt)
+{
+    memset(rtt, 0, sizeof(*rtt));
+
+    /* threads and processes starting together should not back off in step. */
+    rtt->seed = (uint32_t)abex_time_ms() ^ (uint32_t)(uintptr_t)rtt;
+    if(!rtt->seed) {
+        rtt->seed = 1;
+    }
+}
+
+
+/*
+ * Timeout of the next attempt: SRTT + 4 * RTTVAR for each of the packet
+ * round trips it waits for, doubled for every timeout in a row, but never
+ * past the remaining time.  The last attempt gets all of the remaining
+ * time.
+ */
+int tag_rtt_timeout(const struct tag_rtt_s *rtt, int packets, int64_t remaining_ms, int last_attempt)
+{
+    double timeout = TAG_RTT_INITIAL_MS;
+
+    if(remaining_ms < 1) {
+        return 1;
+    }
+
+    if(last_attempt) {
+        return (int)remaining_ms;
+    }
+
+    if(rtt && rtt->samples > 0) {
+        timeout = rtt->srtt + 4.0 * rtt->rttvar;
+        if(timeout < TAG_RTT_MIN_MS) {
+            timeout = TAG_RTT_MIN_MS;
+        }
+    }
+
+    timeout *= (double)(packets > 1 ? packets : 1);
+
+    if(rtt) {
+        timeout *= (double)(1 << rtt->backoff);
+    }
+
+    return timeout < (double)remaining_ms ? (int)timeout : (int)remaining_ms;
+}
+
+
+/* a reply to a first attempt came back after rtt_ms, packets round trips in all, see RFC 6298 */
+void tag_rtt_sample(struct tag_rtt_s *rtt, int64_t rtt_ms, int packets)
+{
+    double r = (double)rtt_ms / (double)(packets > 1 ? packets : 1);
+
+    if(!rtt) {
+        return;
+    }
+
+    if(rtt->samples == 0) {
+        rtt->srtt = r;
+        rtt->rttvar = r / 2.0;
+    } else {
+        double delta = rtt->srtt > r ? rtt->srtt - r : r - rtt->srtt;
+
+        rtt->rttvar = 0.75 * rtt->rttvar + 0.25 * delta;
+        rtt->srtt = 0.875 * rtt->srtt + 0.125 * r;
+    }
+
+    rtt->samples++;
+    rtt->backoff = 0;
+}
+
+
+void tag_rtt_timed_out(struct tag_rtt_s *rtt)
+{
+    if(!rtt) {
+        return;
+    }
+
+    rtt->timeouts++;
+
+    if(rtt->backoff < TAG_RTT_MAX_BACKOFF) {
+        rtt->backoff++;
+    }
+}
+
+
+/* "full jitter": spread the retries of many clients over the whole window */
+int tag_rtt_backoff_ms(struct tag_rtt_s *rtt, int attempt)
+{
+    int window = TAG_RTT_BACKOFF_CAP_MS;
+    uint32_t x;
+
+    if(attempt < 16 && (TAG_RTT_BACKOFF_BASE_MS << attempt) < TAG_RTT_BACKOFF_CAP_MS) {
+        window = TAG_RTT_BACKOFF_BASE_MS << attempt;
+    }
+
+    if(!rtt) {
+        return window / 2;
+    }
+
+    /* xorshift32 */
+    x = rtt->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rtt->seed = x;
+
+    return (int)(x % (uint32_t)window);
+}
+
+
+/*
+ * The RTT of the gateway in attrs, added on first use.  Returns NULL if
+ * out of memory, the other functions take that as a gateway never seen.
+ */
+struct tag_rtt_s *tag_rtt_for(struct tag_rtt_table_s *table, const char *attrs)
+{
+    struct tag_rtt_entry_s *entry;
+    char gateway[GATEWAY_NAME_SIZE];
+
+    if(abex_attr_value(attrs, "gateway", gateway, sizeof(gateway))) {
+        gateway[0] = 0;
+    }
+
+    for(entry = table->head; entry; entry = entry->next) {
+        if(!strcmp(entry->gateway, gateway)) {
+            return &entry->rtt;
+        }
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if(!entry) {
+        return NULL;
+    }
+
+    entry->gateway = compat_strdup(gateway);
+    if(!entry->gateway) {
+        free(entry);
+        return NULL;
+    }
+
+    tag_rtt_init(&entry->rtt);
+
+    entry->next = table->head;
+    table->head = entry;
+
+    return &entry->rtt;
+}
+
+
+void tag_rtt_clear(struct tag_rtt_table_s *table)
+{
+    while(table->head) {
+        struct tag_rtt_entry_s *next = table->head->next;
+
+        free(table->head->gateway);
+        free(table->head);
+        table->head = next;
+    }
+}
+
+
+/* "gateway <name> srtt_us=N rttvar_us=N samples=N attempts=N timeouts=N", see tag_stats.h */
+void tag_rtt_format(const struct tag_rtt_s *rtt, const char *gateway, struct abex_buf_s *out)
+{
+    abex_buf_printf(out, "gateway %s srtt_us=%" PRId64 " rttvar_us=%" PRId64 " samples=%d attempts=%" PRIu64
+                    " timeouts=%" PRIu64 "\n", gateway[0] ? gateway : "-", (int64_t)(rtt->srtt * 1000.0),
+                    (int64_t)(rtt->rttvar * 1000.0), rtt->samples, rtt->attempts, rtt->timeouts);
+}
+
+void tag_rtt_format_table(const struct tag_rtt_table_s *table, struct abex_buf_s *out)
+{
+    const struct tag_rtt_entry_s *entry;
+
+    for(entry = table->head; entry; entry = entry->next) {
+        tag_rtt_format(&entry->rtt, entry->gateway, out);
+    }
+}
+
+
+/* packets the tag buffer takes, or the most seen on the gateway if its size is not known yet */
+static int tag_packets(const struct tag_rtt_s *rtt, int32_t tag)
+{
+    int size = plc_tag_get_size(tag);
+
+    if(size > 0) {
+        return 1 + (size - 1) / TAG_RTT_PACKET_BYTES;
+    }
+
+    return rtt && rtt->max_packets > 0 ? rtt->max_packets : 1;
+}
+
+/* an attempt of packets is sent: it waits for the ones in flight, returns how many */
+static int attempt_sent(struct tag_rtt_s *rtt, int packets)
+{
+    int ahead = 0;
+
+    if(rtt) {
+        ahead = rtt->inflight;
+        rtt->inflight += packets;
+        rtt->attempts++;
+    }
+
+    return ahead;
+}
+
+/*
+ * The attempt is over.  After a reply to a first attempt, the round trip
+ * is sampled by the packets the reply really took (now that the size of
+ * a listing is known) plus those it waited for.
+ */
+static void attempt_done(struct tag_rtt_s *rtt, int32_t tag, int packets, int ahead, int64_t rtt_ms)
+{
+    if(!rtt) {
+        return;
+    }
+
+    rtt->inflight -= packets;
+
+    if(rtt_ms >= 0) {
+        int actual = tag_packets(NULL, tag);
+
+        if(actual > rtt->max_packets) {
+            rtt->max_packets = actual;
+        }
+
+        tag_rtt_sample(rtt, rtt_ms, actual + ahead);
+    }
+}
+
+
+/*
+ * Read or write a created tag, blocking until done or deadline.  Timeouts
+ * are retried up to retries times, other errors are returned at once.
+ * Returns a PLCTAG status.
+ */
+int tag_rtt_request(struct tag_rtt_s *rtt, int32_t tag, int is_write, int retries, int64_t deadline)
+{
+    int attempt;
+    int rc = PLCTAG_ERR_TIMEOUT;
+
+    for(attempt = 0; attempt <= retries; attempt++) {
+        int64_t sent = abex_time_ms();
+        int packets;
+        int ahead;
+        int timeout;
+
+        if(sent >= deadline) {
+            break;
+        }
+
+        if(attempt > 0) {
+            int wait = tag_rtt_backoff_ms(rtt, attempt - 1);
+
+            if(sent + wait >= deadline) {
+                break;
+            }
+
+            abex_sleep_ms(wait);
+            sent = abex_time_ms();
+        }
+
+        packets = tag_packets(rtt, tag);
+        ahead = attempt_sent(rtt, packets);
+
+        /* a timed out blocking call aborts the request itself. */
+        timeout = tag_rtt_timeout(rtt, packets + ahead, deadline - sent, attempt == retries);
+        rc = is_write ? plc_tag_write(tag, timeout) : plc_tag_read(tag, timeout);
+
+        /* a late reply to an earlier attempt would look like a short round trip (Karn). */
+        attempt_done(rtt, tag, packets, ahead, rc == PLCTAG_STATUS_OK && attempt == 0 ? abex_time_ms() - sent : -1);
+
+        if(rc == PLCTAG_STATUS_OK) {
+            return rc;
+        }
+
+        if(rc != PLCTAG_ERR_TIMEOUT) {
+            return rc;
+        }
+
+        tag_rtt_timed_out(rtt);
+    }
+
+    return rc;
+}
+
+
+static void end_attempt(struct tag_rtt_op_s *op, int64_t rtt_ms)
+{
+    if(op->packets) {
+        attempt_done(op->rtt, op->tag, op->packets, op->ahead, rtt_ms);
+        op->packets = 0;
+    }
+}
+
+static int send_attempt(struct tag_rtt_op_s *op)
+{
+    int64_t now = abex_time_ms();
+    int rc;
+
+    op->waiting = 0;
+    op->sent_ms = now;
+    op->packets = tag_packets(op->rtt, op->tag);
+    op->ahead = attempt_sent(op->rtt, op->packets);
+    op->until = now + tag_rtt_timeout(op->rtt, op->packets + op->ahead, op->deadline - now, op->attempt == op->retries);
+
+    rc = op->is_write ? plc_tag_write(op->tag, 0) : plc_tag_read(op->tag, 0);
+    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        end_attempt(op, -1);
+        return rc;
+    }
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+/*
+ * Start a read or write of a created tag without blocking, then call
+ * tag_rtt_op_poll() until it no longer returns PLCTAG_STATUS_PENDING.
+ */
+int tag_rtt_op_start(struct tag_rtt_op_s *op, struct tag_rtt_s *rtt, int32_t tag, int is_write, int retries,
+                     int64_t deadline)
+{
+    memset(op, 0, sizeof(*op));
+    op->rtt = rtt;
+    op->tag = tag;
+    op->is_write = is_write;
+    op->retries = retries;
+    op->deadline = deadline;
+
+    return send_attempt(op);
+}
+
+/* PLCTAG_STATUS_PENDING while an attempt or a backoff is running, else the result */
+int tag_rtt_op_poll(struct tag_rtt_op_s *op)
+{
+    int64_t now = abex_time_ms();
+    int rc;
+
+    if(op->waiting) {
+        if(now < op->until) {
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        op->attempt++;
+
+        rc = send_attempt(op);
+        if(rc != PLCTAG_STATUS_PENDING) {
+            return rc;
+        }
+    }
+
+    rc = plc_tag_status(op->tag);
+
+    if(rc == PLCTAG_STATUS_OK) {
+        end_attempt(op, op->attempt == 0 ? now - op->sent_ms : -1);
+        return rc;
+    }
+
+    if(rc == PLCTAG_STATUS_PENDING && now <= op->until) {
+        return rc;
+    }
+
+    end_attempt(op, -1);
+
+    if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_ERR_TIMEOUT) {
+        return rc;
+    }
+
+    plc_tag_abort(op->tag);
+    tag_rtt_timed_out(op->rtt);
+
+    if(op->attempt >= op->retries) {
+        return PLCTAG_ERR_TIMEOUT;
+    }
+
+    op->waiting = 1;
+    op->until = now + tag_rtt_backoff_ms(op->rtt, op->attempt);
+    if(op->until >= op->deadline) {
+        return PLCTAG_ERR_TIMEOUT;
+    }
+
+    return PLCTAG_STATUS_PENDING;
+}
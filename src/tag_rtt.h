@@ -0,0 +1,119 @@
+/***************************************************************************
+ *   Round trip times per gateway, kept TCP-style (RFC 6298): a smoothed   *
+ *   RTT and its variance give the timeout of each attempt, so a dropped   *
+ *   packet costs a few RTTs instead of the whole deadline.  Timed out     *
+ *   reads are retried after a jittered backoff until the request's total  *
+ *   deadline; writes only when asked to.                                  *
+ *                                                                         *
+ *   The RTT is kept per packet round trip: an attempt's timeout is scaled *
+ *   by the packets its tag buffer takes (TAG_RTT_PACKET_BYTES each) plus  *
+ *   those of the attempts already in flight to the gateway, which go     *
+ *   first on the shared connection.  Samples are scaled back the same     *
+ *   way, so a large read or a busy batch neither times out early nor      *
+ *   skews the RTT of small reads.                                         *
+ ***************************************************************************/
+
+#ifndef __TAG_RTT_H__
+#define __TAG_RTT_H__
+
+#include <stdint.h>
+#include "abex_util.h"
+
+/* total time a request may take, see --deadline-ms */
+#define TAG_RTT_DEFAULT_DEADLINE_MS (5000)
+#define TAG_RTT_DEFAULT_RETRIES (2)
+
+/* attempt timeout before the first sample, and its bounds after */
+#define TAG_RTT_INITIAL_MS (1000)
+#define TAG_RTT_MIN_MS (20)
+#define TAG_RTT_MAX_BACKOFF (6)
+
+/* tag buffer bytes per request packet (about one unconnected CIP reply) */
+#define TAG_RTT_PACKET_BYTES (480)
+
+/* the wait before attempt n is random in [0, min(CAP, BASE << n)) */
+#define TAG_RTT_BACKOFF_BASE_MS (5)
+#define TAG_RTT_BACKOFF_CAP_MS (250)
+
+struct tag_rtt_config_s {
+    int deadline_ms;
+    int retries;
+    int retry_writes;
+};
+
+#define TAG_RTT_CONFIG_INIT {TAG_RTT_DEFAULT_DEADLINE_MS, TAG_RTT_DEFAULT_RETRIES, 0}
+
+struct tag_rtt_s {
+    /* milliseconds per packet round trip, valid once samples > 0 */
+    double srtt;
+    double rttvar;
+    int samples;
+
+    /* timeouts in a row, each one doubles the next attempt timeout */
+    int backoff;
+
+    /* packets of the attempts in flight to the gateway now */
+    int inflight;
+
+    /* most packets a reply took, the guess for one of unknown size (@tags listings) */
+    int max_packets;
+
+    uint32_t seed;
+
+    /* requests sent, retries included, and how many timed out, for --stats */
+    uint64_t attempts;
+    uint64_t timeouts;
+};
+
+struct tag_rtt_entry_s {
+    struct tag_rtt_entry_s *next;
+    char *gateway;
+    struct tag_rtt_s rtt;
+};
+
+struct tag_rtt_table_s {
+    struct tag_rtt_entry_s *head;
+};
+
+/*
+ * One read or write with its retries, moved along by tag_rtt_op_poll()
+ * without blocking.
+ */
+struct tag_rtt_op_s {
+    struct tag_rtt_s *rtt;
+    int32_t tag;
+    int is_write;
+    int retries;
+    int attempt;
+    int waiting;
+    int64_t deadline;
+    int64_t sent_ms;
+
+    /* packets of the current attempt, and of those in flight ahead of it; 0 when none is */
+    int packets;
+    int ahead;
+
+    /* end of the current attempt, or of the backoff while waiting */
+    int64_t until;
+};
+
+extern int tag_rtt_parse_arg(struct tag_rtt_config_s *config, const char *arg);
+extern int tag_rtt_retries(const struct tag_rtt_config_s *config, int is_write);
+
+extern void tag_rtt_init(struct tag_rtt_s *rtt);
+extern int tag_rtt_timeout(const struct tag_rtt_s *rtt, int packets, int64_t remaining_ms, int last_attempt);
+extern void tag_rtt_sample(struct tag_rtt_s *rtt, int64_t rtt_ms, int packets);
+extern void tag_rtt_timed_out(struct tag_rtt_s *rtt);
+extern int tag_rtt_backoff_ms(struct tag_rtt_s *rtt, int attempt);
+
+extern struct tag_rtt_s *tag_rtt_for(struct tag_rtt_table_s *table, const char *attrs);
+extern void tag_rtt_clear(struct tag_rtt_table_s *table);
+extern void tag_rtt_format(const struct tag_rtt_s *rtt, const char *gateway, struct abex_buf_s *out);
+extern void tag_rtt_format_table(const struct tag_rtt_table_s *table, struct abex_buf_s *out);
+
+extern int tag_rtt_request(struct tag_rtt_s *rtt, int32_t tag, int is_write, int retries, int64_t deadline);
+extern int tag_rtt_op_start(struct tag_rtt_op_s *op, struct tag_rtt_s *rtt, int32_t tag, int is_write, int retries,
+                            int64_t deadline);
+extern int tag_rtt_op_poll(struct tag_rtt_op_s *op);
+
+#endif
@@ -0,0 +1,155 @@
+/***************************************************************************
+ *   Phase timings and counters for --stats.                               *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "abex_util.h"
+#include "tag_stats.h"
+
+static const char *phase_names[TAG_STATS_PHASES] = {
+    "lib_check",
+    "limit_wait",
+    "create",
+    "status",
+    "read",
+    "write",
+    "decode",
+    "output",
+    "total"
+};
+
+
+/* values below 32 us get a bucket each, above that 32 buckets per power of two */
+static int bucket_of(uint32_t us)
+{
+    int msb = 0;
+    int shift;
+
+    if(us < (1u << TAG_STATS_SUB_BITS)) {
+        return (int)us;
+    }
+
+    while(us >> (msb + 1)) {
+        msb++;
+    }
+
+    shift = msb - TAG_STATS_SUB_BITS;
+
+    return (shift << TAG_STATS_SUB_BITS) + (int)(us >> shift);
+}
+
+/* highest value that falls in the bucket */
+static int64_t bucket_value(int bucket)
+{
+    int shift;
+    int64_t top;
+
+    if(bucket < (1 << TAG_STATS_SUB_BITS) * 2) {
+        return bucket;
+    }
+
+    shift = (bucket >> TAG_STATS_SUB_BITS) - 1;
+    top = bucket - ((int64_t)shift << TAG_STATS_SUB_BITS);
+
+    return (top << shift) + ((int64_t)1 << shift) - 1;
+}
+
+
+void tag_stats_add(struct tag_stats_s *stats, int phase, int64_t us)
+{
+    struct tag_stats_hist_s *hist;
+
+    if(!stats->enabled || phase < 0 || phase >= TAG_STATS_PHASES) {
+        return;
+    }
+
+    if(us < 0) {
+        us = 0;
+    } else if(us > (int64_t)UINT32_MAX) {
+        us = (int64_t)UINT32_MAX;
+    }
+
+    hist = &stats->phases[phase];
+    hist->count++;
+    hist->sum_us += (uint64_t)us;
+    hist->buckets[bucket_of((uint32_t)us)]++;
+
+    if(us > hist->max_us) {
+        hist->max_us = us;
+    }
+}
+
+
+/* record the time from start_us (abex_time_us()) to now */
+void tag_stats_since(struct tag_stats_s *stats, int phase, int64_t start_us)
+{
+    if(stats->enabled) {
+        tag_stats_add(stats, phase, abex_time_us() - start_us);
+    }
+}
+
+
+/* the value pct percent of the samples are at or below, 0 without samples */
+int64_t tag_stats_percentile(const struct tag_stats_hist_s *hist, double pct)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+    int i;
+
+    if(hist->count == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t)((double)hist->count * pct / 100.0 + 0.5);
+    if(rank < 1) {
+        rank = 1;
+    }
+
+    for(i = 0; i < TAG_STATS_BUCKETS; i++) {
+        seen += hist->buckets[i];
+
+        if(seen >= rank) {
+            int64_t value = bucket_value(i);
+
+            return value < hist->max_us ? value : hist->max_us;
+        }
+    }
+
+    return hist->max_us;
+}
+
+
+void tag_stats_reset(struct tag_stats_s *stats)
+{
+    int enabled = stats->enabled;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = enabled;
+}
+
+
+void tag_stats_format(const struct tag_stats_s *stats, struct abex_buf_s *out)
+{
+    int i;
+
+    for(i = 0; i < TAG_STATS_PHASES; i++) {
+        const struct tag_stats_hist_s *hist = &stats->phases[i];
+
+        if(hist->count == 0) {
+            continue;
+        }
+
+        abex_buf_printf(out, "phase %s count=%" PRIu64 " sum_us=%" PRIu64 " p50_us=%" PRId64 " p90_us=%" PRId64
+                        " p99_us=%" PRId64 " max_us=%" PRId64 "\n",
+                        phase_names[i], hist->count, hist->sum_us, tag_stats_percentile(hist, 50.0),
+                        tag_stats_percentile(hist, 90.0), tag_stats_percentile(hist, 99.0), hist->max_us);
+    }
+
+    abex_buf_printf(out, "counter bytes_read %" PRIu64 "\n", stats->bytes_read);
+    abex_buf_printf(out, "counter bytes_written %" PRIu64 "\n", stats->bytes_written);
+    abex_buf_printf(out, "counter errors %" PRIu64 "\n", stats->errors);
+    abex_buf_printf(out, "counter cache_hits %" PRIu64 "\n", stats->cache_hits);
+    abex_buf_printf(out, "counter coalesced %" PRIu64 "\n", stats->coalesced);
+}
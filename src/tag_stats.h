@@ -0,0 +1,68 @@
+/***************************************************************************
+ *   Opt-in timings for --stats: how long each phase of a request took,    *
+ *   kept in HDR-style log-linear histograms (about 3% precision from 1 us *
+ *   to over an hour in under 4 KB), plus byte and error counters.         *
+ *                                                                         *
+ *   tag_stats_format() writes one line per phase and counter:             *
+ *                                                                         *
+ *     phase <name> count=N sum_us=N p50_us=N p90_us=N p99_us=N max_us=N   *
+ *     counter <name> N                                                    *
+ *                                                                         *
+ *   Phases nothing was recorded for are left out.                         *
+ ***************************************************************************/
+
+#ifndef __TAG_STATS_H__
+#define __TAG_STATS_H__
+
+#include <stdint.h>
+#include "abex_util.h"
+
+/* 32 linear buckets per power of two, values up to 2^32 us */
+#define TAG_STATS_SUB_BITS (5)
+#define TAG_STATS_BUCKETS (896)
+
+enum {
+    TAG_STATS_LIB_CHECK,
+    TAG_STATS_LIMIT_WAIT,
+    TAG_STATS_CREATE,
+    TAG_STATS_STATUS,
+    TAG_STATS_READ,
+    TAG_STATS_WRITE,
+    TAG_STATS_DECODE,
+    TAG_STATS_OUTPUT,
+
+    /* a whole request (rw_tag), cycle (scanner) or listing run (tag_list) */
+    TAG_STATS_TOTAL,
+
+    TAG_STATS_PHASES
+};
+
+struct tag_stats_hist_s {
+    uint64_t count;
+    uint64_t sum_us;
+    int64_t max_us;
+    uint32_t buckets[TAG_STATS_BUCKETS];
+};
+
+struct tag_stats_s {
+    int enabled;
+    struct tag_stats_hist_s phases[TAG_STATS_PHASES];
+
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t errors;
+
+    /* reads answered from a buffer younger than --max-age-ms */
+    uint64_t cache_hits;
+
+    /* --write-queue writes replaced by a newer value for the tag before they were sent */
+    uint64_t coalesced;
+};
+
+extern void tag_stats_add(struct tag_stats_s *stats, int phase, int64_t us);
+extern void tag_stats_since(struct tag_stats_s *stats, int phase, int64_t start_us);
+extern int64_t tag_stats_percentile(const struct tag_stats_hist_s *hist, double pct);
+extern void tag_stats_reset(struct tag_stats_s *stats);
+extern void tag_stats_format(const struct tag_stats_s *stats, struct abex_buf_s *out);
+
+#endif
@@ -0,0 +1,74 @@
+/***************************************************************************
+ *   Decoder for Logix @tags (symbol object) listings.                     *
+ ***************************************************************************/
+
+#include <string.h>
+#include "abex_util.h"
+#include "tag_symbols.h"
+
+#define SYSTEM_NAME_PREFIX "__"
+
+
+void tag_symbols_init(struct tag_symbols_s *symbols, const uint8_t *data, size_t size)
+{
+    symbols->data = data;
+    symbols->size = size;
+    symbols->offset = 0;
+}
+
+
+/*
+ * Decode the next entry into symbol.  Returns 1 for an entry, 0 at the
+ * end of the listing and -1 if the last entry is cut short, which ends the
+ * listing as well.
+ */
+int tag_symbols_next(struct tag_symbols_s *symbols, struct tag_symbol_s *symbol)
+{
+    const uint8_t *p = symbols->data + symbols->offset;
+    size_t left = symbols->size - symbols->offset;
+
+    if(left == 0) {
+        return 0;
+    }
+
+    if(left < TAG_SYMBOL_HEADER_SIZE) {
+        symbols->offset = symbols->size;
+        return -1;
+    }
+
+    symbol->instance_id = get_le32(p);
+    symbol->symbol_type = get_le16(p + 4);
+    symbol->element_length = get_le16(p + 6);
+    symbol->array_dims[0] = get_le32(p + 8);
+    symbol->array_dims[1] = get_le32(p + 12);
+    symbol->array_dims[2] = get_le32(p + 16);
+    symbol->name_len = get_le16(p + 20);
+    symbol->name_offset = (uint32_t)(symbols->offset + TAG_SYMBOL_HEADER_SIZE);
+
+    if(left - TAG_SYMBOL_HEADER_SIZE < symbol->name_len) {
+        symbols->offset = symbols->size;
+        return -1;
+    }
+
+    symbols->offset += TAG_SYMBOL_HEADER_SIZE + symbol->name_len;
+
+    return 1;
+}
+
+
+/* number of array dimensions, 0 for a scalar */
+int tag_symbol_dims(const struct tag_symbol_s *symbol)
+{
+    return (symbol->symbol_type & TAG_SYMBOL_DIMS_MASK) >> TAG_SYMBOL_DIMS_SHIFT;
+}
+
+
+/* flagged as a system tag, or named like one (__...) */
+int tag_symbol_is_system(uint16_t symbol_type, const char *name, size_t name_len)
+{
+    if(symbol_type & TAG_SYMBOL_IS_SYSTEM) {
+        return 1;
+    }
+
+    return name_len >= strlen(SYSTEM_NAME_PREFIX) && !memcmp(name, SYSTEM_NAME_PREFIX, strlen(SYSTEM_NAME_PREFIX));
+}
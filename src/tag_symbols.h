@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   Decoder for Logix @tags (symbol object) listings.                     *
+ *                                                                         *
+ *   The response is copied out of the tag once and the entries are read   *
+ *   straight from that copy: no accessor call per field or per byte, and  *
+ *   names are not copied, an entry only says where its name is.  Each    *
+ *   entry is                                                              *
+ *                                                                         *
+ *     uint32_t instance_id    increasing but not contiguous               *
+ *     uint16_t symbol_type    see the TAG_SYMBOL_* bits                   *
+ *     uint16_t element_length bytes per array element                     *
+ *     uint32_t array_dims[3]                                              *
+ *     uint16_t name_len                                                   *
+ *     char     name[name_len] not NUL terminated                          *
+ *                                                                         *
+ *   all little-endian.                                                    *
+ ***************************************************************************/
+
+#ifndef __TAG_SYMBOLS_H__
+#define __TAG_SYMBOLS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TAG_SYMBOL_HEADER_SIZE (22)
+
+/* symbol_type: a UDT (the low 12 bits are its template id), a system tag, how many array dimensions */
+#define TAG_SYMBOL_IS_STRUCT   (0x8000)
+#define TAG_SYMBOL_DIMS_MASK   (0x6000)
+#define TAG_SYMBOL_DIMS_SHIFT  (13)
+#define TAG_SYMBOL_IS_SYSTEM   (0x1000)
+
+struct tag_symbol_s {
+    uint32_t instance_id;
+    uint16_t symbol_type;
+    uint16_t element_length;
+    uint32_t array_dims[3];
+
+    /* the name is name_len bytes at name_offset in the listing */
+    uint32_t name_offset;
+    uint16_t name_len;
+};
+
+struct tag_symbols_s {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+};
+
+extern void tag_symbols_init(struct tag_symbols_s *symbols, const uint8_t *data, size_t size);
+extern int tag_symbols_next(struct tag_symbols_s *symbols, struct tag_symbol_s *symbol);
+
+extern int tag_symbol_dims(const struct tag_symbol_s *symbol);
+extern int tag_symbol_is_system(uint16_t symbol_type, const char *name, size_t name_len);
+
+#endif
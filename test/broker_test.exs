@@ -0,0 +1,87 @@
+defmodule Abex.BrokerTest do
+  use ExUnit.Case, async: false
+
+  import Mox
+
+  setup :verify_on_exit!
+  setup :set_mox_global
+
+  test "starts rw_tag --broker on the socket and closes it on stop" do
+    port = make_ref()
+
+    Abex.CmdMock
+    |> expect(:open, fn cmd, args ->
+      assert String.ends_with?(cmd, "rw_tag")
+
+      assert args == [
+        "--broker", "--socket=/tmp/abex.sock", "--watch-stdin",
+        "--idle-ms=30000", "--rate-limit=20", "--stats"
+      ]
+
+      port
+    end)
+    |> expect(:close, fn ^port -> :ok end)
+
+    {:ok, broker} =
+      Abex.Broker.start_link(socket: "/tmp/abex.sock", idle_ms: 30000, rate_limit: [rate: 20], stats: true)
+
+    Abex.Broker.stop(broker)
+    refute Process.alive?(broker)
+  end
+
+  test "stops when the broker exits" do
+    port = make_ref()
+
+    Abex.CmdMock
+    |> expect(:open, fn _cmd, ["--broker", "--socket=/tmp/abex.sock", "--watch-stdin"] -> port end)
+
+    Process.flag(:trap_exit, true)
+    {:ok, broker} = Abex.Broker.start_link(socket: "/tmp/abex.sock")
+
+    send(broker, {port, {:exit_status, 1}})
+    assert_receive {:EXIT, ^broker, {:exit_status, 1}}
+  end
+
+  describe "rw_tag --broker" do
+    @describetag :native
+
+    setup do
+      socket = Path.join(System.tmp_dir!(), "abex_broker_#{System.unique_integer([:positive])}.sock")
+      rw_tag = :abex |> :code.priv_dir() |> to_string() |> Path.join("rw_tag")
+
+      # the broker stops when this test process, and so the port's stdin, goes away
+      Port.open({:spawn_executable, rw_tag}, [:binary, args: ["--broker", "--socket=#{socket}", "--watch-stdin"]])
+      wait_for(socket, 20)
+
+      %{socket: socket}
+    end
+
+    test "answers other clients while one stalls mid-request", %{socket: socket} do
+      {:ok, stalled} = :gen_tcp.connect({:local, socket}, 0, [:binary, active: false])
+      :ok = :gen_tcp.send(stalled, <<0, 0>>)
+
+      {:ok, client} = :gen_tcp.connect({:local, socket}, 0, [:binary, active: false, packet: 4])
+      :ok = :gen_tcp.send(client, "--stats-dump")
+      assert {:ok, <<0, _report::binary>>} = :gen_tcp.recv(client, 0, 1000)
+
+      # dropped after BROKER_STALL_MS (5 s)
+      assert {:error, :closed} = :gen_tcp.recv(stalled, 0, 8000)
+
+      :ok = :gen_tcp.send(client, "--stats-dump")
+      assert {:ok, <<0, _report::binary>>} = :gen_tcp.recv(client, 0, 1000)
+    end
+  end
+
+  defp wait_for(_socket, 0), do: flunk("rw_tag --broker did not start")
+
+  defp wait_for(socket, tries) do
+    case :gen_tcp.connect({:local, socket}, 0, [:binary, active: false]) do
+      {:ok, probe} ->
+        :gen_tcp.close(probe)
+
+      {:error, _not_yet} ->
+        Process.sleep(100)
+        wait_for(socket, tries - 1)
+    end
+  end
+end
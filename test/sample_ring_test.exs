@@ -0,0 +1,81 @@
+defmodule Abex.SampleRingTest do
+  use ExUnit.Case, async: true
+
+  @data_size 8
+  @record_size 32 + @data_size
+
+  setup do
+    path = Path.join(System.tmp_dir!(), "abex_ring_#{System.unique_integer([:positive])}")
+    on_exit(fn -> File.rm(path) end)
+    {:ok, path: path}
+  end
+
+  # what rw_tag --sample writes for a sint32[2] and a real32, capacity 4
+  defp ring_file(path, samples, tail \\ 0, overruns \\ 0) do
+    head = length(samples)
+    tags = [tag_entry(0x220, 4, 2, "Counter"), tag_entry(0x320, 4, 1, "Level")]
+    records_offset = 64 + 64 * length(tags)
+
+    header =
+      <<"ABEXRING", 1::little-32, 64::little-32, @record_size::little-32, 4::little-32, @data_size::little-32,
+        2::little-32, head::little-64, tail::little-64, overruns::little-64, records_offset::little-32,
+        0::little-32>>
+
+    slots =
+      samples
+      |> Enum.with_index()
+      |> Enum.reduce(%{}, fn {record, n}, slots -> Map.put(slots, rem(n, 4), record.(n + 1)) end)
+
+    records = for slot <- 0..3, into: <<>>, do: Map.get(slots, slot, <<0::size(@record_size)-unit(8)>>)
+
+    File.write!(path, IO.iodata_to_binary([header, tags, records]))
+  end
+
+  defp tag_entry(data_type, elem_size, elem_count, name),
+    do: <<data_type::little-16, elem_size::little-16, elem_count::little-32, name::binary, 0::size(56 - byte_size(name))-unit(8)>>
+
+  defp record(tag, status, data) do
+    fn seq ->
+      <<seq::little-64, 1_000 * seq::little-signed-64, tag::little-32, status::little-signed-32,
+        byte_size(data)::little-32, 0::little-32, data::binary, 0::size(@data_size - byte_size(data))-unit(8)>>
+    end
+  end
+
+  test "reads the samples written so far", %{path: path} do
+    ring_file(path, [
+      record(0, 0, <<5::little-signed-32, -6::little-signed-32>>),
+      record(1, 0, <<2.5::little-float-32>>),
+      record(1, -7, <<>>)
+    ])
+
+    {:ok, ring} = Abex.SampleRing.open(path)
+
+    assert {:ok, samples, 3, 0} = Abex.SampleRing.read(ring, 0)
+
+    assert samples == [
+             %{seq: 0, timestamp_ns: 1_000, tag: "Counter", status: 0, values: [5, -6]},
+             %{seq: 1, timestamp_ns: 2_000, tag: "Level", status: 0, values: [2.5]},
+             %{seq: 2, timestamp_ns: 3_000, tag: "Level", status: -7, values: []}
+           ]
+
+    assert {:ok, [], 3, 0} = Abex.SampleRing.read(ring, 3)
+  end
+
+  test "skips and counts samples the sampler already overwrote", %{path: path} do
+    ring_file(path, for(value <- 1..6, do: record(0, 0, <<value::little-signed-32, 0::32>>)), 0, 2)
+
+    {:ok, ring} = Abex.SampleRing.open(path)
+
+    assert {:ok, samples, 6, 2} = Abex.SampleRing.read(ring, 0)
+    assert Enum.map(samples, & &1.values) == [[3, 0], [4, 0], [5, 0], [6, 0]]
+    assert Abex.SampleRing.overruns(ring) == 2
+
+    :ok = Abex.SampleRing.consume(ring, 6)
+    assert <<_::binary-size(40), 6::little-64, _::binary>> = File.read!(path)
+  end
+
+  test "refuses other files", %{path: path} do
+    File.write!(path, :binary.copy(<<0>>, 64))
+    assert {:error, :bad_ring} = Abex.SampleRing.open(path)
+  end
+end
@@ -0,0 +1,81 @@
+defmodule Abex.ScannerTest do
+  use ExUnit.Case, async: false
+
+  import Mox
+
+  setup :verify_on_exit!
+  setup :set_mox_global
+
+  setup do
+    stub(Abex.CmdMock, :close, fn _port -> :ok end)
+    :ok
+  end
+
+  @speed [ip: "10.0.0.1", name: "Speed", data_type: "real32", elem_size: 4, elem_count: 1]
+  @count [ip: "10.0.0.2", path: "1,2", cpu: "micro800", name: "Count", data_type: "sint32", elem_size: 4, elem_count: 2]
+
+  test "starts scanner with one spec per tag and forwards text cycles" do
+    port = make_ref()
+
+    Abex.CmdMock
+    |> expect(:open, fn cmd, args ->
+      assert String.ends_with?(cmd, "scanner")
+
+      assert args == [
+        "--cycle-ms=500", "--per-gateway=2",
+        "-s", "real32 protocol=ab-eip&gateway=10.0.0.1&path=1,0&plc=lgx&elem_size=4&elem_count=1&name=Speed",
+        "-s", "sint32 protocol=ab-eip&gateway=10.0.0.2&path=1,2&plc=micro800&elem_size=4&elem_count=2&name=Count"
+      ]
+
+      port
+    end)
+
+    {:ok, scanner} = Abex.Scanner.start_link(tags: [@speed, @count], cycle_ms: 500, per_gateway: 2)
+
+    send(scanner, {port, {:data, <<0, "cycle 3 10.0.0.2\n1 ok -1 7 \n">>}})
+    assert_receive {:abex_scan, ^scanner, "10.0.0.2", 3, [{"Count", {:ok, [-1, 7]}}]}
+
+    send(scanner, {port, {:data, <<0, "cycle 4 10.0.0.1\n0 error PLCTAG_ERR_TIMEOUT\n">>}})
+    assert_receive {:abex_scan, ^scanner, "10.0.0.1", 4, [{"Speed", {:error, "PLCTAG_ERR_TIMEOUT"}}]}
+
+    Abex.Scanner.stop(scanner)
+    refute Process.alive?(scanner)
+  end
+
+  test "asks for stats and forwards them" do
+    port = make_ref()
+
+    Abex.CmdMock
+    |> expect(:open, fn _cmd, ["--stats-every=10", "--stats" | _specs] -> port end)
+
+    {:ok, scanner} = Abex.Scanner.start_link(tags: [@speed], stats: true, stats_every: 10)
+
+    report = "stats 10.0.0.1\nphase total count=10 sum_us=50 p50_us=5 p90_us=6 p99_us=7 max_us=7\ncounter errors 1\n"
+    send(scanner, {port, {:data, <<2, report::binary>>}})
+
+    assert_receive {:abex_scan_stats, ^scanner, "10.0.0.1",
+                    %{phases: %{total: %{count: 10, max_us: 7}}, counters: %{errors: 1}}}
+  end
+
+  test "decodes binary cycles" do
+    port = make_ref()
+
+    Abex.CmdMock
+    |> expect(:open, fn _cmd, ["--format=binary" | _specs] -> port end)
+
+    {:ok, scanner} = Abex.Scanner.start_link(tags: [@speed, @count], format: :binary)
+
+    block = <<1, 0, 0x220::little-16, 4::little-32, 2::little-32, 8::little-32>>
+    values = <<5::little-signed-32, -6::little-signed-32>>
+
+    cycle =
+      <<9::little-32, 8::little-16, "10.0.0.2">> <>
+        <<1::little-32, 0::little-signed-32>> <> block <> values <>
+        <<0::little-32, -32::little-signed-32, 18::little-16, "PLCTAG_ERR_TIMEOUT">>
+
+    send(scanner, {port, {:data, <<0, cycle::binary>>}})
+
+    assert_receive {:abex_scan, ^scanner, "10.0.0.2", 9,
+                    [{"Count", {:ok, [5, -6]}}, {"Speed", {:error, "PLCTAG_ERR_TIMEOUT"}}]}
+  end
+end
@@ -0,0 +1,60 @@
+defmodule Abex.StatsTest do
+  use ExUnit.Case, async: true
+
+  test "parses phases, counters and gateways" do
+    report = """
+    phase create count=1 sum_us=16 p50_us=16 p90_us=16 p99_us=16 max_us=16
+    phase read count=4 sum_us=10352 p50_us=2175 p90_us=3804 p99_us=3804 max_us=3804
+    counter bytes_read 64
+    counter errors 0
+    gateway 10.0.0.1 srtt_us=2250 rttvar_us=921 samples=4 attempts=5 timeouts=1
+    """
+
+    assert Abex.Stats.parse(report) == %{
+             phases: %{
+               create: %{count: 1, sum_us: 16, p50_us: 16, p90_us: 16, p99_us: 16, max_us: 16},
+               read: %{count: 4, sum_us: 10352, p50_us: 2175, p90_us: 3804, p99_us: 3804, max_us: 3804}
+             },
+             counters: %{bytes_read: 64, errors: 0},
+             gateways: %{
+               "10.0.0.1" => %{srtt_us: 2250, rttvar_us: 921, samples: 4, attempts: 5, timeouts: 1}
+             }
+           }
+  end
+
+  test "keeps unknown names as strings and skips unknown lines" do
+    report = "phase resend count=2 sum_us=9 new_us=3\nsomething else\n"
+
+    assert Abex.Stats.parse(report) == %{
+             phases: %{"resend" => %{count: 2, sum_us: 9, "new_us" => 3}},
+             counters: %{},
+             gateways: %{}
+           }
+  end
+
+  test "merges the reports of several servers" do
+    a = Abex.Stats.parse("""
+    phase read count=2 sum_us=300 p50_us=100 p90_us=200 p99_us=200 max_us=200
+    counter bytes_read 8
+    gateway 10.0.0.1 srtt_us=2000 rttvar_us=500 samples=2 attempts=2 timeouts=0
+    """)
+
+    b = Abex.Stats.parse("""
+    phase read count=1 sum_us=900 p50_us=900 p90_us=900 p99_us=900 max_us=900
+    phase create count=1 sum_us=50 p50_us=50 p90_us=50 p99_us=50 max_us=50
+    counter bytes_read 4
+    gateway 10.0.0.1 srtt_us=9000 rttvar_us=100 samples=1 attempts=3 timeouts=2
+    """)
+
+    assert Abex.Stats.merge([a, b]) == %{
+             phases: %{
+               read: %{count: 3, sum_us: 1200, p50_us: 900, p90_us: 900, p99_us: 900, max_us: 900},
+               create: %{count: 1, sum_us: 50, p50_us: 50, p90_us: 50, p99_us: 50, max_us: 50}
+             },
+             counters: %{bytes_read: 12},
+             gateways: %{
+               "10.0.0.1" => %{srtt_us: 2000, rttvar_us: 500, samples: 3, attempts: 5, timeouts: 2}
+             }
+           }
+  end
+end
@@ -7,14 +7,23 @@ defmodule Abex.TagTest do
   setup :verify_on_exit!
   setup :set_mox_global
 
+  setup do
+    # reads and writes go through a persistent rw_tag server port
+    stub(Abex.CmdMock, :open, fn cmd, args ->
+      assert String.ends_with?(cmd, "rw_tag")
+      assert args == ["--serve"]
+      make_ref()
+    end)
+
+    stub(Abex.CmdMock, :close, fn _port -> :ok end)
+    :ok
+  end
+
   describe "read/2" do
     test "builds correct command arguments for uint32" do
       # Mock the command execution
       Abex.CmdMock
-      |> expect(:cmd, fn cmd, args ->
-        # Verify the command path contains rw_tag
-        assert String.ends_with?(cmd, "rw_tag")
-
+      |> expect(:request, fn _port, args, _timeout ->
         # Verify arguments structure
         assert args == [
           "-t", "uint32",
@@ -39,7 +48,7 @@ defmodule Abex.TagTest do
 
     test "builds correct command arguments for real32" do
       Abex.CmdMock
-      |> expect(:cmd, fn _cmd, args ->
+      |> expect(:request, fn _port, args, _timeout ->
         assert args == [
           "-t", "real32",
           "-p", "protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=clgx&elem_size=4&elem_count=1&name=TempSensor"
@@ -62,7 +71,7 @@ defmodule Abex.TagTest do
 
     test "builds correct command arguments for array read" do
       Abex.CmdMock
-      |> expect(:cmd, fn _cmd, args ->
+      |> expect(:request, fn _port, args, _timeout ->
         assert args == [
           "-t", "uint16",
           "-p", "protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=2&elem_count=5&name=DataArray"
@@ -83,9 +92,21 @@ defmodule Abex.TagTest do
       assert values == [10, 20, 30, 40, 50]
     end
 
+    test "unquotes strings" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, ["-t", "string", "-p", _attrs], _timeout ->
+        {~S("Hello,\x20world" "a\"b" ), 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      assert {:ok, ["Hello, world", "a\"b"]} =
+               Abex.Tag.read(pid, name: "Messages", data_type: "string", elem_size: 88, elem_count: 2)
+    end
+
     test "handles error responses" do
       Abex.CmdMock
-      |> expect(:cmd, fn _cmd, _args ->
+      |> expect(:request, fn _port, _args, _timeout ->
         {"Error: Tag not found", 1}
       end)
 
@@ -105,9 +126,7 @@ defmodule Abex.TagTest do
   describe "write/2" do
     test "builds correct command arguments for uint32 write" do
       Abex.CmdMock
-      |> expect(:cmd, fn cmd, args ->
-        assert String.ends_with?(cmd, "rw_tag")
-
+      |> expect(:request, fn _port, args, _timeout ->
         assert args == [
           "-t", "uint32",
           "-w", "100",
@@ -132,7 +151,7 @@ defmodule Abex.TagTest do
 
     test "builds correct command arguments with different PLC type" do
       Abex.CmdMock
-      |> expect(:cmd, fn _cmd, args ->
+      |> expect(:request, fn _port, args, _timeout ->
         # Verify the plc parameter is set correctly
         ["-t", _, "-w", _, "-p", tag_string] = args
         assert String.contains?(tag_string, "plc=micro800")
@@ -153,9 +172,65 @@ defmodule Abex.TagTest do
       assert result == :ok
     end
 
+    test "writes a list of values in one request" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert ["-t", "sint32", "-w", "1,-2,3", "-p", tag_string] = args
+        assert String.contains?(tag_string, "elem_count=3&name=Recipe")
+
+        {"1,-2,3 ", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      assert :ok ==
+               Abex.Tag.write(pid, name: "Recipe", data_type: "sint32", elem_size: 4, elem_count: 3, value: [1, -2, 3])
+    end
+
+    test "sends a raw payload for a slice in binary format" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert ["-t", "real32", "--start=10", "-p", _tag_string, "--payload=8", payload] = args
+        assert payload == <<1.5::little-float-32, -2.0::little-float-32>>
+
+        {"", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      assert :ok ==
+               Abex.Tag.write(pid, name: "Setpoints", data_type: "real32", elem_size: 4, start: 10, value: [1.5, -2])
+    end
+
+    test "quotes string values" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert ["-t", "string", "-w", ~S("Line\x201","say \"hi\""), "-p", _attrs] = args
+        {"", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      assert :ok ==
+               Abex.Tag.write(pid,
+                 name: "Labels", data_type: "string", elem_size: 88, elem_count: 2, value: ["Line 1", "say \"hi\""])
+    end
+
+    test "writes bits as text in binary format" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, ["-t", "bit", "-w", "true", "-p", attrs], _timeout ->
+        assert String.ends_with?(attrs, "name=Flags.3")
+        {"", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      assert :ok == Abex.Tag.write(pid, name: "Flags.3", data_type: "bit", elem_size: 1, elem_count: 1, value: [true])
+    end
+
     test "handles write errors" do
       Abex.CmdMock
-      |> expect(:cmd, fn _cmd, _args ->
+      |> expect(:request, fn _port, _args, _timeout ->
         {"Error: Write failed", 1}
       end)
 
@@ -173,6 +248,396 @@ defmodule Abex.TagTest do
     end
   end
 
+  describe "rw_tag server" do
+    test "opens one port per PLC and reuses it" do
+      port = make_ref()
+
+      Abex.CmdMock
+      |> expect(:open, 1, fn _cmd, ["--serve"] -> port end)
+      |> expect(:request, 2, fn ^port, _args, _timeout -> {"7 ", 0} end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", path: "1,0", cpu: "lgx")
+
+      params = [name: "Counter", data_type: "sint32", elem_size: 4, elem_count: 1]
+      assert {:ok, [7]} = Abex.Tag.read(pid, params)
+      assert {:ok, [7]} = Abex.Tag.read(pid, params)
+    end
+
+    test "restarts the port after a failed request" do
+      first = make_ref()
+      second = make_ref()
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, _args -> first end)
+      |> expect(:request, fn ^first, _args, _timeout -> {:error, :timeout} end)
+      |> expect(:close, fn ^first -> :ok end)
+      |> expect(:open, fn _cmd, _args -> second end)
+      |> expect(:request, fn ^second, _args, _timeout -> {"1 ", 0} end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", path: "1,0", cpu: "lgx")
+
+      params = [name: "Flag", data_type: "uint8", elem_size: 1, elem_count: 1]
+      assert {:error, :timeout} = Abex.Tag.read(pid, params)
+      assert {:ok, [1]} = Abex.Tag.read(pid, params)
+    end
+
+    test "runs rw_tag once per call when not persistent" do
+      Abex.CmdMock
+      |> expect(:cmd, fn cmd, args ->
+        assert String.ends_with?(cmd, "rw_tag")
+
+        assert args == [
+          "-t", "uint32",
+          "-p", "protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=1&name=TestTag"
+        ]
+
+        {"42", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", path: "1,0", cpu: "lgx", persistent: false)
+
+      {:ok, [value]} = Abex.Tag.read(pid,
+        name: "TestTag",
+        data_type: "uint32",
+        elem_size: 4,
+        elem_count: 1
+      )
+
+      assert value == 42
+    end
+  end
+
+  describe "read cache" do
+    test "asks for a recent enough read and returns its age" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert ["-t", "sint32", "--max-age-ms=500", "--report-age", "-p", _attrs] = args
+        {"120 7 8 ", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", max_age_ms: 100)
+
+      assert {:ok, [7, 8], 120} =
+               Abex.Tag.read(pid,
+                 name: "Count", data_type: "sint32", elem_size: 4, elem_count: 2, max_age_ms: 500, age: true)
+    end
+
+    test "uses the process max_age_ms for batches and binary reads" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, ["--format=binary", "--max-age-ms=100", "-s", _spec], _timeout ->
+        {<<0::little-32, 1, 0, 0x220::little-16, 4::little-32, 1::little-32, 4::little-32, -3::little-signed-32>>, 0}
+      end)
+      |> expect(:request, fn _port, args, _timeout ->
+        assert ["-t", "sint32", "--format=binary", "--max-age-ms=100", "--report-age", "-p", _attrs] = args
+        {<<0::little-32, 1, 0, 0x220::little-16, 4::little-32, 1::little-32, 4::little-32, 9::little-signed-32>>, 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary, max_age_ms: 100)
+
+      params = [name: "Count", data_type: "sint32", elem_size: 4, elem_count: 1]
+      assert {:ok, [{:ok, [-3]}]} = Abex.Tag.read_many(pid, [params])
+      assert {:ok, [9], 0} = Abex.Tag.read(pid, params ++ [age: true])
+    end
+  end
+
+  describe "workers" do
+    test "answers other callers while a request is slow" do
+      test_pid = self()
+
+      Abex.CmdMock
+      |> expect(:request, 2, fn _port, args, _timeout ->
+        if String.ends_with?(List.last(args), "name=Slow") do
+          send(test_pid, {:slow_started, self()})
+
+          receive do
+            :go -> {"1 ", 0}
+          end
+        else
+          {"2 ", 0}
+        end
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      params = [data_type: "sint32", elem_size: 4, elem_count: 1]
+      slow = Task.async(fn -> Abex.Tag.read(pid, [name: "Slow"] ++ params) end)
+      assert_receive {:slow_started, worker}
+
+      assert {:ok, [2]} = Abex.Tag.read(pid, [name: "Fast"] ++ params)
+
+      send(worker, :go)
+      assert {:ok, [1]} = Task.await(slow)
+    end
+
+    test "shares one request between identical reads" do
+      test_pid = self()
+
+      Abex.CmdMock
+      |> expect(:request, 1, fn _port, _args, _timeout ->
+        send(test_pid, {:started, self()})
+
+        receive do
+          :go -> {"5 ", 0}
+        end
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      params = [name: "Shared", data_type: "sint32", elem_size: 4, elem_count: 1]
+      first = Task.async(fn -> Abex.Tag.read(pid, params) end)
+      assert_receive {:started, worker}
+
+      # same request with the options in another order
+      second = Task.async(fn -> Abex.Tag.read(pid, Enum.reverse(params)) end)
+      wait_for_callers(pid, 2)
+
+      send(worker, :go)
+      assert {:ok, [5]} = Task.await(first)
+      assert {:ok, [5]} = Task.await(second)
+    end
+
+    test "queues requests beyond max_concurrency" do
+      test_pid = self()
+
+      Abex.CmdMock
+      |> expect(:open, 1, fn _cmd, ["--serve"] -> make_ref() end)
+      |> expect(:request, 2, fn _port, args, _timeout ->
+        send(test_pid, {:started, List.last(args), self()})
+
+        receive do
+          :go -> {"3 ", 0}
+        end
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", max_concurrency: 1)
+
+      params = [data_type: "sint32", elem_size: 4, elem_count: 1]
+      a = Task.async(fn -> Abex.Tag.read(pid, [name: "A"] ++ params) end)
+      assert_receive {:started, _attrs, worker}
+
+      b = Task.async(fn -> Abex.Tag.read(pid, [name: "B"] ++ params) end)
+      wait_for_callers(pid, 2)
+      refute_received {:started, _attrs, _worker}
+
+      send(worker, :go)
+      assert {:ok, [3]} = Task.await(a)
+      assert_receive {:started, attrs, ^worker}
+      assert String.ends_with?(attrs, "name=B")
+
+      send(worker, :go)
+      assert {:ok, [3]} = Task.await(b)
+    end
+  end
+
+  describe "binary format" do
+    test "requests --format=binary and decodes real32 values" do
+      response =
+        <<1, 0, 0x320::little-16, 4::little-32, 2::little-32, 8::little-32,
+          25.5::little-float-32, -1.25::little-float-32>>
+
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert args == [
+          "-t", "real32",
+          "--format=binary",
+          "-p", "protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=2&name=Temps"
+        ]
+
+        {response, 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", path: "1,0", cpu: "lgx", format: :binary)
+
+      assert {:ok, [25.5, -1.25]} =
+               Abex.Tag.read(pid, name: "Temps", data_type: "real32", elem_size: 4, elem_count: 2)
+    end
+
+    test "decodes signed and unsigned integers" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, _args, _timeout ->
+        {<<1, 0, 0x210::little-16, 2::little-32, 3::little-32, 6::little-32,
+           -2::little-signed-16, 300::little-16, 32767::little-16>>, 0}
+      end)
+      |> expect(:request, fn _port, _args, _timeout ->
+        {<<1, 0, 0x120::little-16, 4::little-32, 1::little-32, 4::little-32,
+           4_000_000_000::little-32>>, 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      assert {:ok, [-2, 300, 32767]} =
+               Abex.Tag.read(pid, name: "Ints", data_type: "sint16", elem_size: 2, elem_count: 3)
+
+      assert {:ok, [4_000_000_000]} =
+               Abex.Tag.read(pid, name: "Big", data_type: "uint32", elem_size: 4, elem_count: 1)
+    end
+
+    test "decodes string blocks" do
+      chars = String.pad_trailing("OK", 82, <<0>>)
+
+      Abex.CmdMock
+      |> expect(:request, fn _port, _args, _timeout ->
+        {<<1, 0, 0x400::little-16, 88::little-32, 1::little-32, 88::little-32,
+           2::little-32, chars::binary, 0, 0>>, 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      assert {:ok, ["OK"]} = Abex.Tag.read(pid, name: "Status", data_type: "string", elem_size: 88, elem_count: 1)
+    end
+
+    test "passes errors through" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, _args, _timeout ->
+        {"ERROR: tag read error, tag status: PLCTAG_ERR_TIMEOUT\n", 1}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      assert {:error, "ERROR: tag read error, tag status: PLCTAG_ERR_TIMEOUT\n"} =
+               Abex.Tag.read(pid, name: "Slow", data_type: "sint32", elem_size: 4, elem_count: 1)
+    end
+  end
+
+  describe "ranged reads" do
+    test "reads count elements from start and collects the pieces of a fragment: read" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert args == [
+          "-t", "uint32",
+          "--start=1200", "--count=5", "--fragment=2",
+          "-p", "protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=&name=Arr"
+        ]
+
+        {"1 2 ", 2}
+      end)
+      |> expect(:next_response, fn _port, _timeout -> {"3 4 ", 2} end)
+      |> expect(:next_response, fn _port, _timeout -> {"5 ", 0} end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      assert {:ok, [1, 2, 3, 4, 5]} =
+               Abex.Tag.read(pid, name: "Arr", data_type: "uint32", elem_size: 4, start: 1200, count: 5, fragment: 2)
+    end
+
+    test "decodes a binary block per piece and records the limit wait once" do
+      block = fn values ->
+        data = for v <- values, into: <<>>, do: <<v::little-32>>
+        <<1, 0, 0x120::little-16, 4::little-32, length(values)::little-32, byte_size(data)::little-32, data::binary>>
+      end
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, ["--serve", "--report-wait", "--rate-limit=5"] -> make_ref() end)
+      |> expect(:request, fn _port, _args, _timeout -> {<<3::little-32>> <> block.([7, 8]), 2} end)
+      |> expect(:next_response, fn _port, _timeout -> {<<9::little-32>> <> block.([9]), 0} end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary, rate_limit: [rate: 5])
+
+      assert {:ok, [7, 8, 9]} =
+               Abex.Tag.read(pid, name: "Arr", data_type: "uint32", elem_size: 4, elem_count: 3, start: 0, fragment: 2)
+
+      assert %{requests: 1, last_ms: 9} = Abex.Tag.limit_stats(pid)
+    end
+
+    test "streams each piece to the caller with stream: true" do
+      test = self()
+
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        refute Enum.any?(args, &String.contains?(&1, "stream"))
+        {"1 2 ", 2}
+      end)
+      |> expect(:next_response, fn _port, _timeout ->
+        send(test, :next_piece)
+        {"3 ", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      assert :ok =
+               Abex.Tag.read(pid, name: "Arr", data_type: "uint32", elem_size: 4, count: 3, fragment: 2, stream: true)
+
+      # the first piece was with the caller before the next one was asked for
+      assert {:messages, [{:abex_fragment, "Arr", [1, 2]}, :next_piece, {:abex_fragment, "Arr", [3]}]} =
+               Process.info(self(), :messages)
+    end
+
+    test "bounds the whole call only when given timeout:" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        refute Enum.any?(args, &String.contains?(&1, "timeout"))
+        Process.sleep(100)
+        {"1 ", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      assert {:timeout, _} =
+               catch_exit(Abex.Tag.read(pid, name: "Tag", data_type: "uint32", elem_size: 4, elem_count: 1, timeout: 10))
+
+      # the request itself still runs to the end
+      Process.sleep(150)
+    end
+
+    test "returns only the error when a piece fails" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, _args, _timeout -> {"1 2 ", 2} end)
+      |> expect(:next_response, fn _port, _timeout ->
+        {"ERROR: tag read error at element 2, tag status: PLCTAG_ERR_TIMEOUT\n", 1}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+
+      assert {:error, "ERROR: tag read error at element 2, tag status: PLCTAG_ERR_TIMEOUT\n"} =
+               Abex.Tag.read(pid, name: "Arr", data_type: "uint32", elem_size: 4, elem_count: 4, fragment: 2)
+    end
+  end
+
+  describe "read_many/2" do
+    test "sends one spec per tag and returns per-tag results" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert args == [
+          "-s", "uint32 protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=2&name=Counts",
+          "-s", "real32 protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=1&name=Speed",
+          "-s", "sint16 protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=2&elem_count=1&name=Missing"
+        ]
+
+        {"ok 1 2 \nok 12.500000 \nerror PLCTAG_ERR_NOT_FOUND\n", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", path: "1,0", cpu: "lgx")
+
+      tags = [
+        [name: "Counts", data_type: "uint32", elem_size: 4, elem_count: 2],
+        [name: "Speed", data_type: "real32", elem_size: 4, elem_count: 1],
+        [name: "Missing", data_type: "sint16", elem_size: 2, elem_count: 1]
+      ]
+
+      assert {:ok, [{:ok, [1, 2]}, {:ok, [12.5]}, {:error, "PLCTAG_ERR_NOT_FOUND"}]} =
+               Abex.Tag.read_many(pid, tags)
+    end
+
+    test "decodes binary batch records" do
+      response =
+        <<0::little-32, 1, 0, 0x220::little-16, 4::little-32, 1::little-32, 4::little-32,
+          -5::little-signed-32>> <>
+          <<-19::little-signed-32, 20::little-16, "PLCTAG_ERR_NOT_FOUND">>
+
+      Abex.CmdMock
+      |> expect(:request, fn _port, ["--format=binary" | _specs], _timeout -> {response, 0} end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      tags = [
+        [name: "Delta", data_type: "sint32", elem_size: 4, elem_count: 1],
+        [name: "Missing", data_type: "sint32", elem_size: 4, elem_count: 1]
+      ]
+
+      assert {:ok, [{:ok, [-5]}, {:error, "PLCTAG_ERR_NOT_FOUND"}]} = Abex.Tag.read_many(pid, tags)
+    end
+  end
+
   describe "get_all_tags/1" do
     test "builds correct command arguments for tag listing" do
       mock_output = """
@@ -206,6 +671,127 @@ defmodule Abex.TagTest do
       assert Map.has_key?(tags.program_tags["Program1"], "ProgramTag1")
     end
 
+    test "passes filters and decodes binary records" do
+      record = fn kind, id, type, name ->
+        <<kind, id::little-32, type::little-16, 4::little-16, 10::little-32, 0::little-32, 0::little-32,
+          byte_size(name)::little-16, name::binary>>
+      end
+
+      output =
+        record.(0, 0x64, 0xC4, "Motor1") <>
+          record.(1, 0, 0, "Program:Main") <> record.(2, 0x65, 0xCA, "MotorSpeed")
+
+      Abex.CmdMock
+      |> expect(:cmd, fn _cmd, args ->
+        assert args == [
+                 "192.168.1.10", "1,0", "--format=binary",
+                 "--prefix=Motor", "--program=Main", "--exclude-program=Safety", "--exclude-program=Test"
+               ]
+
+        {output, 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      {:ok, tags} =
+        Abex.Tag.get_all_tags(pid, prefix: "Motor", program: "Main", exclude_program: ["Safety", "Test"])
+
+      assert tags.controller_tags["Motor1"] ==
+               %{tag_instance_id: "64", tag_type: "c4", element_length: 4, array_dim: "(10, 0, 0)"}
+
+      assert tags.program_tags["Program:Main"]["MotorSpeed"].tag_type == "ca"
+    end
+
+    test "leaves out system tags with skip_system: true" do
+      Abex.CmdMock
+      |> expect(:cmd, fn _cmd, args ->
+        assert args == ["192.168.1.10", "1,0", "--format=binary", "--glob=*Speed", "--skip-system"]
+        {"", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      assert {:ok, _tags} = Abex.Tag.get_all_tags(pid, glob: "*Speed", skip_system: true)
+    end
+
+    test "keeps a tag catalog when catalog_dir is set" do
+      Abex.CmdMock
+      |> expect(:cmd, fn _cmd, args ->
+        assert args == ["192.168.1.10", "1,0", "--catalog-dir=/tmp/abex", "--refresh", "--max-age=600"]
+        {"Program tags\n", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", catalog_dir: "/tmp/abex")
+
+      assert {:ok, %{controller_tags: %{}, program_tags: %{}}} =
+               Abex.Tag.get_all_tags(pid, refresh: true, max_age: 600)
+    end
+
+    test "reads without a data type using the catalog" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert args == [
+                 "--catalog-dir=/tmp/abex",
+                 "-p", "protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=&elem_count=&name=Speed"
+               ]
+
+        {"12.500000 3.000000 ", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", catalog_dir: "/tmp/abex")
+
+      assert {:ok, [12.5, 3.0]} = Abex.Tag.read(pid, name: "Speed")
+    end
+
+    test "decodes UDT templates with udts: true" do
+      record = fn kind, id, type, el, d0, d1, name ->
+        <<kind, id::little-32, type::little-16, el::little-16, d0::little-32, d1::little-32, 0::little-32,
+          byte_size(name)::little-16, name::binary>>
+      end
+
+      output =
+        record.(0, 0x32, 0x8123, 12, 0, 0, "Motor") <>
+          record.(3, 0x123, 0x5A5A, 0, 12, 2, "MotorType") <>
+          record.(4, 0, 0xC4, 4, 0, 0, "Count") <> record.(4, 8, 0xC1, 1, 0, 3, "Running")
+
+      Abex.CmdMock
+      |> expect(:cmd, fn _cmd, args ->
+        assert args == ["192.168.1.10", "1,0", "--format=binary", "--udts"]
+        {output, 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+
+      {:ok, tags} = Abex.Tag.get_all_tags(pid, udts: true)
+
+      assert tags.controller_tags["Motor"].tag_type == "8123"
+
+      assert %{template_id: 0x123, size: 12, members: [count, running]} = tags.udts["MotorType"]
+      assert count == %{name: "Count", offset: 0, type: 0xC4, element_length: 4, count: 0, bit: 0}
+      assert running.bit == 3
+    end
+
+    test "reads UDT members in one request" do
+      Abex.CmdMock
+      |> expect(:request, fn _port, args, _timeout ->
+        assert args == [
+                 "--catalog-dir=/tmp/abex",
+                 "--members=Count,Inner.Small",
+                 "-p", "protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=&elem_count=&name=Motor"
+               ]
+
+        {"Count 7\nInner.Small -2\n", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", catalog_dir: "/tmp/abex")
+
+      assert {:ok, %{"Count" => [7], "Inner.Small" => [-2]}} =
+               Abex.Tag.read_udt(pid, name: "Motor", members: ["Count", "Inner.Small"])
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+      assert {:error, :no_catalog_dir} = Abex.Tag.read_udt(pid, name: "Motor")
+    end
+
     test "handles tag list errors" do
       Abex.CmdMock
       |> expect(:cmd, fn _cmd, _args ->
@@ -220,6 +806,339 @@ defmodule Abex.TagTest do
     end
   end
 
+  describe "subscribe/3" do
+    @counter [name: "Counter", data_type: "sint32", elem_size: 4, elem_count: 2]
+    @level [name: "Level", data_type: "real32", elem_size: 4, elem_count: 1]
+
+    test "starts rw_tag --subscribe and forwards text changes" do
+      port = make_ref()
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, args ->
+        assert args == [
+          "--subscribe", "--interval-ms=100", "--deadband=0.5",
+          "-s", "sint32 protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=2&name=Counter",
+          "-s", "real32 protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=1&name=Level"
+        ]
+
+        port
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+      {:ok, sub} = Abex.Tag.subscribe(pid, [@counter, @level], interval_ms: 100, deadband: 0.5)
+
+      send(sub, {port, {:data, <<0, "0 1 -7\n1 0 12.500000\n">>}})
+      assert_receive {:abex_changes, ^sub, [{"Counter", 1, -7}, {"Level", 0, 12.5}]}
+
+      send(sub, {port, {:data, <<1, "0 ErrorTimeout\n">>}})
+      assert_receive {:abex_error, ^sub, [{"Counter", "ErrorTimeout"}]}
+
+      Abex.Tag.unsubscribe(sub)
+      refute Process.alive?(sub)
+    end
+
+    test "decodes binary change runs" do
+      port = make_ref()
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, args ->
+        assert ["--subscribe", "--no-auto-sync", "--format=binary" | _specs] = args
+        port
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary)
+      {:ok, sub} = Abex.Tag.subscribe(pid, [@counter, @level], auto_sync: false)
+
+      runs =
+        <<0::little-32, 0::little-32, 2::little-32, 3::little-signed-32, -4::little-signed-32>> <>
+          <<1::little-32, 0::little-32, 1::little-32, 1.25::little-float-32>>
+
+      send(sub, {port, {:data, <<0, runs::binary>>}})
+      assert_receive {:abex_changes, ^sub, [{"Counter", 0, 3}, {"Counter", 1, -4}, {"Level", 0, 1.25}]}
+    end
+
+    test "stops when the subscriber exits" do
+      test_pid = self()
+      expect(Abex.CmdMock, :open, fn _cmd, ["--subscribe" | _args] -> make_ref() end)
+
+      subscriber =
+        spawn(fn ->
+          {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+          send(test_pid, Abex.Tag.subscribe(pid, [@counter]))
+          receive do: (:exit -> :ok)
+        end)
+
+      assert_receive {:ok, sub}
+      ref = Process.monitor(sub)
+      send(subscriber, :exit)
+      assert_receive {:DOWN, ^ref, :process, ^sub, :normal}
+    end
+
+    test "stops without closing the port again when rw_tag exits" do
+      port = make_ref()
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, ["--subscribe" | _args] -> port end)
+      |> expect(:close, 0, fn _port -> :ok end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+      {:ok, sub} = Abex.Tag.subscribe(pid, [@counter])
+      ref = Process.monitor(sub)
+
+      send(sub, {port, {:exit_status, 1}})
+      assert_receive {:DOWN, ^ref, :process, ^sub, {:exit_status, 1}}
+    end
+  end
+
+  describe "write_behind" do
+    @setpoint [name: "Setpoint", data_type: "real32", elem_size: 4, elem_count: 1]
+    @attrs "protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=1&name=Setpoint"
+
+    test "sends writes to rw_tag --write-queue and answers each when it is done" do
+      test_pid = self()
+      port = make_ref()
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, args ->
+        assert args == ["--write-queue", "--flush-ms=50"]
+        port
+      end)
+      |> expect(:send, 2, fn ^port, args ->
+        send(test_pid, {:queued, args})
+        :ok
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", write_behind: [flush_ms: 50])
+      queue = :sys.get_state(pid).write_queue
+
+      first = Task.async(fn -> Abex.Tag.write(pid, @setpoint ++ [value: 1.5]) end)
+      assert_receive {:queued, ["1", "-t", "real32", "-w", "1.5", "-p", @attrs]}
+
+      second = Task.async(fn -> Abex.Tag.write(pid, @setpoint ++ [value: 2.5]) end)
+      assert_receive {:queued, ["2" | _args]}
+
+      # both wait for the same write, the second value replaced the first
+      send(queue, {port, {:data, <<0, "1">>}})
+      send(queue, {port, {:data, <<1, "2 ERROR: error writing data: PLCTAG_ERR_TIMEOUT!">>}})
+
+      assert Task.await(first) == :ok
+      assert Task.await(second) == {:error, "ERROR: error writing data: PLCTAG_ERR_TIMEOUT!"}
+    end
+
+    test "wait: false returns once the write is queued" do
+      test_pid = self()
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, ["--write-queue"] -> make_ref() end)
+      |> expect(:send, fn _port, ["0" | _args] = args ->
+        send(test_pid, {:queued, args})
+        :ok
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", write_behind: true)
+
+      assert :ok = Abex.Tag.write(pid, @setpoint ++ [value: 3.0], wait: false)
+      assert_receive {:queued, ["0", "-t", "real32", "-w", "3.0", "-p", @attrs]}
+    end
+
+    test "wait: false needs write_behind" do
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+      assert {:error, :no_write_behind} = Abex.Tag.write(pid, @setpoint ++ [value: 3.0], wait: false)
+    end
+  end
+
+  describe "sample/3" do
+    @counter [name: "Counter", data_type: "sint32", elem_size: 4, elem_count: 2]
+
+    test "starts rw_tag --sample on a ring file and reports when it runs" do
+      port = make_ref()
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, args ->
+        assert args == [
+          "--sample", "--ring=/tmp/line1.ring", "--interval-ms=5", "--records=1024",
+          "-s", "sint32 protocol=ab-eip&gateway=192.168.1.10&path=1,0&plc=lgx&elem_size=4&elem_count=2&name=Counter"
+        ]
+
+        port
+      end)
+      |> expect(:close, fn ^port -> :ok end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+      {:ok, sampler} = Abex.Tag.sample(pid, [@counter], ring: "/tmp/line1.ring", interval_ms: 5, records: 1024)
+
+      send(sampler, {port, {:data, <<0, "ready /tmp/line1.ring">>}})
+      assert_receive {:abex_sampling, ^sampler, "/tmp/line1.ring"}
+
+      Abex.Tag.stop_sampling(sampler)
+      refute Process.alive?(sampler)
+    end
+
+    test "stops without closing the port again when rw_tag exits" do
+      port = make_ref()
+
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, ["--sample" | _args] -> port end)
+      |> expect(:close, 0, fn _port -> :ok end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10")
+      {:ok, sampler} = Abex.Tag.sample(pid, [@counter], ring: "/tmp/line1.ring")
+      ref = Process.monitor(sampler)
+
+      send(sampler, {port, {:exit_status, 1}})
+      assert_receive {:DOWN, ^ref, :process, ^sampler, {:exit_status, 1}}
+    end
+  end
+
+  describe "rate_limit" do
+    test "starts rw_tag with the limits and records how long requests waited" do
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, args ->
+        assert args == ["--serve", "--report-wait", "--rate-limit=20", "--max-concurrent=2", "--limit-dir=/tmp/abex"]
+        make_ref()
+      end)
+      |> expect(:request, 2, fn _port, _args, _timeout -> {<<15::little-32, "42">>, 0} end)
+
+      {:ok, pid} =
+        Abex.Tag.start_link(ip: "192.168.1.10", rate_limit: [rate: 20, max_concurrent: 2, dir: "/tmp/abex"])
+
+      params = [name: "TestTag", data_type: "uint32", elem_size: 4, elem_count: 1]
+      assert {:ok, [42]} = Abex.Tag.read(pid, params)
+      assert {:ok, [42]} = Abex.Tag.read(pid, params)
+
+      assert Abex.Tag.limit_stats(pid) == %{requests: 2, total_ms: 30, max_ms: 15, last_ms: 15}
+    end
+
+    test "passes the limits to one-shot runs" do
+      Abex.CmdMock
+      |> expect(:cmd, fn _cmd, args ->
+        assert ["-t", "uint32", "-p", _attrs, "--rate-limit=5", "--burst=3"] = args
+        {"42", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", persistent: false, rate_limit: [rate: 5, burst: 3])
+      assert {:ok, [42]} = Abex.Tag.read(pid, name: "TestTag", data_type: "uint32", elem_size: 4, elem_count: 1)
+    end
+  end
+
+  describe "retry" do
+    test "sends the deadline and retry options with every request" do
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, ["--serve"] -> make_ref() end)
+      |> expect(:request, fn _port, args, _timeout ->
+        assert ["--deadline-ms=800", "--retries=3", "-t", "uint32" | _rest] = args
+        {"42", 0}
+      end)
+      |> expect(:request, fn _port, args, _timeout ->
+        assert ["--deadline-ms=800", "--retries=3", "-t", "uint32", "-w", "7", "-p", _attrs] = args
+        {"7", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", retry: [deadline_ms: 800, retries: 3])
+
+      params = [name: "TestTag", data_type: "uint32", elem_size: 4, elem_count: 1]
+      assert {:ok, [42]} = Abex.Tag.read(pid, params)
+      assert :ok = Abex.Tag.write(pid, Keyword.put(params, :value, 7))
+    end
+
+    test "retries writes only when asked to" do
+      Abex.CmdMock
+      |> expect(:cmd, fn _cmd, args ->
+        assert ["--retry-writes", "-t", "uint32", "-w", "7", "-p", _attrs] = args
+        {"7", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", persistent: false, retry: [writes: true])
+
+      params = [name: "TestTag", data_type: "uint32", elem_size: 4, elem_count: 1, value: 7]
+      assert :ok = Abex.Tag.write(pid, params)
+    end
+  end
+
+  describe "broker" do
+    test "sends one-shot reads through the broker socket" do
+      Abex.CmdMock
+      |> expect(:cmd, fn _cmd, args ->
+        assert ["-t", "uint32", "-p", _attrs, "--broker=/tmp/abex.sock"] = args
+        {"42", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", persistent: false, broker: "/tmp/abex.sock")
+      assert {:ok, [42]} = Abex.Tag.read(pid, name: "TestTag", data_type: "uint32", elem_size: 4, elem_count: 1)
+    end
+
+    test "lists tags through the broker socket" do
+      Abex.CmdMock
+      |> expect(:cmd, fn _cmd, args ->
+        assert args == ["192.168.1.10", "1,0", "--format=binary", "--broker=/tmp/abex.sock"]
+        {"", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", format: :binary, broker: "/tmp/abex.sock")
+
+      assert {:ok, _tags} = Abex.Tag.get_all_tags(pid)
+    end
+  end
+
+  describe "stats" do
+    test "starts rw_tag with --stats and parses a stats dump" do
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, ["--serve", "--stats"] -> make_ref() end)
+      |> expect(:request, fn _port, ["--stats-dump", "--reset"], _timeout ->
+        {"phase read count=2 sum_us=300 p50_us=100 p90_us=200 p99_us=200 max_us=200\n" <>
+           "counter bytes_read 8\ngateway 192.168.1.10 srtt_us=0 rttvar_us=0 samples=2 attempts=2 timeouts=0\n", 0}
+      end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", stats: true)
+
+      assert {:ok, %{phases: %{read: %{count: 2, p99_us: 200}}, counters: %{bytes_read: 8}, gateways: gateways}} =
+               Abex.Tag.stats(pid, reset: true)
+
+      assert %{"192.168.1.10" => %{samples: 2}} = gateways
+    end
+
+    test "drops the limit wait in front of a stats dump" do
+      Abex.CmdMock
+      |> expect(:open, fn _cmd, ["--serve", "--report-wait", "--rate-limit=5", "--stats"] -> make_ref() end)
+      |> expect(:request, fn _port, ["--stats-dump"], _timeout -> {<<0::little-32, "counter errors 3\n">>, 0} end)
+
+      {:ok, pid} = Abex.Tag.start_link(ip: "192.168.1.10", stats: true, rate_limit: [rate: 5])
+
+      assert {:ok, %{counters: %{errors: 3}}} = Abex.Tag.stats(pid)
+      assert Abex.Tag.limit_stats(pid).requests == 0
+    end
+  end
+
+  describe "rw_tag --serve bit writes" do
+    # needs libplctag's ab_server (built with -DABEX_BUILD_BENCH=ON) free to listen on 127.0.0.1:44818:
+    # AB_SERVER=path/to/ab_server mix test --include ab_server
+    @describetag :ab_server
+
+    setup do
+      server =
+        Port.open({:spawn_executable, System.fetch_env!("AB_SERVER")}, [
+          args: ["--plc=ControlLogix", "--path=1,0", "--tag=Flags:DINT[1]"]
+        ])
+
+      on_exit(fn -> if Port.info(server), do: Port.close(server) end)
+
+      rw_tag = :abex |> :code.priv_dir() |> to_string() |> Path.join("rw_tag")
+      port = Port.open({:spawn_executable, rw_tag}, [:binary, packet: 4, args: ["--serve"]])
+      Process.sleep(500)
+
+      %{port: port}
+    end
+
+    test "writes a bit through a handle that was read", %{port: port} do
+      attrs = "protocol=ab-eip&gateway=127.0.0.1&path=1,0&plc=ControlLogix&elem_size=4&elem_count=1&name=Flags.3"
+
+      # the read leaves the cached handle with the DINT's 4-byte buffer
+      assert <<0, "0 ">> = serve(port, ["-t", "bit", "-p", attrs])
+      assert <<0, "1 ">> = serve(port, ["-t", "bit", "-w", "1", "-p", attrs])
+      assert <<0, "1 ">> = serve(port, ["-t", "bit", "-p", attrs])
+    end
+  end
+
   describe "initialization" do
     test "uses default values when not provided" do
       # We don't call cmd during initialization, so no mock needed
@@ -235,4 +1154,24 @@ defmodule Abex.TagTest do
       assert true
     end
   end
+
+  defp serve(port, args) do
+    Port.command(port, Enum.join(args, <<0>>))
+
+    receive do
+      {^port, {:data, reply}} -> reply
+    after
+      5000 -> flunk("no answer from rw_tag --serve")
+    end
+  end
+
+  # callers waiting on queued or in-flight requests
+  defp wait_for_callers(pid, count) do
+    waiting = pid |> :sys.get_state() |> Map.get(:inflight) |> Map.values() |> Enum.map(&length(&1.from)) |> Enum.sum()
+
+    if waiting < count do
+      Process.sleep(5)
+      wait_for_callers(pid, count)
+    end
+  end
 end
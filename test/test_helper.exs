@@ -1,4 +1,6 @@
 Mox.defmock(Abex.CmdMock, for: Abex.CmdBehaviour)
 Application.put_env(:abex, :cmd_runner, Abex.CmdMock)
 
-ExUnit.start()
+# tests tagged :native run the built programs: mix test --include native;
+# :ab_server ones also need AB_SERVER set to libplctag's ab_server
+ExUnit.start(exclude: [:native, :ab_server])
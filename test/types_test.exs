@@ -0,0 +1,42 @@
+defmodule Abex.Tag.TypesTest do
+  use ExUnit.Case, async: true
+
+  alias Abex.Tag.Types
+
+  test "guesses numbers without a type, printf's nan and inf included" do
+    assert Types.parse("42", nil) == 42
+    assert Types.parse("-7", nil) == -7
+    assert Types.parse("1.500000", nil) == 1.5
+    assert Types.parse("nan", nil) == :nan
+    assert Types.parse("-nan", nil) == :nan
+    assert Types.parse("inf", nil) == :infinity
+    assert Types.parse("-inf", nil) == :neg_infinity
+    assert Types.parse(~S("a\x20b"), nil) == "a b"
+  end
+
+  test "parses bools and bits as 0 or 1" do
+    assert Types.parse("1", "bool") == 1
+    assert Types.parse("0", "bit") == 0
+  end
+
+  test "decodes bool and bit elements as unsigned bytes" do
+    assert Types.size("bool") == 1
+    assert Types.size("bit") == 1
+    assert Types.decode_value(<<1>>, "bool") == 1
+    assert Types.decode_value(<<0>>, "bit") == 0
+    assert Types.decode_value(<<0xFE, 0xFF>>, "sint16") == -2
+  end
+
+  test "keeps NaN and the two infinities of a REAL apart" do
+    assert Types.parse("inf", "real32") == :infinity
+    assert Types.parse("-inf", "real64") == :neg_infinity
+    assert Types.parse("-nan", "real32") == :nan
+    assert Types.decode_value(<<0, 0, 0xC0, 0x7F>>, "real32") == :nan
+    assert Types.decode_value(<<0, 0, 0x80, 0x7F>>, "real32") == :infinity
+    assert Types.decode_value(<<0, 0, 0x80, 0xFF>>, "real32") == :neg_infinity
+    assert Types.decode_value(<<0, 0, 0, 0, 0, 0, 0xF0, 0x7F>>, "real64") == :infinity
+    assert Types.decode_value(<<0, 0, 0, 0, 0, 0, 0xF0, 0xFF>>, "real64") == :neg_infinity
+    assert Types.decode_value(<<1, 0, 0, 0, 0, 0, 0xF0, 0x7F>>, "real64") == :nan
+    assert Types.format(:neg_infinity, "real32") == "-inf"
+  end
+end